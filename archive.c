@@ -0,0 +1,444 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "e2fstool.h"
+
+/*
+ * Streaming archive output (--tar, --cpio).
+ *
+ * Entries are written in walk order to a file or stdout, file data goes
+ * from the image straight through ino_extract_fd(). Tar is POSIX pax:
+ * ustar headers, preceded by an extended header when the path, link
+ * target, size or ids don't fit, or when the entry has SELinux or
+ * capability xattrs (SCHILY.xattr.*). cpio is newc, which has no room
+ * for xattrs. Hard links refer to the first name, in cpio by sharing
+ * its inode number, and only the first name carries data.
+ */
+
+#define TAR_BLOCK 512
+#define TAR_NAME_MAX 100
+#define TAR_ID_MAX 07777777ULL       /* Largest value of the 8 byte fields */
+#define TAR_SIZE_MAX 077777777777ULL /* And of the 12 byte ones */
+#define CPIO_HEADER_LEN 110
+#define CPIO_TRAILER "TRAILER!!!"
+
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+/* One archive member, in the terms both formats need */
+struct archive_entry {
+    const char *name;
+    const char *link; /* Symlink target, or first name of a hard link */
+    char type;        /* ustar typeflag */
+    __u32 ino, mode, uid, gid, nlink, mtime;
+    __u64 size;
+    unsigned int rdev_major, rdev_minor;
+    struct ino_xattrs x;
+};
+
+static archive_format_t format = ARCHIVE_NONE;
+static int archive_fd = -1;
+static __u64 archive_pos = 0;
+static char *pax_buf = NULL;
+static size_t pax_len = 0, pax_cap = 0;
+
+static const char zeroes[TAR_BLOCK];
+
+static errcode_t archive_write(const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    archive_pos += len;
+    while (len)
+    {
+        n = write(archive_fd, p, len);
+        if (n < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            E2FSTOOL_ERROR("while writing archive");
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Pads the archive to a multiple of @align */
+static errcode_t archive_pad(unsigned int align)
+{
+    unsigned int rem = archive_pos % align;
+
+    return rem ? archive_write(zeroes, align - rem) : 0;
+}
+
+static void tar_octal(char *field, size_t len, __u64 val)
+{
+    snprintf(field, len, "%0*llo", (int)len - 1, (unsigned long long)val);
+}
+
+/* Appends a "len key=value\n" record, len counting its own digits */
+static errcode_t pax_add(const char *key, const void *val, size_t val_len)
+{
+    size_t len = strlen(key) + val_len + 3, digits = 1, total, n;
+    errcode_t retval;
+
+    for (n = len; n >= 10; n /= 10)
+        digits++;
+    total = len + digits;
+    for (n = total, digits = 0; n; n /= 10)
+        digits++;
+    if (len + digits != total)
+        total++;
+
+    if (pax_len + total + 1 > pax_cap)
+    {
+        size_t new_cap = pax_cap ? pax_cap : 1024;
+
+        while (pax_len + total + 1 > new_cap)
+            new_cap *= 2;
+        retval = ext2fs_resize_mem(pax_cap, new_cap, &pax_buf);
+        if (retval)
+        {
+            com_err(__func__, retval, "while allocating memory");
+            return retval;
+        }
+        pax_cap = new_cap;
+    }
+
+    n = sprintf(pax_buf + pax_len, "%zu %s=", total, key);
+    memcpy(pax_buf + pax_len + n, val, val_len);
+    pax_buf[pax_len + n + val_len] = '\n';
+    pax_len += total;
+    return 0;
+}
+
+static errcode_t tar_block(const char *name, const char *link, char type, __u32 mode,
+                           __u32 uid, __u32 gid, __u64 size, __u32 mtime,
+                           unsigned int major, unsigned int minor)
+{
+    struct tar_header h;
+    unsigned int sum = 0;
+    size_t i;
+
+    memset(&h, 0, sizeof(h));
+    strncpy(h.name, name, sizeof(h.name));
+    if (link)
+        strncpy(h.linkname, link, sizeof(h.linkname));
+
+    tar_octal(h.mode, sizeof(h.mode), mode & FILE_MODE_MASK);
+    tar_octal(h.uid, sizeof(h.uid), uid > TAR_ID_MAX ? 0 : uid);
+    tar_octal(h.gid, sizeof(h.gid), gid > TAR_ID_MAX ? 0 : gid);
+    tar_octal(h.size, sizeof(h.size), size > TAR_SIZE_MAX ? 0 : size);
+    tar_octal(h.mtime, sizeof(h.mtime), mtime);
+    tar_octal(h.devmajor, sizeof(h.devmajor), major);
+    tar_octal(h.devminor, sizeof(h.devminor), minor);
+    h.typeflag = type;
+    memcpy(h.magic, "ustar", 6);
+    memcpy(h.version, "00", 2);
+
+    memset(h.chksum, ' ', sizeof(h.chksum));
+    for (i = 0; i < sizeof(h); i++)
+        sum += ((unsigned char *)&h)[i];
+    snprintf(h.chksum, sizeof(h.chksum) - 1, "%06o", sum);
+
+    return archive_write(&h, sizeof(h));
+}
+
+static errcode_t tar_header(const struct archive_entry *e)
+{
+    char *name = NULL, pax_name[TAR_NAME_MAX];
+    size_t len = strlen(e->name);
+    errcode_t retval = 0;
+
+    /* Directories are told apart by a trailing slash */
+    if (e->type == '5')
+    {
+        name = malloc(len + 2);
+        if (!name)
+        {
+            E2FSTOOL_ERROR("while allocating memory");
+            return EXT2_ET_NO_MEMORY;
+        }
+        sprintf(name, "%s/", e->name);
+        len++;
+    }
+
+    pax_len = 0;
+    if (len > TAR_NAME_MAX)
+        retval = pax_add("path", name ?: e->name, len);
+    if (!retval && e->link && strlen(e->link) > TAR_NAME_MAX)
+        retval = pax_add("linkpath", e->link, strlen(e->link));
+    if (!retval && e->size > TAR_SIZE_MAX)
+    {
+        char num[24];
+
+        retval = pax_add("size", num, sprintf(num, "%llu", (unsigned long long)e->size));
+    }
+    if (!retval && e->uid > TAR_ID_MAX)
+    {
+        char num[12];
+
+        retval = pax_add("uid", num, sprintf(num, "%u", e->uid));
+    }
+    if (!retval && e->gid > TAR_ID_MAX)
+    {
+        char num[12];
+
+        retval = pax_add("gid", num, sprintf(num, "%u", e->gid));
+    }
+    if (!retval && e->x.selinux)
+        retval = pax_add("SCHILY.xattr.security." XATTR_SELINUX_SUFFIX,
+                         e->x.selinux, e->x.selinux_len);
+    if (!retval && e->x.caps)
+        retval = pax_add("SCHILY.xattr.security." XATTR_CAPS_SUFFIX,
+                         e->x.caps, e->x.caps_len);
+    if (retval)
+        goto end;
+
+    if (pax_len)
+    {
+        snprintf(pax_name, sizeof(pax_name), "PaxHeaders/%u", e->ino);
+        retval = tar_block(pax_name, NULL, 'x', 0644, 0, 0, pax_len, e->mtime, 0, 0);
+        if (!retval)
+            retval = archive_write(pax_buf, pax_len);
+        if (!retval)
+            retval = archive_pad(TAR_BLOCK);
+        if (retval)
+            goto end;
+    }
+
+    retval = tar_block(name ?: e->name, e->link, e->type, e->mode, e->uid, e->gid,
+                       e->size, e->mtime, e->rdev_major, e->rdev_minor);
+end:
+    free(name);
+    return retval;
+}
+
+static errcode_t cpio_header(const struct archive_entry *e)
+{
+    char h[CPIO_HEADER_LEN + 1];
+    size_t name_len = strlen(e->name) + 1;
+    errcode_t retval;
+
+    snprintf(h, sizeof(h), "070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X",
+             e->ino, e->mode, e->uid, e->gid, e->nlink, e->mtime, (unsigned int)e->size,
+             0, 0, e->rdev_major, e->rdev_minor, (unsigned int)name_len, 0);
+
+    retval = archive_write(h, CPIO_HEADER_LEN);
+    if (!retval)
+        retval = archive_write(e->name, name_len);
+    if (!retval)
+        retval = archive_pad(4);
+    return retval;
+}
+
+static errcode_t archive_header(const struct archive_entry *e)
+{
+    return format == ARCHIVE_TAR ? tar_header(e) : cpio_header(e);
+}
+
+static void archive_entry_init(struct archive_entry *e, ext2_ino_t ino,
+                               const struct ext2_inode *inode, const char *path)
+{
+    memset(e, 0, sizeof(*e));
+    e->name = path[0] == '/' ? path + 1 : path;
+    if (!e->name[0])
+        e->name = ".";
+    e->ino = ino;
+    e->mode = inode->i_mode;
+    e->uid = inode_uid(*inode);
+    e->gid = inode_gid(*inode);
+    e->nlink = inode->i_links_count;
+    e->mtime = inode->i_mtime;
+}
+
+/*
+ * Appends @ino of @ctx, named @path relative to the image root, to the
+ * archive. @runs may carry the extent map of a regular file, or be NULL.
+ */
+errcode_t archive_add(struct extract_ctx *ctx, ext2_filsys fs, ext2_ino_t ino,
+                      struct ext2_inode *inode, const char *path,
+                      const struct extent_run *runs, size_t count)
+{
+    struct archive_entry e;
+    char *target = NULL;
+    __u32 dev;
+    errcode_t retval;
+
+    archive_entry_init(&e, ino, inode, path);
+
+    switch (inode->i_mode & LINUX_S_IFMT)
+    {
+    case LINUX_S_IFREG:
+        e.type = '0';
+        e.size = EXT2_I_SIZE(inode);
+        if (format == ARCHIVE_CPIO && e.size > 0xFFFFFFFF)
+        {
+            fprintf(stderr, "Warning: %s is too large for cpio, skipped\n", e.name);
+            return 0;
+        }
+        break;
+    case LINUX_S_IFDIR:
+        e.type = '5';
+        break;
+    case LINUX_S_IFLNK:
+        retval = ino_read_symlink(fs, ino, inode, &target);
+        if (retval)
+            return retval;
+        e.type = '2';
+        if (format == ARCHIVE_TAR)
+            e.link = target;
+        else
+            e.size = strlen(target);
+        break;
+    case LINUX_S_IFCHR:
+    case LINUX_S_IFBLK:
+        /* Old encoding in i_block[0], new one in i_block[1] */
+        dev = inode->i_block[0];
+        if (dev)
+        {
+            e.rdev_major = (dev >> 8) & 0xff;
+            e.rdev_minor = dev & 0xff;
+        }
+        else
+        {
+            dev = inode->i_block[1];
+            e.rdev_major = (dev & 0xfff00) >> 8;
+            e.rdev_minor = (dev & 0xff) | ((dev >> 12) & 0xfff00);
+        }
+        e.type = (inode->i_mode & LINUX_S_IFMT) == LINUX_S_IFCHR ? '3' : '4';
+        break;
+    case LINUX_S_IFIFO:
+        e.type = '6';
+        break;
+    case LINUX_S_IFSOCK:
+        if (format == ARCHIVE_TAR)
+        {
+            fprintf(stderr, "Warning: tar can not hold socket %s, skipped\n", e.name);
+            return 0;
+        }
+        break;
+    default:
+        fprintf(stderr, "Warning: unknown entry \"%s\" (%x), skipped\n",
+                e.name, inode->i_mode & LINUX_S_IFMT);
+        return 0;
+    }
+
+    if (format == ARCHIVE_TAR)
+    {
+        retval = ino_get_xattrs(fs, &ctx->xattrs, ino, &e.x);
+        if (retval)
+            goto end;
+    }
+
+    retval = archive_header(&e);
+    if (retval)
+        goto end;
+
+    if (LINUX_S_ISREG(inode->i_mode))
+    {
+        retval = ino_extract_fd(ctx, fs, ino, inode, archive_fd, runs, count, NULL);
+        archive_pos += e.size;
+    }
+    else if (target && format == ARCHIVE_CPIO)
+    {
+        retval = archive_write(target, e.size);
+    }
+    if (!retval)
+        retval = archive_pad(format == ARCHIVE_TAR ? TAR_BLOCK : 4);
+
+end:
+    free(target);
+    return retval;
+}
+
+/* Appends @path as a further name of @ino, whose first name @target is archived */
+errcode_t archive_hardlink(ext2_ino_t ino, struct ext2_inode *inode,
+                           const char *target, const char *path)
+{
+    struct archive_entry e;
+
+    archive_entry_init(&e, ino, inode, path);
+    if (format == ARCHIVE_TAR)
+    {
+        e.type = '1';
+        e.link = target[0] == '/' ? target + 1 : target;
+    }
+    return archive_header(&e);
+}
+
+/* Opens @path, "-" for stdout, for an archive in @fmt */
+errcode_t archive_open(archive_format_t fmt, const char *path)
+{
+    if (!strcmp(path, "-"))
+        archive_fd = STDOUT_FILENO;
+    else
+        archive_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (archive_fd < 0)
+    {
+        E2FSTOOL_ERROR("while creating %s", path);
+        return -1;
+    }
+
+    format = fmt;
+    archive_pos = 0;
+    return 0;
+}
+
+/* Ends the archive if @finish, a failed walk leaves it without trailer */
+errcode_t archive_close(bool finish)
+{
+    struct archive_entry e = {
+        .name = CPIO_TRAILER,
+        .nlink = 1,
+    };
+    errcode_t retval = 0;
+
+    if (archive_fd < 0)
+        return 0;
+
+    if (finish && format == ARCHIVE_TAR)
+    {
+        retval = archive_write(zeroes, TAR_BLOCK);
+        if (!retval)
+            retval = archive_write(zeroes, TAR_BLOCK);
+    }
+    else if (finish)
+    {
+        retval = cpio_header(&e);
+        if (!retval)
+            retval = archive_pad(TAR_BLOCK);
+    }
+
+    if (archive_fd != STDOUT_FILENO && close(archive_fd) == -1 && !retval)
+    {
+        E2FSTOOL_ERROR("while closing archive");
+        retval = -1;
+    }
+    archive_fd = -1;
+    ext2fs_free_mem(&pax_buf);
+    pax_len = pax_cap = 0;
+    return retval;
+}
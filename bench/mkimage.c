@@ -0,0 +1,689 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+
+#include "e2fstool.h"
+
+/*
+ * Generates a synthetic ext4 image with a controllable shape, for
+ * benchmarking extraction. The same options and seed always give the
+ * same tree, sizes, contents and allocation order. A summary line is
+ * printed on stdout for run_bench.sh.
+ */
+
+#define FRAG_BATCH 8
+#define SPARSE_MAJOR_VERSION 1
+#define SPARSE_HEADER_LEN 28
+#define SPARSE_CHUNK_HEADER_LEN 12
+#define CHUNK_TYPE_RAW 0xCAC1
+#define CHUNK_TYPE_FILL 0xCAC2
+#define CHUNK_TYPE_DONT_CARE 0xCAC3
+
+enum image_format {
+    FORMAT_RAW,
+    FORMAT_SPARSE,
+    FORMAT_MOTO,
+};
+
+struct shape {
+    unsigned int files;
+    __u64 min_size, max_size;
+    unsigned int depth, fanout;
+    unsigned int frag;      /* blocks written per turn when interleaving, 0 = contiguous */
+    unsigned int zero_pct;  /* all-zero data blocks */
+    unsigned int xattr_pct; /* inodes labeled with security.selinux */
+    unsigned int link_pct;  /* files given a second name */
+    unsigned int symlink_pct;
+    unsigned int blocksize;
+    __u64 seed;
+    enum image_format format;
+};
+
+struct gen_file {
+    ext2_ino_t ino;
+    ext2_ino_t dir;
+    __u64 size;
+    __u64 written;
+    ext2_file_t file;
+};
+
+struct gen_stats {
+    unsigned int files, dirs, symlinks, links;
+    __u64 bytes;
+};
+
+static const char *labels[] = {
+    "u:object_r:system_file:s0",
+    "u:object_r:system_lib_file:s0",
+    "u:object_r:vendor_file:s0",
+    "u:object_r:vendor_firmware_file:s0",
+    "u:object_r:system_linker_exec:s0",
+    "u:object_r:zygote_exec:s0",
+};
+
+static __u64 rng_state;
+
+static __u64 rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static unsigned int rng_pct(unsigned int pct)
+{
+    return rng() % 100 < pct;
+}
+
+/* Log-uniform, so small files dominate as on real system images */
+static __u64 rng_size(__u64 min, __u64 max)
+{
+    double lo = min ? min : 1, hi = max ? max : 1;
+    double r = (rng() >> 11) * (1.0 / 9007199254740992.0);
+    __u64 size = lo * exp(r * log(hi / lo));
+
+    if (!min && rng_pct(5))
+        return 0;
+    return size < min ? min : size > max ? max : size;
+}
+
+static errcode_t link_retry(ext2_filsys fs, ext2_ino_t dir, const char *name,
+                            ext2_ino_t ino, int type)
+{
+    errcode_t retval;
+
+    retval = ext2fs_link(fs, dir, name, ino, type);
+    if (retval == EXT2_ET_DIR_NO_SPACE)
+    {
+        retval = ext2fs_expand_dir(fs, dir);
+        if (!retval)
+            retval = ext2fs_link(fs, dir, name, ino, type);
+    }
+    return retval;
+}
+
+static errcode_t mkdir_retry(ext2_filsys fs, ext2_ino_t parent, const char *name,
+                             ext2_ino_t *ret)
+{
+    errcode_t retval;
+
+    retval = ext2fs_mkdir(fs, parent, 0, name);
+    if (retval == EXT2_ET_DIR_NO_SPACE)
+    {
+        retval = ext2fs_expand_dir(fs, parent);
+        if (!retval)
+            retval = ext2fs_mkdir(fs, parent, 0, name);
+    }
+    if (retval)
+        return retval;
+
+    return ext2fs_lookup(fs, parent, name, strlen(name), NULL, ret);
+}
+
+static errcode_t set_xattrs(ext2_filsys fs, ext2_ino_t ino, bool caps)
+{
+    struct ext2_xattr_handle *h;
+    const char *label = labels[rng() % (sizeof(labels) / sizeof(*labels))];
+    struct vfs_cap_data cap = {
+        .magic_etc = VFS_CAP_REVISION | VFS_CAP_FLAGS_EFFECTIVE,
+        .data = {{.permitted = 1 << 10}},
+    };
+    errcode_t retval;
+
+    retval = ext2fs_xattrs_open(fs, ino, &h);
+    if (retval)
+        return retval;
+
+    retval = ext2fs_xattrs_read(h);
+    if (!retval)
+        retval = ext2fs_xattr_set(h, "security." XATTR_SELINUX_SUFFIX, label, strlen(label) + 1);
+    if (!retval && caps)
+        retval = ext2fs_xattr_set(h, "security." XATTR_CAPS_SUFFIX, &cap, XATTR_CAPS_SZ);
+    ext2fs_xattrs_close(&h);
+    return retval;
+}
+
+static errcode_t create_file(ext2_filsys fs, struct gen_file *f, const char *name)
+{
+    ext2_extent_handle_t handle;
+    struct ext2_inode inode;
+    errcode_t retval;
+
+    retval = ext2fs_new_inode(fs, f->dir, LINUX_S_IFREG | 0644, 0, &f->ino);
+    if (retval)
+        return retval;
+
+    retval = link_retry(fs, f->dir, name, f->ino, EXT2_FT_REG_FILE);
+    if (retval)
+        return retval;
+    ext2fs_inode_alloc_stats2(fs, f->ino, +1, 0);
+
+    memset(&inode, 0, sizeof(inode));
+    inode.i_mode = LINUX_S_IFREG | 0644;
+    inode.i_links_count = 1;
+    inode.i_atime = inode.i_ctime = inode.i_mtime = 1500000000 + rng() % 100000000;
+    inode.i_flags |= EXT4_EXTENTS_FL;
+
+    retval = ext2fs_write_new_inode(fs, f->ino, &inode);
+    if (retval)
+        return retval;
+
+    /* Writes the empty extent header */
+    retval = ext2fs_extent_open2(fs, f->ino, &inode, &handle);
+    if (retval)
+        return retval;
+    ext2fs_extent_free(handle);
+
+    return ext2fs_file_open(fs, f->ino, EXT2_FILE_WRITE, &f->file);
+}
+
+/* Appends up to @blocks blocks of data; zero blocks are written, not holes */
+static errcode_t write_blocks(struct gen_file *f, char *buf, unsigned int blocksize,
+                              unsigned int blocks, unsigned int zero_pct)
+{
+    unsigned int i, len, got;
+    __u64 *p;
+    errcode_t retval;
+
+    while (blocks-- && f->written < f->size)
+    {
+        len = f->size - f->written < blocksize ? f->size - f->written : blocksize;
+        if (rng_pct(zero_pct))
+        {
+            memset(buf, 0, len);
+        }
+        else
+        {
+            for (i = 0, p = (__u64 *)buf; i < blocksize / sizeof(*p); i++)
+                p[i] = rng();
+        }
+
+        retval = ext2fs_file_write(f->file, buf, len, &got);
+        if (retval)
+            return retval;
+        f->written += got;
+    }
+    return 0;
+}
+
+static errcode_t populate(ext2_filsys fs, struct shape *sh, struct gen_stats *st)
+{
+    struct gen_file batch[FRAG_BATCH];
+    ext2_ino_t *dirs = NULL;
+    unsigned int ndirs = 1, level_start = 0, level_end = 1, d, i, j, n;
+    unsigned int frag = sh->frag ? sh->frag : ~0U;
+    char name[64], target[256], *buf = NULL;
+    bool active;
+    errcode_t retval;
+
+    retval = ext2fs_get_mem(fs->blocksize, &buf);
+    if (retval)
+        return retval;
+
+    /* Directory tree, breadth first; dirs[0] is the root */
+    for (d = 0, n = 1; d < sh->depth; d++)
+        n = n * sh->fanout + 1;
+    retval = ext2fs_get_array(n, sizeof(*dirs), &dirs);
+    if (retval)
+        goto end;
+    dirs[0] = EXT2_ROOT_INO;
+
+    for (d = 0; d < sh->depth; d++)
+    {
+        for (i = level_start; i < level_end; i++)
+        {
+            for (j = 0; j < sh->fanout; j++)
+            {
+                snprintf(name, sizeof(name), "d%u", j);
+                retval = mkdir_retry(fs, dirs[i], name, &dirs[ndirs]);
+                if (retval)
+                    goto end;
+                if (rng_pct(sh->xattr_pct))
+                {
+                    retval = set_xattrs(fs, dirs[ndirs], false);
+                    if (retval)
+                        goto end;
+                }
+                ndirs++;
+                st->dirs++;
+            }
+        }
+        level_start = level_end;
+        level_end = ndirs;
+    }
+
+    /* Files in batches; data is interleaved within a batch to fragment it */
+    for (i = 0; i < sh->files; i += n)
+    {
+        n = sh->files - i < FRAG_BATCH ? sh->files - i : FRAG_BATCH;
+        for (j = 0; j < n; j++)
+        {
+            struct gen_file *f = &batch[j];
+
+            memset(f, 0, sizeof(*f));
+            f->dir = dirs[rng() % ndirs];
+            f->size = rng_size(sh->min_size, sh->max_size);
+            snprintf(name, sizeof(name), "f%07u", i + j);
+            retval = create_file(fs, f, name);
+            if (retval)
+                goto end;
+            st->files++;
+            st->bytes += f->size;
+        }
+
+        do
+        {
+            active = false;
+            for (j = 0; j < n; j++)
+            {
+                retval = write_blocks(&batch[j], buf, fs->blocksize, frag, sh->zero_pct);
+                if (retval)
+                    goto end;
+                active |= batch[j].written < batch[j].size;
+            }
+        } while (active);
+
+        for (j = 0; j < n; j++)
+        {
+            struct gen_file *f = &batch[j];
+            struct ext2_inode inode;
+
+            retval = ext2fs_file_close(f->file);
+            if (retval)
+                goto end;
+
+            if (rng_pct(sh->xattr_pct))
+            {
+                retval = set_xattrs(fs, f->ino, rng_pct(10));
+                if (retval)
+                    goto end;
+            }
+
+            if (rng_pct(sh->link_pct))
+            {
+                snprintf(name, sizeof(name), "l%07u", i + j);
+                retval = link_retry(fs, dirs[rng() % ndirs], name, f->ino, EXT2_FT_REG_FILE);
+                if (!retval)
+                    retval = ext2fs_read_inode(fs, f->ino, &inode);
+                if (retval)
+                    goto end;
+                inode.i_links_count++;
+                retval = ext2fs_write_inode(fs, f->ino, &inode);
+                if (retval)
+                    goto end;
+                st->links++;
+            }
+
+            if (rng_pct(sh->symlink_pct))
+            {
+                ext2_ino_t dir = dirs[rng() % ndirs];
+
+                /* Every other one too long for i_block, to cover both layouts */
+                snprintf(name, sizeof(name), "s%07u", i + j);
+                snprintf(target, sizeof(target), "%s/f%07u",
+                         rng_pct(50) ? "../../../../../../../../../../../../../../system/lib64" : "..",
+                         i + j);
+                retval = ext2fs_symlink(fs, dir, 0, name, target);
+                if (retval == EXT2_ET_DIR_NO_SPACE)
+                {
+                    retval = ext2fs_expand_dir(fs, dir);
+                    if (!retval)
+                        retval = ext2fs_symlink(fs, dir, 0, name, target);
+                }
+                if (retval)
+                    goto end;
+                st->symlinks++;
+            }
+        }
+    }
+
+end:
+    ext2fs_free_mem(&dirs);
+    ext2fs_free_mem(&buf);
+    return retval;
+}
+
+static errcode_t make_fs(const char *name, struct shape *sh, struct gen_stats *st)
+{
+    struct ext2_super_block param;
+    ext2_filsys fs;
+    __u64 data_blocks, blocks, inodes;
+    ext2_ino_t ino;
+    int fd, log_bs = 0;
+    errcode_t retval;
+
+    /* Expected data plus a generous margin for metadata and xattr blocks */
+    data_blocks = (sh->files * ((sh->min_size + sh->max_size) / 2 + sh->blocksize)) / sh->blocksize;
+    inodes = sh->files * 2 + (sh->depth + 1) * 1024ULL + 1024;
+    blocks = data_blocks + data_blocks / 4 + inodes / 4 + 16384;
+
+    fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0)
+        return errno;
+    if (ftruncate(fd, blocks * sh->blocksize))
+    {
+        retval = errno;
+        close(fd);
+        return retval;
+    }
+    close(fd);
+
+    while ((EXT2_MIN_BLOCK_SIZE << log_bs) < (int)sh->blocksize)
+        log_bs++;
+
+    memset(&param, 0, sizeof(param));
+    ext2fs_blocks_count_set(&param, blocks);
+    param.s_log_block_size = log_bs;
+    param.s_rev_level = EXT2_DYNAMIC_REV;
+    param.s_inode_size = 256;
+    param.s_inodes_count = inodes;
+    ext2fs_set_feature_extents(&param);
+    ext2fs_set_feature_dir_index(&param);
+    ext2fs_set_feature_xattr(&param);
+    ext2fs_set_feature_large_file(&param);
+    ext2fs_set_feature_filetype(&param);
+    ext2fs_set_feature_sparse_super(&param);
+
+    retval = ext2fs_initialize(name, EXT2_FLAG_64BITS, &param, unix_io_manager, &fs);
+    if (retval)
+        return retval;
+
+    retval = ext2fs_allocate_tables(fs);
+    if (!retval)
+        retval = ext2fs_mkdir(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, 0);
+    if (!retval)
+        retval = ext2fs_mkdir(fs, EXT2_ROOT_INO, 0, "lost+found");
+    if (retval)
+        goto end;
+
+    for (ino = EXT2_ROOT_INO + 1; ino < EXT2_FIRST_INODE(fs->super); ino++)
+        ext2fs_inode_alloc_stats2(fs, ino, +1, 0);
+    retval = ext2fs_update_bb_inode(fs, NULL);
+    if (retval)
+        goto end;
+
+    retval = populate(fs, sh, st);
+
+end:
+    if (retval)
+        ext2fs_free(fs);
+    else
+        retval = ext2fs_close_free(&fs);
+    return retval;
+}
+
+static void put_le16(unsigned char *p, __u16 v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_le32(unsigned char *p, __u32 v)
+{
+    put_le16(p, v);
+    put_le16(p + 2, v >> 16);
+}
+
+static errcode_t write_chunk(FILE *out, __u16 type, __u32 blocks, __u32 data_len)
+{
+    unsigned char hdr[SPARSE_CHUNK_HEADER_LEN] = {0};
+
+    put_le16(hdr, type);
+    put_le32(hdr + 4, blocks);
+    put_le32(hdr + 8, SPARSE_CHUNK_HEADER_LEN + data_len);
+    return fwrite(hdr, sizeof(hdr), 1, out) == 1 ? 0 : errno;
+}
+
+/* Block type for the sparse encoder: 0 RAW, 1 FILL with *fill, 2 DONT_CARE */
+static int classify(const char *blk, unsigned int len, __u32 *fill)
+{
+    const __u32 *w = (const __u32 *)blk;
+    unsigned int i;
+
+    for (i = 1; i < len / sizeof(*w); i++)
+    {
+        if (w[i] != w[0])
+            return 0;
+    }
+    *fill = w[0];
+    return w[0] ? 1 : 2;
+}
+
+/*
+ * Re-encodes @raw as an Android sparse image, with a vendor header in front
+ * of the filesystem for MOTO. Runs of zero blocks become DONT_CARE chunks
+ * and runs of a repeated word FILL chunks.
+ */
+static errcode_t write_sparse(const char *raw, const char *name, unsigned int blocksize, bool moto)
+{
+    unsigned char hdr[SPARSE_HEADER_LEN] = {0};
+    FILE *in, *out = NULL;
+    char *blk = NULL, *run = NULL;
+    __u32 fill = 0, run_fill = 0, chunks = 0, total = 0, run_len = 0;
+    size_t run_cap = 64, got;
+    int type, run_type = -1;
+    errcode_t retval = 0;
+
+    in = fopen(raw, "rb");
+    if (!in)
+        return errno;
+    out = fopen(name, "wb");
+    blk = malloc(blocksize);
+    run = malloc((size_t)run_cap * blocksize);
+    if (!out || !blk || !run)
+    {
+        retval = out ? EXT2_ET_NO_MEMORY : errno;
+        goto end;
+    }
+
+    /* Patched with the final counts once everything is written */
+    if (fwrite(hdr, sizeof(hdr), 1, out) != 1)
+    {
+        retval = errno;
+        goto end;
+    }
+
+    for (;;)
+    {
+        if (moto && !total)
+        {
+            memset(blk, 0, blocksize);
+            put_le32((unsigned char *)blk, MOTO_HEADER_MAGIC);
+            got = blocksize;
+        }
+        else
+        {
+            got = fread(blk, 1, blocksize, in);
+        }
+
+        type = got ? classify(blk, blocksize, &fill) : -1;
+        if (moto && !total)
+            type = 0;
+
+        if (run_len && (type != run_type || (type == 1 && fill != run_fill) ||
+                        (type == 0 && run_len == run_cap)))
+        {
+            if (run_type == 0)
+                retval = write_chunk(out, CHUNK_TYPE_RAW, run_len, run_len * blocksize);
+            else if (run_type == 1)
+                retval = write_chunk(out, CHUNK_TYPE_FILL, run_len, sizeof(run_fill));
+            else
+                retval = write_chunk(out, CHUNK_TYPE_DONT_CARE, run_len, 0);
+            if (!retval && run_type == 0 &&
+                fwrite(run, blocksize, run_len, out) != run_len)
+                retval = errno;
+            if (!retval && run_type == 1 &&
+                fwrite(&run_fill, sizeof(run_fill), 1, out) != 1)
+                retval = errno;
+            if (retval)
+                goto end;
+            chunks++;
+            run_len = 0;
+        }
+
+        if (!got)
+            break;
+        if (got < blocksize)
+        {
+            retval = EXT2_ET_SHORT_READ;
+            goto end;
+        }
+
+        if (type == 0)
+            memcpy(run + (size_t)run_len * blocksize, blk, blocksize);
+        run_type = type;
+        run_fill = fill;
+        run_len++;
+        total++;
+    }
+
+    put_le32(hdr, SPARSE_HEADER_MAGIC);
+    put_le16(hdr + 4, SPARSE_MAJOR_VERSION);
+    put_le16(hdr + 8, SPARSE_HEADER_LEN);
+    put_le16(hdr + 10, SPARSE_CHUNK_HEADER_LEN);
+    put_le32(hdr + 12, blocksize);
+    put_le32(hdr + 16, total);
+    put_le32(hdr + 20, chunks);
+    if (fseek(out, 0, SEEK_SET) || fwrite(hdr, sizeof(hdr), 1, out) != 1)
+        retval = errno;
+
+end:
+    free(run);
+    free(blk);
+    if (out && fclose(out) && !retval)
+        retval = errno;
+    fclose(in);
+    return retval;
+}
+
+static int parse_range(const char *arg, __u64 *min, __u64 *max)
+{
+    char *end;
+
+    *min = strtoull(arg, &end, 0);
+    if (*end != ':')
+        return -1;
+    *max = strtoull(end + 1, &end, 0);
+    return *end || *min > *max ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct shape sh = {
+        .files = 10000,
+        .min_size = 0,
+        .max_size = 1 << 20,
+        .depth = 3,
+        .fanout = 6,
+        .blocksize = 4096,
+        .seed = 1,
+    };
+    struct gen_stats st = {0};
+    char *raw_name = NULL;
+    const char *name;
+    errcode_t retval;
+    int c;
+
+    add_error_table(&et_ext2_error_table);
+
+    while ((c = getopt(argc, argv, "b:d:f:F:l:n:r:s:w:x:y:z:")) != EOF)
+    {
+        switch (c)
+        {
+        case 'b':
+            sh.blocksize = strtoul(optarg, NULL, 0);
+            if (sh.blocksize < EXT2_MIN_BLOCK_SIZE || sh.blocksize > EXT2_MAX_BLOCK_SIZE ||
+                sh.blocksize & (sh.blocksize - 1))
+                goto usage;
+            break;
+        case 'd':
+            sh.depth = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            if (!strcmp(optarg, "raw"))
+                sh.format = FORMAT_RAW;
+            else if (!strcmp(optarg, "sparse"))
+                sh.format = FORMAT_SPARSE;
+            else if (!strcmp(optarg, "moto"))
+                sh.format = FORMAT_MOTO;
+            else
+                goto usage;
+            break;
+        case 'F':
+            sh.frag = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            sh.link_pct = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            sh.files = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            sh.seed = strtoull(optarg, NULL, 0);
+            break;
+        case 's':
+            if (parse_range(optarg, &sh.min_size, &sh.max_size))
+                goto usage;
+            break;
+        case 'w':
+            sh.fanout = strtoul(optarg, NULL, 0);
+            break;
+        case 'x':
+            sh.xattr_pct = strtoul(optarg, NULL, 0);
+            break;
+        case 'y':
+            sh.symlink_pct = strtoul(optarg, NULL, 0);
+            break;
+        case 'z':
+            sh.zero_pct = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if (optind != argc - 1 || (sh.depth && !sh.fanout))
+        goto usage;
+    name = argv[optind];
+    rng_state = sh.seed ?: 1;
+
+    if (sh.format != FORMAT_RAW && asprintf(&raw_name, "%s.raw", name) < 0)
+        return EXIT_FAILURE;
+
+    retval = make_fs(raw_name ?: name, &sh, &st);
+    if (retval)
+    {
+        com_err(argv[0], retval, "while generating %s", raw_name ?: name);
+        goto end;
+    }
+
+    if (raw_name)
+    {
+        retval = write_sparse(raw_name, name, sh.blocksize, sh.format == FORMAT_MOTO);
+        if (retval)
+            com_err(argv[0], retval, "while writing %s", name);
+        unlink(raw_name);
+    }
+
+    if (!retval)
+        printf("files=%u dirs=%u symlinks=%u links=%u bytes=%llu\n",
+               st.files, st.dirs, st.symlinks, st.links, (unsigned long long)st.bytes);
+
+end:
+    free(raw_name);
+    remove_error_table(&et_ext2_error_table);
+    return retval ? EXIT_FAILURE : EXIT_SUCCESS;
+
+usage:
+    fprintf(stderr, "%s [-n files] [-s min_size:max_size] [-d depth] [-w fanout]\n"
+                    "\t [-F frag_blocks] [-z zero_pct] [-x xattr_pct] [-l link_pct]\n"
+                    "\t [-y symlink_pct] [-b blocksize] [-r seed] [-f raw|sparse|moto]\n"
+                    "\t image\n",
+            argv[0]);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,124 @@
+#!/bin/sh
+#
+# Generates synthetic images with mkimage and times e2fstool extraction on
+# them. Prints one tab separated row per (shape, format, mode) with files/s,
+# MiB/s, peak RSS and, when strace is installed, the syscall count.
+#
+# usage: run_bench.sh [-k] [-o workdir] [-j jobs] [-S] path/to/e2fstool path/to/mkimage
+#   -k  keep generated images in workdir for the next run
+#   -S  skip the strace pass
+#
+
+set -eu
+
+workdir=${TMPDIR:-/tmp}/e2fstool-bench
+jobs=$(nproc 2>/dev/null || echo 4)
+keep=0
+use_strace=1
+
+while getopts "kj:o:S" opt; do
+    case $opt in
+    k) keep=1 ;;
+    j) jobs=$OPTARG ;;
+    o) workdir=$OPTARG ;;
+    S) use_strace=0 ;;
+    *) sed -n '7,9s/^# \{0,1\}//p' "$0" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -ne 2 ]; then
+    sed -n '7,9s/^# \{0,1\}//p' "$0" >&2
+    exit 1
+fi
+
+e2fstool=$1
+mkimage=$2
+time_bin=/usr/bin/time
+
+if [ ! -x "$time_bin" ]; then
+    echo "GNU time ($time_bin) is required for RSS measurements" >&2
+    exit 1
+fi
+command -v strace >/dev/null 2>&1 || use_strace=0
+
+mkdir -p "$workdir"
+
+# name and mkimage options of every shape
+shapes="
+small -n 50000 -s 0:16384 -d 4 -w 8 -x 90 -l 5 -y 10
+large -n 400 -s 1048576:33554432 -d 2 -w 4
+fragmented -n 4000 -s 65536:2097152 -d 3 -w 4 -F 1 -z 20
+"
+
+# name and e2fstool options of every mode
+modes="
+serial
+configs -c CONFDIR
+parallel -j JOBS
+block-order --block-order
+parallel-block-order -j JOBS --block-order
+sparse-out -S -z
+preserve -p
+zero-copy --zero-copy
+libsparse --libsparse
+"
+
+printf "shape\tformat\tmode\tseconds\tfiles/s\tMiB/s\tmax_rss_kib\tsyscalls\n"
+
+echo "$shapes" | while read -r shape shape_opts; do
+    [ -n "$shape" ] || continue
+
+    for format in raw sparse moto; do
+        image=$workdir/$shape.$format.img
+        if [ ! -s "$image" ] || [ ! -s "$image.meta" ]; then
+            # shellcheck disable=SC2086
+            "$mkimage" $shape_opts -f "$format" "$image" > "$image.meta"
+        fi
+
+        entries=$(sed 's/.*files=\([0-9]*\) dirs=\([0-9]*\) symlinks=\([0-9]*\) links=\([0-9]*\).*/\1 \2 \3 \4/' "$image.meta" |
+                  awk '{ print $1 + $2 + $3 + $4 }')
+        bytes=$(sed 's/.*bytes=\([0-9]*\).*/\1/' "$image.meta")
+
+        echo "$modes" | while read -r mode mode_opts; do
+            [ -n "$mode" ] || continue
+            case $mode in
+            zero-copy) [ "$format" = raw ] || continue ;;
+            libsparse) [ "$format" != raw ] || continue ;;
+            esac
+
+            out=$workdir/out
+            conf=$workdir/conf
+            opts=$(echo "$mode_opts" | sed "s|CONFDIR|$conf|; s|JOBS|$jobs|")
+
+            rm -rf "$out" "$conf"
+            sync
+            # shellcheck disable=SC2086
+            "$time_bin" -f "%e %M" -o "$workdir/time" \
+                "$e2fstool" -q $opts "$image" "$out" > /dev/null
+            read -r seconds rss < "$workdir/time"
+
+            syscalls=-
+            if [ "$use_strace" = 1 ]; then
+                rm -rf "$out" "$conf"
+                # shellcheck disable=SC2086
+                strace -f -c -o "$workdir/strace" \
+                    "$e2fstool" -q $opts "$image" "$out" > /dev/null
+                # columns may be blank, so cut the total row at the "calls" header
+                syscalls=$(awk '/calls/ { end = index($0, "calls") + 4 }
+                                $NF == "total" { n = split(substr($0, 1, end), f); print f[n] }' \
+                           "$workdir/strace")
+            fi
+
+            awk -v s="$shape" -v f="$format" -v m="$mode" -v t="$seconds" \
+                -v n="$entries" -v b="$bytes" -v r="$rss" -v c="$syscalls" \
+                'BEGIN { if (t <= 0) t = 0.001;
+                         printf "%s\t%s\t%s\t%.2f\t%.0f\t%.1f\t%s\t%s\n",
+                                s, f, m, t, n / t, b / t / 1048576, r, c }'
+        done
+
+        [ "$keep" = 1 ] || rm -f "$image" "$image.meta"
+    done
+done
+
+rm -rf "$workdir/out" "$workdir/conf" "$workdir/time" "$workdir/strace"
@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "e2fstool.h"
+
+/*
+ * Compares libsparse's sparse_io_manager with the built-in index manager
+ * on the same image: a full inode scan, random single block reads and a
+ * sequential read of every block.
+ */
+
+#define SEQ_CHUNK_BLOCKS 256
+
+struct bench_result {
+    double scan, random, seq;
+    unsigned long long seq_bytes;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static errcode_t run_bench(const char *name, io_manager mgr, unsigned long reads,
+                           struct bench_result *res)
+{
+    ext2_filsys fs;
+    ext2_inode_scan scan;
+    struct ext2_inode inode;
+    ext2_ino_t ino;
+    blk64_t blk, nblocks;
+    char *buf;
+    unsigned long i;
+    double t;
+    errcode_t retval;
+
+    retval = ext2fs_open(name, EXT2_FLAG_64BITS, 0, 0, mgr, &fs);
+    if (retval)
+        return retval;
+
+    nblocks = ext2fs_blocks_count(fs->super);
+    retval = ext2fs_get_mem((size_t)SEQ_CHUNK_BLOCKS * fs->blocksize, &buf);
+    if (retval)
+        goto end;
+
+    t = now();
+    retval = ext2fs_open_inode_scan(fs, 0, &scan);
+    if (retval)
+        goto free;
+    do
+        retval = ext2fs_get_next_inode_full(scan, &ino, &inode, sizeof(inode));
+    while (!retval && ino);
+    ext2fs_close_inode_scan(scan);
+    if (retval)
+        goto free;
+    res->scan = now() - t;
+
+    srand(1);
+    t = now();
+    for (i = 0; i < reads; i++)
+    {
+        blk = ((blk64_t)rand() * RAND_MAX + rand()) % nblocks;
+        retval = io_channel_read_blk64(fs->io, blk, 1, buf);
+        if (retval)
+            goto free;
+    }
+    res->random = now() - t;
+
+    t = now();
+    for (blk = 0; blk < nblocks; blk += SEQ_CHUNK_BLOCKS)
+    {
+        int count = nblocks - blk < SEQ_CHUNK_BLOCKS ? nblocks - blk : SEQ_CHUNK_BLOCKS;
+
+        retval = io_channel_read_blk64(fs->io, blk, count, buf);
+        if (retval)
+            goto free;
+    }
+    res->seq = now() - t;
+    res->seq_bytes = nblocks * fs->blocksize;
+
+free:
+    ext2fs_free_mem(&buf);
+end:
+    ext2fs_close_free(&fs);
+    return retval;
+}
+
+static void print_result(const char *label, unsigned long reads, struct bench_result *res)
+{
+    printf("%-10s %10.3f %12.0f %12.1f\n", label, res->scan,
+           res->random ? reads / res->random : 0,
+           res->seq ? res->seq_bytes / res->seq / (1 << 20) : 0);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_result lib = {0}, idx = {0};
+    unsigned long reads = 100000;
+    char *lib_name;
+    errcode_t retval;
+    int c;
+
+    add_error_table(&et_ext2_error_table);
+
+    while ((c = getopt(argc, argv, "n:")) != EOF)
+    {
+        switch (c)
+        {
+        case 'n':
+            reads = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if (optind != argc - 1)
+        goto usage;
+
+    if (asprintf(&lib_name, "(%s):0:0", argv[optind]) < 0)
+        return EXIT_FAILURE;
+
+    retval = run_bench(lib_name, sparse_io_manager, reads, &lib);
+    free(lib_name);
+    if (retval)
+    {
+        com_err(argv[0], retval, "while benchmarking libsparse");
+        return EXIT_FAILURE;
+    }
+
+    retval = run_bench(argv[optind], sparse_index_io_manager, reads, &idx);
+    if (retval)
+    {
+        com_err(argv[0], retval, "while benchmarking sparse index");
+        return EXIT_FAILURE;
+    }
+
+    printf("%-10s %10s %12s %12s\n", "manager", "scan (s)", "random/s", "seq MiB/s");
+    print_result("libsparse", reads, &lib);
+    print_result("index", reads, &idx);
+
+    remove_error_table(&et_ext2_error_table);
+    return EXIT_SUCCESS;
+
+usage:
+    fprintf(stderr, "%s [-n random_reads] sparse_image\n", argv[0]);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,241 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#include "e2fstool.h"
+
+/*
+ * Data buffer pool and memory budget.
+ *
+ * File data goes through buffers of power of two size classes, from
+ * POOL_MIN_BUFLEN up to FILE_READ_BUFLEN, picked by file size. Freed
+ * buffers stay in the pool for the next file of their class instead of
+ * going back to the allocator.
+ *
+ * With --max-memory the pooled buffers and the small files queued on the
+ * batched output share one budget, the caches are capped separately (see
+ * main()). A request that doesn't fit first drops idle buffers, then
+ * settles for a smaller class, and only then waits for memory to be
+ * given back. Waiting is what slows the walk down to what the writers
+ * keep up with. A request is always granted when nothing else is held,
+ * so a single buffer larger than the budget can't stall the run.
+ */
+
+#define POOL_MIN_SHIFT 16
+#define POOL_MIN_BUFLEN (1 << POOL_MIN_SHIFT)
+#define POOL_CLASSES 12 /* 64 KiB up to FILE_READ_BUFLEN */
+#define POOL_IDLE_MAX 8 /* Idle buffers kept per class */
+#define POOL_ALIGN 4096
+
+static char *idle[POOL_CLASSES][POOL_IDLE_MAX];
+static unsigned int idle_count[POOL_CLASSES];
+static size_t budget = 0, used = 0, held = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_released = PTHREAD_COND_INITIALIZER;
+
+size_t max_memory = 0;
+
+static inline size_t class_len(unsigned int c)
+{
+    return (size_t)POOL_MIN_BUFLEN << c;
+}
+
+/* Smallest class holding @len bytes, the largest one past that */
+static unsigned int class_of(size_t len)
+{
+    unsigned int c = 0;
+
+    while (c < POOL_CLASSES - 1 && class_len(c) < len)
+        c++;
+    return c;
+}
+
+static char *buf_alloc(size_t len)
+{
+#ifdef _WIN32
+    return _aligned_malloc(len, POOL_ALIGN);
+#else
+    void *buf;
+
+    return posix_memalign(&buf, POOL_ALIGN, len) ? NULL : buf;
+#endif
+}
+
+static void buf_release(char *buf)
+{
+#ifdef _WIN32
+    _aligned_free(buf);
+#else
+    free(buf);
+#endif
+}
+
+static inline bool fits(size_t len)
+{
+    return !budget || used + len <= budget || !held;
+}
+
+/* Frees idle buffers until @len more bytes fit, with pool_lock held */
+static void drop_idle(size_t len)
+{
+    unsigned int c;
+
+    for (c = POOL_CLASSES; c-- > 0 && budget && used + len > budget;)
+    {
+        while (idle_count[c] && used + len > budget)
+        {
+            buf_release(idle[c][--idle_count[c]]);
+            used -= class_len(c);
+        }
+    }
+}
+
+/* Sets the budget shared by data buffers and queued output, 0 for none */
+void bufpool_init(size_t limit)
+{
+    budget = limit;
+}
+
+/*
+ * Hands out a buffer for @want bytes of file data in *@buf, *@len tells
+ * its real size: larger when rounded up to a class, smaller when the
+ * budget is short. Waits for memory to be given back as a last resort.
+ */
+errcode_t bufpool_get(size_t want, char **buf, size_t *len)
+{
+    unsigned int c, top = class_of(want);
+    errcode_t retval;
+    char *b = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    for (;;)
+    {
+        if (idle_count[top])
+        {
+            c = top;
+            b = idle[c][--idle_count[c]];
+            break;
+        }
+
+        drop_idle(class_len(top));
+        for (c = top + 1; c-- > 0;)
+        {
+            /* Short on budget, an idle smaller buffer costs nothing more */
+            if (c < top && idle_count[c])
+                b = idle[c][--idle_count[c]];
+            if (b || fits(class_len(c)))
+                break;
+        }
+        if (c < POOL_CLASSES)
+            break;
+
+        /* Queued output of this thread may be what holds the budget */
+        pthread_mutex_unlock(&pool_lock);
+        retval = out_flush();
+        if (retval)
+            return retval;
+        pthread_mutex_lock(&pool_lock);
+        if (!fits(class_len(0)))
+            pthread_cond_wait(&pool_released, &pool_lock);
+    }
+    if (!b)
+        used += class_len(c);
+    held += class_len(c);
+    pthread_mutex_unlock(&pool_lock);
+
+    if (!b)
+        b = buf_alloc(class_len(c));
+    if (!b)
+    {
+        pthread_mutex_lock(&pool_lock);
+        used -= class_len(c);
+        held -= class_len(c);
+        pthread_cond_broadcast(&pool_released);
+        pthread_mutex_unlock(&pool_lock);
+        return EXT2_ET_NO_MEMORY;
+    }
+    *buf = b;
+    *len = class_len(c);
+    return 0;
+}
+
+/* Returns a buffer from bufpool_get() */
+void bufpool_put(char *buf, size_t len)
+{
+    unsigned int c = class_of(len);
+
+    if (!buf)
+        return;
+
+    pthread_mutex_lock(&pool_lock);
+    held -= len;
+    if (idle_count[c] < POOL_IDLE_MAX)
+    {
+        idle[c][idle_count[c]++] = buf;
+        buf = NULL;
+    }
+    else
+    {
+        used -= len;
+    }
+    pthread_cond_broadcast(&pool_released);
+    pthread_mutex_unlock(&pool_lock);
+    buf_release(buf);
+}
+
+/*
+ * Charges @len bytes allocated elsewhere to the budget, waiting for them
+ * to fit unless @wait is false. Returns whether they were charged. Never
+ * wait while holding a pool buffer, that could wait for itself.
+ */
+bool mem_reserve(size_t len, bool wait)
+{
+    if (!budget)
+        return true;
+
+    pthread_mutex_lock(&pool_lock);
+    drop_idle(len);
+    while (!fits(len))
+    {
+        if (!wait)
+        {
+            pthread_mutex_unlock(&pool_lock);
+            return false;
+        }
+        pthread_cond_wait(&pool_released, &pool_lock);
+        drop_idle(len);
+    }
+    used += len;
+    held += len;
+    pthread_mutex_unlock(&pool_lock);
+    return true;
+}
+
+void mem_release(size_t len)
+{
+    if (!budget)
+        return;
+
+    pthread_mutex_lock(&pool_lock);
+    used -= len;
+    held -= len;
+    pthread_cond_broadcast(&pool_released);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void bufpool_free(void)
+{
+    unsigned int c;
+
+    for (c = 0; c < POOL_CLASSES; c++)
+    {
+        while (idle_count[c])
+        {
+            buf_release(idle[c][--idle_count[c]]);
+            used -= class_len(c);
+        }
+    }
+}
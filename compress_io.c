@@ -0,0 +1,1523 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "e2fstool.h"
+
+/*
+ * Random access to gzip, xz and lz4 compressed images.
+ *
+ * The first open of an image builds an index of access points, roughly
+ * every ZS_SPAN bytes of output, from which decoding can start: for gzip
+ * a deflate block boundary with the 32 KiB of output before it (as zlib's
+ * zran does), for lz4 a block with the 64 KiB dictionary linked blocks
+ * need, for xz the blocks of its own index. The index is saved next to
+ * the image as <image>.zidx and loaded on later runs while the image is
+ * unchanged.
+ *
+ * Reads are served from 1 MiB windows of decompressed data, kept in an
+ * LRU cache shared by all channels and bounded by zcache_cap. A missing
+ * window is decoded from the nearest access point before it, or from
+ * where the channel's decoder stopped when that is closer, so sequential
+ * reads never restart. Channels each have their own decoder, the index
+ * and the cache are shared.
+ */
+
+#define ZS_WINDOW (1 << 20)
+#define ZS_SPAN ((__u64)4 << 20)
+#define ZS_INBUF (128 << 10)
+#define ZS_BUCKETS 256
+#define GZ_DICT (32 << 10)
+#define LZ4_DICT (64 << 10)
+#define LZ4_MAGIC 0x184D2204
+#define LZ4_SKIP_MAGIC 0x184D2A50 /* Low nibble is free */
+#define ZIDX_MAGIC "E2FSZIDX"
+#define ZIDX_VERSION 1
+
+/* Place decoding can start from */
+struct zpoint {
+    __u64 out; /* Offset in the decompressed stream */
+    __u64 in;  /* Offset in the compressed file */
+    int state; /* gzip: unused bits before @in, -1 at a member header; lz4: frame flags; xz: check */
+    __u32 dict_len;
+    unsigned char *dict; /* Output before @out the decoder needs */
+};
+
+struct zindex {
+    char *path;
+    compress_type_t type;
+    __u64 file_size, mtime;
+    __u64 size;
+    struct zpoint *points;
+    size_t count, cap;
+    struct zindex *next;
+};
+
+/* Decompressed window in the shared cache */
+struct zwindow {
+    const struct zindex *zi;
+    __u64 index;
+    unsigned char *buf;
+    size_t len;
+    struct zwindow *hnext, *prev, *next;
+};
+
+/* One channel: input buffer and decoder position */
+struct zfile {
+    struct zindex *zi;
+    int fd;
+    pthread_mutex_t lock;
+
+    unsigned char *in_buf;
+    size_t in_pos, in_len;
+    __u64 in_next; /* File offset after in_buf[in_len - 1] */
+
+    bool live;
+    __u64 out;
+    size_t point;
+    unsigned char *scratch;
+
+    z_stream gz;
+    bool gz_init, gz_raw;
+#ifdef HAVE_LZMA
+    lzma_stream xz;
+    lzma_block block; /* The decoder keeps using it */
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+#endif
+#ifdef HAVE_LZ4
+    int lz4_state; /* Flags of the current frame, -1 between frames */
+    size_t lz4_max;
+    unsigned char *blk, *cblk, *dict;
+    size_t blk_len, blk_pos, dict_len;
+    __u64 blk_in;
+    bool blk_first;
+#endif
+};
+
+struct zformat {
+    errcode_t (*build)(struct zindex *zi, struct zfile *zf);
+    errcode_t (*reset)(struct zfile *zf, const struct zpoint *p);
+    errcode_t (*step)(struct zfile *zf, unsigned char *buf, size_t len);
+};
+
+static struct zindex *indexes = NULL;
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct zwindow *buckets[ZS_BUCKETS];
+static struct zwindow *lru_head = NULL, *lru_tail = NULL;
+static size_t cache_used = 0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+size_t zcache_cap = ZCACHE_DEFAULT_CAP;
+
+static inline __u32 get_le32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (__u32)p[3] << 24;
+}
+
+/* Input */
+
+static void zf_seek(struct zfile *zf, __u64 off)
+{
+    zf->in_pos = zf->in_len = 0;
+    zf->in_next = off;
+}
+
+static __u64 zf_tell(const struct zfile *zf)
+{
+    return zf->in_next - (zf->in_len - zf->in_pos);
+}
+
+/* Makes at least @want bytes available unless the file ends first */
+static errcode_t zf_fill(struct zfile *zf, size_t want)
+{
+    size_t have = zf->in_len - zf->in_pos;
+    ssize_t n;
+
+    if (have >= want)
+        return 0;
+
+    memmove(zf->in_buf, zf->in_buf + zf->in_pos, have);
+    zf->in_pos = 0;
+    zf->in_len = have;
+
+    if (lseek(zf->fd, zf->in_next, SEEK_SET) == (off_t)-1)
+        return errno;
+    while (zf->in_len < want)
+    {
+        n = read(zf->fd, zf->in_buf + zf->in_len, ZS_INBUF - zf->in_len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        if (!n)
+            break;
+        zf->in_len += n;
+        zf->in_next += n;
+    }
+    return 0;
+}
+
+static errcode_t zf_get(struct zfile *zf, void *buf, size_t len)
+{
+    unsigned char *p = buf;
+    size_t n;
+    errcode_t retval;
+
+    while (len)
+    {
+        retval = zf_fill(zf, 1);
+        if (retval)
+            return retval;
+        n = zf->in_len - zf->in_pos;
+        if (!n)
+            return EXT2_ET_SHORT_READ;
+        if (n > len)
+            n = len;
+        if (p)
+        {
+            memcpy(p, zf->in_buf + zf->in_pos, n);
+            p += n;
+        }
+        zf->in_pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static errcode_t zindex_add(struct zindex *zi, __u64 out, __u64 in, int state,
+                            const unsigned char *dict, size_t dict_len)
+{
+    struct zpoint *p;
+    errcode_t retval;
+
+    if (zi->count == zi->cap)
+    {
+        size_t new_cap = zi->cap ? zi->cap * 2 : 64;
+
+        retval = ext2fs_resize_array(sizeof(*zi->points), zi->cap, new_cap, &zi->points);
+        if (retval)
+            return retval;
+        zi->cap = new_cap;
+    }
+
+    p = &zi->points[zi->count];
+    memset(p, 0, sizeof(*p));
+    if (dict_len)
+    {
+        p->dict = malloc(dict_len);
+        if (!p->dict)
+            return EXT2_ET_NO_MEMORY;
+        memcpy(p->dict, dict, dict_len);
+    }
+    p->out = out;
+    p->in = in;
+    p->state = state;
+    p->dict_len = dict_len;
+    zi->count++;
+    return 0;
+}
+
+/* gzip */
+
+static errcode_t gz_init(struct zfile *zf)
+{
+    if (zf->gz_init)
+        return 0;
+    if (inflateInit2(&zf->gz, 47) != Z_OK)
+        return EXT2_ET_NO_MEMORY;
+    zf->gz_init = true;
+    return 0;
+}
+
+/* After a member, true if another one follows */
+static errcode_t gz_next_member(struct zfile *zf, bool *more)
+{
+    errcode_t retval;
+
+    *more = false;
+    retval = zf_fill(zf, 2);
+    if (retval)
+        return retval;
+    if (zf->in_len - zf->in_pos < 2 ||
+        zf->in_buf[zf->in_pos] != 0x1f || zf->in_buf[zf->in_pos + 1] != 0x8b)
+        return 0;
+
+    if (inflateReset2(&zf->gz, 47) != Z_OK)
+        return EIO;
+    zf->gz_raw = false;
+    *more = true;
+    return 0;
+}
+
+static errcode_t gz_build(struct zindex *zi, struct zfile *zf)
+{
+    unsigned char *window, *dict;
+    __u64 totin = 0, totout = 0, last = 0;
+    unsigned int pos;
+    size_t n;
+    bool more;
+    int ret;
+    errcode_t retval;
+
+    retval = gz_init(zf);
+    if (retval)
+        return retval;
+
+    window = malloc(2 * GZ_DICT);
+    if (!window)
+        return EXT2_ET_NO_MEMORY;
+    dict = window + GZ_DICT;
+
+    zf_seek(zf, 0);
+    zf->gz.avail_out = 0;
+    retval = zindex_add(zi, 0, 0, -1, NULL, 0);
+    while (!retval)
+    {
+        retval = zf_fill(zf, 1);
+        if (retval)
+            break;
+        if (zf->in_pos == zf->in_len)
+        {
+            retval = EXT2_ET_SHORT_READ;
+            break;
+        }
+
+        /* The output doubles as a ring of the last 32 KiB */
+        if (!zf->gz.avail_out)
+        {
+            zf->gz.next_out = window;
+            zf->gz.avail_out = GZ_DICT;
+        }
+        zf->gz.next_in = zf->in_buf + zf->in_pos;
+        zf->gz.avail_in = zf->in_len - zf->in_pos;
+        n = zf->gz.avail_out;
+
+        ret = inflate(&zf->gz, Z_BLOCK);
+        totin += zf->in_len - zf->in_pos - zf->gz.avail_in;
+        totout += n - zf->gz.avail_out;
+        zf->in_pos = zf->in_len - zf->gz.avail_in;
+
+        if (ret == Z_STREAM_END)
+        {
+            retval = gz_next_member(zf, &more);
+            if (retval || !more)
+                break;
+            retval = zindex_add(zi, totout, totin, -1, NULL, 0);
+            last = totout;
+            continue;
+        }
+        if (ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+            retval = EIO;
+            break;
+        }
+
+        /* At a block boundary that is not the end of the member */
+        if ((zf->gz.data_type & 128) && !(zf->gz.data_type & 64) && totout - last >= ZS_SPAN)
+        {
+            pos = GZ_DICT - zf->gz.avail_out;
+            memcpy(dict, window + pos, GZ_DICT - pos);
+            memcpy(dict + GZ_DICT - pos, window, pos);
+            retval = zindex_add(zi, totout, totin, zf->gz.data_type & 7, dict, GZ_DICT);
+            last = totout;
+        }
+    }
+
+    free(window);
+    zi->size = totout;
+    zf->live = false;
+    return retval;
+}
+
+static errcode_t gz_reset(struct zfile *zf, const struct zpoint *p)
+{
+    unsigned char c;
+    errcode_t retval;
+
+    retval = gz_init(zf);
+    if (retval)
+        return retval;
+
+    if (p->state < 0)
+    {
+        zf_seek(zf, p->in);
+        zf->gz_raw = false;
+        return inflateReset2(&zf->gz, 47) == Z_OK ? 0 : EIO;
+    }
+
+    zf->gz_raw = true;
+    if (inflateReset2(&zf->gz, -15) != Z_OK)
+        return EIO;
+
+    /* The point may start in the middle of a byte */
+    zf_seek(zf, p->in - (p->state > 0));
+    if (p->state > 0)
+    {
+        retval = zf_get(zf, &c, 1);
+        if (retval)
+            return retval;
+        if (inflatePrime(&zf->gz, p->state, c >> (8 - p->state)) != Z_OK)
+            return EIO;
+    }
+    return inflateSetDictionary(&zf->gz, p->dict, p->dict_len) == Z_OK ? 0 : EIO;
+}
+
+static errcode_t gz_step(struct zfile *zf, unsigned char *buf, size_t len)
+{
+    bool more;
+    int ret;
+    errcode_t retval;
+
+    while (len)
+    {
+        retval = zf_fill(zf, 1);
+        if (retval)
+            return retval;
+        if (zf->in_pos == zf->in_len)
+            return EXT2_ET_SHORT_READ;
+
+        zf->gz.next_in = zf->in_buf + zf->in_pos;
+        zf->gz.avail_in = zf->in_len - zf->in_pos;
+        zf->gz.next_out = buf;
+        zf->gz.avail_out = len;
+
+        ret = inflate(&zf->gz, Z_NO_FLUSH);
+        zf->in_pos = zf->in_len - zf->gz.avail_in;
+        zf->out += len - zf->gz.avail_out;
+        buf += len - zf->gz.avail_out;
+        len = zf->gz.avail_out;
+
+        if (ret == Z_STREAM_END)
+        {
+            /* Raw inflate leaves the member trailer behind */
+            if (zf->gz_raw && (retval = zf_get(zf, NULL, 8)))
+                return retval;
+            retval = gz_next_member(zf, &more);
+            if (retval)
+                return retval;
+            if (!more && len)
+                return EXT2_ET_SHORT_READ;
+        }
+        else if (ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+            return EIO;
+        }
+    }
+    return 0;
+}
+
+static void gz_end(struct zfile *zf)
+{
+    if (zf->gz_init)
+        inflateEnd(&zf->gz);
+    zf->gz_init = false;
+}
+
+#ifdef HAVE_LZMA
+static void xz_free_filters(struct zfile *zf)
+{
+    unsigned int i;
+
+    for (i = 0; i < LZMA_FILTERS_MAX && zf->filters[i].id != LZMA_VLI_UNKNOWN; i++)
+    {
+        free(zf->filters[i].options);
+        zf->filters[i].options = NULL;
+    }
+    zf->filters[0].id = LZMA_VLI_UNKNOWN;
+}
+
+/* xz carries its own index of blocks, every block is an access point */
+static errcode_t xz_build(struct zindex *zi, struct zfile *zf)
+{
+    lzma_stream strm = LZMA_STREAM_INIT;
+    lzma_index *idx = NULL;
+    lzma_index_iter iter;
+    lzma_ret ret;
+    errcode_t retval = 0;
+
+    if (lzma_file_info_decoder(&strm, &idx, UINT64_MAX, zi->file_size) != LZMA_OK)
+        return EXT2_ET_NO_MEMORY;
+
+    zf_seek(zf, 0);
+    for (;;)
+    {
+        retval = zf_fill(zf, 1);
+        if (retval)
+            break;
+        strm.next_in = zf->in_buf + zf->in_pos;
+        strm.avail_in = zf->in_len - zf->in_pos;
+
+        ret = lzma_code(&strm, LZMA_RUN);
+        zf->in_pos = zf->in_len - strm.avail_in;
+        if (ret == LZMA_SEEK_NEEDED)
+        {
+            zf_seek(zf, strm.seek_pos);
+            continue;
+        }
+        if (ret == LZMA_STREAM_END)
+            break;
+        if (ret != LZMA_OK)
+        {
+            retval = ret == LZMA_MEM_ERROR ? EXT2_ET_NO_MEMORY : EIO;
+            break;
+        }
+        if (zf->in_pos == zf->in_len && !strm.avail_in && zf->in_next >= zi->file_size)
+        {
+            retval = EXT2_ET_SHORT_READ;
+            break;
+        }
+    }
+    lzma_end(&strm);
+
+    if (!retval)
+    {
+        lzma_index_iter_init(&iter, idx);
+        while (!retval && !lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK))
+            retval = zindex_add(zi, iter.block.uncompressed_file_offset,
+                                iter.block.compressed_file_offset, iter.stream.flags->check,
+                                NULL, 0);
+        zi->size = lzma_index_uncompressed_size(idx);
+    }
+    if (idx)
+        lzma_index_end(idx, NULL);
+    return retval;
+}
+
+static errcode_t xz_reset(struct zfile *zf, const struct zpoint *p)
+{
+    unsigned char hdr[LZMA_BLOCK_HEADER_SIZE_MAX];
+    lzma_block *block = &zf->block;
+    errcode_t retval;
+
+    zf_seek(zf, p->in);
+    retval = zf_get(zf, hdr, 1);
+    if (retval)
+        return retval;
+    if (!hdr[0])
+        return EIO;
+
+    memset(block, 0, sizeof(*block));
+    block->version = 1;
+    block->check = p->state;
+    block->filters = zf->filters;
+    block->header_size = lzma_block_header_size_decode(hdr[0]);
+    retval = zf_get(zf, hdr + 1, block->header_size - 1);
+    if (retval)
+        return retval;
+
+    xz_free_filters(zf);
+    if (lzma_block_header_decode(block, NULL, hdr) != LZMA_OK)
+        return EIO;
+    if (lzma_block_decoder(&zf->xz, block) != LZMA_OK)
+        retval = EIO;
+    xz_free_filters(zf);
+    return retval;
+}
+
+static errcode_t xz_step(struct zfile *zf, unsigned char *buf, size_t len)
+{
+    const struct zindex *zi = zf->zi;
+    lzma_ret ret;
+    errcode_t retval;
+
+    while (len)
+    {
+        retval = zf_fill(zf, 1);
+        if (retval)
+            return retval;
+
+        zf->xz.next_in = zf->in_buf + zf->in_pos;
+        zf->xz.avail_in = zf->in_len - zf->in_pos;
+        zf->xz.next_out = buf;
+        zf->xz.avail_out = len;
+
+        ret = lzma_code(&zf->xz, LZMA_RUN);
+        zf->in_pos = zf->in_len - zf->xz.avail_in;
+        zf->out += len - zf->xz.avail_out;
+        buf += len - zf->xz.avail_out;
+        len = zf->xz.avail_out;
+
+        if (ret == LZMA_STREAM_END)
+        {
+            /* Blocks are decoded one by one, continue with the next */
+            if (len && ++zf->point >= zi->count)
+                return EXT2_ET_SHORT_READ;
+            if (len && (retval = xz_reset(zf, &zi->points[zf->point])))
+                return retval;
+        }
+        else if (ret != LZMA_OK)
+        {
+            return ret == LZMA_MEM_ERROR ? EXT2_ET_NO_MEMORY : EIO;
+        }
+        else if (!zf->xz.avail_in && zf->in_pos == zf->in_len && zf->in_next >= zi->file_size &&
+                 len)
+        {
+            return EXT2_ET_SHORT_READ;
+        }
+    }
+    return 0;
+}
+
+static void xz_end(struct zfile *zf)
+{
+    lzma_end(&zf->xz);
+    xz_free_filters(zf);
+}
+#endif
+
+#ifdef HAVE_LZ4
+/* Parses a frame header, skipping skippable frames; EXT2_ET_SHORT_READ at the end */
+static errcode_t lz4_frame(struct zfile *zf)
+{
+    unsigned char hdr[4];
+    unsigned int flg, bd;
+    size_t max;
+    errcode_t retval;
+
+    for (;;)
+    {
+        retval = zf_get(zf, hdr, 4);
+        if (retval)
+            return retval;
+        if ((get_le32(hdr) & 0xFFFFFFF0) != LZ4_SKIP_MAGIC)
+            break;
+        retval = zf_get(zf, hdr, 4);
+        if (!retval)
+            retval = zf_get(zf, NULL, get_le32(hdr));
+        if (retval)
+            return retval;
+    }
+    if (get_le32(hdr) != LZ4_MAGIC)
+        return EXT2_ET_BAD_MAGIC;
+
+    retval = zf_get(zf, hdr, 2);
+    if (retval)
+        return retval;
+    flg = hdr[0];
+    bd = hdr[1];
+    if ((flg >> 6) != 1 || ((bd >> 4) & 7) < 4)
+        return EXT2_ET_BAD_MAGIC;
+
+    /* Content size, dictionary id, header checksum */
+    retval = zf_get(zf, NULL, (flg & 8 ? 8 : 0) + (flg & 1 ? 4 : 0) + 1);
+    if (retval)
+        return retval;
+
+    max = (size_t)1 << (2 * ((bd >> 4) & 7) + 8);
+    if (max > zf->lz4_max)
+    {
+        free(zf->blk);
+        free(zf->cblk);
+        zf->blk = malloc(max);
+        zf->cblk = malloc(max);
+        zf->lz4_max = zf->blk && zf->cblk ? max : 0;
+        if (!zf->lz4_max)
+            return EXT2_ET_NO_MEMORY;
+    }
+
+    zf->lz4_state = flg | bd << 8;
+    zf->dict_len = 0;
+    zf->blk_first = true;
+    return 0;
+}
+
+/* Decodes the next block into zf->blk, crossing into later frames */
+static errcode_t lz4_block(struct zfile *zf)
+{
+    unsigned char hdr[4];
+    unsigned int flg;
+    __u32 size, csize;
+    size_t max = (size_t)1 << (2 * ((zf->lz4_state >> 12) & 7) + 8);
+    int n;
+    errcode_t retval;
+
+    if (zf->lz4_state < 0)
+    {
+        retval = lz4_frame(zf);
+        if (retval)
+            return retval;
+        max = zf->lz4_max;
+    }
+    flg = zf->lz4_state & 0xff;
+
+    zf->blk_in = zf_tell(zf);
+    retval = zf_get(zf, hdr, 4);
+    if (retval)
+        return retval;
+    size = get_le32(hdr);
+    if (!size)
+    {
+        /* End mark, then the content checksum */
+        if (flg & 4 && (retval = zf_get(zf, NULL, 4)))
+            return retval;
+        zf->lz4_state = -1;
+        return lz4_block(zf);
+    }
+
+    csize = size & 0x7FFFFFFF;
+    if (csize > max)
+        return EIO;
+    retval = zf_get(zf, zf->cblk, csize);
+    if (!retval && (flg & 0x10))
+        retval = zf_get(zf, NULL, 4);
+    if (retval)
+        return retval;
+
+    if (size & 0x80000000)
+    {
+        memcpy(zf->blk, zf->cblk, csize);
+        n = csize;
+    }
+    else
+    {
+        n = LZ4_decompress_safe_usingDict((const char *)zf->cblk, (char *)zf->blk, csize, max,
+                                          (const char *)zf->dict, zf->dict_len);
+        if (n < 0)
+            return EIO;
+    }
+    zf->blk_len = n;
+    zf->blk_pos = 0;
+
+    /* Linked blocks may refer to the last 64 KiB of output */
+    if (!(flg & 0x20))
+    {
+        if ((size_t)n >= LZ4_DICT)
+        {
+            memcpy(zf->dict, zf->blk + n - LZ4_DICT, LZ4_DICT);
+            zf->dict_len = LZ4_DICT;
+        }
+        else
+        {
+            size_t keep = zf->dict_len + n > LZ4_DICT ? LZ4_DICT - n : zf->dict_len;
+
+            memmove(zf->dict, zf->dict + zf->dict_len - keep, keep);
+            memcpy(zf->dict + keep, zf->blk, n);
+            zf->dict_len = keep + n;
+        }
+    }
+    return 0;
+}
+
+static errcode_t lz4_init(struct zfile *zf)
+{
+    if (!zf->dict)
+        zf->dict = malloc(LZ4_DICT);
+    return zf->dict ? 0 : EXT2_ET_NO_MEMORY;
+}
+
+static errcode_t lz4_build(struct zindex *zi, struct zfile *zf)
+{
+    unsigned char *dict;
+    size_t dict_len = 0;
+    __u64 out = 0, last = 0;
+    bool point;
+    errcode_t retval;
+
+    retval = lz4_init(zf);
+    if (retval)
+        return retval;
+    dict = malloc(LZ4_DICT);
+    if (!dict)
+        return EXT2_ET_NO_MEMORY;
+
+    zf_seek(zf, 0);
+    zf->lz4_state = -1;
+    for (;;)
+    {
+        point = !zi->count || out - last >= ZS_SPAN;
+        if (point && zf->lz4_state >= 0 && !(zf->lz4_state & 0x20))
+        {
+            dict_len = zf->dict_len;
+            memcpy(dict, zf->dict, dict_len);
+        }
+
+        retval = lz4_block(zf);
+        if (retval == EXT2_ET_SHORT_READ && zi->count && zf->lz4_state < 0)
+        {
+            /* Ran out between frames */
+            retval = 0;
+            break;
+        }
+        if (retval)
+            break;
+
+        if (point)
+        {
+            if (zf->blk_first || (zf->lz4_state & 0x20))
+                dict_len = 0;
+            retval = zindex_add(zi, out, zf->blk_in, zf->lz4_state, dict, dict_len);
+            if (retval)
+                break;
+            last = out;
+        }
+        zf->blk_first = false;
+        out += zf->blk_len;
+    }
+
+    free(dict);
+    zi->size = out;
+    zf->live = false;
+    return retval;
+}
+
+static errcode_t lz4_reset(struct zfile *zf, const struct zpoint *p)
+{
+    errcode_t retval;
+
+    retval = lz4_init(zf);
+    if (retval)
+        return retval;
+
+    zf_seek(zf, p->in);
+    zf->lz4_state = p->state;
+    zf->blk_len = zf->blk_pos = 0;
+    zf->dict_len = p->dict_len;
+    if (p->dict_len)
+        memcpy(zf->dict, p->dict, p->dict_len);
+
+    /* Buffers are sized by the frame header, which the point skips */
+    if (zf->lz4_max < (size_t)1 << (2 * ((p->state >> 12) & 7) + 8))
+    {
+        zf->lz4_max = (size_t)1 << (2 * ((p->state >> 12) & 7) + 8);
+        free(zf->blk);
+        free(zf->cblk);
+        zf->blk = malloc(zf->lz4_max);
+        zf->cblk = malloc(zf->lz4_max);
+        if (!zf->blk || !zf->cblk)
+        {
+            zf->lz4_max = 0;
+            return EXT2_ET_NO_MEMORY;
+        }
+    }
+    return 0;
+}
+
+static errcode_t lz4_step(struct zfile *zf, unsigned char *buf, size_t len)
+{
+    size_t n;
+    errcode_t retval;
+
+    while (len)
+    {
+        if (zf->blk_pos == zf->blk_len)
+        {
+            retval = lz4_block(zf);
+            if (retval)
+                return retval;
+        }
+
+        n = zf->blk_len - zf->blk_pos;
+        if (n > len)
+            n = len;
+        memcpy(buf, zf->blk + zf->blk_pos, n);
+        zf->blk_pos += n;
+        zf->out += n;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void lz4_end(struct zfile *zf)
+{
+    free(zf->blk);
+    free(zf->cblk);
+    free(zf->dict);
+    zf->blk = zf->cblk = zf->dict = NULL;
+    zf->lz4_max = 0;
+}
+#endif
+
+static const struct zformat formats[] = {
+    [E2FSTOOL_COMPRESS_GZIP] = {gz_build, gz_reset, gz_step},
+#ifdef HAVE_LZMA
+    [E2FSTOOL_COMPRESS_XZ] = {xz_build, xz_reset, xz_step},
+#endif
+#ifdef HAVE_LZ4
+    [E2FSTOOL_COMPRESS_LZ4] = {lz4_build, lz4_reset, lz4_step},
+#endif
+};
+
+/* Index files */
+
+static bool zindex_load(struct zindex *zi, const char *path)
+{
+    struct {
+        char magic[8];
+        __u32 version, type;
+        __u64 file_size, mtime, size, count;
+    } hdr;
+    struct {
+        __u64 out, in;
+        __s32 state;
+        __u32 dict_len;
+    } rec;
+    unsigned char *dict = NULL;
+    __u64 i;
+    bool ok = false;
+    FILE *fp;
+
+    fp = fopen(path, "rb");
+    if (!fp)
+        return false;
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || memcmp(hdr.magic, ZIDX_MAGIC, 8) ||
+        hdr.version != ZIDX_VERSION || hdr.type != zi->type ||
+        hdr.file_size != zi->file_size || hdr.mtime != zi->mtime)
+        goto end;
+
+    dict = malloc(LZ4_DICT);
+    if (!dict)
+        goto end;
+    for (i = 0; i < hdr.count; i++)
+    {
+        if (fread(&rec, sizeof(rec), 1, fp) != 1 || rec.dict_len > LZ4_DICT ||
+            fread(dict, 1, rec.dict_len, fp) != rec.dict_len ||
+            zindex_add(zi, rec.out, rec.in, rec.state, dict, rec.dict_len))
+            goto end;
+    }
+    zi->size = hdr.size;
+    ok = zi->count > 0;
+end:
+    free(dict);
+    fclose(fp);
+    return ok;
+}
+
+/* Best effort, the image may well sit in a read-only place */
+static void zindex_save(const struct zindex *zi, const char *path)
+{
+    struct {
+        char magic[8];
+        __u32 version, type;
+        __u64 file_size, mtime, size, count;
+    } hdr = {
+        .magic = ZIDX_MAGIC,
+        .version = ZIDX_VERSION,
+        .type = zi->type,
+        .file_size = zi->file_size,
+        .mtime = zi->mtime,
+        .size = zi->size,
+        .count = zi->count,
+    };
+    struct {
+        __u64 out, in;
+        __s32 state;
+        __u32 dict_len;
+    } rec;
+    char *tmp;
+    size_t i;
+    bool ok;
+    FILE *fp;
+
+    if (asprintf(&tmp, "%s.tmp", path) < 0)
+        return;
+    fp = fopen(tmp, "wb");
+    if (!fp)
+    {
+        free(tmp);
+        return;
+    }
+
+    ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+    for (i = 0; ok && i < zi->count; i++)
+    {
+        memset(&rec, 0, sizeof(rec));
+        rec.out = zi->points[i].out;
+        rec.in = zi->points[i].in;
+        rec.state = zi->points[i].state;
+        rec.dict_len = zi->points[i].dict_len;
+        ok = fwrite(&rec, sizeof(rec), 1, fp) == 1 &&
+             (!rec.dict_len || fwrite(zi->points[i].dict, 1, rec.dict_len, fp) == rec.dict_len);
+    }
+    if (fclose(fp) || !ok || rename(tmp, path))
+        unlink(tmp);
+    free(tmp);
+}
+
+static void zindex_free(struct zindex *zi)
+{
+    size_t i;
+
+    for (i = 0; i < zi->count; i++)
+        free(zi->points[i].dict);
+    ext2fs_free_mem(&zi->points);
+    free(zi->path);
+    free(zi);
+}
+
+/* Index of @path as of @st, called with index_lock held */
+static struct zindex *zindex_find(const char *path, const struct stat *st)
+{
+    struct zindex *zi;
+
+    for (zi = indexes; zi; zi = zi->next)
+    {
+        if (!strcmp(zi->path, path) && zi->file_size == (__u64)st->st_size &&
+            zi->mtime == (__u64)st->st_mtime)
+            break;
+    }
+    return zi;
+}
+
+/*
+ * Shared index of @zf's image, loaded or built on first use. Building
+ * decompresses the whole image, so it runs outside index_lock; when two
+ * channels build the same index at once the first one inserted is kept.
+ */
+static errcode_t zindex_get(struct zfile *zf, const char *path, compress_type_t type,
+                            const struct stat *st)
+{
+    struct zindex *zi, *other;
+    char *idx_path = NULL;
+    bool built = false;
+    errcode_t retval = 0;
+
+    pthread_mutex_lock(&index_lock);
+    zi = zindex_find(path, st);
+    pthread_mutex_unlock(&index_lock);
+    if (zi)
+    {
+        zf->zi = zi;
+        return 0;
+    }
+
+    zi = calloc(1, sizeof(*zi));
+    if (!zi || !(zi->path = strdup(path)))
+    {
+        free(zi);
+        return EXT2_ET_NO_MEMORY;
+    }
+    zi->type = type;
+    zi->file_size = st->st_size;
+    zi->mtime = st->st_mtime;
+
+    if (asprintf(&idx_path, "%s.zidx", path) < 0)
+        idx_path = NULL;
+    if (!idx_path || !zindex_load(zi, idx_path))
+    {
+        size_t i;
+
+        for (i = 0; i < zi->count; i++)
+            free(zi->points[i].dict);
+        zi->count = 0;
+
+        zf->zi = zi;
+        retval = formats[type].build(zi, zf);
+        zf->zi = NULL;
+        if (retval)
+        {
+            zindex_free(zi);
+            goto end;
+        }
+        built = true;
+    }
+
+    pthread_mutex_lock(&index_lock);
+    other = zindex_find(path, st);
+    if (!other)
+    {
+        zi->next = indexes;
+        indexes = zi;
+    }
+    pthread_mutex_unlock(&index_lock);
+
+    if (other)
+    {
+        zindex_free(zi);
+        zi = other;
+    }
+    else if (built && idx_path)
+    {
+        zindex_save(zi, idx_path);
+    }
+    zf->zi = zi;
+end:
+    free(idx_path);
+    return retval;
+}
+
+/* Window cache */
+
+static size_t zwindow_hash(const struct zindex *zi, __u64 index)
+{
+    return ((uintptr_t)zi / sizeof(*zi) ^ index * 0x9E3779B97F4A7C15ULL) % ZS_BUCKETS;
+}
+
+static void zwindow_unlink(struct zwindow *w)
+{
+    if (w->prev)
+        w->prev->next = w->next;
+    else
+        lru_head = w->next;
+    if (w->next)
+        w->next->prev = w->prev;
+    else
+        lru_tail = w->prev;
+    w->prev = w->next = NULL;
+}
+
+static void zwindow_push(struct zwindow *w)
+{
+    w->next = lru_head;
+    if (lru_head)
+        lru_head->prev = w;
+    lru_head = w;
+    if (!lru_tail)
+        lru_tail = w;
+}
+
+static void zwindow_drop(struct zwindow *w)
+{
+    struct zwindow **pp = &buckets[zwindow_hash(w->zi, w->index)];
+
+    while (*pp != w)
+        pp = &(*pp)->hnext;
+    *pp = w->hnext;
+    zwindow_unlink(w);
+    cache_used -= w->len;
+    free(w->buf);
+    free(w);
+}
+
+/* Copies [@off, @off + @len) of window @index out if cached, called with cache_lock held */
+static bool zwindow_copy(const struct zindex *zi, __u64 index, size_t off,
+                         void *buf, size_t len)
+{
+    struct zwindow *w;
+
+    for (w = buckets[zwindow_hash(zi, index)]; w; w = w->hnext)
+    {
+        if (w->zi == zi && w->index == index)
+        {
+            memcpy(buf, w->buf + off, len);
+            if (w != lru_head)
+            {
+                zwindow_unlink(w);
+                zwindow_push(w);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Takes @buf over as window @index, unless it is there already */
+static void zwindow_insert(const struct zindex *zi, __u64 index, unsigned char *buf, size_t len)
+{
+    struct zwindow *w;
+    size_t h = zwindow_hash(zi, index);
+
+    for (w = buckets[h]; w; w = w->hnext)
+    {
+        if (w->zi == zi && w->index == index)
+        {
+            free(buf);
+            return;
+        }
+    }
+
+    w = calloc(1, sizeof(*w));
+    if (!w)
+    {
+        free(buf);
+        return;
+    }
+    w->zi = zi;
+    w->index = index;
+    w->buf = buf;
+    w->len = len;
+    w->hnext = buckets[h];
+    buckets[h] = w;
+    zwindow_push(w);
+    cache_used += len;
+
+    while (cache_used > zcache_cap && lru_tail != w)
+        zwindow_drop(lru_tail);
+}
+
+/* Decodes window @index into @buf, from the cursor or the closest access point */
+static errcode_t zfile_decode(struct zfile *zf, __u64 index, unsigned char *buf, size_t len)
+{
+    const struct zindex *zi = zf->zi;
+    __u64 start = index * ZS_WINDOW;
+    size_t lo = 0, hi = zi->count, p;
+    errcode_t retval;
+
+    while (hi - lo > 1)
+    {
+        p = lo + (hi - lo) / 2;
+        if (zi->points[p].out <= start)
+            lo = p;
+        else
+            hi = p;
+    }
+    p = lo;
+
+    if (!zf->live || zf->out > start || zi->points[p].out > zf->out)
+    {
+        zf->live = false;
+        retval = formats[zi->type].reset(zf, &zi->points[p]);
+        if (retval)
+            return retval;
+        zf->out = zi->points[p].out;
+        zf->point = p;
+        zf->live = true;
+    }
+
+    while (zf->out < start)
+    {
+        size_t n = start - zf->out < ZS_WINDOW ? start - zf->out : ZS_WINDOW;
+
+        retval = formats[zi->type].step(zf, zf->scratch, n);
+        if (retval)
+            goto err;
+    }
+    retval = formats[zi->type].step(zf, buf, len);
+    if (!retval)
+        return 0;
+err:
+    zf->live = false;
+    return retval;
+}
+
+errcode_t zfile_read(struct zfile *zf, __u64 off, void *buf, size_t len)
+{
+    const struct zindex *zi = zf->zi;
+    unsigned char *out = buf, *win;
+    __u64 index;
+    size_t woff, wlen, n;
+    bool hit;
+    errcode_t retval;
+
+    if (off > zi->size || len > zi->size - off)
+        return EXT2_ET_SHORT_READ;
+
+    while (len)
+    {
+        index = off / ZS_WINDOW;
+        woff = off % ZS_WINDOW;
+        n = ZS_WINDOW - woff < len ? ZS_WINDOW - woff : len;
+
+        pthread_mutex_lock(&cache_lock);
+        hit = zwindow_copy(zi, index, woff, out, n);
+        pthread_mutex_unlock(&cache_lock);
+
+        if (!hit)
+        {
+            wlen = zi->size - index * ZS_WINDOW < ZS_WINDOW ? zi->size - index * ZS_WINDOW
+                                                             : ZS_WINDOW;
+            win = malloc(wlen);
+            if (!win)
+                return EXT2_ET_NO_MEMORY;
+
+            pthread_mutex_lock(&zf->lock);
+            retval = zfile_decode(zf, index, win, wlen);
+            pthread_mutex_unlock(&zf->lock);
+            if (retval)
+            {
+                free(win);
+                return retval;
+            }
+
+            memcpy(out, win + woff, n);
+            pthread_mutex_lock(&cache_lock);
+            zwindow_insert(zi, index, win, wlen);
+            pthread_mutex_unlock(&cache_lock);
+        }
+
+        out += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+__u64 zfile_size(const struct zfile *zf)
+{
+    return zf->zi->size;
+}
+
+/* Tells compressed images apart by their magic, E2FSTOOL_COMPRESS_NONE for the rest */
+compress_type_t compress_detect(const char *path)
+{
+    unsigned char magic[6] = {0};
+    compress_type_t type = E2FSTOOL_COMPRESS_NONE;
+    FILE *fp;
+
+    fp = fopen(path, "rb");
+    if (!fp)
+        return E2FSTOOL_COMPRESS_NONE;
+    if (fread(magic, 1, sizeof(magic), fp) == sizeof(magic))
+    {
+        if (magic[0] == 0x1f && magic[1] == 0x8b)
+            type = E2FSTOOL_COMPRESS_GZIP;
+        else if (!memcmp(magic, "\xFD" "7zXZ\0", 6))
+            type = E2FSTOOL_COMPRESS_XZ;
+        else if (get_le32(magic) == LZ4_MAGIC || (get_le32(magic) & 0xFFFFFFF0) == LZ4_SKIP_MAGIC)
+            type = E2FSTOOL_COMPRESS_LZ4;
+    }
+    fclose(fp);
+    return type;
+}
+
+const char *compress_type_str(compress_type_t type)
+{
+    switch (type)
+    {
+    case E2FSTOOL_COMPRESS_GZIP:
+        return "gzip";
+    case E2FSTOOL_COMPRESS_XZ:
+        return "xz";
+    case E2FSTOOL_COMPRESS_LZ4:
+        return "lz4";
+    default:
+        return "uncompressed";
+    }
+}
+
+errcode_t zfile_open(const char *path, struct zfile **ret)
+{
+    compress_type_t type = compress_detect(path);
+    struct zfile *zf;
+    struct stat st;
+    errcode_t retval;
+
+    if (type == E2FSTOOL_COMPRESS_NONE || type >= sizeof(formats) / sizeof(formats[0]) ||
+        !formats[type].build)
+        return EXT2_ET_UNIMPLEMENTED;
+
+    zf = calloc(1, sizeof(*zf));
+    if (!zf)
+        return EXT2_ET_NO_MEMORY;
+    pthread_mutex_init(&zf->lock, NULL);
+    zf->fd = -1;
+#ifdef HAVE_LZMA
+    zf->xz = (lzma_stream)LZMA_STREAM_INIT;
+    zf->filters[0].id = LZMA_VLI_UNKNOWN;
+#endif
+#ifdef HAVE_LZ4
+    zf->lz4_state = -1;
+#endif
+
+    zf->in_buf = malloc(ZS_INBUF);
+    zf->scratch = malloc(ZS_WINDOW);
+    if (!zf->in_buf || !zf->scratch)
+    {
+        retval = EXT2_ET_NO_MEMORY;
+        goto err;
+    }
+
+    zf->fd = open(path, O_RDONLY | O_BINARY);
+    if (zf->fd < 0)
+    {
+        retval = errno;
+        goto err;
+    }
+    if (fstat(zf->fd, &st))
+    {
+        retval = errno;
+        goto err;
+    }
+
+    retval = zindex_get(zf, path, type, &st);
+    if (retval)
+        goto err;
+
+    *ret = zf;
+    return 0;
+err:
+    zf->zi = NULL;
+    zfile_close(zf);
+    return retval;
+}
+
+/* Indexes and cached windows outlive their channels until compress_free() */
+void zfile_close(struct zfile *zf)
+{
+    if (!zf)
+        return;
+    /* zi is unset when building the index failed, so end every decoder */
+    gz_end(zf);
+#ifdef HAVE_LZMA
+    xz_end(zf);
+#endif
+#ifdef HAVE_LZ4
+    lz4_end(zf);
+#endif
+    if (zf->fd >= 0)
+        close(zf->fd);
+    pthread_mutex_destroy(&zf->lock);
+    free(zf->in_buf);
+    free(zf->scratch);
+    free(zf);
+}
+
+void compress_free(void)
+{
+    struct zindex *zi;
+
+    while (lru_tail)
+        zwindow_drop(lru_tail);
+    while ((zi = indexes))
+    {
+        indexes = zi->next;
+        zindex_free(zi);
+    }
+}
+
+/* io_manager for RAW images inside a compressed file */
+
+struct zio {
+    struct zfile *zf;
+    struct struct_io_stats stats;
+};
+
+static struct struct_io_manager struct_compressed_manager;
+
+static errcode_t zio_open(const char *name, int flags, io_channel *channel)
+{
+    io_channel io = NULL;
+    struct zio *zio = NULL;
+    errcode_t retval;
+
+    if (!name)
+        return EXT2_ET_BAD_DEVICE_NAME;
+    if (flags & IO_FLAG_RW)
+        return EXT2_ET_OP_NOT_SUPPORTED;
+
+    retval = ext2fs_get_memzero(sizeof(*zio), &zio);
+    if (retval)
+        return retval;
+    retval = zfile_open(name, &zio->zf);
+    if (retval)
+        goto err;
+
+    retval = ext2fs_get_memzero(sizeof(struct struct_io_channel), &io);
+    if (retval)
+        goto err;
+    retval = ext2fs_get_mem(strlen(name) + 1, &io->name);
+    if (retval)
+        goto err;
+    strcpy(io->name, name);
+
+    io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+    io->manager = &struct_compressed_manager;
+    io->block_size = 1024;
+    io->refcount = 1;
+    io->private_data = zio;
+    zio->stats.num_fields = 2;
+
+    *channel = io;
+    return 0;
+err:
+    if (io)
+        ext2fs_free_mem(&io);
+    zfile_close(zio->zf);
+    ext2fs_free_mem(&zio);
+    return retval;
+}
+
+static errcode_t zio_close(io_channel channel)
+{
+    struct zio *zio = channel->private_data;
+
+    if (--channel->refcount > 0)
+        return 0;
+
+    zfile_close(zio->zf);
+    ext2fs_free_mem(&zio);
+    ext2fs_free_mem(&channel->name);
+    ext2fs_free_mem(&channel);
+    return 0;
+}
+
+static errcode_t zio_set_blksize(io_channel channel, int blksize)
+{
+    channel->block_size = blksize;
+    return 0;
+}
+
+static errcode_t zio_read_blk64(io_channel channel, unsigned long long block,
+                                int count, void *data)
+{
+    struct zio *zio = channel->private_data;
+    size_t size = count < 0 ? (size_t)-count : (size_t)count * channel->block_size;
+    errcode_t retval;
+
+    retval = zfile_read(zio->zf, block * channel->block_size, data, size);
+    if (retval && channel->read_error)
+        retval = channel->read_error(channel, block, count, data, size, 0, retval);
+    if (!retval)
+        zio->stats.bytes_read += size;
+    return retval;
+}
+
+static errcode_t zio_read_blk(io_channel channel, unsigned long block, int count, void *data)
+{
+    return zio_read_blk64(channel, block, count, data);
+}
+
+static errcode_t zio_write_blk64(io_channel channel EXT2FS_ATTR((unused)),
+                                 unsigned long long block EXT2FS_ATTR((unused)),
+                                 int count EXT2FS_ATTR((unused)),
+                                 const void *data EXT2FS_ATTR((unused)))
+{
+    return EXT2_ET_OP_NOT_SUPPORTED;
+}
+
+static errcode_t zio_write_blk(io_channel channel, unsigned long block, int count,
+                               const void *data)
+{
+    return zio_write_blk64(channel, block, count, data);
+}
+
+static errcode_t zio_flush(io_channel channel EXT2FS_ATTR((unused)))
+{
+    return 0;
+}
+
+static errcode_t zio_set_option(io_channel channel EXT2FS_ATTR((unused)),
+                                const char *option EXT2FS_ATTR((unused)),
+                                const char *arg EXT2FS_ATTR((unused)))
+{
+    return EXT2_ET_INVALID_ARGUMENT;
+}
+
+static errcode_t zio_get_stats(io_channel channel, io_stats *stats)
+{
+    struct zio *zio = channel->private_data;
+
+    if (stats)
+        *stats = &zio->stats;
+    return 0;
+}
+
+static struct struct_io_manager struct_compressed_manager = {
+    .magic = EXT2_ET_MAGIC_IO_MANAGER,
+    .name = "Compressed image I/O Manager",
+    .open = zio_open,
+    .close = zio_close,
+    .set_blksize = zio_set_blksize,
+    .read_blk = zio_read_blk,
+    .write_blk = zio_write_blk,
+    .flush = zio_flush,
+    .set_option = zio_set_option,
+    .get_stats = zio_get_stats,
+    .read_blk64 = zio_read_blk64,
+    .write_blk64 = zio_write_blk64,
+};
+
+io_manager compressed_io_manager = &struct_compressed_manager;
@@ -0,0 +1,353 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "e2fstool.h"
+
+/*
+ * Physical block dedup for shared_blocks images.
+ *
+ * e2fsdroid -s points identical files at the same blocks. Every extent
+ * run written to the output is recorded here with the file and logical
+ * block it went to, first writer wins. A later file mapping the same
+ * physical start clones or copies the range from that file instead of
+ * reading the image again.
+ *
+ * Where the output can't clone (--hash, -z, another platform) or the
+ * first file was still queued on the batched output, shared ranges are
+ * read through a cache of image blocks keyed by physical block. A range
+ * is only cached once it was seen shared, so it serves the third and
+ * later references. It is capped by dedup_cache_cap and evicts least
+ * recently used ranges first.
+ *
+ * Block numbers only mean something within one image, so every image
+ * extracted gets a table of its own from dedup_new().
+ */
+
+#define DCACHE_BUCKETS 4096
+
+struct dedup_range {
+    blk64_t pblk;
+    blk64_t lblk;
+    blk64_t len;
+    const char *path; /* NULL if the data can't be copied from the output */
+};
+
+struct dcache_entry {
+    blk64_t blk;
+    blk64_t n;
+    char *data;
+    size_t len;
+    struct dcache_entry *prev, *next, *hnext;
+};
+
+struct dedup {
+    struct dedup_range *ranges;
+    size_t range_cap, range_count;
+    char **paths;
+    size_t path_count, path_size;
+    pthread_mutex_t lock;
+
+    struct dcache_entry *buckets[DCACHE_BUCKETS];
+    struct dcache_entry *lru_head, *lru_tail;
+    size_t cache_used, cache_cap;
+    pthread_mutex_t cache_lock;
+};
+
+size_t dedup_cache_cap = DEDUP_CACHE_DEFAULT_CAP;
+
+static inline size_t blk_hash(blk64_t blk)
+{
+    return (blk * 0x9E3779B97F4A7C15ULL) >> 32;
+}
+
+static struct dedup_range *range_find(struct dedup *d, blk64_t pblk)
+{
+    size_t i, mask = d->range_cap - 1;
+
+    if (!d->range_cap)
+        return NULL;
+
+    for (i = blk_hash(pblk) & mask; d->ranges[i].len; i = (i + 1) & mask)
+    {
+        if (d->ranges[i].pblk == pblk)
+            return &d->ranges[i];
+    }
+    return NULL;
+}
+
+static void range_insert(struct dedup_range *table, size_t cap, const struct dedup_range *r)
+{
+    size_t i;
+
+    for (i = blk_hash(r->pblk) & (cap - 1); table[i].len; i = (i + 1) & (cap - 1))
+        ;
+    table[i] = *r;
+}
+
+static errcode_t range_reserve(struct dedup *d, size_t count)
+{
+    struct dedup_range *grown;
+    size_t cap = d->range_cap ? d->range_cap : 1024, i;
+    errcode_t retval;
+
+    while ((d->range_count + count) * 2 > cap)
+        cap *= 2;
+    if (cap == d->range_cap)
+        return 0;
+
+    retval = ext2fs_get_arrayzero(cap, sizeof(*grown), &grown);
+    if (retval)
+        return retval;
+    for (i = 0; i < d->range_cap; i++)
+    {
+        if (d->ranges[i].len)
+            range_insert(grown, cap, &d->ranges[i]);
+    }
+    ext2fs_free_mem(&d->ranges);
+    d->ranges = grown;
+    d->range_cap = cap;
+    return 0;
+}
+
+/* An empty table for one image, with a block cache of up to @cache_cap bytes */
+errcode_t dedup_new(size_t cache_cap, struct dedup **ret)
+{
+    struct dedup *d;
+    errcode_t retval;
+
+    retval = ext2fs_get_memzero(sizeof(*d), &d);
+    if (retval)
+        return retval;
+    d->cache_cap = cache_cap;
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_mutex_init(&d->cache_lock, NULL);
+    *ret = d;
+    return 0;
+}
+
+/*
+ * Records the data runs of a file written to @path (relative to the
+ * output directory, NULL if it can't be copied from there yet).
+ */
+errcode_t dedup_record(struct dedup *d, const char *path, const struct extent_run *runs,
+                       size_t count)
+{
+    struct dedup_range r, *found;
+    char *copy = NULL;
+    size_t i;
+    errcode_t retval;
+
+    if (path)
+    {
+        copy = strdup(path);
+        if (!copy)
+            return EXT2_ET_NO_MEMORY;
+    }
+
+    pthread_mutex_lock(&d->lock);
+    retval = range_reserve(d, count);
+    if (!retval && copy && d->path_count == d->path_size)
+    {
+        size_t new_size = d->path_size ? d->path_size * 2 : 256;
+
+        retval = ext2fs_resize_array(sizeof(*d->paths), d->path_size, new_size, &d->paths);
+        if (!retval)
+            d->path_size = new_size;
+    }
+    if (retval)
+    {
+        pthread_mutex_unlock(&d->lock);
+        free(copy);
+        return retval;
+    }
+    if (copy)
+        d->paths[d->path_count++] = copy;
+
+    for (i = 0; i < count; i++)
+    {
+        if (runs[i].uninit)
+            continue;
+
+        found = range_find(d, runs[i].pblk);
+        if (found)
+        {
+            /* Only a copyable source replaces an earlier one */
+            if (!found->path && copy)
+            {
+                found->lblk = runs[i].lblk;
+                found->len = runs[i].len;
+                found->path = copy;
+            }
+            continue;
+        }
+
+        r.pblk = runs[i].pblk;
+        r.lblk = runs[i].lblk;
+        r.len = runs[i].len;
+        r.path = copy;
+        range_insert(d->ranges, d->range_cap, &r);
+        d->range_count++;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+}
+
+/*
+ * Looks up a run starting at physical block @pblk. Returns how many of
+ * its first @len blocks were already written, 0 if none. *@path and
+ * *@lblk then tell where, *@path is NULL if they can only be cached.
+ */
+blk64_t dedup_lookup(struct dedup *d, blk64_t pblk, blk64_t len, const char **path,
+                     blk64_t *lblk)
+{
+    struct dedup_range *r;
+    blk64_t n = 0;
+
+    pthread_mutex_lock(&d->lock);
+    r = range_find(d, pblk);
+    if (r)
+    {
+        n = r->len < len ? r->len : len;
+        *path = r->path;
+        *lblk = r->lblk;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return n;
+}
+
+static void lru_unlink(struct dedup *d, struct dcache_entry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        d->lru_head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        d->lru_tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push(struct dedup *d, struct dcache_entry *e)
+{
+    e->next = d->lru_head;
+    if (d->lru_head)
+        d->lru_head->prev = e;
+    d->lru_head = e;
+    if (!d->lru_tail)
+        d->lru_tail = e;
+}
+
+static void cache_remove(struct dedup *d, struct dcache_entry *e)
+{
+    struct dcache_entry **p = &d->buckets[blk_hash(e->blk) % DCACHE_BUCKETS];
+
+    while (*p != e)
+        p = &(*p)->hnext;
+    *p = e->hnext;
+    lru_unlink(d, e);
+    d->cache_used -= e->len;
+    free(e->data);
+    free(e);
+}
+
+static struct dcache_entry *cache_find(struct dedup *d, blk64_t blk)
+{
+    struct dcache_entry *e;
+
+    for (e = d->buckets[blk_hash(blk) % DCACHE_BUCKETS]; e; e = e->hnext)
+    {
+        if (e->blk == blk)
+            return e;
+    }
+    return NULL;
+}
+
+/* Copies @n blocks at @blk into @buf if they are cached */
+bool dedup_cache_get(struct dedup *d, blk64_t blk, blk64_t n, unsigned int blocksize, void *buf)
+{
+    struct dcache_entry *e;
+    bool hit = false;
+
+    if (!d->cache_cap)
+        return false;
+
+    pthread_mutex_lock(&d->cache_lock);
+    e = cache_find(d, blk);
+    if (e && e->n >= n)
+    {
+        memcpy(buf, e->data, n * blocksize);
+        lru_unlink(d, e);
+        lru_push(d, e);
+        hit = true;
+    }
+    pthread_mutex_unlock(&d->cache_lock);
+    return hit;
+}
+
+/* Caches @n blocks at @blk read from the image, best effort */
+void dedup_cache_put(struct dedup *d, blk64_t blk, blk64_t n, unsigned int blocksize,
+                     const void *buf)
+{
+    struct dcache_entry *e;
+    size_t len = n * blocksize;
+    char *data;
+
+    if (!d->cache_cap || len > d->cache_cap / 4)
+        return;
+
+    data = malloc(len);
+    if (!data)
+        return;
+    memcpy(data, buf, len);
+
+    pthread_mutex_lock(&d->cache_lock);
+    e = cache_find(d, blk);
+    if (e && e->n >= n)
+    {
+        pthread_mutex_unlock(&d->cache_lock);
+        free(data);
+        return;
+    }
+    if (e)
+        cache_remove(d, e);
+
+    while (d->lru_tail && d->cache_used + len > d->cache_cap)
+        cache_remove(d, d->lru_tail);
+
+    e = calloc(1, sizeof(*e));
+    if (!e)
+    {
+        pthread_mutex_unlock(&d->cache_lock);
+        free(data);
+        return;
+    }
+    e->blk = blk;
+    e->n = n;
+    e->data = data;
+    e->len = len;
+    e->hnext = d->buckets[blk_hash(blk) % DCACHE_BUCKETS];
+    d->buckets[blk_hash(blk) % DCACHE_BUCKETS] = e;
+    lru_push(d, e);
+    d->cache_used += len;
+    pthread_mutex_unlock(&d->cache_lock);
+}
+
+void dedup_free(struct dedup *d)
+{
+    size_t i;
+
+    if (!d)
+        return;
+
+    while (d->lru_tail)
+        cache_remove(d, d->lru_tail);
+    for (i = 0; i < d->path_count; i++)
+        free(d->paths[i]);
+    ext2fs_free_mem(&d->paths);
+    ext2fs_free_mem(&d->ranges);
+    pthread_mutex_destroy(&d->lock);
+    pthread_mutex_destroy(&d->cache_lock);
+    ext2fs_free_mem(&d);
+}
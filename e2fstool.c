@@ -1,118 +1,67 @@
 #define _GNU_SOURCE
 
 #include <stdio.h>
+#include <fnmatch.h>
 #include <getopt.h>
 #include <string.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "e2fstool.h"
 
-static ext2_filsys fs = NULL;
-static struct ext2fs_numeric_progress_struct progress;
+static struct u64_map interned = {0};
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char **include_pats = NULL, **exclude_pats = NULL;
+static size_t include_count = 0, exclude_count = 0;
 
 const char *prog_name = "e2fstool";
-char *in_file = NULL;
-char *out_dir = NULL;
-char *conf_dir = NULL;
-char *mountpoint;
-FILE *contexts, *filesystem;
-bool android_configure = false, android_configure_only = false;
-bool system_as_root = false;
-image_type_t image_type = UNKNOWN;
+bool android_configure_only = false;
 bool quiet = false;
 bool verbose = false;
+bool sparse_output = false, detect_zeroes = false;
+bool zero_copy = false;
+bool use_libsparse = false;
+bool block_order = false;
+bool preserve = false;
+unsigned int jobs = 1;
+unsigned int readahead_threads = RA_DEFAULT_THREADS;
+unsigned int output_threads = OUT_DEFAULT_THREADS;
+archive_format_t archive_format = ARCHIVE_NONE;
+const char *archive_path = NULL;
+const char *incremental_path = NULL;
+unsigned int blocksize = 0;
 
 static void usage(int ret)
 {
-    fprintf(stderr, "%s [-ehqsvV] [-c config_dir] [-m mountpoint]\n"
-                    "\t [-b blocksize] filename [directory]\n",
-            prog_name);
+    fprintf(stderr, "%s [-ehpqsSvVz] [-c config_dir] [-m mountpoint]\n"
+                    "\t [-b blocksize] [-j jobs] [--zero-copy] [--libsparse]\n"
+                    "\t [--block-order] [--preserve] [--stats file] [--trace file]\n"
+                    "\t [--include pattern] [--exclude pattern] [--inode-cache MiB]\n"
+                    "\t [--readahead threads] [--output-threads threads] [--zcache MiB]\n"
+                    "\t [--dedup-cache MiB] [--max-memory MiB]\n"
+                    "\t [--incremental manifest] [--hash sha256,crc32c,blake3]\n"
+                    "\t [--tar file|- | --cpio file|-]\n"
+                    "\t filename [directory]\n"
+                    "%s cat|stat|getfattr [-b blocksize] [-es] filename path\n"
+                    "%s list [-b blocksize] [-es] [--json] filename\n"
+                    "%s batch [options] list\n"
+                    "\t (options as above, without -c, -m, -o, --incremental, --tar or --cpio)\n",
+            prog_name, prog_name, prog_name, prog_name);
     exit(ret);
 }
 
-static const char *get_image_type_str(image_type_t type)
-{
-    switch (type)
-    {
-    case SPARSE:
-        return "SPARSE";
-    case RAW:
-        return "RAW";
-    case MOTO:
-        return "MOTO";
-    default:
-        return "UNKNOWN";
-    }
-}
-
-static image_type_t get_image_type(const char *filename)
-{
-    image_type_t type = UNKNOWN;
-    FILE *fp = NULL;
-    uint32_t sparse_magic, moto_magic;
-    uint16_t ext4_magic;
-    int ret;
-
-    fp = fopen(filename, "rb");
-    if (!fp)
-    {
-        E2FSTOOL_ERROR("while opening file");
-        return UNKNOWN;
-    }
-
-    ret = fread(&sparse_magic, sizeof(sparse_magic), 1, fp);
-    if (ret != 1)
-    {
-        E2FSTOOL_ERROR("while reading sparse_magic number");
-        goto end;
-    }
-
-    ret = fseek(fp, 0x28, SEEK_SET);
-    if (ret)
-    {
-        E2FSTOOL_ERROR("while seeking to MOTO magic offset");
-        goto end;
-    }
-
-    ret = fread(&moto_magic, sizeof(moto_magic), 1, fp);
-    if (ret != 1)
-    {
-        E2FSTOOL_ERROR("while reading moto_magic number");
-        goto end;
-    }
-
-    ret = fseek(fp, 0x438, SEEK_SET);
-    if (ret)
-    {
-        E2FSTOOL_ERROR("while seeking to EXT4 magic offset");
-        goto end;
-    }
-
-    ret = fread(&ext4_magic, sizeof(ext4_magic), 1, fp);
-    if (ret != 1)
-    {
-        E2FSTOOL_ERROR("while reading ext4_magic number");
-        goto end;
-    }
-
-    if (sparse_magic == SPARSE_HEADER_MAGIC && moto_magic == MOTO_HEADER_MAGIC)
-    {
-        type = MOTO;
-    }
-    else if (sparse_magic == SPARSE_HEADER_MAGIC)
-    {
-        type = SPARSE;
-    }
-    else if (ext4_magic == EXT2_SUPER_MAGIC)
-    {
-        type = RAW;
-    }
-
-end:
-    fclose(fp);
-    return type;
-}
-
 static char *escape_regex_meta_chars(const char *filepath)
 {
     size_t len = strlen(filepath) + 1;
@@ -120,6 +69,9 @@ static char *escape_regex_meta_chars(const char *filepath)
     const char *p = filepath;
     char *e = escaped;
 
+    if (!escaped)
+        return NULL;
+
     while (*p)
     {
         if (strchr(".^$*+?()[]{}|\\<>", *p))
@@ -128,8 +80,7 @@ static char *escape_regex_meta_chars(const char *filepath)
             if (new_escaped == NULL)
             {
                 free(escaped);
-                E2FSTOOL_ERROR("Failed to allocate memory for escaped string %s", filepath);
-                exit(EXIT_FAILURE);
+                return NULL;
             }
             e = new_escaped + (e - escaped);
             escaped = new_escaped;
@@ -179,546 +130,3684 @@ xattrs_close:
     return retval;
 }
 
-static inline errcode_t ino_get_selinux_xattr(ext2_filsys fs, ext2_ino_t ino,
-                                              void **val, size_t *val_len)
+void xattr_decode_caps(const void *val, size_t len, uint64_t *cap)
 {
-    errcode_t retval = ino_get_xattr(fs, ino, "security." XATTR_SELINUX_SUFFIX, val, val_len);
-
-    return retval == EXT2_ET_EA_KEY_NOT_FOUND ? 0 : retval;
-}
-
-static inline errcode_t ino_get_capabilities_xattr(ext2_filsys fs, ext2_ino_t ino,
-                                                   uint64_t *cap)
-{
-    errcode_t retval;
-    struct vfs_cap_data *cap_data = NULL;
-    size_t len = 0;
+    struct vfs_cap_data cap_data;
 
     *cap = 0;
+    if (!val)
+        return;
 
-    retval = ino_get_xattr(fs, ino, "security." XATTR_CAPS_SUFFIX, (void **)&cap_data, &len);
-    if (retval)
-    {
-        goto end;
-    }
+    memset(&cap_data, 0, sizeof(cap_data));
+    memcpy(&cap_data, val, len < sizeof(cap_data) ? len : sizeof(cap_data));
 
-    if (cap_data &&
-        cap_data->magic_etc & VFS_CAP_REVISION &&
+    if (cap_data.magic_etc & VFS_CAP_REVISION &&
         len == XATTR_CAPS_SZ)
     {
-        *cap = cap_data->data[1].permitted;
+        *cap = cap_data.data[1].permitted;
         *cap <<= 32;
-        *cap |= cap_data->data[0].permitted;
+        *cap |= cap_data.data[0].permitted;
     }
-    else if (cap_data)
+    else
     {
-        fprintf(stderr, "%s: Unknown capabilities revision 0x%x\n", __func__, cap_data->magic_etc & VFS_CAP_REVISION_MASK);
+        fprintf(stderr, "%s: Unknown capabilities revision 0x%x\n", __func__, cap_data.magic_etc & VFS_CAP_REVISION_MASK);
     }
+}
 
-end:
-    return retval == EXT2_ET_EA_KEY_NOT_FOUND ? 0 : retval;
+static inline size_t hash_u64(__u64 key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
 }
 
-errcode_t ino_get_config(ext2_ino_t ino, struct ext2_inode inode, const char *path)
+/* Open addressing map from a non-zero 64-bit key to a pointer */
+static void *u64_map_get(struct u64_map *map, __u64 key)
 {
-    char *ctx = NULL;
-    size_t ctx_len;
-    uint64_t cap;
-    errcode_t retval = 0;
+    size_t i;
 
-    retval = ino_get_selinux_xattr(fs, ino, (void **)&ctx, &ctx_len);
-    if (retval)
-    {
-        return retval;
-    }
+    if (!map->cap)
+        return NULL;
 
-    retval = ino_get_capabilities_xattr(fs, ino, &cap);
-    if (retval)
+    for (i = hash_u64(key) & (map->cap - 1); map->slots[i].key; i = (i + 1) & (map->cap - 1))
     {
-        return retval;
+        if (map->slots[i].key == key)
+            return map->slots[i].val;
     }
+    return NULL;
+}
 
-    fprintf(filesystem, "%s %u %u %o", ino == EXT2_ROOT_INO ? "/" : path, inode.i_uid, inode.i_gid, inode.i_mode & FILE_MODE_MASK);
-
-    if (cap)
-    {
-        fprintf(filesystem, " capabilities=%llu", cap);
-    }
-    fputc('\n', filesystem);
+static errcode_t u64_map_put(struct u64_map *map, __u64 key, void *val)
+{
+    size_t i;
+    errcode_t retval;
 
-    if (ctx)
+    if ((map->count + 1) * 2 > map->cap)
     {
-        char *context = NULL, *start = NULL, *escaped = NULL;
-        size_t len = ctx_len + 2;
-
-        if (ino == EXT2_ROOT_INO)
-        {
-            len += 6;
-        }
+        struct u64_map grown = {
+            .cap = map->cap ? map->cap * 2 : 256,
+        };
 
-        if (ino != EXT2_ROOT_INO || !system_as_root)
-        {
-            if (system_as_root)
-                path++;
-            escaped = escape_regex_meta_chars(path);
-            len += strlen(escaped) + 1;
-        }
+        retval = ext2fs_get_arrayzero(grown.cap, sizeof(*grown.slots), &grown.slots);
+        if (retval)
+            return retval;
 
-        context = malloc(len);
-        start = context;
-        if (!context)
+        for (i = 0; i < map->cap; i++)
         {
-            E2FSTOOL_ERROR("while allocating memory");
-            exit(EXIT_FAILURE);
+            if (map->slots[i].key)
+                u64_map_put(&grown, map->slots[i].key, map->slots[i].val);
         }
+        ext2fs_free_mem(&map->slots);
+        *map = grown;
+    }
 
-        if (ino != EXT2_ROOT_INO || !system_as_root)
+    for (i = hash_u64(key) & (map->cap - 1); map->slots[i].key; i = (i + 1) & (map->cap - 1))
+    {
+        if (map->slots[i].key == key)
         {
-            context += snprintf(context, strlen(escaped) + 2, "/%s", escaped);
-            free(escaped);
+            map->slots[i].val = val;
+            return 0;
         }
+    }
+    map->slots[i].key = key;
+    map->slots[i].val = val;
+    map->count++;
+    return 0;
+}
 
-        if (ino == EXT2_ROOT_INO)
-        {
-            context += snprintf(context, 7, "(/.*)?");
-        }
+static void u64_map_free(struct u64_map *map, void (*free_val)(void *))
+{
+    size_t i;
 
-        context += snprintf(context, ctx_len + 2, " %s\n", ctx);
-        fwrite(start, 1, len - 1, contexts);
-        free(start);
+    for (i = 0; free_val && i < map->cap; i++)
+    {
+        if (map->slots[i].key)
+            free_val(map->slots[i].val);
     }
-    return retval;
+    ext2fs_free_mem(&map->slots);
+    map->cap = map->count = 0;
 }
 
-errcode_t ino_extract_symlink(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
-                              const char *path)
+/*
+ * Xattr values are interned: every distinct value is stored once, NUL
+ * terminated, and lives until exit. Android images carry a handful of
+ * SELinux labels across all inodes.
+ */
+static const char *xattr_intern(const void *val, size_t len)
 {
-    ext2_file_t e2_file;
-    char *link_target = NULL;
-    __u32 i_size = inode->i_size;
-    errcode_t retval = 0;
+    struct interned_value *iv;
+    __u64 h = hash_bytes(val, len) ?: 1;
 
-    link_target = malloc(i_size + 1);
-    if (!link_target)
+    pthread_mutex_lock(&intern_lock);
+    for (iv = u64_map_get(&interned, h); iv; iv = iv->next)
     {
-        E2FSTOOL_ERROR("while allocating memory");
-        return EXT2_ET_NO_MEMORY;
+        if (iv->len == len && !memcmp(iv->data, val, len))
+            goto out;
     }
 
-    if (i_size < SYMLINK_I_BLOCK_MAX_SIZE)
+    iv = malloc(sizeof(*iv) + len + 1);
+    if (!iv)
+        goto out;
+
+    iv->len = len;
+    memcpy(iv->data, val, len);
+    iv->data[len] = '\0';
+    iv->next = u64_map_get(&interned, h);
+    if (u64_map_put(&interned, h, iv))
     {
-        strncpy(link_target, (char *)inode->i_block, i_size + 1);
+        free(iv);
+        iv = NULL;
     }
-    else
+out:
+    pthread_mutex_unlock(&intern_lock);
+    return iv ? iv->data : NULL;
+}
+
+static void interned_free(void *val)
+{
+    struct interned_value *iv = val, *next;
+
+    for (; iv; iv = next)
     {
-        unsigned bytes = i_size;
-        char *p = link_target;
-        retval = ext2fs_file_open(fs, ino, 0, &e2_file);
-        if (retval)
-        {
-            com_err(__func__, retval, "while opening ex2fs symlink");
-            goto end;
-        }
-        for (;;)
+        next = iv->next;
+        free(iv);
+    }
+}
+
+/*
+ * Picks security.selinux and security.capability out of one xattr entry
+ * table. Returns false if the table can't be decoded here (corruption or
+ * values stored in EA inodes), the caller then goes through libext2fs.
+ */
+static bool xattr_scan(const char *entries, const char *values, const char *end,
+                       struct ino_xattrs *x)
+{
+    const struct ext2_ext_attr_entry *e = (const struct ext2_ext_attr_entry *)entries;
+
+    while ((const char *)e + sizeof(__u32) <= end && !EXT2_EXT_IS_LAST_ENTRY(e))
+    {
+        const char *name = EXT2_EXT_ATTR_NAME(e), *val;
+        const struct ext2_ext_attr_entry *next = EXT2_EXT_ATTR_NEXT(e);
+        const char **dst = NULL;
+        size_t *dst_len = NULL;
+
+        if ((const char *)e + sizeof(*e) > end || (const char *)next > end)
+            return false;
+
+        if (e->e_name_index == XATTR_INDEX_SECURITY)
         {
-            unsigned int got;
-            retval = ext2fs_file_read(e2_file, p, bytes, &got);
-            if (retval)
+            if (e->e_name_len == sizeof(XATTR_SELINUX_SUFFIX) - 1 &&
+                !memcmp(name, XATTR_SELINUX_SUFFIX, e->e_name_len))
             {
-                com_err(__func__, retval, "while reading ex2fs symlink");
-                goto end;
+                dst = &x->selinux;
+                dst_len = &x->selinux_len;
+            }
+            else if (e->e_name_len == sizeof(XATTR_CAPS_SUFFIX) - 1 &&
+                     !memcmp(name, XATTR_CAPS_SUFFIX, e->e_name_len))
+            {
+                dst = (const char **)&x->caps;
+                dst_len = &x->caps_len;
             }
-            bytes -= got;
-            p += got;
-            if (got == 0 || bytes == 0)
-                break;
         }
-        link_target[i_size] = '\0';
-        retval = ext2fs_file_close(e2_file);
-        if (retval)
+
+        if (dst)
         {
-            com_err(__func__, retval, "while closing symlink");
-            goto end;
-        }
-    }
+            if (e->e_value_inum)
+                return false;
 
-    retval = symlink(link_target, path);
-    if (retval == -1)
-    {
-        E2FSTOOL_ERROR("while creating symlink");
-    }
+            val = values + e->e_value_offs;
+            if (val < values || val + e->e_value_size > end)
+                return false;
 
-end:
-    free(link_target);
-    return retval;
+            *dst = xattr_intern(val, e->e_value_size);
+            if (!*dst)
+                return false;
+            *dst_len = e->e_value_size;
+        }
+        e = next;
+    }
+    return true;
 }
 
-errcode_t ino_extract_regular(ext2_filsys fs, ext2_ino_t ino, const char *path)
+static errcode_t ea_block_get_xattrs(ext2_filsys fs, struct xattr_cache *cache,
+                                     ext2_ino_t ino, blk64_t blk, struct ino_xattrs *x,
+                                     bool *decoded)
 {
-    ext2_file_t e2_file;
-    struct ext2_inode inode;
+    const struct ext2_ext_attr_header *hdr;
+    struct ino_xattrs *cached = NULL;
     char *buf = NULL;
-    int fd, nbytes;
-    unsigned int written = 0, got;
-    errcode_t retval = 0, close_retval = 0;
+    errcode_t retval;
 
-    retval = ext2fs_read_inode(fs, ino, &inode);
-    if (retval)
+    if (cache)
     {
-        com_err(__func__, retval, "while reading file inode %u", ino);
-        return retval;
+        pthread_mutex_lock(&cache->lock);
+        cached = u64_map_get(&cache->blocks, blk);
+        pthread_mutex_unlock(&cache->lock);
     }
-
-    fd = open(path, O_WRONLY | O_TRUNC | O_BINARY | O_CREAT, 0644);
-    if (fd < 0)
+    if (cached)
     {
-        E2FSTOOL_ERROR("while creating file");
-        return -1;
+        *x = *cached;
+        *decoded = true;
+        return 0;
     }
 
-    retval = ext2fs_file_open(fs, ino, 0, &e2_file);
+    retval = ext2fs_get_mem(fs->blocksize, &buf);
     if (retval)
-    {
-        com_err(__func__, retval, "while opening ext2 file");
-        goto end;
-    }
+        return retval;
 
-    retval = ext2fs_get_mem(FILE_READ_BUFLEN, &buf);
+    retval = ext2fs_read_ext_attr3(fs, blk, buf, ino);
     if (retval)
     {
-        com_err(__func__, retval, "while allocating memory");
+        com_err(__func__, retval, "while reading EA block %llu of inode %u",
+                (unsigned long long)blk, ino);
         goto end;
     }
 
-    do
+    hdr = (const struct ext2_ext_attr_header *)buf;
+    *decoded = hdr->h_magic == EXT2_EXT_ATTR_MAGIC &&
+               xattr_scan(buf + sizeof(*hdr), buf, buf + fs->blocksize, x);
+
+    /* The cache is only an optimization, failing to fill it is fine */
+    if (cache && *decoded && (cached = malloc(sizeof(*cached))))
     {
-        retval = ext2fs_file_read(e2_file, buf, FILE_READ_BUFLEN, &got);
-        if (retval)
-        {
-            com_err(__func__, retval, "while reading ext2 file");
-            goto quit;
-        }
+        *cached = *x;
+        pthread_mutex_lock(&cache->lock);
+        if (u64_map_get(&cache->blocks, blk) || u64_map_put(&cache->blocks, blk, cached))
+            free(cached);
+        pthread_mutex_unlock(&cache->lock);
+    }
 
-retry:
-        nbytes = write(fd, buf, got);
-        if (nbytes < 0)
-        {
-            if (errno & (EINTR | EAGAIN))
-            {
-                goto retry;
-            }
-            E2FSTOOL_ERROR("while writing file");
-            retval = -1;
-            goto close;
-        }
+end:
+    ext2fs_free_mem(&buf);
+    return retval;
+}
+
+static errcode_t ino_get_xattrs_slow(ext2_filsys fs, ext2_ino_t ino, struct ino_xattrs *x)
+{
+    void *val = NULL;
+    size_t len = 0;
+    errcode_t retval;
 
-        written += nbytes;
-    } while (written < inode.i_size);
+    memset(x, 0, sizeof(*x));
 
-    if (inode.i_size != written)
+    retval = ino_get_xattr(fs, ino, "security." XATTR_SELINUX_SUFFIX, &val, &len);
+    if (!retval && val)
     {
-        E2FSTOOL_ERROR("while writing file (%u of %u)", written, inode.i_size);
-        retval = -1;
+        x->selinux = xattr_intern(val, len);
+        x->selinux_len = len;
     }
+    ext2fs_free_mem(&val);
+    if (retval && retval != EXT2_ET_EA_KEY_NOT_FOUND)
+        return retval;
 
-close:
-    close_retval = ext2fs_file_close(e2_file);
-    if (close_retval)
-        com_err(__func__, close_retval, "while closing ext2 file\n");
-quit:
-    ext2fs_free_mem(&buf);
-end:
-    close(fd);
-    return retval ?: close_retval;
+    retval = ino_get_xattr(fs, ino, "security." XATTR_CAPS_SUFFIX, &val, &len);
+    if (!retval && val)
+    {
+        x->caps = xattr_intern(val, len);
+        x->caps_len = len;
+    }
+    ext2fs_free_mem(&val);
+    if (retval && retval != EXT2_ET_EA_KEY_NOT_FOUND)
+        return retval;
+
+    if ((x->selinux_len && !x->selinux) || (x->caps_len && !x->caps))
+        return EXT2_ET_NO_MEMORY;
+    return 0;
 }
 
-int walk_dir(ext2_ino_t dir,
-             int flags EXT2FS_ATTR((unused)),
-             struct ext2_dir_entry *de,
-             int offset EXT2FS_ATTR((unused)),
-             int blocksize EXT2FS_ATTR((unused)),
-             char *buf EXT2FS_ATTR((unused)), void *priv_data)
+/*
+ * Reads the xattrs ino_get_config needs in one pass over the inode body
+ * and its EA block. EA blocks are shared by many inodes on Android
+ * images, so their decoded contents are kept in @cache by block number,
+ * unless it is NULL. @inode is the full on-disk inode of @inode_size bytes.
+ */
+errcode_t ino_decode_xattrs(ext2_filsys fs, struct xattr_cache *cache, ext2_ino_t ino,
+                            struct ext2_inode_large *inode, int inode_size,
+                            struct ino_xattrs *x)
 {
-    __u16 name_len;
-    char *output_file;
-    struct ext2_inode inode;
-    struct inode_params *params = (struct inode_params *)priv_data;
+    struct ino_xattrs block_x = {0};
+    bool decoded = true;
+    blk64_t blk;
     errcode_t retval = 0;
 
-    name_len = de->name_len & 0xff;
-    if (!strncmp(de->name, ".", name_len) ||
-        !strncmp(de->name, "..", name_len))
-        return 0;
+    memset(x, 0, sizeof(*x));
 
-    if (asprintf(&params->filename, "%s/%.*s", params->path, name_len, de->name) < 0)
+    if (inode_size > EXT2_GOOD_OLD_INODE_SIZE &&
+        EXT2_GOOD_OLD_INODE_SIZE + inode->i_extra_isize + sizeof(__u32) <= (unsigned)inode_size)
     {
-        E2FSTOOL_ERROR("while allocating memory");
-        return EXT2_ET_NO_MEMORY;
-    }
+        char *start = (char *)inode + EXT2_GOOD_OLD_INODE_SIZE + inode->i_extra_isize;
 
-    if (!android_configure_only)
-    {
-        if (asprintf(&output_file, "%s%s", out_dir,
-                     params->filename) < 0)
+        if (*(__u32 *)start == EXT2_EXT_ATTR_MAGIC)
         {
-            E2FSTOOL_ERROR("while allocating memory");
-            retval = EXT2_ET_NO_MEMORY;
-            goto end;
+            start += sizeof(__u32);
+            decoded = xattr_scan(start, start, (char *)inode + inode_size, x);
         }
     }
 
-    retval = ext2fs_read_inode(fs, de->inode, &inode);
-    if (retval)
+    blk = ext2fs_file_acl_block(fs, (struct ext2_inode *)inode);
+    if (decoded && blk)
     {
-        com_err(__func__, retval, "while reading inode %u", de->inode);
-        goto err;
-    }
+        retval = ea_block_get_xattrs(fs, cache, ino, blk, &block_x, &decoded);
+        if (retval)
+            return retval;
 
-    if (android_configure)
-    {
-        char *config_path;
-        retval = asprintf(&config_path, "%s%s", mountpoint, params->filename);
-        if (retval < 0 || !config_path)
+        if (!x->selinux)
         {
-            E2FSTOOL_ERROR("while allocating memory");
-            retval = EXT2_ET_NO_MEMORY;
-            goto err;
+            x->selinux = block_x.selinux;
+            x->selinux_len = block_x.selinux_len;
+        }
+        if (!x->caps)
+        {
+            x->caps = block_x.caps;
+            x->caps_len = block_x.caps_len;
         }
-
-        retval = ino_get_config(de->inode, inode, config_path);
-        free(config_path);
-
-        if (retval)
-            goto err;
     }
 
-    if (!quiet)
-    {
-        ext2fs_numeric_progress_update(fs, &progress, de->inode - RESERVED_INODES_COUNT);
+    if (!decoded)
+        retval = ino_get_xattrs_slow(fs, ino, x);
+    return retval;
+}
+
+errcode_t ino_get_xattrs(ext2_filsys fs, struct xattr_cache *cache, ext2_ino_t ino,
+                         struct ino_xattrs *x)
+{
+    struct ext2_inode_large *inode;
+    int inode_size = EXT2_INODE_SIZE(fs->super);
+    errcode_t retval;
+
+    memset(x, 0, sizeof(*x));
+
+    retval = ext2fs_get_mem(inode_size, &inode);
+    if (retval)
+        return retval;
+
+    retval = ino_read(fs, ino, (struct ext2_inode *)inode, inode_size);
+    if (retval)
+        com_err(__func__, retval, "while reading inode %u", ino);
+    else
+        retval = ino_decode_xattrs(fs, cache, ino, inode, inode_size, x);
+
+    ext2fs_free_mem(&inode);
+    return retval;
+}
+
+void xattr_cache_init(struct xattr_cache *cache)
+{
+    memset(&cache->blocks, 0, sizeof(cache->blocks));
+    pthread_mutex_init(&cache->lock, NULL);
+}
+
+void xattr_cache_free(struct xattr_cache *cache)
+{
+    u64_map_free(&cache->blocks, free);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+errcode_t ino_get_config(struct inode_params *params, ext2_ino_t ino,
+                         struct ext2_inode inode, const char *path)
+{
+    FILE *filesystem = params->filesystem, *contexts = params->contexts;
+    struct ino_xattrs xattrs;
+    const char *ctx;
+    size_t ctx_len;
+    uint64_t cap;
+    __u64 config_start = stats_now();
+    errcode_t retval = 0;
+
+    retval = ino_get_xattrs(params->fs, &params->ctx->xattrs, ino, &xattrs);
+    if (retval)
+    {
+        return retval;
+    }
+    stats_end(STAT_XATTR, config_start, xattrs.selinux_len + xattrs.caps_len, NULL);
+
+    ctx = xattrs.selinux;
+    ctx_len = xattrs.selinux_len;
+    xattr_decode_caps(xattrs.caps, xattrs.caps_len, &cap);
+
+    fprintf(filesystem, "%s %u %u %o", ino == EXT2_ROOT_INO ? "/" : path, inode.i_uid, inode.i_gid, inode.i_mode & FILE_MODE_MASK);
+
+    if (cap)
+    {
+        fprintf(filesystem, " capabilities=%llu", cap);
+    }
+    fputc('\n', filesystem);
+
+    if (ctx)
+    {
+        char *context = NULL, *start = NULL, *escaped = NULL;
+        size_t len = ctx_len + 2;
+
+        if (ino == EXT2_ROOT_INO)
+        {
+            len += 6;
+        }
+
+        if (ino != EXT2_ROOT_INO || !params->ctx->system_as_root)
+        {
+            if (params->ctx->system_as_root)
+                path++;
+            escaped = escape_regex_meta_chars(path);
+            if (!escaped)
+            {
+                E2FSTOOL_ERROR("while escaping %s", path);
+                return EXT2_ET_NO_MEMORY;
+            }
+            len += strlen(escaped) + 1;
+        }
+
+        context = malloc(len);
+        start = context;
+        if (!context)
+        {
+            E2FSTOOL_ERROR("while allocating memory");
+            free(escaped);
+            return EXT2_ET_NO_MEMORY;
+        }
+
+        if (ino != EXT2_ROOT_INO || !params->ctx->system_as_root)
+        {
+            context += snprintf(context, strlen(escaped) + 2, "/%s", escaped);
+            free(escaped);
+        }
+
+        if (ino == EXT2_ROOT_INO)
+        {
+            context += snprintf(context, 7, "(/.*)?");
+        }
+
+        context += snprintf(context, ctx_len + 2, " %s\n", ctx);
+        fwrite(start, 1, len - 1, contexts);
+        free(start);
+    }
+
+    stats_end(STAT_CONFIG, config_start, 0, path);
+    return retval;
+}
+
+#ifndef SVB_MINGW
+/*
+ * Restores owner, mode and timestamps of an extracted entry (-p). Symlinks
+ * have no descriptor and are addressed by @dirfd and @name instead, which
+ * otherwise only names the entry in messages. Owners are only restored
+ * when running as root.
+ */
+void ino_restore_metadata(int fd, int dirfd, const char *name,
+                          const struct ext2_inode *inode)
+{
+    struct timespec times[2] = {
+        {.tv_sec = inode->i_atime},
+        {.tv_sec = inode->i_mtime},
+    };
+    __u64 start = stats_now();
+    int ret;
+
+    if (!geteuid())
+    {
+        if (fd >= 0)
+            ret = fchown(fd, inode_uid(*inode), inode_gid(*inode));
+        else
+            ret = fchownat(dirfd, name, inode_uid(*inode), inode_gid(*inode),
+                           AT_SYMLINK_NOFOLLOW);
+        if (ret == -1)
+            E2FSTOOL_ERROR("while restoring owner of %s", name);
+    }
+
+    /* After the owner, chown drops the setuid and setgid bits */
+    if (fd >= 0 && fchmod(fd, inode->i_mode & FILE_MODE_MASK) == -1)
+        E2FSTOOL_ERROR("while restoring mode of %s", name);
+
+    if (fd >= 0)
+        ret = futimens(fd, times);
+    else
+        ret = utimensat(dirfd, name, times, AT_SYMLINK_NOFOLLOW);
+    if (ret == -1)
+        E2FSTOOL_ERROR("while restoring timestamps of %s", name);
+
+    stats_end(STAT_METADATA, start, 0, name);
+}
+#else
+/* MinGW stamps entries by path in walk_dir, -p is not available */
+void ino_restore_metadata(int fd EXT2FS_ATTR((unused)),
+                          int dirfd EXT2FS_ATTR((unused)),
+                          const char *name EXT2FS_ATTR((unused)),
+                          const struct ext2_inode *inode EXT2FS_ATTR((unused)))
+{
+}
+#endif
+
+/* Creates symlink @name relative to @dirfd pointing where @ino does */
+errcode_t ino_extract_symlink(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
+                              int dirfd, const char *name)
+{
+    char *link_target = NULL;
+    errcode_t retval;
+
+    retval = ino_read_symlink(fs, ino, inode, &link_target);
+    if (retval)
+        return retval;
+
+    if (output_threads)
+        return out_queue_symlink(dirfd, name, link_target, inode);
+
+    retval = symlinkat(link_target, dirfd, name);
+    if (retval == -1)
+    {
+        E2FSTOOL_ERROR("while creating symlink");
+        goto end;
+    }
+
+    if (preserve)
+        ino_restore_metadata(-1, dirfd, name, inode);
+
+end:
+    free(link_target);
+    return retval;
+}
+
+static errcode_t write_all(int fd, const char *buf, size_t len)
+{
+    __u64 start = stats_now(), total = len;
+    ssize_t nbytes;
+
+    while (len)
+    {
+        nbytes = write(fd, buf, len);
+        if (nbytes < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            E2FSTOOL_ERROR("while writing file");
+            return -1;
+        }
+        buf += nbytes;
+        len -= nbytes;
+    }
+
+    stats_end(STAT_WRITE, start, total, NULL);
+    return 0;
+}
+
+static errcode_t write_zeroes(int fd, char *buf, size_t buflen, __u64 len)
+{
+    errcode_t retval;
+
+    memset(buf, 0, buflen < len ? buflen : len);
+    while (len)
+    {
+        size_t n = buflen < len ? buflen : len;
+
+        retval = write_all(fd, buf, n);
+        if (retval)
+            return retval;
+        len -= n;
+    }
+    return 0;
+}
+
+static bool buf_is_zero(const char *buf, size_t len)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 64 <= len; i += 64)
+    {
+        __m128i v = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + i)),
+                         _mm_loadu_si128((const __m128i *)(buf + i + 16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + i + 32)),
+                         _mm_loadu_si128((const __m128i *)(buf + i + 48))));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xFFFF)
+            return false;
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 64 <= len; i += 64)
+    {
+        uint8x16_t v = vorrq_u8(
+            vorrq_u8(vld1q_u8((const uint8_t *)buf + i),
+                     vld1q_u8((const uint8_t *)buf + i + 16)),
+            vorrq_u8(vld1q_u8((const uint8_t *)buf + i + 32),
+                     vld1q_u8((const uint8_t *)buf + i + 48)));
+
+        if (vmaxvq_u8(v))
+            return false;
+    }
+#endif
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+    {
+        uint64_t v;
+
+        memcpy(&v, buf + i, sizeof(v));
+        if (v)
+            return false;
+    }
+    for (; i < len; i++)
+    {
+        if (buf[i])
+            return false;
+    }
+    return true;
+}
+
+static errcode_t out_file_init(struct out_file *of, int fd, char *buf,
+                               size_t buflen, __u64 size, struct hash_ctx *hash)
+{
+    of->fd = fd;
+    of->buf = buf;
+    of->buflen = buflen;
+    of->pos = 0;
+    of->seek = false;
+    of->hash = hash;
+
+    /* Size the file up front so skipped ranges always end up as holes */
+    if (fd >= 0 && sparse_output && ftruncate(fd, size) == -1)
+    {
+        E2FSTOOL_ERROR("while resizing file to %llu bytes", (unsigned long long)size);
+        return -1;
+    }
+    return 0;
+}
+
+/* Output files are created empty and sized up front, skipping leaves a hole */
+static errcode_t out_file_hole(struct out_file *of, __u64 len)
+{
+    of->pos += len;
+    of->seek = true;
+    return 0;
+}
+
+static errcode_t out_file_put(struct out_file *of, const char *buf, size_t len)
+{
+    errcode_t retval;
+
+    if (of->fd < 0)
+    {
+        of->pos += len;
+        return 0;
+    }
+
+    if (of->seek)
+    {
+        if (lseek(of->fd, of->pos, SEEK_SET) == (off_t)-1)
+        {
+            E2FSTOOL_ERROR("while seeking to %llu", (unsigned long long)of->pos);
+            return -1;
+        }
+        of->seek = false;
+    }
+
+    retval = write_all(of->fd, buf, len);
+    if (!retval)
+        of->pos += len;
+    return retval;
+}
+
+/*
+ * Skips a hole or unwritten range: seeks over it in sparse mode,
+ * writes zeroes otherwise. Only call between chunks, the scratch
+ * buffer is clobbered.
+ */
+static errcode_t out_file_skip(struct out_file *of, __u64 len)
+{
+    errcode_t retval;
+
+    if (of->hash)
+        digest_feed_zeroes(of->hash, len);
+    if (sparse_output || of->fd < 0)
+        return out_file_hole(of, len);
+
+    retval = write_zeroes(of->fd, of->buf, of->buflen, len);
+    if (!retval)
+        of->pos += len;
+    return retval;
+}
+
+static errcode_t out_file_write(struct out_file *of, const char *buf, size_t len,
+                                unsigned int blocksize)
+{
+    size_t off = 0, end, n;
+    bool zero;
+    errcode_t retval;
+
+    if (of->hash)
+        digest_feed(of->hash, buf, len);
+    if (!detect_zeroes || of->fd < 0)
+        return out_file_put(of, buf, len);
+
+    while (off < len)
+    {
+        n = len - off < blocksize ? len - off : blocksize;
+        zero = buf_is_zero(buf + off, n);
+
+        for (end = off + n; end < len; end += n)
+        {
+            n = len - end < blocksize ? len - end : blocksize;
+            if (buf_is_zero(buf + end, n) != zero)
+                break;
+        }
+
+        if (zero)
+            retval = out_file_hole(of, end - off);
+        else
+            retval = out_file_put(of, buf + off, end - off);
+        if (retval)
+            return retval;
+        off = end;
+    }
+    return 0;
+}
+
+#ifdef __linux__
+/* The output filesystem or kernel cannot do it at all, stop trying */
+static bool copy_unsupported(int err)
+{
+    return err == EXDEV || err == EOPNOTSUPP || err == ENOSYS;
+}
+
+/* Refused for this pair of files or ranges only, the next call may work */
+static bool copy_refused(int err)
+{
+    return err == EINVAL || err == EBADF || err == ETXTBSY || err == EPERM;
+}
+
+/*
+ * Moves [src, src + len) of @src_fd (the RAW image, or an output file
+ * with the same data) to the output cursor without a userspace copy:
+ * block-aligned ranges are reflinked where the output filesystem of
+ * @ctx allows it, the rest goes through copy_file_range(). Stops early
+ * (*copied < len) when the kernel refuses, the caller then reads the
+ * remainder itself.
+ */
+static errcode_t out_file_copy(struct extract_ctx *ctx, struct out_file *of, int src_fd,
+                               __u64 src, __u64 len, __u64 *copied)
+{
+    __u64 done = 0, start = stats_now();
+#ifdef FICLONERANGE
+    struct stat st;
+#endif
+
+    *copied = 0;
+    of->seek = true;
+
+#ifdef FICLONERANGE
+    if (atomic_load(&ctx->reflink_ok) && !fstat(of->fd, &st) && st.st_blksize > 0)
+    {
+        __u64 align = st.st_blksize;
+        struct file_clone_range range = {
+            .src_fd = src_fd,
+            .src_offset = src,
+            .src_length = len - len % align,
+            .dest_offset = of->pos,
+        };
+
+        if (range.src_length && !(src % align) && !(of->pos % align))
+        {
+            if (!ioctl(of->fd, FICLONERANGE, &range))
+            {
+                done = range.src_length;
+            }
+            else if (copy_unsupported(errno) || errno == ENOTTY)
+            {
+                atomic_store(&ctx->reflink_ok, false);
+            }
+            else if (!copy_refused(errno))
+            {
+                E2FSTOOL_ERROR("while cloning range");
+                return -1;
+            }
+        }
+    }
+#endif
+
+    while (done < len && atomic_load(&ctx->copy_range_ok))
+    {
+        loff_t off_in = src + done, off_out = of->pos + done;
+        ssize_t n;
+
+        n = copy_file_range(src_fd, &off_in, of->fd, &off_out, len - done, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (copy_unsupported(errno))
+                atomic_store(&ctx->copy_range_ok, false);
+            if (copy_unsupported(errno) || copy_refused(errno))
+                break;
+            E2FSTOOL_ERROR("while copying range");
+            return -1;
+        }
+        if (!n)
+            break;
+        done += n;
+    }
+
+    of->pos += done;
+    *copied = done;
+    stats_end(STAT_COPY, start, done, NULL);
+    return 0;
+}
+#else
+static errcode_t out_file_copy(struct extract_ctx *ctx EXT2FS_ATTR((unused)),
+                               struct out_file *of EXT2FS_ATTR((unused)),
+                               int src_fd EXT2FS_ATTR((unused)),
+                               __u64 src EXT2FS_ATTR((unused)),
+                               __u64 len EXT2FS_ATTR((unused)), __u64 *copied)
+{
+    *copied = 0;
+    return 0;
+}
+#endif
+
+/* Like out_file_copy() from @path, an output file written earlier in this run */
+static errcode_t out_file_clone(struct extract_ctx *ctx, struct out_file *of, const char *path,
+                                __u64 src, __u64 len, __u64 *copied)
+{
+    errcode_t retval = 0;
+    struct stat st;
+    int fd;
+
+    *copied = 0;
+#ifndef SVB_MINGW
+    fd = openat(ctx->out_dir_fd, path + 1, O_RDONLY | O_BINARY | O_NOFOLLOW);
+    if (fd < 0)
+        return 0;
+
+    /* A shared partial tail block ends @path early, the caller buffers the rest */
+    if (!fstat(fd, &st) && (__u64)st.st_size > src)
+    {
+        if (len > (__u64)st.st_size - src)
+            len = st.st_size - src;
+        retval = out_file_copy(ctx, of, fd, src, len, copied);
+    }
+    close(fd);
+#endif
+    return retval;
+}
+
+/* Reads @n blocks at @blk, through the dedup cache if they are known to be shared */
+static errcode_t dedup_read_blk(struct extract_ctx *ctx, ext2_filsys fs, blk64_t blk, blk64_t n,
+                                bool shared, char *buf)
+{
+    errcode_t retval;
+
+    if (shared && dedup_cache_get(ctx->dedup, blk, n, fs->blocksize, buf))
+        return 0;
+
+    retval = io_channel_read_blk64(fs->io, blk, n, buf);
+    if (!retval && shared)
+        dedup_cache_put(ctx->dedup, blk, n, fs->blocksize, buf);
+    return retval;
+}
+
+static errcode_t out_file_finish(struct out_file *of, __u64 size)
+{
+    if (of->pos < size)
+        return out_file_skip(of, size - of->pos);
+    return 0;
+}
+
+/* Queues the data blocks of @runs on the readahead engine */
+static void runs_readahead(ext2_filsys fs, const struct extent_run *runs, size_t count)
+{
+    size_t i;
+
+    if (!readahead_threads)
+        return;
+
+    for (i = 0; i < count; i++)
+    {
+        if (!runs[i].uninit)
+            io_channel_cache_readahead(fs->io, runs[i].pblk, runs[i].len);
+    }
+}
+
+/* Queues the blocks of directory @ino before dir_iterate reads them one by one */
+static void dir_readahead(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode)
+{
+    struct extent_run *runs = NULL;
+    size_t count = 0;
+
+    if (!readahead_threads || !(inode->i_flags & EXT4_EXTENTS_FL) ||
+        (inode->i_flags & EXT4_INLINE_DATA_FL))
+        return;
+
+    if (!ino_get_extent_runs(fs, ino, inode, &runs, &count))
+        runs_readahead(fs, runs, count);
+    ext2fs_free_mem(&runs);
+}
+
+/* ino_extract_extents() state for its run_ops */
+struct extract_runs {
+    struct extract_ctx *ctx;
+    ext2_filsys fs;
+    struct out_file *of;
+    blk64_t pblk; /* Of the current run */
+    blk64_t shared; /* Blocks at its start that other files have too */
+};
+
+static errcode_t extract_run_hole(void *data, __u64 off EXT2FS_ATTR((unused)), __u64 len)
+{
+    struct extract_runs *x = data;
+
+    return out_file_skip(x->of, len);
+}
+
+/* Zero-copy from the image, or reuse of an output file that has the blocks already */
+static errcode_t extract_run_take(void *data, const struct extent_run *run, __u64 len,
+                                  blk64_t *done)
+{
+    struct extract_runs *x = data;
+    struct extract_ctx *ctx = x->ctx;
+    struct out_file *of = x->of;
+    unsigned int bs = x->fs->blocksize;
+    const char *src;
+    blk64_t src_lblk;
+    __u64 copied = 0;
+    errcode_t retval;
+
+    x->pblk = run->pblk;
+    x->shared = 0;
+    *done = 0;
+
+    if (ctx->raw_fd >= 0)
+    {
+        retval = out_file_copy(ctx, of, ctx->raw_fd, run->pblk * bs, len, &copied);
+        if (retval)
+            return retval;
+    }
+    else if (ctx->dedup)
+    {
+        x->shared = dedup_lookup(ctx->dedup, run->pblk, run->len, &src, &src_lblk);
+        if (!x->shared || !src || of->fd < 0 || of->hash || detect_zeroes ||
+            (!atomic_load(&ctx->reflink_ok) && !atomic_load(&ctx->copy_range_ok)))
+            return 0;
+
+        if (len > x->shared * bs)
+            len = x->shared * bs;
+        retval = out_file_clone(ctx, of, src, src_lblk * bs, len, &copied);
+        if (retval)
+            return retval;
+    }
+    else
+    {
+        return 0;
+    }
+
+    if (copied == len)
+    {
+        *done = (copied + bs - 1) / bs;
+        return 0;
+    }
+
+    /* Refused midway, redo the partial block through the buffer */
+    of->pos -= copied % bs;
+    *done = copied / bs;
+    return 0;
+}
+
+static errcode_t extract_run_read(void *data, blk64_t blk, blk64_t n, char *buf)
+{
+    struct extract_runs *x = data;
+    __u64 start = stats_now();
+    errcode_t retval;
+
+    retval = dedup_read_blk(x->ctx, x->fs, blk, n, blk - x->pblk < x->shared, buf);
+    stats_end(STAT_DATA_READ, start, n * x->fs->blocksize, NULL);
+    return retval;
+}
+
+static errcode_t extract_run_data(void *data, __u64 off EXT2FS_ATTR((unused)), const char *buf,
+                                  size_t len)
+{
+    struct extract_runs *x = data;
+
+    return out_file_write(x->of, buf, len, x->fs->blocksize);
+}
+
+static const struct run_ops extract_run_ops = {
+    .hole = extract_run_hole,
+    .take = extract_run_take,
+    .read = extract_run_read,
+    .data = extract_run_data,
+};
+
+/*
+ * Extent-mapped files skip the libext2fs file cache: physically contiguous
+ * extents are merged into runs and every run is fetched with as few large
+ * channel reads as the buffer allows.
+ */
+static errcode_t ino_extract_extents(struct extract_ctx *ctx, ext2_filsys fs, ext2_ino_t ino,
+                                     struct ext2_inode *inode, int fd,
+                                     const struct extent_run *runs, size_t count,
+                                     struct hash_ctx *hash)
+{
+    struct extent_run *own_runs = NULL;
+    struct out_file of;
+    struct extract_runs x = {.ctx = ctx, .fs = fs, .of = &of};
+    size_t buflen = 0;
+    __u64 size = EXT2_I_SIZE(inode);
+    char *buf = NULL;
+    errcode_t retval = 0;
+
+    if (!runs)
+    {
+        retval = ino_get_extent_runs(fs, ino, inode, &own_runs, &count);
+        if (retval)
+            return retval;
+        runs = own_runs;
+    }
+
+    /* Zero-copy never reads through the channel */
+    if (ctx->raw_fd < 0)
+        runs_readahead(fs, runs, count);
+
+    if (!size)
+        goto end;
+
+    /* Sized to the file, or less when --max-memory is short */
+    retval = bufpool_get(size < FILE_READ_BUFLEN ? size : FILE_READ_BUFLEN, &buf, &buflen);
+    if (retval)
+    {
+        com_err(__func__, retval, "while allocating memory");
+        goto end;
+    }
+
+    retval = out_file_init(&of, fd, buf, buflen, size, hash);
+    if (!retval)
+        retval = ino_read_runs(fs, ino, runs, count, size, buf, buflen, &extract_run_ops, &x);
+    if (!retval)
+        retval = out_file_finish(&of, size);
+
+end:
+    bufpool_put(buf, buflen);
+    ext2fs_free_mem(&own_runs);
+    return retval;
+}
+
+/*
+ * Files read without an ext2 file: inline data is copied out of the
+ * inode, and a block map whose blocks are all direct points at them from
+ * i_block already.
+ */
+static bool ino_small_direct(ext2_filsys fs, const struct ext2_inode *inode)
+{
+    if (inode->i_flags & EXT4_INLINE_DATA_FL)
+        return true;
+    return !(inode->i_flags & EXT4_EXTENTS_FL) &&
+           EXT2_I_SIZE(inode) <= (__u64)EXT2_NDIR_BLOCKS * fs->blocksize;
+}
+
+/*
+ * Reads all of small @inode into @buf, which holds its size rounded up
+ * to whole blocks and is zeroed: holes and unwritten extents read as
+ * zeroes. Runs come from @runs, i_block or, for deeper extent trees,
+ * libext2fs, and each takes a single channel read.
+ */
+static errcode_t ino_read_small_into(struct extract_ctx *ctx, ext2_filsys fs, ext2_ino_t ino,
+                                     struct ext2_inode *inode, const struct extent_run *runs,
+                                     size_t count, char *buf)
+{
+    struct extent_run root[EXT2_NDIR_BLOCKS], *own_runs = NULL;
+    ext2_file_t e2_file;
+    __u64 size = EXT2_I_SIZE(inode), read_start = stats_now();
+    blk64_t buf_blocks = (size + fs->blocksize - 1) / fs->blocksize, n, shared = 0, src_lblk;
+    const char *src;
+    unsigned int got;
+    size_t i, inline_size = size;
+    int root_count;
+    errcode_t retval, close_retval;
+
+    if (!size)
+        return 0;
+
+    if (inode->i_flags & EXT4_INLINE_DATA_FL)
+    {
+        /* Only what doesn't fit in i_block spills into the system.data xattr */
+        if (size <= sizeof(inode->i_block))
+        {
+            memcpy(buf, inode->i_block, size);
+            retval = 0;
+            goto end;
+        }
+        retval = ext2fs_inline_data_get(fs, ino, inode, buf, &inline_size);
+        if (retval)
+            com_err(__func__, retval, "while reading inline data of inode %u", ino);
+        goto end;
+    }
+
+    if (!(inode->i_flags & EXT4_EXTENTS_FL) && buf_blocks <= EXT2_NDIR_BLOCKS)
+    {
+        for (count = 0, i = 0; i < buf_blocks; i++)
+        {
+            if (!inode->i_block[i])
+                continue;
+            if (count && root[count - 1].lblk + root[count - 1].len == i &&
+                root[count - 1].pblk + root[count - 1].len == inode->i_block[i])
+            {
+                root[count - 1].len++;
+                continue;
+            }
+            root[count].lblk = i;
+            root[count].pblk = inode->i_block[i];
+            root[count].len = 1;
+            root[count].uninit = 0;
+            count++;
+        }
+        runs = root;
+    }
+    else if (!(inode->i_flags & EXT4_EXTENTS_FL))
+    {
+        retval = ext2fs_file_open2(fs, ino, inode, 0, &e2_file);
+        if (retval)
+        {
+            com_err(__func__, retval, "while opening ext2 file");
+            return retval;
+        }
+        retval = ext2fs_file_read(e2_file, buf, size, &got);
+        if (!retval && got != size)
+            retval = EXT2_ET_SHORT_READ;
+        if (retval)
+            com_err(__func__, retval, "while reading ext2 file");
+        close_retval = ext2fs_file_close(e2_file);
+        if (close_retval)
+            com_err(__func__, close_retval, "while closing ext2 file");
+        retval = retval ?: close_retval;
+        goto end;
+    }
+    else if (!runs && (root_count = ino_root_runs(inode, root)) >= 0)
+    {
+        runs = root;
+        count = root_count;
+    }
+    else if (!runs)
+    {
+        retval = ino_get_extent_runs(fs, ino, inode, &own_runs, &count);
+        if (retval)
+            return retval;
+        runs = own_runs;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (runs[i].uninit || runs[i].lblk >= buf_blocks)
+            continue;
+
+        n = runs[i].len;
+        if (n > buf_blocks - runs[i].lblk)
+            n = buf_blocks - runs[i].lblk;
+
+        if (ctx->dedup)
+            shared = dedup_lookup(ctx->dedup, runs[i].pblk, n, &src, &src_lblk);
+        retval = dedup_read_blk(ctx, fs, runs[i].pblk, n, shared,
+                                buf + runs[i].lblk * fs->blocksize);
+        if (retval)
+        {
+            com_err(__func__, retval, "while reading blocks %llu-%llu of inode %u",
+                    (unsigned long long)runs[i].pblk,
+                    (unsigned long long)(runs[i].pblk + n - 1), ino);
+            goto end;
+        }
+    }
+    retval = 0;
+
+end:
+    ext2fs_free_mem(&own_runs);
+    if (!retval)
+        stats_end(STAT_DATA_READ, read_start, size, NULL);
+    return retval;
+}
+
+/* Reads all of small @inode into a new buffer in *@ret */
+static errcode_t ino_read_small(struct extract_ctx *ctx, ext2_filsys fs, ext2_ino_t ino,
+                                struct ext2_inode *inode, const struct extent_run *runs,
+                                size_t count, char **ret)
+{
+    __u64 size = EXT2_I_SIZE(inode);
+    blk64_t buf_blocks = (size + fs->blocksize - 1) / fs->blocksize;
+    char *buf;
+    errcode_t retval;
+
+    buf = calloc(1, buf_blocks * fs->blocksize ?: 1);
+    if (!buf)
+    {
+        E2FSTOOL_ERROR("while allocating memory");
+        return EXT2_ET_NO_MEMORY;
+    }
+
+    retval = ino_read_small_into(ctx, fs, ino, inode, runs, count, buf);
+    if (retval)
+    {
+        free(buf);
+        return retval;
+    }
+    *ret = buf;
+    return 0;
+}
+
+/*
+ * Charges @len bytes of file data allocated outside the pool to --max-memory.
+ * Waiting with our own entries still queued could wait for ourselves.
+ */
+static errcode_t out_charge(size_t len)
+{
+    errcode_t retval;
+
+    if (mem_reserve(len, false))
+        return 0;
+
+    retval = out_flush();
+    if (retval)
+        return retval;
+    mem_reserve(len, true);
+    return 0;
+}
+
+/* ino_extract_fd() for ino_small_direct() files, read in one go */
+static errcode_t ino_extract_direct(struct extract_ctx *ctx, ext2_filsys fs, ext2_ino_t ino,
+                                    struct ext2_inode *inode, int fd, struct hash_ctx *hash)
+{
+    __u64 size = EXT2_I_SIZE(inode);
+    size_t buflen, need = (size + fs->blocksize - 1) / fs->blocksize * fs->blocksize;
+    struct out_file of;
+    char *buf, *data = NULL;
+    errcode_t retval;
+
+    retval = bufpool_get(need, &buf, &buflen);
+    if (retval)
+    {
+        com_err(__func__, retval, "while allocating memory");
+        return retval;
+    }
+
+    /* Short on budget, trade the pooled buffer for a charged one of our own */
+    if (buflen < need)
+    {
+        bufpool_put(buf, buflen);
+        retval = out_charge(need);
+        if (retval)
+            return retval;
+        retval = ino_read_small(ctx, fs, ino, inode, NULL, 0, &data);
+        if (retval)
+        {
+            mem_release(need);
+            return retval;
+        }
+        buf = data;
+        buflen = need;
+    }
+    else
+    {
+        memset(buf, 0, need);
+        retval = ino_read_small_into(ctx, fs, ino, inode, NULL, 0, buf);
+    }
+
+    if (!retval)
+        retval = out_file_init(&of, fd, buf, buflen, size, hash);
+    if (!retval)
+        retval = out_file_write(&of, buf, size, fs->blocksize);
+    if (!retval)
+        retval = out_file_finish(&of, size);
+
+    if (data)
+    {
+        free(data);
+        mem_release(need);
+    }
+    else
+    {
+        bufpool_put(buf, buflen);
+    }
+    return retval;
+}
+
+/*
+ * Writes the contents of @inode of @ctx to @fd. @runs may carry the
+ * extent map already collected for @inode, or NULL. The data also goes
+ * to @hash unless it is NULL; with @fd -1 it only goes there.
+ */
+errcode_t ino_extract_fd(struct extract_ctx *ctx, ext2_filsys fs, ext2_ino_t ino,
+                         struct ext2_inode *inode, int fd, const struct extent_run *runs,
+                         size_t count, struct hash_ctx *hash)
+{
+    ext2_file_t e2_file;
+    struct out_file of;
+    char *buf = NULL;
+    size_t buflen = 0;
+    unsigned int written = 0, got;
+    errcode_t retval = 0, close_retval = 0;
+
+    if ((inode->i_flags & EXT4_EXTENTS_FL) &&
+        !(inode->i_flags & EXT4_INLINE_DATA_FL))
+    {
+        return ino_extract_extents(ctx, fs, ino, inode, fd, runs, count, hash);
+    }
+
+    if (ino_small_direct(fs, inode))
+        return ino_extract_direct(ctx, fs, ino, inode, fd, hash);
+
+    retval = ext2fs_file_open2(fs, ino, inode, 0, &e2_file);
+    if (retval)
+    {
+        com_err(__func__, retval, "while opening ext2 file");
+        return retval;
+    }
+
+    retval = bufpool_get(inode->i_size < FILE_READ_BUFLEN ? inode->i_size : FILE_READ_BUFLEN,
+                         &buf, &buflen);
+    if (retval)
+    {
+        com_err(__func__, retval, "while allocating memory");
+        goto close;
+    }
+
+    retval = out_file_init(&of, fd, buf, buflen, inode->i_size, hash);
+    if (retval)
+        goto close;
+
+    do
+    {
+        __u64 read_start = stats_now();
+
+        retval = ext2fs_file_read(e2_file, buf, buflen, &got);
+        stats_end(STAT_DATA_READ, read_start, got, NULL);
+        if (retval)
+        {
+            com_err(__func__, retval, "while reading ext2 file");
+            goto quit;
+        }
+
+        if (!got)
+            break;
+
+        retval = out_file_write(&of, buf, got, fs->blocksize);
+        if (retval)
+            goto close;
+
+        written += got;
+    } while (written < inode->i_size);
+
+    if (inode->i_size != written)
+    {
+        E2FSTOOL_ERROR("while writing file (%u of %u)", written, inode->i_size);
+        retval = -1;
+    }
+
+close:
+    close_retval = ext2fs_file_close(e2_file);
+    if (close_retval)
+        com_err(__func__, close_retval, "while closing ext2 file\n");
+quit:
+    bufpool_put(buf, buflen);
+    return retval ?: close_retval;
+}
+
+/*
+ * Small files go to the batched output whole. Sparse output needs seeks
+ * and zero-copy a descriptor, and later names of a hard link must find
+ * the first one already there.
+ */
+static bool out_batched(struct extract_ctx *ctx, const struct ext2_inode *inode)
+{
+    return output_threads && !sparse_output && ctx->raw_fd < 0 &&
+           inode->i_links_count <= 1 && EXT2_I_SIZE(inode) <= OUT_SMALL_MAX;
+}
+
+/* Records the digest of @inode as @path without writing it anywhere */
+static errcode_t ino_digest(struct extract_ctx *ctx, ext2_filsys fs, ext2_ino_t ino,
+                            struct ext2_inode *inode, const char *path)
+{
+    struct hash_ctx *hash;
+    errcode_t retval;
+
+    retval = digest_begin(&hash);
+    if (retval)
+        return retval;
+
+    retval = ino_extract_fd(ctx, fs, ino, inode, -1, NULL, 0, hash);
+    if (retval)
+    {
+        digest_abort(hash);
+        return retval;
+    }
+    return digest_end(&ctx->digests, hash, path, ino);
+}
+
+/*
+ * Creates @name relative to @dirfd with the contents of @inode. With
+ * --hash the data is digested on the way and recorded as @path, unless
+ * @path is NULL.
+ */
+errcode_t ino_extract_file(struct extract_ctx *ctx, ext2_filsys fs, ext2_ino_t ino,
+                           struct ext2_inode *inode, int dirfd, const char *name,
+                           const struct extent_run *runs, size_t count, const char *path)
+{
+    struct extent_run *own_runs = NULL;
+    struct hash_ctx *hash = NULL;
+    char *data;
+    errcode_t retval;
+    int fd;
+
+    /* The runs are recorded once the data is out */
+    if (ctx->dedup && path && !runs && (inode->i_flags & EXT4_EXTENTS_FL) &&
+        !(inode->i_flags & EXT4_INLINE_DATA_FL))
+    {
+        retval = ino_get_extent_runs(fs, ino, inode, &own_runs, &count);
+        if (retval)
+            return retval;
+        runs = own_runs;
+    }
+
+    if (hash_algos && path)
+    {
+        retval = digest_begin(&hash);
+        if (retval)
+            goto end;
+    }
+
+    if (out_batched(ctx, inode))
+    {
+        /* ino_read_small() allocates whole blocks */
+        size_t charged = (EXT2_I_SIZE(inode) + fs->blocksize - 1) / fs->blocksize *
+                         fs->blocksize;
+
+        retval = out_charge(charged);
+        if (retval)
+            goto end;
+        retval = ino_read_small(ctx, fs, ino, inode, runs, count, &data);
+        if (retval)
+        {
+            mem_release(charged);
+            goto end;
+        }
+        if (hash)
+            digest_feed(hash, data, EXT2_I_SIZE(inode));
+        retval = out_queue_file(dirfd, name, data, EXT2_I_SIZE(inode), charged, inode);
+
+        /* Still queued, later references can only be cached */
+        if (!retval && ctx->dedup && runs)
+            retval = dedup_record(ctx->dedup, NULL, runs, count);
+        goto end;
+    }
+
+    fd = openat(dirfd, name, O_WRONLY | O_TRUNC | O_BINARY | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        E2FSTOOL_ERROR("while creating %s", name);
+        retval = -1;
+        goto end;
+    }
+
+    retval = ino_extract_fd(ctx, fs, ino, inode, fd, runs, count, hash);
+    if (!retval && preserve)
+        ino_restore_metadata(fd, dirfd, name, inode);
+    close(fd);
+    if (!retval && ctx->dedup && path && runs)
+        retval = dedup_record(ctx->dedup, path, runs, count);
+
+end:
+    if (hash && retval)
+        digest_abort(hash);
+    else if (hash)
+        retval = digest_end(&ctx->digests, hash, path, ino);
+    ext2fs_free_mem(&own_runs);
+    return retval;
+}
+
+/*
+ * Block order mode (--block-order) runs in two phases: the walk creates
+ * directories and symlinks and only records regular files here, with
+ * their extent maps. Phase two then extracts them sorted by first
+ * physical block, which keeps reads of the image close to sequential.
+ */
+static errcode_t manifest_add(struct extract_ctx *ctx, ext2_filsys fs, ext2_ino_t ino,
+                              struct ext2_inode *inode, const char *path)
+{
+    struct manifest_entry e = {
+        .ino = ino,
+        .inode = *inode,
+    };
+    size_t i;
+    errcode_t retval = 0;
+
+    if (inode->i_flags & EXT4_INLINE_DATA_FL)
+        ;
+    else if (inode->i_flags & EXT4_EXTENTS_FL)
+    {
+        retval = ino_get_extent_runs(fs, ino, inode, &e.runs, &e.count);
+        if (retval)
+            return retval;
+
+        for (i = 0; i < e.count; i++)
+        {
+            if (!e.runs[i].uninit)
+            {
+                e.first_block = e.runs[i].pblk;
+                break;
+            }
+        }
+    }
+    else
+    {
+        retval = ext2fs_bmap2(fs, ino, inode, NULL, 0, 0, NULL, &e.first_block);
+        if (retval)
+        {
+            com_err(__func__, retval, "while mapping inode %u", ino);
+            return retval;
+        }
+    }
+
+    e.path = strdup(path);
+    if (!e.path)
+    {
+        E2FSTOOL_ERROR("while allocating memory");
+        retval = EXT2_ET_NO_MEMORY;
+        goto err;
+    }
+
+    pthread_mutex_lock(&ctx->manifest_lock);
+    if (ctx->manifest_count == ctx->manifest_size)
+    {
+        size_t new_size = ctx->manifest_size ? ctx->manifest_size * 2 : 1024;
+
+        retval = ext2fs_resize_array(sizeof(*ctx->manifest), ctx->manifest_size, new_size,
+                                     &ctx->manifest);
+        if (retval)
+        {
+            pthread_mutex_unlock(&ctx->manifest_lock);
+            com_err(__func__, retval, "while allocating memory");
+            goto err;
+        }
+        ctx->manifest_size = new_size;
+    }
+    ctx->manifest[ctx->manifest_count++] = e;
+    pthread_mutex_unlock(&ctx->manifest_lock);
+    return 0;
+
+err:
+    free(e.path);
+    ext2fs_free_mem(&e.runs);
+    return retval;
+}
+
+static int manifest_cmp(const void *a, const void *b)
+{
+    const struct manifest_entry *ea = a, *eb = b;
+
+    if (ea->first_block != eb->first_block)
+        return ea->first_block < eb->first_block ? -1 : 1;
+    return ea->ino < eb->ino ? -1 : ea->ino > eb->ino;
+}
+
+static void manifest_sort(struct extract_ctx *ctx)
+{
+    qsort(ctx->manifest, ctx->manifest_count, sizeof(*ctx->manifest), manifest_cmp);
+    atomic_store(&ctx->manifest_next, 0);
+}
+
+/*
+ * Extracts manifest entries in order; safe to run from several workers.
+ * Entry paths are relative to the output directory.
+ */
+static errcode_t manifest_drain(struct extract_ctx *ctx, ext2_filsys fs)
+{
+    struct manifest_entry *manifest = ctx->manifest, *e;
+    struct path_arena scratch = {0};
+    const char *name;
+    size_t i, queued = 0;
+    __u64 start;
+    errcode_t retval = 0, flush_retval;
+
+    while ((i = atomic_fetch_add(&ctx->manifest_next, 1)) < ctx->manifest_count)
+    {
+        if (atomic_load(&ctx->walk_error))
+            break;
+
+        /* Keep the next files in flight while this one is written */
+        if (queued < i + 1)
+            queued = i + 1;
+        for (; ctx->raw_fd < 0 && queued < ctx->manifest_count && queued <= i + RA_LOOKAHEAD;
+             queued++)
+            runs_readahead(fs, manifest[queued].runs, manifest[queued].count);
+
+        e = &manifest[i];
+#ifdef SVB_MINGW
+        name = path_join(&scratch, ctx->out_dir, e->path);
+        if (!name)
+        {
+            retval = EXT2_ET_NO_MEMORY;
+            break;
+        }
+#else
+        name = e->path + 1;
+#endif
+        start = stats_now();
+        if (archive_format)
+            retval = archive_add(ctx, fs, e->ino, &e->inode, e->path, e->runs, e->count);
+        else
+            retval = ino_extract_file(ctx, fs, e->ino, &e->inode, ctx->out_dir_fd, name,
+                                      e->runs, e->count, e->path);
+        stats_end(STAT_FILE, start, EXT2_I_SIZE(&e->inode), e->path);
+        if (retval)
+            break;
+
+#ifdef SVB_MINGW
+        if (set_path_timestamp(name, e->inode.i_atime, e->inode.i_mtime, e->inode.i_ctime))
+            E2FSTOOL_ERROR("while configuring timestamps for %s", name);
+#endif
+    }
+    flush_retval = out_flush();
+    if (!retval)
+        retval = flush_retval;
+    path_free(&scratch);
+    return retval;
+}
+
+static void manifest_free(struct extract_ctx *ctx)
+{
+    size_t i;
+
+    for (i = 0; i < ctx->manifest_count; i++)
+    {
+        free(ctx->manifest[i].path);
+        ext2fs_free_mem(&ctx->manifest[i].runs);
+    }
+    ext2fs_free_mem(&ctx->manifest);
+    ctx->manifest_count = ctx->manifest_size = 0;
+}
+
+#ifndef SVB_MINGW
+static errcode_t dir_fixup_add(struct extract_ctx *ctx, const char *path,
+                               const struct ext2_inode *inode)
+{
+    struct dir_fixup f = {
+        .inode = *inode,
+    };
+    const char *p;
+    errcode_t retval;
+
+    for (p = path; *p; p++)
+        f.depth += *p == '/';
+
+    f.path = strdup(path);
+    if (!f.path)
+    {
+        E2FSTOOL_ERROR("while allocating memory");
+        return EXT2_ET_NO_MEMORY;
+    }
+
+    pthread_mutex_lock(&ctx->dir_fixup_lock);
+    if (ctx->dir_fixup_count == ctx->dir_fixup_size)
+    {
+        size_t new_size = ctx->dir_fixup_size ? ctx->dir_fixup_size * 2 : 256;
+
+        retval = ext2fs_resize_array(sizeof(*ctx->dir_fixups), ctx->dir_fixup_size, new_size,
+                                     &ctx->dir_fixups);
+        if (retval)
+        {
+            pthread_mutex_unlock(&ctx->dir_fixup_lock);
+            com_err(__func__, retval, "while allocating memory");
+            free(f.path);
+            return retval;
+        }
+        ctx->dir_fixup_size = new_size;
+    }
+    ctx->dir_fixups[ctx->dir_fixup_count++] = f;
+    pthread_mutex_unlock(&ctx->dir_fixup_lock);
+    return 0;
+}
+
+static int dir_fixup_cmp(const void *a, const void *b)
+{
+    const struct dir_fixup *fa = a, *fb = b;
+
+    return fa->depth < fb->depth ? 1 : -(fa->depth > fb->depth);
+}
+
+/*
+ * Directories restored while their subtree is still being extracted (-j,
+ * --block-order) would get their mtime bumped or lock out their own
+ * children, so they are done last, deepest first.
+ */
+static void dir_fixup_apply(struct extract_ctx *ctx)
+{
+    struct dir_fixup *f;
+    size_t i;
+    int fd;
+
+    qsort(ctx->dir_fixups, ctx->dir_fixup_count, sizeof(*ctx->dir_fixups), dir_fixup_cmp);
+
+    for (i = 0; i < ctx->dir_fixup_count; i++)
+    {
+        f = &ctx->dir_fixups[i];
+        fd = openat(ctx->out_dir_fd, f->path + 1, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (fd < 0)
+        {
+            E2FSTOOL_ERROR("while opening %s", f->path);
+            continue;
+        }
+        ino_restore_metadata(fd, -1, f->path, &f->inode);
+        close(fd);
+    }
+}
+
+static void dir_fixup_free(struct extract_ctx *ctx)
+{
+    size_t i;
+
+    for (i = 0; i < ctx->dir_fixup_count; i++)
+        free(ctx->dir_fixups[i].path);
+    ext2fs_free_mem(&ctx->dir_fixups);
+    ctx->dir_fixup_count = ctx->dir_fixup_size = 0;
+}
+static void walk_task_run(struct workpool_task *work, void *worker_data);
+
+static errcode_t walk_task_new(struct extract_ctx *ctx, struct walk_task **ret, ext2_ino_t ino,
+                               const char *path, bool included)
+{
+    struct walk_task *task;
+
+    task = calloc(1, sizeof(*task));
+    if (!task)
+    {
+        E2FSTOOL_ERROR("while allocating memory");
+        return EXT2_ET_NO_MEMORY;
+    }
+
+    task->path = strdup(path);
+    if (!task->path)
+    {
+        E2FSTOOL_ERROR("while allocating memory");
+        free(task);
+        return EXT2_ET_NO_MEMORY;
+    }
+
+    task->work.run = walk_task_run;
+    task->ctx = ctx;
+    task->ino = ino;
+    task->included = included;
+    *ret = task;
+    return 0;
+}
+
+static errcode_t walk_seg_open(struct inode_params *params)
+{
+    struct walk_task *task = params->task;
+    struct walk_seg *seg;
+
+    seg = calloc(1, sizeof(*seg));
+    if (!seg)
+    {
+        E2FSTOOL_ERROR("while allocating memory");
+        return EXT2_ET_NO_MEMORY;
+    }
+
+    if (task->last)
+        task->last->next = seg;
+    else
+        task->segs = seg;
+    task->last = seg;
+
+    if (params->ctx->android_configure)
+    {
+        params->filesystem = open_memstream(&seg->fs_buf, &seg->fs_len);
+        params->contexts = open_memstream(&seg->se_buf, &seg->se_len);
+        if (!params->filesystem || !params->contexts)
+        {
+            E2FSTOOL_ERROR("while opening config stream");
+            return EXT2_ET_NO_MEMORY;
+        }
+    }
+    return 0;
+}
+
+static void walk_seg_close(struct inode_params *params)
+{
+    if (params->filesystem)
+        fclose(params->filesystem);
+    if (params->contexts)
+        fclose(params->contexts);
+    params->filesystem = params->contexts = NULL;
+}
+
+static errcode_t walk_task_spawn(struct inode_params *params, ext2_ino_t ino)
+{
+    struct walk_task *child;
+    errcode_t retval;
+
+    retval = walk_task_new(params->ctx, &child, ino, params->path.buf, params->included);
+    if (retval)
+        return retval;
+
+    /* Everything emitted after this directory goes after its subtree */
+    params->task->last->child = child;
+    walk_seg_close(params);
+    retval = walk_seg_open(params);
+    if (retval)
+        return retval;
+
+    retval = workpool_submit(params->ctx->pool, &child->work);
+    if (retval)
+    {
+        E2FSTOOL_ERROR("while queueing %s", child->path);
+        return EXT2_ET_NO_MEMORY;
+    }
+    return 0;
+}
+#else
+static errcode_t walk_task_spawn(struct inode_params *params EXT2FS_ATTR((unused)),
+                                 ext2_ino_t ino EXT2FS_ATTR((unused)))
+{
+    return EXT2_ET_UNIMPLEMENTED;
+}
+#endif
+
+#ifndef SVB_MINGW
+/*
+ * Multiply-linked inodes are extracted once: the first name walked is
+ * recorded here and returned to every later one in @first, which is NULL
+ * for the first name itself.
+ */
+static errcode_t hardlink_lookup(struct extract_ctx *ctx, ext2_ino_t ino, const char *path,
+                                 const char **first)
+{
+    char *copy;
+    errcode_t retval = 0;
+
+    pthread_mutex_lock(&ctx->hardlink_lock);
+    *first = u64_map_get(&ctx->first_links, ino);
+    if (!*first)
+    {
+        copy = strdup(path);
+        if (!copy || (retval = u64_map_put(&ctx->first_links, ino, copy)))
+        {
+            free(copy);
+            E2FSTOOL_ERROR("while allocating memory");
+            retval = EXT2_ET_NO_MEMORY;
+        }
+    }
+    pthread_mutex_unlock(&ctx->hardlink_lock);
+    return retval;
+}
+
+/* Errors for which the output filesystem won't hard-link at all */
+static bool link_refused(int err)
+{
+    switch (err)
+    {
+    case EPERM:
+    case EXDEV:
+    case ENOTSUP:
+#if EOPNOTSUPP != ENOTSUP
+    case EOPNOTSUPP:
+#endif
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Creates @name relative to @dirfd as a hard link to @target, which is
+ * relative to the output directory. Falls back to extracting the inode
+ * again where links are refused or the link count is maxed out.
+ */
+static errcode_t hardlink_create(struct extract_ctx *ctx, ext2_filsys fs, ext2_ino_t ino,
+                                 struct ext2_inode *inode, const char *target, int dirfd,
+                                 const char *name)
+{
+    __u64 start = stats_now();
+
+    if (atomic_load(&ctx->link_ok))
+    {
+        if (!linkat(ctx->out_dir_fd, target + 1, dirfd, name, 0) ||
+            (errno == EEXIST && !unlinkat(dirfd, name, 0) &&
+             !linkat(ctx->out_dir_fd, target + 1, dirfd, name, 0)))
+        {
+            stats_end(STAT_LINK, start, 0, name);
+            return 0;
+        }
+
+        if (link_refused(errno))
+            atomic_store(&ctx->link_ok, false);
+        else if (errno != EMLINK)
+        {
+            E2FSTOOL_ERROR("while linking %s to %s", name, target);
+            return -1;
+        }
+    }
+
+    return ino_extract_file(ctx, fs, ino, inode, dirfd, name, NULL, 0, NULL);
+}
+
+/*
+ * With -j or --block-order the first name may not exist yet when a later
+ * one is walked, these are linked once all data is written.
+ */
+static errcode_t hardlink_defer(struct extract_ctx *ctx, ext2_ino_t ino, const char *target,
+                                const char *path)
+{
+    struct hardlink l = {
+        .ino = ino,
+    };
+    errcode_t retval;
+
+    l.target = strdup(target);
+    l.path = strdup(path);
+    if (!l.target || !l.path)
+    {
+        E2FSTOOL_ERROR("while allocating memory");
+        retval = EXT2_ET_NO_MEMORY;
+        goto err;
+    }
+
+    pthread_mutex_lock(&ctx->hardlink_lock);
+    if (ctx->hardlink_count == ctx->hardlink_size)
+    {
+        size_t new_size = ctx->hardlink_size ? ctx->hardlink_size * 2 : 256;
+
+        retval = ext2fs_resize_array(sizeof(*ctx->hardlinks), ctx->hardlink_size, new_size,
+                                     &ctx->hardlinks);
+        if (retval)
+        {
+            pthread_mutex_unlock(&ctx->hardlink_lock);
+            com_err(__func__, retval, "while allocating memory");
+            goto err;
+        }
+        ctx->hardlink_size = new_size;
+    }
+    ctx->hardlinks[ctx->hardlink_count++] = l;
+    pthread_mutex_unlock(&ctx->hardlink_lock);
+    return 0;
+
+err:
+    free(l.target);
+    free(l.path);
+    return retval;
+}
+
+static errcode_t hardlink_apply(struct extract_ctx *ctx)
+{
+    ext2_filsys fs = ctx->fs;
+    struct ext2_inode inode;
+    struct hardlink *l;
+    size_t i;
+    errcode_t retval;
+
+    for (i = 0; i < ctx->hardlink_count; i++)
+    {
+        l = &ctx->hardlinks[i];
+
+        retval = ino_read(fs, l->ino, &inode, sizeof(inode));
+        if (retval)
+        {
+            com_err(__func__, retval, "while reading inode %u", l->ino);
+            return retval;
+        }
+
+        if (archive_format)
+            retval = archive_hardlink(l->ino, &inode, l->target, l->path);
+        else
+            retval = hardlink_create(ctx, fs, l->ino, &inode, l->target, ctx->out_dir_fd,
+                                     l->path + 1);
+        if (retval)
+            return retval;
+    }
+    return 0;
+}
+
+static void hardlink_free(struct extract_ctx *ctx)
+{
+    size_t i;
+
+    for (i = 0; i < ctx->hardlink_count; i++)
+    {
+        free(ctx->hardlinks[i].target);
+        free(ctx->hardlinks[i].path);
+    }
+    ext2fs_free_mem(&ctx->hardlinks);
+    ctx->hardlink_count = ctx->hardlink_size = 0;
+    u64_map_free(&ctx->first_links, free);
+}
+#endif
+
+/*
+ * Patterns starting with "/" match the whole path from the image root,
+ * "*" stopping at slashes; other patterns match the entry name anywhere.
+ */
+static bool path_match(const char *pat, const char *path)
+{
+    if (pat[0] == '/')
+        return !fnmatch(pat, path, FNM_PATHNAME);
+    return !fnmatch(pat, strrchr(path, '/') + 1, 0);
+}
+
+/* Whether directory @path matches the leading components of @pat */
+static bool path_match_prefix(const char *pat, const char *path)
+{
+    char pat_comp[512], path_comp[EXT2_NAME_LEN + 1];
+
+    if (pat[0] != '/')
+        return true;
+
+    for (;;)
+    {
+        size_t pat_len, path_len;
+
+        while (*pat == '/')
+            pat++;
+        while (*path == '/')
+            path++;
+        if (!*path)
+            return *pat != '\0';
+        if (!*pat)
+            return false;
+
+        pat_len = strcspn(pat, "/");
+        path_len = strcspn(path, "/");
+        if (pat_len >= sizeof(pat_comp) || path_len >= sizeof(path_comp))
+            return true;
+
+        memcpy(pat_comp, pat, pat_len);
+        pat_comp[pat_len] = '\0';
+        memcpy(path_comp, path, path_len);
+        path_comp[path_len] = '\0';
+        if (fnmatch(pat_comp, path_comp, 0))
+            return false;
+
+        pat += pat_len;
+        path += path_len;
+    }
+}
+
+/*
+ * Excludes win over includes. Below an included directory everything is
+ * included; elsewhere directories are only walked while an include could
+ * still match something under them.
+ */
+static path_verdict_t path_filter(const char *path, bool included)
+{
+    size_t i;
+
+    for (i = 0; i < exclude_count; i++)
+    {
+        if (path_match(exclude_pats[i], path))
+            return PATH_SKIP;
+    }
+
+    if (included)
+        return PATH_INCLUDE;
+
+    for (i = 0; i < include_count; i++)
+    {
+        if (path_match(include_pats[i], path))
+            return PATH_INCLUDE;
+    }
+
+    for (i = 0; i < include_count; i++)
+    {
+        if (path_match_prefix(include_pats[i], path))
+            return PATH_DESCEND;
+    }
+    return PATH_SKIP;
+}
+
+/*
+ * --tar/--cpio: hands the entry to the archive in place of the output
+ * directory. Directories are still walked into by the caller.
+ */
+static errcode_t walk_archive(struct inode_params *params, ext2_ino_t ino,
+                              struct ext2_inode *inode)
+{
+    struct extract_ctx *ctx = params->ctx;
+    const char *path = params->path.buf;
+    __u64 start;
+    errcode_t retval;
+
+#ifndef SVB_MINGW
+    if (LINUX_S_ISREG(inode->i_mode) && inode->i_links_count > 1)
+    {
+        const char *first;
+
+        retval = hardlink_lookup(ctx, ino, path, &first);
+        if (retval)
+            return retval;
+
+        /* In block order the first name is only archived in phase two */
+        if (first && block_order)
+            return hardlink_defer(ctx, ino, first, path);
+        if (first)
+            return archive_hardlink(ino, inode, first, path);
+    }
+#endif
+
+    if (LINUX_S_ISREG(inode->i_mode) && block_order)
+        return manifest_add(ctx, params->fs, ino, inode, path);
+
+    start = stats_now();
+    retval = archive_add(ctx, params->fs, ino, inode, path, NULL, 0);
+    if (LINUX_S_ISREG(inode->i_mode))
+        stats_end(STAT_FILE, start, EXT2_I_SIZE(inode), path);
+    return retval;
+}
+
+/* Name of the current entry, as passed along with params->dirfd */
+static const char *walk_output_name(struct inode_params *params, size_t parent_len)
+{
+#ifdef SVB_MINGW
+    return path_join(&params->scratch, params->ctx->out_dir, params->path.buf);
+#else
+    return params->path.buf + parent_len + 1;
+#endif
+}
+
+int walk_dir(ext2_ino_t dir,
+             int flags EXT2FS_ATTR((unused)),
+             struct ext2_dir_entry *de,
+             int offset EXT2FS_ATTR((unused)),
+             int blocksize EXT2FS_ATTR((unused)),
+             char *buf EXT2FS_ATTR((unused)), void *priv_data)
+{
+    __u16 name_len;
+    const char *output_file = NULL;
+    struct ext2_inode inode;
+    struct inode_params *params = (struct inode_params *)priv_data;
+    struct extract_ctx *ctx = params->ctx;
+    struct path_arena *path = &params->path;
+    size_t parent_len = path->len;
+    path_verdict_t verdict = PATH_INCLUDE;
+    bool unchanged = false;
+    __u64 start;
+    errcode_t retval = 0;
+
+    name_len = de->name_len & 0xff;
+    if (!strncmp(de->name, ".", name_len) ||
+        !strncmp(de->name, "..", name_len))
+        return 0;
+
+    retval = path_push(path, de->name, name_len);
+    if (retval)
+        return retval;
+
+    if (include_count || exclude_count)
+    {
+        int type = ext2fs_dirent_file_type(de);
+
+        /* Pruned entries are never read, let alone their subtrees */
+        verdict = path_filter(path->buf, params->included);
+        if (verdict == PATH_SKIP ||
+            (verdict == PATH_DESCEND && type != EXT2_FT_UNKNOWN && type != EXT2_FT_DIR))
+            goto err;
+    }
+
+    start = stats_now();
+    retval = ino_read(params->fs, de->inode, &inode, sizeof(inode));
+    if (retval)
+    {
+        com_err(__func__, retval, "while reading inode %u", de->inode);
+        goto err;
+    }
+    stats_end(STAT_INODE_READ, start, sizeof(inode), NULL);
+
+    if (verdict == PATH_DESCEND && !LINUX_S_ISDIR(inode.i_mode))
+        goto err;
+
+    if (ctx->android_configure)
+    {
+        const char *config_path = path_join(&params->scratch, ctx->config_root, path->buf);
+        if (!config_path)
+        {
+            retval = EXT2_ET_NO_MEMORY;
+            goto err;
+        }
+
+        retval = ino_get_config(params, de->inode, inode, config_path);
+        if (retval)
+            goto err;
+    }
+
+    if (ctx->progress_bar)
+    {
+        pthread_mutex_lock(&ctx->progress_lock);
+        ext2fs_numeric_progress_update(ctx->fs, &ctx->progress,
+                                       de->inode - RESERVED_INODES_COUNT);
+        pthread_mutex_unlock(&ctx->progress_lock);
+    }
+
+    if (dir == EXT2_ROOT_INO &&
+        !strncmp(de->name, "lost+found", name_len))
+    {
+        goto err;
+    }
+
+    if (!quiet && verbose)
+    {
+        fprintf(stdout, "Extracting %s\n", path->buf + 1);
+    }
+
+    if (android_configure_only &&
+        (inode.i_mode & LINUX_S_IFMT) != LINUX_S_IFDIR)
+    {
+        /* Nothing is written, but --hash still reads regular files */
+        if (hash_algos && LINUX_S_ISREG(inode.i_mode))
+            retval = ino_digest(ctx, params->fs, de->inode, &inode, path->buf);
+        goto err;
+    }
+
+    if (archive_format)
+    {
+        retval = walk_archive(params, de->inode, &inode);
+        if (retval || !LINUX_S_ISDIR(inode.i_mode))
+            goto err;
+    }
+    else if (!android_configure_only)
+    {
+        output_file = walk_output_name(params, parent_len);
+        if (!output_file)
+        {
+            retval = EXT2_ET_NO_MEMORY;
+            goto err;
+        }
+
+        if (incremental_path)
+        {
+            retval = incr_check(params->fs, de->inode, &inode, path->buf, &unchanged);
+            if (retval)
+                goto err;
+        }
+    }
+
+    switch (inode.i_mode & LINUX_S_IFMT)
+    {
+    case LINUX_S_IFCHR:
+    case LINUX_S_IFBLK:
+    case LINUX_S_IFIFO:
+#if !defined(_WIN32) || defined(SVB_WIN32)
+#if defined(S_IFSOCK) && !defined(SVB_WIN32)
+    case LINUX_S_IFSOCK:
+#endif
+    case LINUX_S_IFLNK:
+        if (unchanged)
+            break;
+        start = stats_now();
+        retval = ino_extract_symlink(params->fs, de->inode, &inode, params->dirfd, output_file);
+        stats_end(STAT_SYMLINK, start, inode.i_size, path->buf);
+        if (retval)
+        {
+            goto err;
+        }
+        break;
+#endif
+    case LINUX_S_IFREG:
+#ifndef SVB_MINGW
+        if (inode.i_links_count > 1 && !android_configure_only)
+        {
+            const char *first;
+
+            retval = hardlink_lookup(ctx, de->inode, path->buf, &first);
+            if (retval)
+            {
+                goto err;
+            }
+
+            if (first)
+            {
+                if (hash_algos)
+                    retval = digest_link(&ctx->digests, path->buf, de->inode);
+                if (retval)
+                    goto err;
+                if (params->task || block_order)
+                    retval = hardlink_defer(ctx, de->inode, first, path->buf);
+                else
+                    retval = hardlink_create(ctx, params->fs, de->inode, &inode, first,
+                                             params->dirfd, output_file);
+                if (retval)
+                {
+                    goto err;
+                }
+                break;
+            }
+        }
+#endif
+        /* Left as the previous run wrote it, later names still link to it */
+        if (unchanged)
+        {
+            if (hash_algos)
+                retval = ino_digest(ctx, params->fs, de->inode, &inode, path->buf);
+            if (retval)
+                goto err;
+            break;
+        }
+        if (block_order)
+        {
+            retval = manifest_add(ctx, params->fs, de->inode, &inode, path->buf);
+        }
+        else
+        {
+            start = stats_now();
+            retval = ino_extract_file(ctx, params->fs, de->inode, &inode, params->dirfd,
+                                      output_file, NULL, 0, path->buf);
+            stats_end(STAT_FILE, start, EXT2_I_SIZE(&inode), path->buf);
+        }
+        if (retval)
+        {
+            goto err;
+        }
+        break;
+    case LINUX_S_IFDIR:;
+        int parent_fd = params->dirfd, child_fd = -1;
+        bool parent_included = params->included;
+        errcode_t flush_retval;
+
+        if (output_file)
+        {
+            /* With -p the real mode is applied once the subtree exists */
+            start = stats_now();
+#ifndef SVB_MINGW
+            retval = out_mkdir_open(parent_fd, output_file,
+                                    preserve ? S_IRWXU : inode.i_mode & FILE_MODE_MASK,
+                                    params->task ? NULL : &child_fd);
+#else
+            retval = out_mkdir_open(parent_fd, output_file, inode.i_mode & FILE_MODE_MASK, NULL);
+#endif
+            stats_end(STAT_MKDIR, start, 0, path->buf);
+            if (retval)
+                goto err;
+        }
+        params->included = verdict == PATH_INCLUDE;
+        if (params->task)
+            retval = walk_task_spawn(params, de->inode);
+        else
+        {
+            params->dirfd = child_fd;
+            dir_readahead(params->fs, de->inode, &inode);
+            retval = ext2fs_dir_iterate2(params->fs, de->inode, 0, NULL,
+                                         walk_dir, params);
+            params->dirfd = parent_fd;
+
+            /* Queued entries may still refer to child_fd */
+            flush_retval = out_flush();
+            if (!retval)
+                retval = flush_retval;
+        }
+        params->included = parent_included;
+
+#ifndef SVB_MINGW
+        if (!retval && preserve && !android_configure_only)
+        {
+            if (child_fd >= 0 && !block_order)
+                ino_restore_metadata(child_fd, -1, path->buf, &inode);
+            else
+                retval = dir_fixup_add(ctx, path->buf, &inode);
+        }
+#endif
+        if (child_fd >= 0)
+            close(child_fd);
+        if (retval)
+        {
+            goto err;
+        }
+
+        /* The subtree reused the arenas */
+        if (output_file)
+            output_file = walk_output_name(params, parent_len);
+        break;
+    default:
+        E2FSTOOL_ERROR("warning: unknown entry \"%s\" (%x)", path->buf, inode.i_mode & LINUX_S_IFMT);
+    }
+
+#ifdef SVB_MINGW
+    /* Deferred files are stamped once phase two wrote them */
+    if (output_file &&
+        !(block_order && LINUX_S_ISREG(inode.i_mode)))
+    {
+        retval = set_path_timestamp(output_file, inode.i_atime, inode.i_mtime, inode.i_ctime);
+        if (retval)
+        {
+            E2FSTOOL_ERROR("while configuring timestamps for %s", output_file);
+        }
+    }
+#endif
+
+err:
+    path_pop(path, parent_len);
+    return retval;
+}
+
+#ifndef SVB_MINGW
+/* Pool workers are told apart by their index, passed as worker data */
+static inline unsigned int worker_index(void *worker_data)
+{
+    return (uintptr_t)worker_data;
+}
+
+static void walk_task_run(struct workpool_task *work, void *worker_data)
+{
+    struct walk_task *task = (struct walk_task *)work;
+    struct extract_ctx *ctx = task->ctx;
+    struct inode_params params = {
+        .ctx = ctx,
+        .fs = ctx->handles[worker_index(worker_data)],
+        .dirfd = -1,
+        .task = task,
+        .included = task->included,
+    };
+    errcode_t expected = 0, retval, flush_retval;
+
+    if (atomic_load(&ctx->walk_error))
+        return;
+
+    retval = path_set(&params.path, task->path);
+    if (!retval && !android_configure_only)
+    {
+        /* One lookup per directory, its entries are created relative to it */
+        params.dirfd = openat(ctx->out_dir_fd, task->path[0] ? task->path + 1 : ".",
+                              O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (params.dirfd < 0)
+        {
+            E2FSTOOL_ERROR("while opening %s", task->path);
+            retval = -1;
+        }
+    }
+    if (!retval)
+        retval = walk_seg_open(&params);
+    if (!retval && readahead_threads)
+    {
+        struct ext2_inode inode;
+
+        if (!ino_read(params.fs, task->ino, &inode, sizeof(inode)))
+            dir_readahead(params.fs, task->ino, &inode);
+    }
+    if (!retval)
+        retval = ext2fs_dir_iterate2(params.fs, task->ino, 0, NULL,
+                                     walk_dir, &params);
+    flush_retval = out_flush();
+    if (!retval)
+        retval = flush_retval;
+    walk_seg_close(&params);
+    if (params.dirfd >= 0)
+        close(params.dirfd);
+    path_free(&params.path);
+    path_free(&params.scratch);
+
+    if (retval)
+        atomic_compare_exchange_strong(&ctx->walk_error, &expected, retval);
+}
+
+static void walk_task_flush(struct walk_task *task, FILE *fs_config, FILE *se_contexts)
+{
+    struct walk_seg *seg, *next;
+
+    for (seg = task->segs; seg; seg = next)
+    {
+        next = seg->next;
+
+        if (fs_config && seg->fs_len)
+            fwrite(seg->fs_buf, 1, seg->fs_len, fs_config);
+        if (se_contexts && seg->se_len)
+            fwrite(seg->se_buf, 1, seg->se_len, se_contexts);
+        free(seg->fs_buf);
+        free(seg->se_buf);
+
+        if (seg->child)
+            walk_task_flush(seg->child, fs_config, se_contexts);
+        free(seg);
+    }
+
+    free(task->path);
+    free(task);
+}
+
+/* A worker's share of the block ordered phase of one image */
+struct drain_task {
+    struct workpool_task work;
+    struct extract_ctx *ctx;
+};
+
+static void walk_fail(struct extract_ctx *ctx, errcode_t retval)
+{
+    errcode_t expected = 0;
+
+    if (retval)
+        atomic_compare_exchange_strong(&ctx->walk_error, &expected, retval);
+}
+
+static void manifest_drain_task(struct workpool_task *work, void *worker_data)
+{
+    struct extract_ctx *ctx = ((struct drain_task *)work)->ctx;
+
+    walk_fail(ctx, manifest_drain(ctx, ctx->handles[worker_index(worker_data)]));
+}
+
+/*
+ * Queues the walk of @ctx on its pool. libext2fs handles are not
+ * thread-safe, so every worker gets its own read-only handle on the
+ * image. walk_collect() has to follow whatever this returns.
+ */
+static errcode_t walk_submit(struct extract_ctx *ctx)
+{
+    unsigned int i;
+    errcode_t retval;
+
+    retval = ext2fs_get_arrayzero(jobs, sizeof(*ctx->handles), &ctx->handles);
+    if (retval)
+    {
+        com_err(__func__, retval, "while allocating memory");
+        return retval;
+    }
+
+    for (i = 0; i < jobs; i++)
+    {
+        retval = e2fstool_open_handle(ctx->image, &ctx->handles[i]);
+        if (retval)
+        {
+            com_err(__func__, retval, "while opening worker handle %u", i);
+            return retval;
+        }
+    }
+
+    retval = walk_task_new(ctx, &ctx->root, EXT2_ROOT_INO, "", !include_count);
+    if (retval)
+        return retval;
+
+    retval = workpool_submit(ctx->pool, &ctx->root->work);
+    if (retval)
+    {
+        E2FSTOOL_ERROR("while queueing root directory");
+        return EXT2_ET_NO_MEMORY;
+    }
+    return 0;
+}
+
+/* Queues the block ordered phase of @ctx once its walk is done */
+static errcode_t walk_submit_drain(struct extract_ctx *ctx)
+{
+    unsigned int i;
+    errcode_t retval;
+
+    retval = ext2fs_get_arrayzero(jobs, sizeof(*ctx->drain_tasks), &ctx->drain_tasks);
+    if (retval)
+    {
+        com_err(__func__, retval, "while allocating memory");
+        return retval;
+    }
+
+    manifest_sort(ctx);
+    for (i = 0; i < jobs; i++)
+    {
+        ctx->drain_tasks[i].work.run = manifest_drain_task;
+        ctx->drain_tasks[i].ctx = ctx;
+        if (workpool_submit(ctx->pool, &ctx->drain_tasks[i].work))
+        {
+            E2FSTOOL_ERROR("while queueing extraction");
+            return EXT2_ET_NO_MEMORY;
+        }
+    }
+    return 0;
+}
+
+/* Writes the configs of @ctx in tree order and drops its worker handles */
+static void walk_collect(struct extract_ctx *ctx)
+{
+    unsigned int i;
+
+    if (ctx->root)
+        walk_task_flush(ctx->root, ctx->filesystem, ctx->contexts);
+    ctx->root = NULL;
+    for (i = 0; ctx->handles && i < jobs; i++)
+    {
+        if (ctx->handles[i])
+            ext2fs_close_free(&ctx->handles[i]);
+    }
+    ext2fs_free_mem(&ctx->handles);
+    ext2fs_free_mem(&ctx->drain_tasks);
+}
+
+/* Starts the -j workers every image of the run is walked on */
+static errcode_t pool_start(struct workpool **ret)
+{
+    void **worker_data;
+    unsigned int i;
+    errcode_t retval;
+
+    retval = ext2fs_get_array(jobs, sizeof(*worker_data), &worker_data);
+    if (retval)
+    {
+        com_err(__func__, retval, "while allocating memory");
+        return retval;
+    }
+    for (i = 0; i < jobs; i++)
+        worker_data[i] = (void *)(uintptr_t)i;
+
+    retval = workpool_create(ret, jobs, worker_data);
+    if (retval)
+    {
+        com_err(__func__, 0, "while starting %u workers: %s", jobs, strerror(retval));
+        *ret = NULL;
+    }
+    ext2fs_free_mem(&worker_data);
+    return retval;
+}
+
+/*
+ * Walks the images of @ctxs side by side on @pool, errors end up in
+ * their walk_error. Every walk is queued before the first block ordered
+ * phase, so workers done with one image help with the others instead of
+ * waiting. Tasks from outside the pool start in the order they came, the
+ * largest image goes first.
+ */
+static void walk_parallel(struct workpool *pool, struct extract_ctx **ctxs, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        walk_fail(ctxs[i], walk_submit(ctxs[i]));
+    workpool_wait(pool);
+
+    for (i = 0; block_order && i < count; i++)
+    {
+        if (!atomic_load(&ctxs[i]->walk_error))
+            walk_fail(ctxs[i], walk_submit_drain(ctxs[i]));
+    }
+    workpool_wait(pool);
+
+    for (i = 0; i < count; i++)
+        walk_collect(ctxs[i]);
+}
+#endif
+
+static void walk_close_configs(struct extract_ctx *ctx)
+{
+    if (ctx->contexts)
+        fclose(ctx->contexts);
+    if (ctx->filesystem)
+        fclose(ctx->filesystem);
+    ctx->contexts = ctx->filesystem = NULL;
+}
+
+/*
+ * Reads the root of @ctx and creates its output directory and configs.
+ * Once this succeeds walk_close() has to follow, whatever the walk did.
+ */
+static errcode_t walk_open(struct extract_ctx *ctx)
+{
+    ext2_filsys fs = ctx->fs;
+    struct ext2_inode *inode = &ctx->root_inode;
+    struct inode_params params = {
+        .ctx = ctx,
+        .fs = fs,
+        .dirfd = -1,
+        .included = !include_count,
+    };
+    char *path;
+    errcode_t retval;
+
+    retval = ino_read(fs, EXT2_ROOT_INO, inode, sizeof(*inode));
+    if (retval)
+    {
+        com_err(__func__, retval, "while reading root inode");
+        return retval;
+    }
+
+    if (!android_configure_only && !archive_format)
+    {
+        retval = mkdir(ctx->out_dir, preserve ? S_IRWXU : inode->i_mode);
+        if (retval == -1 && errno != EEXIST)
+        {
+            E2FSTOOL_ERROR("while creating %s", ctx->out_dir);
+            return retval;
+        }
+    }
+
+    if (ctx->android_configure)
+    {
+        if (ctx->mountpoint)
+            ;
+        else if (fs->super->s_last_mounted[0])
+            ctx->mountpoint = strdup((char *)fs->super->s_last_mounted);
+        else if (fs->super->s_volume_name[0]) {
+            if (asprintf(&ctx->mountpoint, "/%s", (char *)fs->super->s_volume_name) < 0)
+            {
+                E2FSTOOL_ERROR("while allocating memory");
+                return EXT2_ET_NO_MEMORY;
+            }
+        }
+        else
+            ctx->mountpoint = strdup(ctx->out_dir);
+        if (!ctx->mountpoint)
+        {
+            E2FSTOOL_ERROR("while allocating memory");
+            return EXT2_ET_NO_MEMORY;
+        }
+
+        ctx->config_root = ctx->mountpoint + 1;
+        ctx->system_as_root = !ctx->config_root[0];
+
+        retval = mkdir(ctx->conf_dir, S_IRWXU | S_IRWXG | S_IRWXO);
+        if (retval == -1 && errno != EEXIST)
+        {
+            E2FSTOOL_ERROR("while creating %s", ctx->conf_dir);
+            return retval;
+        }
+
+        if (asprintf(&path, "%s/selinux_contexts.fs", ctx->conf_dir) < 0) {
+            E2FSTOOL_ERROR("while allocating memory");
+            return EXT2_ET_NO_MEMORY;
+        }
+        ctx->contexts = fopen(path, "w");
+        free(path);
+        if (!ctx->contexts)
+            return -1;
+
+        if (asprintf(&path, "%s/filesystem_config.fs", ctx->conf_dir) < 0) {
+            E2FSTOOL_ERROR("while allocating memory");
+            walk_close_configs(ctx);
+            return EXT2_ET_NO_MEMORY;
+        }
+        ctx->filesystem = fopen(path, "w");
+        free(path);
+        if (!ctx->filesystem)
+        {
+            walk_close_configs(ctx);
+            return -1;
+        }
+
+        params.filesystem = ctx->filesystem;
+        params.contexts = ctx->contexts;
+        retval = ino_get_config(&params, EXT2_ROOT_INO, *inode, ctx->config_root);
+        if (retval)
+        {
+            walk_close_configs(ctx);
+            return retval;
+        }
+    }
+
+    if (ctx->progress_bar)
+        ext2fs_numeric_progress_init(fs, &ctx->progress,
+                                     "Extracting filesystem inodes: ",
+                                     fs->super->s_inodes_count - fs->super->s_free_inodes_count - RESERVED_INODES_COUNT);
+
+#ifndef SVB_MINGW
+    if (!android_configure_only && !archive_format)
+    {
+        ctx->out_dir_fd = open(ctx->out_dir, O_RDONLY | O_DIRECTORY);
+        if (ctx->out_dir_fd < 0)
+        {
+            E2FSTOOL_ERROR("while opening %s", ctx->out_dir);
+            walk_close_configs(ctx);
+            return -1;
+        }
     }
+#endif
+    return 0;
+}
 
-    if (dir == EXT2_ROOT_INO &&
-        !strncmp(de->name, "lost+found", name_len))
+/* Walks @ctx from this thread alone, archives always go this way */
+static errcode_t walk_serial(struct extract_ctx *ctx)
+{
+    ext2_filsys fs = ctx->fs;
+    struct inode_params params = {
+        .ctx = ctx,
+        .fs = fs,
+        .dirfd = ctx->out_dir_fd,
+        .included = !include_count,
+        .filesystem = ctx->filesystem,
+        .contexts = ctx->contexts,
+    };
+    errcode_t retval, flush_retval;
+
+    retval = path_set(&params.path, "");
+    if (retval)
+        return retval;
+
+    if (archive_format)
+        retval = archive_add(ctx, fs, EXT2_ROOT_INO, &ctx->root_inode, "", NULL, 0);
+    dir_readahead(fs, EXT2_ROOT_INO, &ctx->root_inode);
+    if (!retval)
+        retval = ext2fs_dir_iterate2(fs, EXT2_ROOT_INO, 0, NULL, walk_dir, &params);
+    flush_retval = out_flush();
+    if (!retval)
+        retval = flush_retval;
+    if (!retval && block_order)
     {
-        goto err;
+        manifest_sort(ctx);
+        retval = manifest_drain(ctx, fs);
     }
 
-    if (!quiet && verbose)
+    path_free(&params.path);
+    path_free(&params.scratch);
+    return retval;
+}
+
+/* Finishes after the walk of @ctx: links, directory metadata, digests and configs */
+static errcode_t walk_close(struct extract_ctx *ctx, errcode_t retval)
+{
+    manifest_free(ctx);
+
+#ifndef SVB_MINGW
+    if (!retval)
+        retval = hardlink_apply(ctx);
+    hardlink_free(ctx);
+
+    if (!retval && preserve && ctx->out_dir_fd >= 0)
     {
-        fprintf(stdout, "Extracting %s\n", params->filename + 1);
+        dir_fixup_apply(ctx);
+        ino_restore_metadata(ctx->out_dir_fd, -1, ctx->out_dir, &ctx->root_inode);
     }
+    dir_fixup_free(ctx);
+    if (ctx->out_dir_fd >= 0)
+        close(ctx->out_dir_fd);
+    ctx->out_dir_fd = -1;
+#endif
 
-    if (android_configure_only &&
-        (inode.i_mode & LINUX_S_IFMT) != LINUX_S_IFDIR)
+    if (!retval && hash_algos)
     {
-        goto err;
+        char *digest_path;
+
+        if (asprintf(&digest_path, "%s/file_digests.txt", ctx->conf_dir) < 0)
+        {
+            E2FSTOOL_ERROR("while allocating memory");
+            retval = EXT2_ET_NO_MEMORY;
+        }
+        else
+        {
+            retval = digest_write(&ctx->digests, digest_path, ctx->config_root);
+            free(digest_path);
+        }
     }
 
-    switch (inode.i_mode & LINUX_S_IFMT)
+#ifdef SVB_MINGW
+    if (!retval && !android_configure_only && !archive_format)
+    {
+        retval = set_path_timestamp(ctx->out_dir, ctx->root_inode.i_atime,
+                                    ctx->root_inode.i_mtime, ctx->root_inode.i_ctime);
+        if (retval)
+        {
+            E2FSTOOL_ERROR("while configuring timestamps for %s", ctx->out_dir);
+        }
+    }
+#endif
+
+    if (!retval && ctx->progress_bar)
+        ext2fs_numeric_progress_close(ctx->fs, &ctx->progress, "done\n");
+    walk_close_configs(ctx);
+    return retval;
+}
+
+static errcode_t walk_fs(struct extract_ctx *ctx)
+{
+    errcode_t retval;
+
+    retval = walk_open(ctx);
+    if (retval)
+        return retval;
+
+#ifndef SVB_MINGW
+    if (ctx->pool)
+    {
+        walk_parallel(ctx->pool, &ctx, 1);
+        retval = atomic_load(&ctx->walk_error);
+    }
+    else
+#endif
+        retval = walk_serial(ctx);
+    return walk_close(ctx, retval);
+}
+
+typedef enum command {
+    CMD_EXTRACT,
+    CMD_CAT,
+    CMD_STAT,
+    CMD_GETFATTR,
+    CMD_LIST,
+    CMD_BATCH,
+} command_t;
+
+static const char *command_names[] = {
+    [CMD_CAT] = "cat",
+    [CMD_STAT] = "stat",
+    [CMD_GETFATTR] = "getfattr",
+    [CMD_LIST] = "list",
+    [CMD_BATCH] = "batch",
+};
+
+static const char *ino_type_str(__u16 mode)
+{
+    switch (mode & LINUX_S_IFMT)
     {
+    case LINUX_S_IFREG:
+        return "regular file";
+    case LINUX_S_IFDIR:
+        return "directory";
+    case LINUX_S_IFLNK:
+        return "symbolic link";
     case LINUX_S_IFCHR:
+        return "character device";
     case LINUX_S_IFBLK:
+        return "block device";
     case LINUX_S_IFIFO:
-#if !defined(_WIN32) || defined(SVB_WIN32)
-#if defined(S_IFSOCK) && !defined(SVB_WIN32)
+        return "fifo";
     case LINUX_S_IFSOCK:
-#endif
-    case LINUX_S_IFLNK:
-        retval = ino_extract_symlink(fs, de->inode, &inode, output_file);
-        if (retval)
+        return "socket";
+    default:
+        return "unknown";
+    }
+}
+
+/* What a single path command keeps across its walk */
+struct command_walk {
+    ext2_filsys fs;
+    errcode_t retval;
+};
+
+static e2fstool_action_t cat_entry(void *data, const struct e2fstool_entry *e)
+{
+    struct command_walk *cw = data;
+    __u16 mode = e->inode->i_mode;
+
+    if (LINUX_S_ISREG(mode))
+        return E2FSTOOL_CONTINUE;
+
+    fprintf(stderr, "%s: %s is a %s\n", prog_name, e->path, ino_type_str(mode));
+    cw->retval = -1;
+    return E2FSTOOL_STOP;
+}
+
+/* Holes come as chunks without a buffer and are written as zeroes */
+static e2fstool_action_t cat_data(void *data, const struct e2fstool_entry *e,
+                                  __u64 off EXT2FS_ATTR((unused)), const void *buf, size_t len)
+{
+    static const char zeroes[4096];
+    struct command_walk *cw = data;
+    size_t n;
+
+    while (len)
+    {
+        n = buf || len < sizeof(zeroes) ? len : sizeof(zeroes);
+        if (fwrite(buf ? buf : zeroes, 1, n, stdout) != n)
         {
-            goto err;
+            cw->retval = errno;
+            com_err(prog_name, cw->retval, "while writing %s", e->path);
+            return E2FSTOOL_STOP;
         }
-        break;
-#endif
-    case LINUX_S_IFREG:
-        retval = ino_extract_regular(fs, de->inode, output_file);
-        if (retval)
+        len -= n;
+    }
+    return E2FSTOOL_CONTINUE;
+}
+
+static void print_time(const char *key, __u32 t)
+{
+    time_t tt = t;
+    char buf[64];
+
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", gmtime(&tt));
+    printf("%s: %s (%u)\n", key, buf, t);
+}
+
+static e2fstool_action_t stat_entry(void *data, const struct e2fstool_entry *e)
+{
+    struct command_walk *cw = data;
+    struct ext2_inode *inode = (struct ext2_inode *)e->inode;
+
+    printf("path: %s\n", e->path);
+    printf("inode: %u\n", e->ino);
+    printf("type: %s\n", ino_type_str(inode->i_mode));
+    printf("mode: %04o\n", inode->i_mode & FILE_MODE_MASK);
+    printf("uid: %u\n", inode_uid(*inode));
+    printf("gid: %u\n", inode_gid(*inode));
+    printf("size: %llu\n", (unsigned long long)EXT2_I_SIZE(inode));
+    printf("links: %u\n", inode->i_links_count);
+    printf("blocks: %llu\n", (unsigned long long)ext2fs_get_stat_i_blocks(cw->fs, inode));
+    printf("flags: 0x%08x\n", inode->i_flags);
+    print_time("atime", inode->i_atime);
+    print_time("mtime", inode->i_mtime);
+    print_time("ctime", inode->i_ctime);
+    if (e->link_target)
+        printf("target: %s\n", e->link_target);
+    return E2FSTOOL_SKIP;
+}
+
+/* Only the entry asked for, what is below a directory is left alone */
+static e2fstool_action_t getfattr_entry(void *data EXT2FS_ATTR((unused)),
+                                        const struct e2fstool_entry *e)
+{
+    if (e->depth)
+        return E2FSTOOL_STOP;
+
+    printf("# file: %s\n", e->path[0] == '/' ? e->path + 1 : e->path);
+    return E2FSTOOL_CONTINUE;
+}
+
+/* Prints one xattr as getfattr -d does, binary values in hex */
+static e2fstool_action_t getfattr_xattr(void *data EXT2FS_ATTR((unused)),
+                                        const struct e2fstool_entry *e EXT2FS_ATTR((unused)),
+                                        const char *name, const void *value, size_t value_len)
+{
+    const char *v = value;
+    size_t i, len = value_len;
+
+    while (len && !v[len - 1])
+        len--;
+    for (i = 0; i < len; i++)
+    {
+        if (v[i] < 0x20 || v[i] == 0x7f || v[i] == '"' || v[i] == '\\')
+            break;
+    }
+
+    if (i == len && len)
+    {
+        printf("%s=\"%.*s\"\n", name, (int)len, v);
+    }
+    else
+    {
+        printf("%s=0x", name);
+        for (i = 0; i < value_len; i++)
+            printf("%02x", (unsigned char)v[i]);
+        putchar('\n');
+    }
+    return E2FSTOOL_CONTINUE;
+}
+
+static const struct e2fstool_visitor command_visitors[] = {
+    [CMD_CAT] = {.entry = cat_entry, .data = cat_data},
+    [CMD_STAT] = {.entry = stat_entry},
+    [CMD_GETFATTR] = {.entry = getfattr_entry, .xattr = getfattr_xattr},
+};
+
+/* Single file access: a walk of @path alone, looked up with the directory index */
+static errcode_t run_command(struct e2fstool_image *image, command_t cmd, const char *path)
+{
+    struct command_walk cw = {.fs = e2fstool_fs(image)};
+    errcode_t retval;
+
+    retval = e2fstool_walk_path(image, path, cmd == CMD_CAT, &command_visitors[cmd], &cw);
+    retval = retval ?: cw.retval;
+    if (!retval && cmd == CMD_GETFATTR)
+        putchar('\n');
+    if (fflush(stdout) && !retval)
+        retval = errno;
+    return retval;
+}
+
+/* Appends @pat to a --include/--exclude list, trailing slashes dropped */
+static void add_pattern(const char ***pats, size_t *count, char *pat)
+{
+    size_t len = strlen(pat);
+
+    while (len > 1 && pat[len - 1] == '/')
+        pat[--len] = '\0';
+
+    *pats = realloc(*pats, (*count + 1) * sizeof(**pats));
+    if (!*pats)
+    {
+        E2FSTOOL_ERROR("while allocating memory");
+        exit(EXIT_FAILURE);
+    }
+    (*pats)[(*count)++] = pat;
+}
+
+enum {
+    OPT_ZERO_COPY = 0x100,
+    OPT_LIBSPARSE,
+    OPT_BLOCK_ORDER,
+    OPT_STATS,
+    OPT_TRACE,
+    OPT_INCLUDE,
+    OPT_EXCLUDE,
+    OPT_JSON,
+    OPT_INODE_CACHE,
+    OPT_READAHEAD,
+    OPT_OUTPUT_THREADS,
+    OPT_TAR,
+    OPT_CPIO,
+    OPT_ZCACHE,
+    OPT_INCREMENTAL,
+    OPT_HASH,
+    OPT_DEDUP_CACHE,
+    OPT_MAX_MEMORY,
+};
+
+static const struct option long_options[] = {
+    {"sparse", no_argument, NULL, 'S'},
+    {"detect-zeroes", no_argument, NULL, 'z'},
+    {"zero-copy", no_argument, NULL, OPT_ZERO_COPY},
+    {"libsparse", no_argument, NULL, OPT_LIBSPARSE},
+    {"block-order", no_argument, NULL, OPT_BLOCK_ORDER},
+    {"preserve", no_argument, NULL, 'p'},
+    {"stats", required_argument, NULL, OPT_STATS},
+    {"trace", required_argument, NULL, OPT_TRACE},
+    {"include", required_argument, NULL, OPT_INCLUDE},
+    {"exclude", required_argument, NULL, OPT_EXCLUDE},
+    {"json", no_argument, NULL, OPT_JSON},
+    {"inode-cache", required_argument, NULL, OPT_INODE_CACHE},
+    {"readahead", required_argument, NULL, OPT_READAHEAD},
+    {"output-threads", required_argument, NULL, OPT_OUTPUT_THREADS},
+    {"tar", required_argument, NULL, OPT_TAR},
+    {"cpio", required_argument, NULL, OPT_CPIO},
+    {"zcache", required_argument, NULL, OPT_ZCACHE},
+    {"incremental", required_argument, NULL, OPT_INCREMENTAL},
+    {"hash", required_argument, NULL, OPT_HASH},
+    {"dedup-cache", required_argument, NULL, OPT_DEDUP_CACHE},
+    {"max-memory", required_argument, NULL, OPT_MAX_MEMORY},
+    {NULL, 0, NULL, 0},
+};
+
+/* Image of a batch list with where it goes */
+struct batch_image {
+    char *image;
+    char *out_dir;
+    char *conf_dir; /* NULL for no configs */
+    char *mountpoint; /* NULL to take it from the image */
+};
+
+static void batch_free(struct batch_image *list, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        free(list[i].image);
+        free(list[i].out_dir);
+        free(list[i].conf_dir);
+        free(list[i].mountpoint);
+    }
+    ext2fs_free_mem(&list);
+}
+
+/*
+ * Reads a batch list, one image per line followed by its output
+ * directory and optionally a config directory and a mountpoint, separated
+ * by whitespace. Empty lines and lines starting with '#' are skipped.
+ */
+static errcode_t batch_read(const char *path, struct batch_image **ret, size_t *ret_count)
+{
+    struct batch_image *list = NULL, *b;
+    size_t count = 0, size = 0, line_size = 0, lineno = 0;
+    char *line = NULL, *fields[4], *p;
+    unsigned int n;
+    FILE *f;
+    errcode_t retval = 0;
+
+    f = fopen(path, "r");
+    if (!f)
+    {
+        retval = errno;
+        E2FSTOOL_ERROR("while opening %s", path);
+        return retval;
+    }
+
+    while (getline(&line, &line_size, f) > 0)
+    {
+        lineno++;
+        for (n = 0, p = strtok(line, " \t\r\n"); p && n < 4; p = strtok(NULL, " \t\r\n"))
+            fields[n++] = p;
+        if (!n || fields[0][0] == '#')
+            continue;
+
+        if (n < 2 || p)
         {
-            goto err;
+            fprintf(stderr, "%s:%zu: expected image, directory, "
+                            "[config directory [mountpoint]]\n", path, lineno);
+            retval = EXT2_ET_INVALID_ARGUMENT;
+            break;
+        }
+        if (n == 4 && fields[3][0] != '/')
+        {
+            fprintf(stderr, "%s:%zu: invalid mountpoint %s\n", path, lineno, fields[3]);
+            retval = EXT2_ET_INVALID_ARGUMENT;
+            break;
+        }
+        /* The digests are written next to the configs */
+        if (hash_algos && n < 3)
+        {
+            fprintf(stderr, "%s:%zu: --hash needs a config directory\n", path, lineno);
+            retval = EXT2_ET_INVALID_ARGUMENT;
+            break;
         }
-        break;
-    case LINUX_S_IFDIR:;
-        char *cur_path = params->path;
-        char *cur_filename = params->filename;
-        params->path = params->filename;
 
-        if (!android_configure_only)
+        if (count == size)
         {
-            retval = mkdir(output_file, inode.i_mode & FILE_MODE_MASK);
-            if (retval == -1 && errno != EEXIST)
+            size_t new_size = size ? size * 2 : 8;
+
+            retval = ext2fs_resize_array(sizeof(*list), size, new_size, &list);
+            if (retval)
             {
-                E2FSTOOL_ERROR("while creating %s", output_file);
-                goto err;
+                com_err(__func__, retval, "while allocating memory");
+                break;
             }
+            size = new_size;
+        }
+
+        b = &list[count++];
+        memset(b, 0, sizeof(*b));
+        b->image = strdup(fields[0]);
+        b->out_dir = strdup(fields[1]);
+        b->conf_dir = n > 2 ? strdup(fields[2]) : NULL;
+        b->mountpoint = n > 3 ? strdup(fields[3]) : NULL;
+        if (!b->image || !b->out_dir || (n > 2 && !b->conf_dir) || (n > 3 && !b->mountpoint))
+        {
+            E2FSTOOL_ERROR("while allocating memory");
+            retval = EXT2_ET_NO_MEMORY;
+            break;
         }
-        retval = ext2fs_dir_iterate2(fs, de->inode, 0, NULL,
-                                     walk_dir, params);
+    }
+    free(line);
+    fclose(f);
+
+    if (!retval && !count)
+    {
+        fprintf(stderr, "%s: no images listed\n", path);
+        retval = EXT2_ET_INVALID_ARGUMENT;
+    }
+    if (retval)
+    {
+        batch_free(list, count);
+        return retval;
+    }
+
+    *ret = list;
+    *ret_count = count;
+    return 0;
+}
+
+static void extract_ctx_init(struct extract_ctx *ctx)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->raw_fd = -1;
+    ctx->out_dir_fd = -1;
+    pthread_mutex_init(&ctx->progress_lock, NULL);
+    pthread_mutex_init(&ctx->manifest_lock, NULL);
+    pthread_mutex_init(&ctx->dir_fixup_lock, NULL);
+    pthread_mutex_init(&ctx->hardlink_lock, NULL);
+    xattr_cache_init(&ctx->xattrs);
+    digest_list_init(&ctx->digests);
+}
+
+/* Frees what @ctx owns, close_image() has to be done with it first */
+static void extract_ctx_free(struct extract_ctx *ctx)
+{
+    free(ctx->in_file);
+    free(ctx->out_dir);
+    free(ctx->conf_dir);
+    free(ctx->mountpoint);
+    pthread_mutex_destroy(&ctx->progress_lock);
+    pthread_mutex_destroy(&ctx->manifest_lock);
+    pthread_mutex_destroy(&ctx->dir_fixup_lock);
+    pthread_mutex_destroy(&ctx->hardlink_lock);
+    xattr_cache_free(&ctx->xattrs);
+    digest_list_free(&ctx->digests);
+}
+
+/*
+ * Probes and opens @ctx->in_file into its image and fs, @opts->type is
+ * E2FSTOOL_UNKNOWN unless -s or -e forced it. Zero-copy gets a
+ * descriptor of its own.
+ */
+static errcode_t open_image(struct extract_ctx *ctx, const struct e2fstool_open_opts *opts)
+{
+    struct e2fstool_open_opts image_opts = *opts;
+    const char *in_file = ctx->in_file;
+    errcode_t retval;
+
+    ctx->image_type = opts->type;
+    if (ctx->image_type == E2FSTOOL_UNKNOWN)
+    {
+        retval = e2fstool_probe(in_file, &ctx->image_type, &ctx->image_compression);
         if (retval)
         {
-            goto err;
+            fprintf(stderr, "Unknown image type %s\n", in_file);
+            return retval;
         }
-        params->path = cur_path;
-        params->filename = cur_filename;
-        break;
-    default:
-        E2FSTOOL_ERROR("warning: unknown entry \"%s\" (%x)", params->filename, inode.i_mode & LINUX_S_IFMT);
     }
+    else
+    {
+        ctx->image_compression = compress_detect(in_file);
+    }
+
+    if (!quiet)
+    {
+        if (ctx->image_compression != E2FSTOOL_COMPRESS_NONE)
+            printf("Opening %s compressed %s image file",
+                   compress_type_str(ctx->image_compression),
+                   e2fstool_image_type_str(ctx->image_type));
+        else
+            printf("Opening %s image file", e2fstool_image_type_str(ctx->image_type));
+        if (blocksize)
+            printf(" with blocksize of %u", blocksize);
+        printf(": ");
+    }
+
+    if (zero_copy && !android_configure_only)
+    {
+#ifdef __linux__
+        if (ctx->image_type != E2FSTOOL_RAW ||
+            ctx->image_compression != E2FSTOOL_COMPRESS_NONE)
+            fprintf(stderr, "Warning: --zero-copy needs an uncompressed RAW image, "
+                            "using buffered reads.\n");
+        else if (detect_zeroes)
+            fprintf(stderr, "Warning: --zero-copy is ignored with -z, "
+                            "zero detection needs the data.\n");
+        else if (hash_algos)
+            fprintf(stderr, "Warning: --zero-copy is ignored with --hash, "
+                            "hashing needs the data.\n");
+        else if ((ctx->raw_fd = open(in_file, O_RDONLY | O_BINARY)) < 0)
+            E2FSTOOL_ERROR("while opening %s for zero-copy, using buffered reads", in_file);
+#else
+        fprintf(stderr, "Warning: --zero-copy is not supported on this "
+                        "platform.\n");
+#endif
+    }
+
+    if (ctx->image_compression != E2FSTOOL_COMPRESS_NONE && ctx->image_type != E2FSTOOL_RAW &&
+        use_libsparse)
+        fprintf(stderr, "Warning: --libsparse can't read compressed images, "
+                        "using the built-in reader.\n");
+
+    image_opts.type = ctx->image_type;
+    image_opts.use_libsparse = use_libsparse;
+    retval = e2fstool_open(in_file, &image_opts, &ctx->image);
+    if (retval)
+    {
+        puts("\n");
+        com_err(prog_name, retval, "while opening file %s", in_file);
+        return retval;
+    }
+    ctx->fs = e2fstool_fs(ctx->image);
+
+    if (!quiet)
+    {
+        puts("done");
+    }
+    return 0;
+}
+
+
+/* Drops the open image of @ctx and everything that was only valid for it */
+static errcode_t close_image(struct extract_ctx *ctx)
+{
+    errcode_t retval;
+
+    retval = e2fstool_close(ctx->image);
+    if (retval)
+    {
+        com_err(prog_name, retval, "%s",
+                "while closing filesystem");
+    }
+    ctx->image = NULL;
+    ctx->fs = NULL;
+
+    if (ctx->raw_fd >= 0)
+        close(ctx->raw_fd);
+    ctx->raw_fd = -1;
+    incr_free();
+    dedup_free(ctx->dedup);
+    ctx->dedup = NULL;
+    return retval;
+}
+
+/* Extracts the open image of @ctx to its directories, or to the archive */
+/* Sets up what the walk of the open image @ctx needs, @dedup_cap bytes of dedup cache */
+static errcode_t extract_prepare(struct extract_ctx *ctx, size_t dedup_cap)
+{
+    errcode_t retval;
+
+    /* e2fsdroid -s images share the blocks of identical files, zero-copy already shares them */
+    if (ext2fs_has_feature_shared_blocks(ctx->fs->super) && ctx->raw_fd < 0 &&
+        !android_configure_only && !archive_format)
+    {
+        retval = dedup_new(dedup_cap, &ctx->dedup);
+        if (retval)
+        {
+            com_err(__func__, retval, "while allocating memory");
+            return retval;
+        }
+    }
+    atomic_store(&ctx->walk_error, 0);
+    atomic_store(&ctx->reflink_ok, true);
+    atomic_store(&ctx->copy_range_ok, true);
+    atomic_store(&ctx->link_ok, true);
+    ctx->progress_bar = !quiet && !verbose;
+    return 0;
+}
+
+static void extract_report(struct extract_ctx *ctx)
+{
+    ext2_filsys fs = ctx->fs;
+
+    if (!quiet && !android_configure_only)
+    {
+        fprintf(stdout, "\nWritten %u inodes (%u blocks) to \"%s\"\n",
+                fs->super->s_inodes_count - fs->super->s_free_inodes_count,
+                fs->super->s_blocks_count - fs->super->s_free_blocks_count -
+                    RESERVED_INODES_COUNT,
+                archive_format ? archive_path : ctx->out_dir);
+    }
+}
 
-#ifdef SVB_MINGW
-    if (!android_configure_only)
+static errcode_t extract_image(struct extract_ctx *ctx)
+{
+    errcode_t retval;
+
+    retval = extract_prepare(ctx, dedup_cache_cap);
+    if (retval)
+        return retval;
+
+    if (archive_format)
     {
-        retval = set_path_timestamp(output_file, inode.i_atime, inode.i_mtime, inode.i_ctime);
+        retval = archive_open(archive_format, archive_path);
         if (retval)
-        {
-            E2FSTOOL_ERROR("while configuring timestamps for %s", output_file);
-        }
+            return retval;
     }
-#endif
 
-err:
-    if (!android_configure_only)
+    if (incremental_path)
     {
-        free(output_file);
+        retval = incr_init(incremental_path, ctx->out_dir);
+        if (retval)
+            return retval;
     }
-end:
-    free(params->filename);
-    return retval;
-}
 
-static errcode_t walk_fs(ext2_filsys fs)
-{
-    struct ext2_inode inode;
-    struct inode_params params = {
-        .path = "",
-    };
-    char *se_path, *fs_path;
-    errcode_t retval = 0;
+    retval = walk_fs(ctx);
+    if (archive_format)
+    {
+        errcode_t archive_retval = archive_close(!retval);
 
-    retval = ext2fs_read_inode(fs, EXT2_ROOT_INO, &inode);
+        if (!retval)
+            retval = archive_retval;
+    }
     if (retval)
-    {
-        com_err(__func__, retval, "while reading root inode");
         return retval;
-    }
 
-    if (!android_configure_only)
+    /* A failed run keeps the old manifest, the next one redoes what differs from it */
+    if (incremental_path)
     {
-        retval = mkdir(out_dir, inode.i_mode);
-        if (retval == -1 && errno != EEXIST)
-        {
-            E2FSTOOL_ERROR("while creating %s", out_dir);
+        size_t removed;
+
+        retval = incr_finish(!include_count && !exclude_count, &removed);
+        if (retval)
             return retval;
-        }
+        if (!quiet && removed)
+            fprintf(stdout, "\nRemoved %zu entries gone from the image", removed);
     }
 
-    if (android_configure)
+    extract_report(ctx);
+    return 0;
+}
+
+/* Closes and frees the batch image @ctx, counting it as failed if it or @retval is */
+static void batch_done(struct extract_ctx *ctx, errcode_t retval, size_t *failed, errcode_t *first)
+{
+    errcode_t close_retval;
+
+    close_retval = close_image(ctx);
+    retval = retval ?: close_retval;
+    extract_ctx_free(ctx);
+
+    if (retval)
     {
-        if (mountpoint)
-            ;
-        else if (fs->super->s_last_mounted[0])
-            mountpoint = strdup((char *)fs->super->s_last_mounted);
-        else if (fs->super->s_volume_name[0]) {
-            if (asprintf(&mountpoint, "/%s", (char *)fs->super->s_volume_name) < 0)
-            {
-                E2FSTOOL_ERROR("while allocating memory");
-                return EXT2_ET_NO_MEMORY;
-            }
-        }
-        else
-            mountpoint = strdup(out_dir);
+        *first = *first ?: retval;
+        (*failed)++;
+    }
+}
 
-        ++mountpoint;
-        if (!mountpoint[0])
-            system_as_root = true;
+#ifndef SVB_MINGW
+/* Largest image first, by the blocks it uses */
+static int batch_cmp(const void *a, const void *b)
+{
+    const struct extract_ctx *x = *(struct extract_ctx *const *)a;
+    const struct extract_ctx *y = *(struct extract_ctx *const *)b;
+    blk64_t x_used = ext2fs_blocks_count(x->fs->super) - ext2fs_free_blocks_count(x->fs->super);
+    blk64_t y_used = ext2fs_blocks_count(y->fs->super) - ext2fs_free_blocks_count(y->fs->super);
 
-        retval = mkdir(conf_dir, S_IRWXU | S_IRWXG | S_IRWXO);
-        if (retval == -1 && errno != EEXIST)
-        {
-            E2FSTOOL_ERROR("while creating %s", conf_dir);
-            return retval;
-        }
+    return x_used < y_used ? 1 : x_used > y_used ? -1 : 0;
+}
 
-        if (asprintf(&se_path, "%s/selinux_contexts.fs", conf_dir) < 0) {
-            E2FSTOOL_ERROR("while allocating memory");
-            return EXT2_ET_NO_MEMORY;
-        }
+/*
+ * Extracts the open images of @ctxs together on @pool, queued largest
+ * first so the long walks don't start last. Every image is done with
+ * once this returns.
+ */
+static void batch_parallel(struct workpool *pool, struct extract_ctx **ctxs, size_t count,
+                           size_t dedup_cap, size_t *failed, errcode_t *first)
+{
+    size_t i, n = 0;
+    errcode_t retval;
 
-        contexts = fopen(se_path, "w");
-        if (!contexts)
-        {
-            retval = -1;
-            goto ctx_end;
-        }
+    qsort(ctxs, count, sizeof(*ctxs), batch_cmp);
+    for (i = 0; i < count; i++)
+    {
+        struct extract_ctx *ctx = ctxs[i];
 
-        if (asprintf(&fs_path, "%s/filesystem_config.fs", conf_dir) < 0) {
-            E2FSTOOL_ERROR("while allocating memory");
-            retval = EXT2_ET_NO_MEMORY;
-            goto fs_end;
-        }
-        filesystem = fopen(fs_path, "w");
-        if (!filesystem)
+        retval = extract_prepare(ctx, dedup_cap);
+        /* Progress bars of images walked together would share the line */
+        ctx->progress_bar = false;
+        ctx->pool = pool;
+        if (!retval)
+            retval = walk_open(ctx);
+        if (retval)
         {
-            retval = -1;
-            goto fs_end;
+            com_err(prog_name, retval, "while extracting %s", ctx->in_file);
+            batch_done(ctx, retval, failed, first);
+            continue;
         }
+        ctxs[n++] = ctx;
+    }
 
-        retval = ino_get_config(EXT2_ROOT_INO, inode, (char *)mountpoint);
+    walk_parallel(pool, ctxs, n);
+
+    for (i = 0; i < n; i++)
+    {
+        retval = walk_close(ctxs[i], atomic_load(&ctxs[i]->walk_error));
         if (retval)
-            goto end;
+            com_err(prog_name, retval, "while extracting %s", ctxs[i]->in_file);
+        else
+            extract_report(ctxs[i]);
+        batch_done(ctxs[i], retval, failed, first);
     }
+}
+#endif
 
-    if (!quiet && !verbose)
-        ext2fs_numeric_progress_init(fs, &progress,
-                                     "Extracting filesystem inodes: ",
-                                     fs->super->s_inodes_count - fs->super->s_free_inodes_count - RESERVED_INODES_COUNT);
+/*
+ * Extracts the images of a batch list. With -j they are all opened
+ * first and walked side by side on one pool, each with its share of the
+ * inode, dedup and readahead budgets; without it they go one after
+ * another in list order. The output writers, the decompression cache
+ * and the stats are shared. A failed image is reported and the batch
+ * goes on.
+ */
+static errcode_t run_batch(struct batch_image *list, size_t count,
+                           const struct e2fstool_open_opts *opts)
+{
+    struct e2fstool_open_opts image_opts = *opts;
+    struct extract_ctx *ctxs = NULL, **opened = NULL;
+    struct workpool *pool = NULL;
+    size_t i, n = 0, failed = 0, window = 0, dedup_cap = dedup_cache_cap;
+    errcode_t retval, first = 0;
 
-    retval = ext2fs_dir_iterate2(fs, EXT2_ROOT_INO, 0, NULL, walk_dir,
-                                 &params);
+    retval = ext2fs_get_arrayzero(count, sizeof(*ctxs), &ctxs);
+    if (!retval)
+        retval = ext2fs_get_array(count, sizeof(*opened), &opened);
     if (retval)
     {
-        goto end;
+        com_err(__func__, retval, "while allocating memory");
+        ext2fs_free_mem(&ctxs);
+        return retval;
     }
 
-#ifdef SVB_MINGW
-    if (!android_configure_only)
+#ifndef SVB_MINGW
+    if (jobs > 1)
     {
-        retval = set_path_timestamp(out_dir, inode.i_atime, inode.i_mtime, inode.i_ctime);
+        retval = pool_start(&pool);
         if (retval)
         {
-            E2FSTOOL_ERROR("while configuring timestamps for %s", out_dir);
+            ext2fs_free_mem(&opened);
+            ext2fs_free_mem(&ctxs);
+            return retval;
         }
+        image_opts.inode_cache /= count;
+        dedup_cap /= count;
+        window = *(size_t *)opts->wrap_data / count;
+        image_opts.wrap_data = &window;
     }
 #endif
 
-    if (!quiet && !verbose)
-        ext2fs_numeric_progress_close(fs, &progress, "done\n");
-end:
-    if (android_configure)
-    {
-        free(fs_path);
-        fclose(filesystem);
-    }
-fs_end:
-    if (android_configure)
+    for (i = 0; i < count; i++)
     {
-        free(se_path);
-        fclose(contexts);
+        struct extract_ctx *ctx = &ctxs[i];
+
+        extract_ctx_init(ctx);
+        ctx->in_file = strdup(list[i].image);
+        ctx->out_dir = strdup(list[i].out_dir);
+        ctx->conf_dir = list[i].conf_dir ? strdup(list[i].conf_dir) : NULL;
+        ctx->mountpoint = list[i].mountpoint ? strdup(list[i].mountpoint) : NULL;
+        ctx->android_configure = list[i].conf_dir != NULL;
+        if (!ctx->in_file || !ctx->out_dir || (list[i].conf_dir && !ctx->conf_dir) ||
+            (list[i].mountpoint && !ctx->mountpoint))
+        {
+            E2FSTOOL_ERROR("while allocating memory");
+            extract_ctx_free(ctx);
+            first = first ?: EXT2_ET_NO_MEMORY;
+            failed++;
+            continue;
+        }
+
+        if (!quiet)
+            printf("[%zu/%zu] %s\n", i + 1, count, ctx->in_file);
+
+        retval = open_image(ctx, &image_opts);
+        if (!retval && pool)
+        {
+            opened[n++] = ctx;
+            continue;
+        }
+        if (!retval)
+        {
+            retval = extract_image(ctx);
+            if (retval)
+                com_err(prog_name, retval, "while extracting %s", ctx->in_file);
+        }
+        batch_done(ctx, retval, &failed, &first);
     }
-ctx_end:
-    return retval;
+
+#ifndef SVB_MINGW
+    if (n)
+        batch_parallel(pool, opened, n, dedup_cap, &failed, &first);
+    workpool_destroy(pool);
+#endif
+    ext2fs_free_mem(&opened);
+    ext2fs_free_mem(&ctxs);
+
+    if (!quiet)
+        printf("\nExtracted %zu of %zu images\n", count - failed, count);
+    return first;
+}
+
+/* Readahead and instrumentation go over the io manager of the image */
+static io_manager wrap_io(io_manager inner, void *data)
+{
+    /* libsparse channels can't be read from several threads */
+    if (readahead_threads && inner != sparse_io_manager && inner != moto_io_manager)
+        inner = readahead_io_manager(inner, readahead_threads * jobs, *(size_t *)data);
+    if (stats_enabled)
+        inner = stats_io_manager(inner);
+    return inner;
 }
 
 int main(int argc, char *argv[])
 {
     int c, show_version_only = 0;
-    io_manager io_mgr = unix_io_manager;
+    const char *stats_path = NULL, *trace_path = NULL, *lookup_path = NULL, *batch_path = NULL;
+    command_t cmd = CMD_EXTRACT;
+    bool json = false, extracting;
+    struct batch_image *batch = NULL;
+    size_t batch_count = 0;
     errcode_t retval = 0, close_retval = 0;
-    unsigned int b, blocksize = 0;
+    unsigned int b;
+    size_t ra_window = RA_DEFAULT_WINDOW;
+    image_type_t image_type = E2FSTOOL_UNKNOWN;
+    struct e2fstool_open_opts open_opts = {0};
+    struct extract_ctx ctx;
+    char *end;
 
     add_error_table(&et_ext2_error_table);
+    extract_ctx_init(&ctx);
+
+    if (argc > 1)
+    {
+        for (c = CMD_CAT; c <= CMD_BATCH; c++)
+        {
+            if (!strcmp(argv[1], command_names[c]))
+            {
+                cmd = c;
+                argv[1] = argv[0];
+                argv++;
+                argc--;
+                break;
+            }
+        }
+    }
 
-    while ((c = getopt(argc, argv, "b:c:ehm:oqsvV")) != EOF)
+    while ((c = getopt_long(argc, argv, "b:c:ehj:m:opqsSvVz", long_options, NULL)) != EOF)
     {
         switch (c)
         {
@@ -738,25 +3827,157 @@ int main(int argc, char *argv[])
                         blocksize);
             break;
         case 'c':
-            conf_dir = strdup(optarg);
-            ++android_configure;
+            free(ctx.conf_dir);
+            ctx.conf_dir = strdup(optarg);
+            ctx.android_configure = true;
             break;
         case 'e':
-            image_type = RAW;
+            image_type = E2FSTOOL_RAW;
+            break;
+        case 'j':
+            jobs = strtoul(optarg, &end, 0);
+            if (*end || !jobs)
+            {
+                com_err(prog_name, 0,
+                        "invalid number of jobs - %s", optarg);
+                exit(EXIT_FAILURE);
+            }
+#ifdef SVB_MINGW
+            if (jobs > 1)
+            {
+                fprintf(stderr, "Warning: parallel extraction is not "
+                                "supported on this platform.\n");
+                jobs = 1;
+            }
+#endif
             break;
         case 's':
-            image_type = SPARSE;
+            image_type = E2FSTOOL_SPARSE;
+            break;
+        case 'S':
+            sparse_output = true;
+            break;
+        case 'z':
+            sparse_output = detect_zeroes = true;
+            break;
+        case OPT_ZERO_COPY:
+            zero_copy = true;
+            break;
+        case OPT_LIBSPARSE:
+            use_libsparse = true;
+            break;
+        case OPT_BLOCK_ORDER:
+            block_order = true;
+            break;
+        case OPT_STATS:
+            stats_path = optarg;
+            break;
+        case OPT_TRACE:
+            trace_path = optarg;
+            break;
+        case OPT_INCLUDE:
+            add_pattern(&include_pats, &include_count, optarg);
+            break;
+        case OPT_EXCLUDE:
+            add_pattern(&exclude_pats, &exclude_count, optarg);
+            break;
+        case OPT_JSON:
+            json = true;
+            break;
+        case OPT_INODE_CACHE:
+            icache_cap = strtoul(optarg, &end, 0);
+            if (*end)
+            {
+                com_err(prog_name, 0,
+                        "invalid inode cache size - %s", optarg);
+                exit(EXIT_FAILURE);
+            }
+            icache_cap <<= 20;
+            break;
+        case OPT_READAHEAD:
+            readahead_threads = strtoul(optarg, &end, 0);
+            if (*end)
+            {
+                com_err(prog_name, 0,
+                        "invalid number of readahead threads - %s", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_OUTPUT_THREADS:
+            output_threads = strtoul(optarg, &end, 0);
+            if (*end)
+            {
+                com_err(prog_name, 0,
+                        "invalid number of output threads - %s", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_ZCACHE:
+            zcache_cap = strtoul(optarg, &end, 0);
+            if (*end || !zcache_cap)
+            {
+                com_err(prog_name, 0,
+                        "invalid decompression cache size - %s", optarg);
+                exit(EXIT_FAILURE);
+            }
+            zcache_cap <<= 20;
+            break;
+        case OPT_DEDUP_CACHE:
+            dedup_cache_cap = strtoul(optarg, &end, 0);
+            if (*end)
+            {
+                com_err(prog_name, 0,
+                        "invalid dedup cache size - %s", optarg);
+                exit(EXIT_FAILURE);
+            }
+            dedup_cache_cap <<= 20;
+            break;
+        case OPT_MAX_MEMORY:
+            max_memory = strtoul(optarg, &end, 0);
+            if (*end || max_memory < MAX_MEMORY_MIN >> 20)
+            {
+                com_err(prog_name, 0,
+                        "invalid memory budget - %s (%zu MiB at least)", optarg,
+                        MAX_MEMORY_MIN >> 20);
+                exit(EXIT_FAILURE);
+            }
+            max_memory <<= 20;
+            break;
+        case OPT_INCREMENTAL:
+            incremental_path = optarg;
+            break;
+        case OPT_HASH:
+            hash_algos = hash_parse(optarg);
+            if (!hash_algos)
+            {
+                com_err(prog_name, 0, "invalid hash list - %s", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_TAR:
+        case OPT_CPIO:
+            archive_format = c == OPT_TAR ? ARCHIVE_TAR : ARCHIVE_CPIO;
+            archive_path = optarg;
             break;
         case 'o':
             android_configure_only++;
             break;
+        case 'p':
+#ifdef SVB_MINGW
+            fprintf(stderr, "Warning: -p is not supported on this "
+                            "platform, only timestamps are restored.\n");
+#else
+            preserve = true;
+#endif
+            break;
         case 'm':
             if (*optarg != '/')
             {
                 fprintf(stderr, "Invalid mountpoint %s", optarg);
                 exit(EXIT_FAILURE);
             }
-            mountpoint = strdup(optarg);
+            free(ctx.mountpoint);
+            ctx.mountpoint = strdup(optarg);
             break;
         case 'h':
             usage(EXIT_SUCCESS);
@@ -782,9 +4003,71 @@ int main(int argc, char *argv[])
             usage(EXIT_FAILURE);
         }
 
-        in_file = strdup(argv[optind++]);
+        if (cmd == CMD_BATCH)
+            batch_path = argv[optind++];
+        else
+            ctx.in_file = strdup(argv[optind++]);
+
+        if (cmd == CMD_BATCH)
+        {
+            /* The list names the directories of every image */
+            if (ctx.android_configure || ctx.mountpoint || archive_format || incremental_path)
+            {
+                fprintf(stderr, "Cannot use options: -c, -m, -o, --incremental, "
+                                "--tar or --cpio with batch\n");
+                usage(EXIT_FAILURE);
+            }
+        }
+        else if (cmd != CMD_EXTRACT)
+        {
+            if (cmd != CMD_LIST && optind >= argc)
+            {
+                fprintf(stderr, "Expected path after filename\n");
+                usage(EXIT_FAILURE);
+            }
+
+            /* Output goes to stdout untouched */
+            if (cmd != CMD_LIST)
+                lookup_path = argv[optind++];
+            quiet = true;
+            verbose = false;
+            ctx.android_configure = android_configure_only = false;
+            sparse_output = detect_zeroes = false;
+            zero_copy = preserve = block_order = false;
+            hash_algos = 0;
+        }
+        else if (archive_format)
+        {
+            if (android_configure_only)
+            {
+                fprintf(stderr, "Cannot use option: -o with --tar or --cpio\n");
+                usage(EXIT_FAILURE);
+            }
+            if (incremental_path)
+            {
+                fprintf(stderr, "Cannot use option: --incremental with --tar or --cpio\n");
+                usage(EXIT_FAILURE);
+            }
+            if (hash_algos)
+            {
+                fprintf(stderr, "Cannot use option: --hash with --tar or --cpio\n");
+                usage(EXIT_FAILURE);
+            }
 
-        if (!android_configure_only)
+            /* One stream in walk order, entries carry their own metadata */
+            if (jobs > 1)
+                fprintf(stderr, "Warning: archives are written serially, "
+                                "ignoring -j.\n");
+            jobs = 1;
+            sparse_output = detect_zeroes = false;
+            zero_copy = preserve = false;
+            if (!strcmp(archive_path, "-"))
+            {
+                quiet = true;
+                verbose = false;
+            }
+        }
+        else if (!android_configure_only)
         {
             if (optind >= argc)
             {
@@ -792,11 +4075,11 @@ int main(int argc, char *argv[])
                 usage(EXIT_FAILURE);
             }
 
-            out_dir = strdup(argv[optind++]);
+            ctx.out_dir = strdup(argv[optind++]);
         }
 
         if (android_configure_only &&
-            !android_configure)
+            !ctx.android_configure)
         {
             fprintf(stderr, "Cant use option: -o without -c\n");
             usage(EXIT_FAILURE);
@@ -809,13 +4092,28 @@ int main(int argc, char *argv[])
         }
 
         if (android_configure_only &&
-            !android_configure)
+            !ctx.android_configure)
         {
             fprintf(stderr, "Cannot use option: -o without -c\n");
             usage(EXIT_FAILURE);
         }
+
+        if (android_configure_only && incremental_path)
+        {
+            fprintf(stderr, "Cannot use option: --incremental with -o\n");
+            usage(EXIT_FAILURE);
+        }
+
+        /* The digests are written next to the configs, batch checks its list */
+        if (hash_algos && !ctx.android_configure && cmd != CMD_BATCH)
+        {
+            fprintf(stderr, "Cannot use option: --hash without -c\n");
+            usage(EXIT_FAILURE);
+        }
     }
 
+    extracting = cmd == CMD_EXTRACT || cmd == CMD_BATCH;
+
     if (!quiet || show_version_only)
         printf("e2fstool %s (%s)\n\n", E2FSTOOL_VERSION,
                E2FSTOOL_DATE);
@@ -827,85 +4125,117 @@ int main(int argc, char *argv[])
         exit(EXIT_SUCCESS);
     }
 
-    if (image_type == UNKNOWN)
+    /*
+     * --max-memory: the caches and the readahead windows get an eighth of
+     * it each at most, data buffers and queued output share the rest.
+     */
+    if (max_memory && extracting)
     {
-        image_type = get_image_type(in_file);
-        if (image_type == UNKNOWN)
-        {
-            fprintf(stderr, "Unknown image type\n");
-            usage(EXIT_FAILURE);
-        }
-    }
+        size_t eighth = max_memory / 8, data = max_memory;
 
-    if (!quiet)
-    {
-        printf("Opening %s image file", get_image_type_str(image_type));
-        if (blocksize)
-            printf(" with blocksize of %u", blocksize);
-        printf(": ");
-    }
+        if (icache_cap > eighth)
+            icache_cap = eighth;
+        if (zcache_cap > eighth)
+            zcache_cap = eighth;
+        if (dedup_cache_cap > eighth)
+            dedup_cache_cap = eighth;
+        data -= icache_cap + zcache_cap + dedup_cache_cap;
 
-    if (image_type != RAW)
-    {
-        char *new_in_file = NULL;
+        /* Every -j worker reads through a channel of its own */
+        ra_window = eighth / jobs;
+        if (ra_window > RA_DEFAULT_WINDOW)
+            ra_window = RA_DEFAULT_WINDOW;
+        if (ra_window < (1 << 20))
+            readahead_threads = 0;
+        if (readahead_threads)
+            data -= ra_window * jobs;
 
-        if (image_type == SPARSE)
-            io_mgr = sparse_io_manager;
-        else
-            io_mgr = moto_io_manager;
+        bufpool_init(data);
+    }
 
-        if (asprintf(&new_in_file, "(%s):0:%u", in_file, blocksize) == -1)
+    /* Single file commands read too little to get ahead of */
+    if (!extracting)
+        readahead_threads = 0;
+
+    if (stats_path || trace_path)
+    {
+        retval = stats_init(trace_path);
+        if (retval)
         {
-            E2FSTOOL_ERROR("while allocating file name");
+            com_err(prog_name, retval, "while opening trace file %s", trace_path);
             exit(EXIT_FAILURE);
         }
-        free(in_file);
-        in_file = new_in_file;
     }
 
-    retval = ext2fs_open(in_file, EXT2_FLAG_64BITS | EXT2_FLAG_EXCLUSIVE | EXT2_FLAG_THREADS | EXT2_FLAG_PRINT_PROGRESS, 0, blocksize, io_mgr, &fs);
+    open_opts.type = image_type;
+    open_opts.blocksize = blocksize;
+    open_opts.flags = EXT2_FLAG_EXCLUSIVE | EXT2_FLAG_THREADS |
+                      (extracting ? EXT2_FLAG_PRINT_PROGRESS : 0);
+    /* Single path lookups read a handful of inodes */
+    open_opts.inode_cache = extracting || cmd == CMD_LIST ? icache_cap : 0;
+    open_opts.wrap_io = wrap_io;
+    open_opts.wrap_data = &ra_window;
+
+#ifndef SVB_MINGW
+    /* MinGW stamps entries by path right after creating them */
+    if (extracting && output_threads && !android_configure_only && !archive_format)
+        retval = out_init(output_threads, preserve);
+    else
+#endif
+        output_threads = 0;
     if (retval)
-    {
-        puts("\n");
-        com_err(prog_name, retval, "while opening file %s", in_file);
-        exit(EXIT_FAILURE);
-    }
+        goto end;
 
-    if (!quiet)
+    if (cmd == CMD_BATCH)
     {
-        puts("done");
+        retval = batch_read(batch_path, &batch, &batch_count);
+        if (!retval)
+            retval = run_batch(batch, batch_count, &open_opts);
+        goto end;
     }
 
-    retval = walk_fs(fs);
+    retval = open_image(&ctx, &open_opts);
     if (retval)
-        goto end;
+        exit(EXIT_FAILURE);
 
-    if (!quiet && !android_configure_only)
+    if (cmd == CMD_LIST)
+        retval = list_fs(ctx.image, stdout, json);
+    else if (cmd != CMD_EXTRACT)
+        retval = run_command(ctx.image, cmd, lookup_path);
+    else
     {
-        fprintf(stdout, "\nWritten %u inodes (%u blocks) to \"%s\"\n",
-                fs->super->s_inodes_count - fs->super->s_free_inodes_count,
-                fs->super->s_blocks_count - fs->super->s_free_blocks_count -
-                    RESERVED_INODES_COUNT,
-                out_dir);
+#ifndef SVB_MINGW
+        if (jobs > 1)
+            retval = pool_start(&ctx.pool);
+        if (!retval)
+#endif
+            retval = extract_image(&ctx);
     }
 end:
-    close_retval = ext2fs_close_free(&fs);
-    if (close_retval)
-    {
-        com_err(prog_name, close_retval, "%s",
-                "while closing filesystem");
-    }
-    if (retval)
+    close_retval = close_image(&ctx);
+    workpool_destroy(ctx.pool);
+    if (retval && cmd == CMD_EXTRACT)
     {
         com_err(prog_name, retval, "%s",
                 "while walking filesystem");
     }
 
-    free(in_file);
-    free(out_dir);
-    free(conf_dir);
-    if (mountpoint)
-        free(android_configure ? --mountpoint : mountpoint);
+    if (stats_path)
+    {
+        errcode_t stats_retval = stats_report(stats_path);
+        if (stats_retval)
+            com_err(prog_name, stats_retval, "while writing stats to %s", stats_path);
+    }
+    stats_free();
+
+    out_free();
+    compress_free();
+    bufpool_free();
+    batch_free(batch, batch_count);
+    free(include_pats);
+    free(exclude_pats);
+    extract_ctx_free(&ctx);
+    u64_map_free(&interned, interned_free);
     remove_error_table(&et_ext2_error_table);
     return (close_retval || retval) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -2,6 +2,9 @@
 #define E2FSTOOL_H_INC
 
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <sparse/sparse.h>
@@ -10,9 +13,14 @@
 #include <e2p/e2p.h>
 #include <ext2fs/ext2fs.h>
 #include <ext2fs/ext2fsP.h>
+#include <ext2fs/ext3_extents.h>
 
 #include <private/android_filesystem_capability.h>
 
+#include "stats.h"
+#include "workpool.h"
+#include "libe2fstool.h"
+
 #define E2FSTOOL_VERSION "1.1.0"
 #define E2FSTOOL_DATE "15-July-2024"
 
@@ -24,6 +32,11 @@
 #endif
 
 #define mkdir(p, m) mkdir(p)
+
+/* No *at() calls here, walk_dir passes full paths as names instead */
+#define mkdirat(d, p, m) mkdir(p, m)
+#define openat(d, p, ...) open(p, __VA_ARGS__)
+#define symlinkat(t, d, p) symlink(t, p)
 #endif
 
 #ifndef XATTR_SELINUX_SUFFIX
@@ -33,23 +46,390 @@
 #define XATTR_CAPS_SUFFIX "capability"
 #endif
 
+#define XATTR_INDEX_SECURITY 6
+
 #define FILE_MODE_MASK 0x0FFF
 #define FILE_READ_BUFLEN (1 << 27)
 #define RESERVED_INODES_COUNT 0xA /* Excluding EXT2_ROOT_INO */
 #define SYMLINK_I_BLOCK_MAX_SIZE 0x3D
+#define ROOT_RUNS_MAX 4 /* Extents in the i_block tree root */
+#define PATH_ARENA_INIT 256
+#define ICACHE_DEFAULT_CAP ((size_t)64 << 20)
+#define RA_DEFAULT_THREADS 4 /* Per -j worker */
+#define RA_LOOKAHEAD 8 /* Files queued ahead in block order */
+#define RA_DEFAULT_WINDOW ((size_t)32 << 20) /* Per channel */
+#define OUT_DEFAULT_THREADS 4
+#define OUT_SMALL_MAX (256 << 10) /* Files written from memory in one go */
+#define ZCACHE_DEFAULT_CAP ((size_t)64 << 20)
+#define DEDUP_CACHE_DEFAULT_CAP ((size_t)64 << 20)
+#define MAX_MEMORY_MIN ((size_t)16 << 20)
+
+/* Content digests (--hash), any combination */
+#define HASH_SHA256 0x1
+#define HASH_CRC32C 0x2
+#define HASH_BLAKE3 0x4
 
 #define SPARSE_HEADER_MAGIC 0xed26ff3a
 #define MOTO_HEADER_MAGIC 0x4f544f4d
 
-typedef enum image_type {
-    SPARSE,
-    RAW,
-    MOTO,
-    UNKNOWN
-} image_type_t;
+struct u64_map_slot {
+    __u64 key;
+    void *val;
+};
+
+struct u64_map {
+    struct u64_map_slot *slots;
+    size_t cap, count;
+};
+
+struct interned_value {
+    struct interned_value *next;
+    size_t len;
+    char data[];
+};
+
+/* Xattrs of interest of one inode, values point into the intern table */
+struct ino_xattrs {
+    const char *selinux;
+    size_t selinux_len;
+    const void *caps;
+    size_t caps_len;
+};
+
+/* Merged run of logically and physically contiguous extents */
+struct extent_run {
+    blk64_t lblk;
+    blk64_t pblk;
+    blk64_t len;
+    int uninit;
+};
+
+/* What ino_read_runs() does with a file, any of them may fail to end it */
+struct run_ops {
+    /* @len bytes at @off that read as zeroes, holes and unwritten extents */
+    errcode_t (*hole)(void *data, __u64 off, __u64 len);
+    /* Optional, sets *@done to the blocks at the start of @run dealt with unread */
+    errcode_t (*take)(void *data, const struct extent_run *run, __u64 len, blk64_t *done);
+    /* Optional, reads @n blocks at @blk instead of the io channel */
+    errcode_t (*read)(void *data, blk64_t blk, blk64_t n, char *buf);
+    errcode_t (*data)(void *data, __u64 off, const char *buf, size_t len);
+};
+
+struct hash_ctx;
+
+/*
+ * Output cursor; in sparse mode holes are seeked over instead of written.
+ * With fd -1 nothing is written, the data only goes to @hash.
+ */
+struct out_file {
+    int fd;
+    char *buf;
+    size_t buflen;
+    __u64 pos;
+    bool seek;
+    struct hash_ctx *hash;
+};
+
+/* Streaming output instead of a directory (--tar, --cpio) */
+typedef enum archive_format {
+    ARCHIVE_NONE,
+    ARCHIVE_TAR,
+    ARCHIVE_CPIO,
+} archive_format_t;
+
+/* Outcome of --include/--exclude for one entry */
+typedef enum path_verdict {
+    PATH_SKIP,
+    PATH_INCLUDE,
+    PATH_DESCEND, /* Only a directory leading to possible matches */
+} path_verdict_t;
+
+/* Regular file deferred to the block ordered extraction phase */
+struct manifest_entry {
+    ext2_ino_t ino;
+    struct ext2_inode inode;
+    blk64_t first_block;
+    struct extent_run *runs;
+    size_t count;
+    char *path;
+};
+
+/* Directory whose metadata is restored once everything below it exists */
+struct dir_fixup {
+    char *path;
+    unsigned int depth;
+    struct ext2_inode inode;
+};
+
+/* Later name of a multiply-linked inode, linked once its data exists */
+struct hardlink {
+    ext2_ino_t ino;
+    char *target;
+    char *path;
+};
+
+/*
+ * Path of the entry being walked, relative to the image root. walk_dir
+ * appends "/name" and truncates back when done, so walking an entry
+ * needs no allocation.
+ */
+struct path_arena {
+    char *buf;
+    size_t len, cap;
+};
+
+/* Decoded EA blocks of one image by block number, see ino_decode_xattrs */
+struct xattr_cache {
+    struct u64_map blocks;
+    pthread_mutex_t lock;
+};
+
+/* Digests of the files of one image, see digest_write */
+struct digest_list {
+    struct digest_rec *recs;
+    size_t count, size;
+    pthread_mutex_t lock;
+};
+
+/*
+ * An image being extracted and everything that is only valid for it.
+ * Options stay global, they apply to every image alike.
+ */
+struct extract_ctx {
+    char *in_file;
+    char *out_dir;
+    char *conf_dir; /* NULL without -c */
+    char *mountpoint; /* NULL to take it from the image */
+    const char *config_root; /* mountpoint past its leading '/' */
+    bool android_configure;
+    bool system_as_root;
+    image_type_t image_type;
+    compress_type_t image_compression;
+    struct e2fstool_image *image;
+    ext2_filsys fs;
+    struct ext2_inode root_inode;
+    struct workpool *pool; /* -j workers, shared by a batch, NULL to walk serially */
+    ext2_filsys *handles; /* One per -j worker */
+    struct walk_task *root;
+    struct drain_task *drain_tasks; /* One per -j worker with --block-order */
+    int raw_fd; /* The image itself for --zero-copy, -1 otherwise */
+    struct dedup *dedup; /* Only for images sharing blocks */
+    /* Cleared from any -j worker once the output filesystem refuses */
+    atomic_bool reflink_ok, copy_range_ok, link_ok;
+    int out_dir_fd;
+    FILE *contexts, *filesystem;
+    bool progress_bar; /* Off in a batch, its images would share the line */
+    struct ext2fs_numeric_progress_struct progress;
+    pthread_mutex_t progress_lock;
+    _Atomic(errcode_t) walk_error;
+    struct xattr_cache xattrs;
+    struct digest_list digests;
+
+    struct manifest_entry *manifest;
+    size_t manifest_count, manifest_size;
+    atomic_size_t manifest_next;
+    pthread_mutex_t manifest_lock;
+
+    struct dir_fixup *dir_fixups;
+    size_t dir_fixup_count, dir_fixup_size;
+    pthread_mutex_t dir_fixup_lock;
+
+    struct u64_map first_links;
+    struct hardlink *hardlinks;
+    size_t hardlink_count, hardlink_size;
+    pthread_mutex_t hardlink_lock;
+};
+
+extern io_manager sparse_index_io_manager;
+extern io_manager moto_index_io_manager;
+
+struct walk_task;
 
 struct inode_params {
+    struct extract_ctx *ctx;
+    ext2_filsys fs;
+    struct path_arena path;
+    struct path_arena scratch;
+    int dirfd;
+    FILE *filesystem;
+    FILE *contexts;
+    struct walk_task *task;
+    bool included;
+};
+
+/*
+ * Parallel walk (-j): every directory is a pool task. Config lines are
+ * buffered per task in segments, each one followed by the subtree of the
+ * directory that ended it, so flushing the tree depth-first reproduces
+ * the serial ordering exactly.
+ */
+struct walk_seg {
+    char *fs_buf, *se_buf;
+    size_t fs_len, se_len;
+    struct walk_task *child;
+    struct walk_seg *next;
+};
+
+struct walk_task {
+    struct workpool_task work;
+    struct extract_ctx *ctx;
+    ext2_ino_t ino;
     char *path;
-    char *filename;
+    bool included;
+    struct walk_seg *segs, *last;
 };
+
+/* FNV-1a, @h carries on from an earlier call */
+static inline __u64 hash_update(__u64 h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    while (len--)
+        h = (h ^ *p++) * 0x100000001b3ULL;
+    return h;
+}
+
+static inline __u64 hash_bytes(const void *data, size_t len)
+{
+    return hash_update(0xcbf29ce484222325ULL, data, len);
+}
+
+/* inode_cache.c */
+struct icache;
+
+extern size_t icache_cap;
+
+errcode_t icache_new(ext2_filsys fs, size_t cap, struct icache **ret);
+void icache_attach(struct icache *ic, ext2_filsys fs);
+errcode_t ino_read(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode, int bufsize);
+void icache_free(struct icache *ic);
+
+/* readahead_io.c */
+io_manager readahead_io_manager(io_manager inner, unsigned int threads, size_t window);
+
+/* output_io.c */
+errcode_t out_init(unsigned int threads, bool restore);
+errcode_t out_queue_file(int dirfd, const char *name, char *data, size_t len,
+                         size_t charged, const struct ext2_inode *inode);
+errcode_t out_queue_symlink(int dirfd, const char *name, char *target,
+                            const struct ext2_inode *inode);
+errcode_t out_mkdir_open(int dirfd, const char *name, mode_t mode, int *fd);
+errcode_t out_flush(void);
+void out_free(void);
+
+/* archive.c */
+errcode_t archive_open(archive_format_t fmt, const char *path);
+errcode_t archive_add(struct extract_ctx *ctx, ext2_filsys fs, ext2_ino_t ino,
+                      struct ext2_inode *inode, const char *path,
+                      const struct extent_run *runs, size_t count);
+errcode_t archive_hardlink(ext2_ino_t ino, struct ext2_inode *inode,
+                           const char *target, const char *path);
+errcode_t archive_close(bool finish);
+
+/* compress_io.c */
+struct zfile;
+
+extern size_t zcache_cap;
+extern io_manager compressed_io_manager;
+
+compress_type_t compress_detect(const char *path);
+const char *compress_type_str(compress_type_t type);
+errcode_t zfile_open(const char *path, struct zfile **ret);
+errcode_t zfile_read(struct zfile *zf, __u64 off, void *buf, size_t len);
+__u64 zfile_size(const struct zfile *zf);
+void zfile_close(struct zfile *zf);
+void compress_free(void);
+
+/* bufpool.c */
+extern size_t max_memory;
+
+void bufpool_init(size_t limit);
+errcode_t bufpool_get(size_t want, char **buf, size_t *len);
+void bufpool_put(char *buf, size_t len);
+bool mem_reserve(size_t len, bool wait);
+void mem_release(size_t len);
+void bufpool_free(void);
+
+/* dedup.c */
+struct dedup;
+
+extern size_t dedup_cache_cap;
+
+errcode_t dedup_new(size_t cache_cap, struct dedup **ret);
+errcode_t dedup_record(struct dedup *d, const char *path, const struct extent_run *runs,
+                       size_t count);
+blk64_t dedup_lookup(struct dedup *d, blk64_t pblk, blk64_t len, const char **path,
+                     blk64_t *lblk);
+bool dedup_cache_get(struct dedup *d, blk64_t blk, blk64_t n, unsigned int blocksize, void *buf);
+void dedup_cache_put(struct dedup *d, blk64_t blk, blk64_t n, unsigned int blocksize,
+                     const void *buf);
+void dedup_free(struct dedup *d);
+
+/* hash.c */
+extern unsigned int hash_algos;
+
+unsigned int hash_parse(const char *list);
+errcode_t digest_begin(struct hash_ctx **ret);
+void digest_feed(struct hash_ctx *ctx, const void *data, size_t len);
+void digest_feed_zeroes(struct hash_ctx *ctx, __u64 len);
+errcode_t digest_end(struct digest_list *dl, struct hash_ctx *ctx, const char *path,
+                     ext2_ino_t ino);
+void digest_abort(struct hash_ctx *ctx);
+errcode_t digest_link(struct digest_list *dl, const char *path, ext2_ino_t ino);
+errcode_t digest_write(struct digest_list *dl, const char *path, const char *prefix);
+void digest_list_init(struct digest_list *dl);
+void digest_list_free(struct digest_list *dl);
+
+/* incremental.c */
+errcode_t incr_init(const char *path, const char *out_dir);
+errcode_t incr_check(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
+                     const char *path, bool *unchanged);
+errcode_t incr_finish(bool prune, size_t *removed);
+void incr_free(void);
+
+/* list.c */
+errcode_t list_fs(struct e2fstool_image *image, FILE *out, bool json);
+
+/* lookup.c */
+errcode_t dir_lookup(ext2_filsys fs, ext2_ino_t dir, const char *name, int len, ext2_ino_t *ino);
+errcode_t path_resolve(ext2_filsys fs, const char *path, bool follow, ext2_ino_t *ret_ino);
+
+/* libe2fstool.c */
+errcode_t path_reserve(struct path_arena *pa, size_t len);
+errcode_t path_set(struct path_arena *pa, const char *path);
+errcode_t path_push(struct path_arena *pa, const char *name, size_t len);
+const char *path_join(struct path_arena *pa, const char *prefix, const char *path);
+void path_free(struct path_arena *pa);
+
+static inline void path_pop(struct path_arena *pa, size_t len)
+{
+    pa->len = len;
+    pa->buf[len] = '\0';
+}
+
+int ino_root_runs(const struct ext2_inode *inode, struct extent_run *runs);
+errcode_t ino_get_extent_runs(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
+                              struct extent_run **ret_runs, size_t *ret_count);
+errcode_t ino_get_block_runs(ext2_filsys fs, ext2_ino_t ino, struct extent_run **ret_runs,
+                             size_t *ret_count);
+errcode_t ino_read_runs(ext2_filsys fs, ext2_ino_t ino, const struct extent_run *runs,
+                        size_t count, __u64 size, char *buf, size_t buflen,
+                        const struct run_ops *ops, void *data);
+errcode_t ino_read_symlink(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
+                           char **target);
+
+/* e2fstool.c */
+void xattr_decode_caps(const void *val, size_t len, uint64_t *cap);
+void xattr_cache_init(struct xattr_cache *cache);
+errcode_t ino_decode_xattrs(ext2_filsys fs, struct xattr_cache *cache, ext2_ino_t ino,
+                            struct ext2_inode_large *inode, int inode_size,
+                            struct ino_xattrs *x);
+errcode_t ino_get_xattrs(ext2_filsys fs, struct xattr_cache *cache, ext2_ino_t ino,
+                         struct ino_xattrs *x);
+void xattr_cache_free(struct xattr_cache *cache);
+void ino_restore_metadata(int fd, int dirfd, const char *name,
+                          const struct ext2_inode *inode);
+errcode_t ino_extract_fd(struct extract_ctx *ctx, ext2_filsys fs, ext2_ino_t ino,
+                         struct ext2_inode *inode, int fd, const struct extent_run *runs,
+                         size_t count, struct hash_ctx *hash);
 #endif /* E2FSTOOL_H_INC */
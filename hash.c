@@ -0,0 +1,764 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "e2fstool.h"
+
+/*
+ * Content digests computed on the buffers extraction already holds
+ * (--hash sha256,crc32c,blake3), written to file_digests.txt next to
+ * filesystem_config.fs.
+ *
+ * SHA-256 uses the SHA extensions and CRC32C the SSE4.2 crc32
+ * instruction where the CPU has them, picked at runtime, with portable
+ * fallbacks. BLAKE3 is the portable single-lane implementation.
+ */
+
+#define SHA256_BLOCK 64
+#define B3_BLOCK 64
+#define B3_CHUNK 1024
+#define B3_MAX_DEPTH 54
+
+#define B3_CHUNK_START 1
+#define B3_CHUNK_END 2
+#define B3_PARENT 4
+#define B3_ROOT 8
+
+struct sha256_ctx {
+    __u32 h[8];
+    __u64 len;
+    unsigned char buf[SHA256_BLOCK];
+    size_t n;
+};
+
+struct b3_chunk {
+    __u32 cv[8];
+    __u64 counter;
+    unsigned char block[B3_BLOCK];
+    size_t block_len;
+    unsigned int blocks;
+};
+
+struct b3_ctx {
+    struct b3_chunk chunk;
+    __u32 stack[B3_MAX_DEPTH][8];
+    unsigned int depth;
+};
+
+struct hash_ctx {
+    struct sha256_ctx sha;
+    __u32 crc;
+    struct b3_ctx b3;
+};
+
+struct digest_rec {
+    char *path;
+    ext2_ino_t ino;
+    bool has;
+    unsigned char sha[32];
+    unsigned char b3[32];
+    __u32 crc;
+};
+
+static const __u32 sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+/* SHA-256 initial state, BLAKE3 uses it as its IV too */
+static const __u32 sha256_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const unsigned char b3_perm[16] = {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8};
+
+unsigned int hash_algos = 0;
+
+static void (*sha256_blocks)(__u32 h[8], const unsigned char *p, size_t n);
+static __u32 (*crc32c_update)(__u32 crc, const unsigned char *p, size_t len);
+static __u32 crc32c_table[8][256];
+static pthread_once_t hash_once = PTHREAD_ONCE_INIT;
+
+static inline __u32 rotr32(__u32 x, unsigned int n)
+{
+    return x >> n | x << (32 - n);
+}
+
+static inline __u32 load_be32(const unsigned char *p)
+{
+    return (__u32)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static inline __u32 load_le32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (__u32)p[3] << 24;
+}
+
+/* SHA-256 */
+
+static void sha256_blocks_generic(__u32 h[8], const unsigned char *p, size_t n)
+{
+    __u32 w[64], a, b, c, d, e, f, g, hh, t1, t2;
+    int i;
+
+    for (; n; n--, p += SHA256_BLOCK)
+    {
+        for (i = 0; i < 16; i++)
+            w[i] = load_be32(p + 4 * i);
+        for (; i < 64; i++)
+            w[i] = w[i - 16] + (rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ w[i - 15] >> 3) +
+                   w[i - 7] + (rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ w[i - 2] >> 10);
+
+        a = h[0], b = h[1], c = h[2], d = h[3];
+        e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (i = 0; i < 64; i++)
+        {
+            t1 = hh + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) +
+                 sha256_k[i] + w[i];
+            t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g, g = f, f = e, e = d + t1;
+            d = c, c = b, b = a, a = t1 + t2;
+        }
+        h[0] += a, h[1] += b, h[2] += c, h[3] += d;
+        h[4] += e, h[5] += f, h[6] += g, h[7] += hh;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(__u32 h[8], const unsigned char *p, size_t n)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, abef, cdgh, msg, tmp, w[4];
+    int i;
+
+    /* The round instructions want the state as ABEF and CDGH */
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[0]), 0xB1);
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[4]), 0x1B);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    for (; n; n--, p += SHA256_BLOCK)
+    {
+        abef = state0;
+        cdgh = state1;
+
+        for (i = 0; i < 16; i++)
+        {
+            if (i < 4)
+            {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * i)), mask);
+            }
+            else
+            {
+                tmp = _mm_alignr_epi8(w[(i - 1) & 3], w[(i - 2) & 3], 4);
+                tmp = _mm_add_epi32(_mm_sha256msg1_epu32(w[i & 3], w[(i - 3) & 3]), tmp);
+                w[i & 3] = _mm_sha256msg2_epu32(tmp, w[(i - 1) & 3]);
+            }
+
+            msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i *)&sha256_k[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    _mm_storeu_si128((__m128i *)&h[0], _mm_blend_epi16(tmp, state1, 0xF0));
+    _mm_storeu_si128((__m128i *)&h[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+#endif
+
+static void sha256_init(struct sha256_ctx *ctx)
+{
+    memcpy(ctx->h, sha256_iv, sizeof(ctx->h));
+    ctx->len = 0;
+    ctx->n = 0;
+}
+
+static void sha256_feed(struct sha256_ctx *ctx, const unsigned char *p, size_t len)
+{
+    size_t n;
+
+    ctx->len += len;
+    if (ctx->n)
+    {
+        n = SHA256_BLOCK - ctx->n < len ? SHA256_BLOCK - ctx->n : len;
+        memcpy(ctx->buf + ctx->n, p, n);
+        ctx->n += n;
+        p += n;
+        len -= n;
+        if (ctx->n < SHA256_BLOCK)
+            return;
+        sha256_blocks(ctx->h, ctx->buf, 1);
+        ctx->n = 0;
+    }
+
+    n = len / SHA256_BLOCK;
+    if (n)
+        sha256_blocks(ctx->h, p, n);
+    p += n * SHA256_BLOCK;
+    len -= n * SHA256_BLOCK;
+
+    memcpy(ctx->buf, p, len);
+    ctx->n = len;
+}
+
+static void sha256_final(struct sha256_ctx *ctx, unsigned char out[32])
+{
+    __u64 bits = ctx->len * 8;
+    int i;
+
+    ctx->buf[ctx->n++] = 0x80;
+    if (ctx->n > SHA256_BLOCK - 8)
+    {
+        memset(ctx->buf + ctx->n, 0, SHA256_BLOCK - ctx->n);
+        sha256_blocks(ctx->h, ctx->buf, 1);
+        ctx->n = 0;
+    }
+    memset(ctx->buf + ctx->n, 0, SHA256_BLOCK - 8 - ctx->n);
+    for (i = 0; i < 8; i++)
+        ctx->buf[SHA256_BLOCK - 1 - i] = bits >> (8 * i);
+    sha256_blocks(ctx->h, ctx->buf, 1);
+
+    for (i = 0; i < 8; i++)
+    {
+        out[4 * i] = ctx->h[i] >> 24;
+        out[4 * i + 1] = ctx->h[i] >> 16;
+        out[4 * i + 2] = ctx->h[i] >> 8;
+        out[4 * i + 3] = ctx->h[i];
+    }
+}
+
+/* CRC32C */
+
+static __u32 crc32c_generic(__u32 crc, const unsigned char *p, size_t len)
+{
+    __u32 lo, hi;
+
+    /* Slicing by 8 */
+    for (; len >= 8; len -= 8, p += 8)
+    {
+        lo = crc ^ load_le32(p);
+        hi = load_le32(p + 4);
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+    }
+    while (len--)
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ crc >> 8;
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static __u32 crc32c_sse42(__u32 crc, const unsigned char *p, size_t len)
+{
+    __u64 c = crc, v;
+
+    for (; len >= 8; len -= 8, p += 8)
+    {
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = c;
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+static __u32 crc32c_arm(__u32 crc, const unsigned char *p, size_t len)
+{
+    __u64 v;
+
+    for (; len >= 8; len -= 8, p += 8)
+    {
+        memcpy(&v, p, sizeof(v));
+        crc = __crc32cd(crc, v);
+    }
+    while (len--)
+        crc = __crc32cb(crc, *p++);
+    return crc;
+}
+#endif
+
+/* BLAKE3 */
+
+#define B3_G(a, b, c, d, x, y)             \
+    do                                     \
+    {                                      \
+        s[a] = s[a] + s[b] + (x);          \
+        s[d] = rotr32(s[d] ^ s[a], 16);    \
+        s[c] = s[c] + s[d];                \
+        s[b] = rotr32(s[b] ^ s[c], 12);    \
+        s[a] = s[a] + s[b] + (y);          \
+        s[d] = rotr32(s[d] ^ s[a], 8);     \
+        s[c] = s[c] + s[d];                \
+        s[b] = rotr32(s[b] ^ s[c], 7);     \
+    } while (0)
+
+static void b3_compress(const __u32 cv[8], const unsigned char block[B3_BLOCK], __u64 counter,
+                        __u32 block_len, __u32 flags, __u32 out[8])
+{
+    __u32 s[16], m[16], t[16];
+    int r, i;
+
+    for (i = 0; i < 16; i++)
+        m[i] = load_le32(block + 4 * i);
+    memcpy(s, cv, 8 * sizeof(__u32));
+    memcpy(s + 8, sha256_iv, 4 * sizeof(__u32));
+    s[12] = counter;
+    s[13] = counter >> 32;
+    s[14] = block_len;
+    s[15] = flags;
+
+    for (r = 0; r < 7; r++)
+    {
+        B3_G(0, 4, 8, 12, m[0], m[1]);
+        B3_G(1, 5, 9, 13, m[2], m[3]);
+        B3_G(2, 6, 10, 14, m[4], m[5]);
+        B3_G(3, 7, 11, 15, m[6], m[7]);
+        B3_G(0, 5, 10, 15, m[8], m[9]);
+        B3_G(1, 6, 11, 12, m[10], m[11]);
+        B3_G(2, 7, 8, 13, m[12], m[13]);
+        B3_G(3, 4, 9, 14, m[14], m[15]);
+
+        for (i = 0; i < 16; i++)
+            t[i] = m[b3_perm[i]];
+        memcpy(m, t, sizeof(m));
+    }
+
+    for (i = 0; i < 8; i++)
+        out[i] = s[i] ^ s[i + 8];
+}
+
+static void b3_chunk_init(struct b3_chunk *c, __u64 counter)
+{
+    memcpy(c->cv, sha256_iv, sizeof(c->cv));
+    c->counter = counter;
+    c->block_len = 0;
+    c->blocks = 0;
+}
+
+static size_t b3_chunk_len(const struct b3_chunk *c)
+{
+    return (size_t)c->blocks * B3_BLOCK + c->block_len;
+}
+
+static void b3_chunk_feed(struct b3_chunk *c, const unsigned char *p, size_t len)
+{
+    size_t n;
+
+    while (len)
+    {
+        /* The last block is only compressed once it is known to be the last */
+        if (c->block_len == B3_BLOCK)
+        {
+            b3_compress(c->cv, c->block, c->counter, B3_BLOCK,
+                        c->blocks ? 0 : B3_CHUNK_START, c->cv);
+            c->blocks++;
+            c->block_len = 0;
+        }
+
+        n = B3_BLOCK - c->block_len < len ? B3_BLOCK - c->block_len : len;
+        memcpy(c->block + c->block_len, p, n);
+        c->block_len += n;
+        p += n;
+        len -= n;
+    }
+}
+
+/* Chaining value of the chunk, or the hash itself with @flags B3_ROOT */
+static void b3_chunk_cv(const struct b3_chunk *c, __u32 flags, __u32 out[8])
+{
+    unsigned char block[B3_BLOCK] = {0};
+
+    memcpy(block, c->block, c->block_len);
+    b3_compress(c->cv, block, flags & B3_ROOT ? 0 : c->counter, c->block_len,
+                flags | B3_CHUNK_END | (c->blocks ? 0 : B3_CHUNK_START), out);
+}
+
+static void b3_parent_cv(const __u32 left[8], const __u32 right[8], __u32 flags, __u32 out[8])
+{
+    unsigned char block[B3_BLOCK];
+    int i;
+
+    for (i = 0; i < 8; i++)
+    {
+        block[4 * i] = left[i];
+        block[4 * i + 1] = left[i] >> 8;
+        block[4 * i + 2] = left[i] >> 16;
+        block[4 * i + 3] = left[i] >> 24;
+        block[32 + 4 * i] = right[i];
+        block[32 + 4 * i + 1] = right[i] >> 8;
+        block[32 + 4 * i + 2] = right[i] >> 16;
+        block[32 + 4 * i + 3] = right[i] >> 24;
+    }
+    b3_compress(sha256_iv, block, 0, B3_BLOCK, B3_PARENT | flags, out);
+}
+
+static void b3_init(struct b3_ctx *ctx)
+{
+    b3_chunk_init(&ctx->chunk, 0);
+    ctx->depth = 0;
+}
+
+static void b3_feed(struct b3_ctx *ctx, const unsigned char *p, size_t len)
+{
+    __u32 cv[8];
+    __u64 chunks;
+    size_t n;
+
+    while (len)
+    {
+        if (b3_chunk_len(&ctx->chunk) == B3_CHUNK)
+        {
+            /* Merge completed subtrees, one per trailing zero of the chunk count */
+            b3_chunk_cv(&ctx->chunk, 0, cv);
+            for (chunks = ctx->chunk.counter + 1; !(chunks & 1); chunks >>= 1)
+                b3_parent_cv(ctx->stack[--ctx->depth], cv, 0, cv);
+            memcpy(ctx->stack[ctx->depth++], cv, sizeof(cv));
+            b3_chunk_init(&ctx->chunk, ctx->chunk.counter + 1);
+        }
+
+        n = B3_CHUNK - b3_chunk_len(&ctx->chunk);
+        if (n > len)
+            n = len;
+        b3_chunk_feed(&ctx->chunk, p, n);
+        p += n;
+        len -= n;
+    }
+}
+
+static void b3_final(struct b3_ctx *ctx, unsigned char out[32])
+{
+    __u32 cv[8];
+    unsigned int i;
+
+    if (!ctx->depth)
+    {
+        b3_chunk_cv(&ctx->chunk, B3_ROOT, cv);
+    }
+    else
+    {
+        b3_chunk_cv(&ctx->chunk, 0, cv);
+        for (i = ctx->depth; i-- > 0;)
+            b3_parent_cv(ctx->stack[i], cv, i ? 0 : B3_ROOT, cv);
+    }
+
+    for (i = 0; i < 8; i++)
+    {
+        out[4 * i] = cv[i];
+        out[4 * i + 1] = cv[i] >> 8;
+        out[4 * i + 2] = cv[i] >> 16;
+        out[4 * i + 3] = cv[i] >> 24;
+    }
+}
+
+/* Kernel selection */
+
+static void hash_setup(void)
+{
+    __u32 crc;
+    int i, j;
+
+    for (i = 0; i < 256; i++)
+    {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = crc & 1 ? crc >> 1 ^ 0x82F63B78 : crc >> 1;
+        crc32c_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++)
+    {
+        for (j = 1; j < 8; j++)
+            crc32c_table[j][i] = crc32c_table[0][crc32c_table[j - 1][i] & 0xff] ^
+                                 crc32c_table[j - 1][i] >> 8;
+    }
+
+    sha256_blocks = sha256_blocks_generic;
+    crc32c_update = crc32c_generic;
+#if defined(__x86_64__) || defined(__i386__)
+    {
+        unsigned int a, b, c, d;
+
+        if (__get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & bit_SHA) &&
+            __get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSE4_1) && (c & bit_SSSE3))
+            sha256_blocks = sha256_blocks_shani;
+#if defined(__x86_64__)
+        if (__get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSE4_2))
+            crc32c_update = crc32c_sse42;
+#endif
+    }
+#elif defined(__ARM_FEATURE_CRC32)
+    crc32c_update = crc32c_arm;
+#endif
+}
+
+/* Parses a comma separated list of algorithms into a mask, 0 if invalid */
+unsigned int hash_parse(const char *list)
+{
+    unsigned int algos = 0;
+    const char *p = list, *end;
+    size_t len;
+
+    while (*p)
+    {
+        end = strchr(p, ',');
+        len = end ? (size_t)(end - p) : strlen(p);
+
+        if (len == 6 && !strncmp(p, "sha256", len))
+            algos |= HASH_SHA256;
+        else if (len == 6 && !strncmp(p, "crc32c", len))
+            algos |= HASH_CRC32C;
+        else if (len == 6 && !strncmp(p, "blake3", len))
+            algos |= HASH_BLAKE3;
+        else
+            return 0;
+
+        p += len + !!end;
+    }
+    return algos;
+}
+
+errcode_t digest_begin(struct hash_ctx **ret)
+{
+    struct hash_ctx *ctx;
+
+    pthread_once(&hash_once, hash_setup);
+
+    ctx = malloc(sizeof(*ctx));
+    if (!ctx)
+        return EXT2_ET_NO_MEMORY;
+    if (hash_algos & HASH_SHA256)
+        sha256_init(&ctx->sha);
+    ctx->crc = ~0U;
+    if (hash_algos & HASH_BLAKE3)
+        b3_init(&ctx->b3);
+    *ret = ctx;
+    return 0;
+}
+
+void digest_feed(struct hash_ctx *ctx, const void *data, size_t len)
+{
+    __u64 start = stats_now();
+
+    if (hash_algos & HASH_SHA256)
+        sha256_feed(&ctx->sha, data, len);
+    if (hash_algos & HASH_CRC32C)
+        ctx->crc = crc32c_update(ctx->crc, data, len);
+    if (hash_algos & HASH_BLAKE3)
+        b3_feed(&ctx->b3, data, len);
+    stats_end(STAT_HASH, start, len, NULL);
+}
+
+/* Holes and unwritten extents read as zeroes */
+void digest_feed_zeroes(struct hash_ctx *ctx, __u64 len)
+{
+    static const unsigned char zeroes[1 << 16];
+    size_t n;
+
+    while (len)
+    {
+        n = len < sizeof(zeroes) ? len : sizeof(zeroes);
+        digest_feed(ctx, zeroes, n);
+        len -= n;
+    }
+}
+
+static errcode_t digest_push(struct digest_list *dl, const char *path, ext2_ino_t ino,
+                             struct hash_ctx *ctx)
+{
+    struct digest_rec *rec;
+    errcode_t retval = 0;
+
+    pthread_mutex_lock(&dl->lock);
+    if (dl->count == dl->size)
+    {
+        size_t new_cap = dl->size ? dl->size * 2 : 1024;
+
+        retval = ext2fs_resize_array(sizeof(*dl->recs), dl->size, new_cap, &dl->recs);
+        if (retval)
+            goto end;
+        dl->size = new_cap;
+    }
+
+    rec = &dl->recs[dl->count];
+    memset(rec, 0, sizeof(*rec));
+    rec->path = strdup(path);
+    if (!rec->path)
+    {
+        retval = EXT2_ET_NO_MEMORY;
+        goto end;
+    }
+    rec->ino = ino;
+    if (ctx)
+    {
+        rec->has = true;
+        if (hash_algos & HASH_SHA256)
+            sha256_final(&ctx->sha, rec->sha);
+        if (hash_algos & HASH_BLAKE3)
+            b3_final(&ctx->b3, rec->b3);
+        rec->crc = ~ctx->crc;
+    }
+    dl->count++;
+end:
+    pthread_mutex_unlock(&dl->lock);
+    return retval;
+}
+
+/* Finishes @ctx as the digest of @path, kept in @dl, and frees it */
+errcode_t digest_end(struct digest_list *dl, struct hash_ctx *ctx, const char *path,
+                     ext2_ino_t ino)
+{
+    errcode_t retval = digest_push(dl, path, ino, ctx);
+
+    free(ctx);
+    return retval;
+}
+
+void digest_abort(struct hash_ctx *ctx)
+{
+    free(ctx);
+}
+
+/* Later name of a hard link, it shares the digest of the first one */
+errcode_t digest_link(struct digest_list *dl, const char *path, ext2_ino_t ino)
+{
+    return digest_push(dl, path, ino, NULL);
+}
+
+static int digest_ino_cmp(const void *a, const void *b)
+{
+    const struct digest_rec *x = a, *y = b;
+
+    if (x->ino != y->ino)
+        return x->ino < y->ino ? -1 : 1;
+    return y->has - x->has;
+}
+
+static int digest_path_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct digest_rec *)a)->path, ((const struct digest_rec *)b)->path);
+}
+
+static void put_hex(FILE *f, const unsigned char *p, size_t len)
+{
+    while (len--)
+        fprintf(f, "%02x", *p++);
+    fputc(' ', f);
+}
+
+/* Paths go last so spaces need no quoting, only backslashes and newlines are escaped */
+static void put_path(FILE *f, const char *s)
+{
+    for (; *s; s++)
+    {
+        if (*s == '\\')
+            fputs("\\\\", f);
+        else if (*s == '\n')
+            fputs("\\n", f);
+        else
+            fputc(*s, f);
+    }
+}
+
+/* Writes the digests of @dl to @path, file paths prefixed with @prefix as in the configs */
+errcode_t digest_write(struct digest_list *dl, const char *path, const char *prefix)
+{
+    struct digest_rec *rec, *src = NULL;
+    FILE *f;
+    bool ok;
+
+    /* Link names take the digest of the name that was read */
+    qsort(dl->recs, dl->count, sizeof(*dl->recs), digest_ino_cmp);
+    for (rec = dl->recs; rec < dl->recs + dl->count; rec++)
+    {
+        if (rec->has)
+            src = rec;
+        else if (src && src->ino == rec->ino)
+        {
+            memcpy(rec->sha, src->sha, sizeof(rec->sha));
+            memcpy(rec->b3, src->b3, sizeof(rec->b3));
+            rec->crc = src->crc;
+            rec->has = true;
+        }
+    }
+    qsort(dl->recs, dl->count, sizeof(*dl->recs), digest_path_cmp);
+
+    f = fopen(path, "w");
+    if (!f)
+    {
+        E2FSTOOL_ERROR("while creating %s", path);
+        return errno;
+    }
+
+    fputc('#', f);
+    if (hash_algos & HASH_SHA256)
+        fputs(" sha256", f);
+    if (hash_algos & HASH_CRC32C)
+        fputs(" crc32c", f);
+    if (hash_algos & HASH_BLAKE3)
+        fputs(" blake3", f);
+    fputs(" path\n", f);
+
+    for (rec = dl->recs; rec < dl->recs + dl->count; rec++)
+    {
+        if (!rec->has)
+            continue;
+
+        if (hash_algos & HASH_SHA256)
+            put_hex(f, rec->sha, sizeof(rec->sha));
+        if (hash_algos & HASH_CRC32C)
+            fprintf(f, "%08x ", rec->crc);
+        if (hash_algos & HASH_BLAKE3)
+            put_hex(f, rec->b3, sizeof(rec->b3));
+        put_path(f, prefix);
+        put_path(f, rec->path);
+        fputc('\n', f);
+    }
+
+    ok = !ferror(f);
+    if (fclose(f) || !ok)
+    {
+        E2FSTOOL_ERROR("while writing %s", path);
+        return errno ?: EIO;
+    }
+    return 0;
+}
+
+void digest_list_init(struct digest_list *dl)
+{
+    memset(dl, 0, sizeof(*dl));
+    pthread_mutex_init(&dl->lock, NULL);
+}
+
+void digest_list_free(struct digest_list *dl)
+{
+    size_t i;
+
+    for (i = 0; i < dl->count; i++)
+        free(dl->recs[i].path);
+    ext2fs_free_mem(&dl->recs);
+    dl->count = dl->size = 0;
+    pthread_mutex_destroy(&dl->lock);
+}
@@ -0,0 +1,472 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "e2fstool.h"
+
+/*
+ * Incremental extraction (--incremental manifest).
+ *
+ * The manifest of the previous run lists every extracted entry with a
+ * fingerprint of its metadata: type, size, mode, owner and mtime, plus
+ * the extent map of regular files, the inline data of inline files and
+ * the target of symlinks. The fingerprint never needs file data, so
+ * entries that kept it are skipped without reading a block. Changed
+ * entries are removed first and extracted again, which also breaks
+ * hard links the old tree may have shared. Entries gone from the image
+ * are deleted at the end, and the manifest is then replaced by the one
+ * of this run.
+ */
+
+#define INCR_HEADER "# e2fstool incremental manifest 1"
+
+struct incr_entry {
+    char *path;
+    __u64 fp;
+    __u64 size;
+    __u32 mode, uid, gid, mtime;
+    char type; /* 'f' regular file, 'd' directory, 'l' symlink and the rest */
+    atomic_bool seen;
+};
+
+static struct incr_entry *old_entries = NULL, *new_entries = NULL;
+static size_t old_count = 0, new_count = 0, new_size = 0;
+static pthread_mutex_t new_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *manifest_path = NULL;
+static const char *incr_out_dir = NULL;
+
+static int incr_entry_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct incr_entry *)a)->path, ((const struct incr_entry *)b)->path);
+}
+
+/* Same escaping as list.c, paths stay one field of one line */
+static void incr_put_path(FILE *f, const char *s)
+{
+    for (; *s; s++)
+    {
+        unsigned char c = *s;
+
+        if (c == '\\')
+            fputs("\\\\", f);
+        else if (c == '\t')
+            fputs("\\t", f);
+        else if (c == '\n')
+            fputs("\\n", f);
+        else if (c < 0x20)
+            fprintf(f, "\\x%02x", c);
+        else
+            fputc(c, f);
+    }
+}
+
+/* Unescapes @s in place */
+static void incr_get_path(char *s)
+{
+    char *d = s;
+    unsigned int c;
+
+    for (; *s; s++)
+    {
+        if (*s != '\\' || !s[1])
+        {
+            *d++ = *s;
+            continue;
+        }
+
+        s++;
+        if (*s == 't')
+            *d++ = '\t';
+        else if (*s == 'n')
+            *d++ = '\n';
+        else if (*s == 'x' && sscanf(s + 1, "%2x", &c) == 1)
+        {
+            *d++ = c;
+            s += 2;
+        }
+        else
+            *d++ = *s;
+    }
+    *d = '\0';
+}
+
+static errcode_t incr_load(FILE *f)
+{
+    char *line = NULL, *path;
+    size_t line_size = 0, size = 0;
+    ssize_t len;
+    struct incr_entry e;
+    unsigned long long fp, fsize;
+    int n;
+    errcode_t retval = 0;
+
+    len = getline(&line, &line_size, f);
+    if (len < 0 || strncmp(line, INCR_HEADER, strlen(INCR_HEADER)))
+    {
+        free(line);
+        return EXT2_ET_BAD_MAGIC;
+    }
+
+    while ((len = getline(&line, &line_size, f)) > 0)
+    {
+        if (line[len - 1] == '\n')
+            line[--len] = '\0';
+
+        memset(&e, 0, sizeof(e));
+        n = 0;
+        if (sscanf(line, "%c\t%llx\t%llu\t%o\t%u\t%u\t%u\t%n", &e.type, &fp, &fsize, &e.mode,
+                   &e.uid, &e.gid, &e.mtime, &n) != 7 || !n)
+            continue;
+
+        path = line + n;
+        incr_get_path(path);
+        e.path = strdup(path);
+        if (!e.path)
+        {
+            retval = EXT2_ET_NO_MEMORY;
+            break;
+        }
+        e.fp = fp;
+        e.size = fsize;
+
+        if (old_count == size)
+        {
+            size_t new_cap = size ? size * 2 : 1024;
+
+            retval = ext2fs_resize_array(sizeof(*old_entries), size, new_cap, &old_entries);
+            if (retval)
+            {
+                free(e.path);
+                break;
+            }
+            size = new_cap;
+        }
+        old_entries[old_count++] = e;
+    }
+
+    free(line);
+    qsort(old_entries, old_count, sizeof(*old_entries), incr_entry_cmp);
+    return retval;
+}
+
+/* Loads the previous manifest at @path, a missing one means a full run */
+errcode_t incr_init(const char *path, const char *out_dir)
+{
+    FILE *f;
+    errcode_t retval = 0;
+
+    manifest_path = strdup(path);
+    if (!manifest_path)
+        return EXT2_ET_NO_MEMORY;
+    incr_out_dir = out_dir;
+
+    f = fopen(path, "r");
+    if (!f)
+    {
+        if (errno == ENOENT)
+            return 0;
+        E2FSTOOL_ERROR("while opening manifest %s", path);
+        return errno;
+    }
+
+    retval = incr_load(f);
+    fclose(f);
+    if (retval)
+        com_err(__func__, retval, "while reading manifest %s", path);
+    return retval;
+}
+
+static errcode_t incr_fingerprint(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
+                                  __u64 *ret)
+{
+    struct {
+        __u64 size;
+        __u32 mtime, uid, gid;
+        __u16 mode;
+    } meta;
+    struct extent_run *runs = NULL;
+    size_t count = 0, i;
+    char *buf = NULL;
+    __u64 h, v[4];
+    errcode_t retval = 0;
+
+    memset(&meta, 0, sizeof(meta));
+    meta.size = EXT2_I_SIZE(inode);
+    meta.mtime = inode->i_mtime;
+    meta.uid = inode_uid(*inode);
+    meta.gid = inode_gid(*inode);
+    meta.mode = inode->i_mode;
+    h = hash_bytes(&meta, sizeof(meta));
+
+    if (LINUX_S_ISDIR(inode->i_mode))
+    {
+        /* Directories are never skipped, their contents are compared one by one */
+    }
+    else if (LINUX_S_ISREG(inode->i_mode) && (inode->i_flags & EXT4_INLINE_DATA_FL))
+    {
+        size_t size = fs->blocksize;
+
+        buf = malloc(size);
+        if (!buf)
+            return EXT2_ET_NO_MEMORY;
+        retval = ext2fs_inline_data_get(fs, ino, inode, buf, &size);
+        if (!retval)
+            h = hash_update(h, buf, size);
+    }
+    else if (LINUX_S_ISREG(inode->i_mode) && (inode->i_flags & EXT4_EXTENTS_FL))
+    {
+        retval = ino_get_extent_runs(fs, ino, inode, &runs, &count);
+        for (i = 0; !retval && i < count; i++)
+        {
+            v[0] = runs[i].lblk;
+            v[1] = runs[i].pblk;
+            v[2] = runs[i].len;
+            v[3] = runs[i].uninit;
+            h = hash_update(h, v, sizeof(v));
+        }
+    }
+    else if (LINUX_S_ISLNK(inode->i_mode) && EXT2_I_SIZE(inode) >= SYMLINK_I_BLOCK_MAX_SIZE)
+    {
+        retval = ino_read_symlink(fs, ino, inode, &buf);
+        if (!retval)
+            h = hash_update(h, buf, strlen(buf));
+    }
+    else
+    {
+        /* Block map, fast symlink target or device number */
+        h = hash_update(h, inode->i_block, sizeof(inode->i_block));
+    }
+
+    ext2fs_free_mem(&runs);
+    free(buf);
+    *ret = h;
+    return retval;
+}
+
+static errcode_t incr_push(const struct incr_entry *src)
+{
+    struct incr_entry *e;
+    errcode_t retval = 0;
+
+    pthread_mutex_lock(&new_lock);
+    if (new_count == new_size)
+    {
+        size_t new_cap = new_size ? new_size * 2 : 1024;
+
+        retval = ext2fs_resize_array(sizeof(*new_entries), new_size, new_cap, &new_entries);
+        if (retval)
+            goto end;
+        new_size = new_cap;
+    }
+
+    e = &new_entries[new_count];
+    *e = *src;
+    e->path = strdup(src->path);
+    if (!e->path)
+    {
+        retval = EXT2_ET_NO_MEMORY;
+        goto end;
+    }
+    atomic_init(&e->seen, false);
+    new_count++;
+end:
+    pthread_mutex_unlock(&new_lock);
+    return retval;
+}
+
+/* Removes @path and, if it is a directory, everything below it */
+static int remove_tree(const char *path)
+{
+    struct dirent *de;
+    char *child;
+    DIR *dir;
+    int ret = 0;
+
+    if (!unlink(path) || errno == ENOENT)
+        return 0;
+
+    dir = opendir(path);
+    if (!dir)
+        return -1;
+    while (!ret && (de = readdir(dir)))
+    {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if (asprintf(&child, "%s/%s", path, de->d_name) < 0)
+        {
+            errno = ENOMEM;
+            ret = -1;
+            break;
+        }
+        ret = remove_tree(child);
+        free(child);
+    }
+    closedir(dir);
+
+    return ret ?: rmdir(path);
+}
+
+/*
+ * Records @path for the new manifest and compares it with the previous
+ * run. *@unchanged tells the caller to leave the output alone; otherwise
+ * whatever the old run left at @path is already gone.
+ */
+errcode_t incr_check(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
+                     const char *path, bool *unchanged)
+{
+    struct incr_entry key = {.path = (char *)path}, *old;
+    char type = LINUX_S_ISDIR(inode->i_mode) ? 'd' : LINUX_S_ISREG(inode->i_mode) ? 'f' : 'l';
+    char *full;
+    __u64 fp;
+    int ret;
+    errcode_t retval;
+
+    *unchanged = false;
+    retval = incr_fingerprint(fs, ino, inode, &fp);
+    if (!retval)
+    {
+        struct incr_entry e = {
+            .path = (char *)path,
+            .fp = fp,
+            .size = EXT2_I_SIZE(inode),
+            .mode = inode->i_mode,
+            .uid = inode_uid(*inode),
+            .gid = inode_gid(*inode),
+            .mtime = inode->i_mtime,
+            .type = type,
+        };
+
+        retval = incr_push(&e);
+    }
+    if (retval)
+    {
+        com_err(__func__, retval, "while fingerprinting %s", path);
+        return retval;
+    }
+
+    old = old_count ? bsearch(&key, old_entries, old_count, sizeof(*old_entries), incr_entry_cmp)
+                    : NULL;
+    if (!old)
+        return 0;
+    atomic_store(&old->seen, true);
+
+    if (old->type == type && (type == 'd' || old->fp == fp))
+    {
+        *unchanged = true;
+        return 0;
+    }
+
+    if (asprintf(&full, "%s%s", incr_out_dir, path) < 0)
+        return EXT2_ET_NO_MEMORY;
+    ret = old->type == 'd' ? remove_tree(full) : unlink(full);
+    if (ret == -1 && errno != ENOENT)
+    {
+        E2FSTOOL_ERROR("while removing stale %s", full);
+        retval = errno;
+    }
+    free(full);
+    return retval;
+}
+
+static errcode_t incr_write(void)
+{
+    struct incr_entry *e;
+    char *tmp;
+    FILE *f;
+    bool ok;
+    errcode_t retval = 0;
+
+    if (asprintf(&tmp, "%s.tmp", manifest_path) < 0)
+        return EXT2_ET_NO_MEMORY;
+
+    f = fopen(tmp, "w");
+    if (!f)
+    {
+        E2FSTOOL_ERROR("while creating manifest %s", tmp);
+        free(tmp);
+        return errno;
+    }
+
+    fprintf(f, "%s\n", INCR_HEADER);
+    for (e = new_entries; e < new_entries + new_count; e++)
+    {
+        fprintf(f, "%c\t%016llx\t%llu\t%o\t%u\t%u\t%u\t", e->type, (unsigned long long)e->fp,
+                (unsigned long long)e->size, e->mode, e->uid, e->gid, e->mtime);
+        incr_put_path(f, e->path);
+        fputc('\n', f);
+    }
+
+    ok = !ferror(f);
+    if (fclose(f) || !ok || rename(tmp, manifest_path))
+    {
+        E2FSTOOL_ERROR("while writing manifest %s", manifest_path);
+        retval = errno ?: EIO;
+        unlink(tmp);
+    }
+    free(tmp);
+    return retval;
+}
+
+/*
+ * Deletes what vanished from the image and replaces the manifest. With
+ * @prune false (a filtered walk) unvisited entries may still exist, they
+ * are kept and carried over instead.
+ */
+errcode_t incr_finish(bool prune, size_t *removed)
+{
+    size_t i;
+    char *full;
+    int ret;
+    errcode_t retval;
+
+    *removed = 0;
+
+    /* Descending order puts children before their directory */
+    for (i = old_count; i-- > 0;)
+    {
+        struct incr_entry *e = &old_entries[i];
+
+        if (atomic_load(&e->seen))
+            continue;
+
+        if (!prune)
+        {
+            retval = incr_push(e);
+            if (retval)
+                return retval;
+            continue;
+        }
+
+        if (asprintf(&full, "%s%s", incr_out_dir, e->path) < 0)
+            return EXT2_ET_NO_MEMORY;
+        ret = e->type == 'd' ? rmdir(full) : unlink(full);
+        if (!ret)
+            (*removed)++;
+        else if (errno != ENOENT)
+            E2FSTOOL_ERROR("while removing %s", full);
+        free(full);
+    }
+
+    qsort(new_entries, new_count, sizeof(*new_entries), incr_entry_cmp);
+    return incr_write();
+}
+
+void incr_free(void)
+{
+    size_t i;
+
+    for (i = 0; i < old_count; i++)
+        free(old_entries[i].path);
+    for (i = 0; i < new_count; i++)
+        free(new_entries[i].path);
+    ext2fs_free_mem(&old_entries);
+    ext2fs_free_mem(&new_entries);
+    old_count = new_count = new_size = 0;
+    free(manifest_path);
+    manifest_path = NULL;
+}
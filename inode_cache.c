@@ -0,0 +1,261 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "e2fstool.h"
+
+/*
+ * Inode table cache.
+ *
+ * ext2fs_read_inode() costs one small random read per inode. Here the
+ * first lookup in a group loads the used part of its inode table with a
+ * single read, and later lookups in that group are served from memory.
+ * Entries are mostly allocated in the group of their directory, so
+ * entering a directory loads the table its entries live in. Groups are
+ * evicted least recently used first once the cap of the cache is
+ * reached, and a group larger than the cap goes through libext2fs.
+ *
+ * Every image has a cache of its own, found by ino_read() in the
+ * priv_data of each handle on the image. Loaded tables are shared by all
+ * handles; a miss reads through the handle that hit it, outside the lock.
+ */
+
+struct icache_group {
+    char *buf;
+    size_t len;
+    ext2_ino_t count;
+    dgrp_t group;
+    struct icache_group *prev, *next;
+};
+
+struct icache {
+    struct icache_group **groups;
+    dgrp_t group_count;
+    struct icache_group *lru_head, *lru_tail;
+    size_t used, cap;
+    pthread_mutex_t lock;
+};
+
+size_t icache_cap = ICACHE_DEFAULT_CAP;
+
+static void lru_unlink(struct icache *ic, struct icache_group *g)
+{
+    if (g->prev)
+        g->prev->next = g->next;
+    else
+        ic->lru_head = g->next;
+    if (g->next)
+        g->next->prev = g->prev;
+    else
+        ic->lru_tail = g->prev;
+    g->prev = g->next = NULL;
+}
+
+static void lru_push(struct icache *ic, struct icache_group *g)
+{
+    g->next = ic->lru_head;
+    if (ic->lru_head)
+        ic->lru_head->prev = g;
+    ic->lru_head = g;
+    if (!ic->lru_tail)
+        ic->lru_tail = g;
+}
+
+static void icache_group_free(struct icache_group *g)
+{
+    free(g->buf);
+    free(g);
+}
+
+/* Reads the in-use part of the inode table of @group, NULL if not cacheable */
+static errcode_t icache_load(struct icache *ic, ext2_filsys fs, dgrp_t group,
+                             struct icache_group **ret)
+{
+    ext2_ino_t count = EXT2_INODES_PER_GROUP(fs->super);
+    blk64_t blk = ext2fs_inode_table_loc(fs, group);
+    size_t blocks, len;
+    struct icache_group *g;
+    errcode_t retval;
+
+    *ret = NULL;
+    if (ext2fs_has_group_desc_csum(fs))
+    {
+        __u32 unused = ext2fs_bg_itable_unused(fs, group);
+
+        count = unused < count ? count - unused : 0;
+    }
+
+    len = (size_t)count * EXT2_INODE_SIZE(fs->super);
+    blocks = (len + fs->blocksize - 1) / fs->blocksize;
+    if (!count || !blk || blocks * fs->blocksize > ic->cap)
+        return 0;
+
+    g = calloc(1, sizeof(*g));
+    if (!g)
+        return EXT2_ET_NO_MEMORY;
+
+    g->len = blocks * fs->blocksize;
+    g->count = count;
+    g->group = group;
+    g->buf = malloc(g->len);
+    if (!g->buf)
+    {
+        free(g);
+        return EXT2_ET_NO_MEMORY;
+    }
+
+    retval = io_channel_read_blk64(fs->io, blk, blocks, g->buf);
+    if (retval)
+    {
+        com_err(__func__, retval, "while reading inode table of group %u", group);
+        icache_group_free(g);
+        return retval;
+    }
+
+    *ret = g;
+    return 0;
+}
+
+/* Copies inode @index of @g out, called with the cache lock held */
+static void icache_copy(struct icache *ic, ext2_filsys fs, struct icache_group *g,
+                        ext2_ino_t index, struct ext2_inode_large *dst)
+{
+    int inode_size = EXT2_INODE_SIZE(fs->super);
+
+    memcpy(dst, g->buf + (size_t)index * inode_size, inode_size);
+    if (g != ic->lru_head)
+    {
+        lru_unlink(ic, g);
+        lru_push(ic, g);
+    }
+}
+
+/* A cache of up to @cap bytes of inode tables for the image of @fs */
+errcode_t icache_new(ext2_filsys fs, size_t cap, struct icache **ret)
+{
+    struct icache *ic;
+
+    ic = calloc(1, sizeof(*ic));
+    if (ic)
+        ic->groups = calloc(fs->group_desc_count, sizeof(*ic->groups));
+    if (!ic || !ic->groups)
+    {
+        free(ic);
+        E2FSTOOL_ERROR("while allocating memory");
+        return EXT2_ET_NO_MEMORY;
+    }
+    ic->group_count = fs->group_desc_count;
+    ic->cap = cap;
+    pthread_mutex_init(&ic->lock, NULL);
+    *ret = ic;
+    return 0;
+}
+
+/* Makes ino_read() on @fs, a handle on the image of @ic, go through @ic */
+void icache_attach(struct icache *ic, ext2_filsys fs)
+{
+    fs->priv_data = ic;
+}
+
+/*
+ * Drop-in for ext2fs_read_inode_full(). Checksums are verified the way
+ * libext2fs does it, misses and unused slots fall back to libext2fs.
+ */
+errcode_t ino_read(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode, int bufsize)
+{
+    struct icache *ic = fs->priv_data;
+    int inode_size = EXT2_INODE_SIZE(fs->super);
+    char raw[1024] __attribute__((aligned(8)));
+    struct ext2_inode_large *large = (struct ext2_inode_large *)raw;
+    struct icache_group *g, *victim;
+    ext2_ino_t index;
+    dgrp_t group;
+    bool hit = false;
+    errcode_t retval;
+
+    if (!ic || inode_size > (int)sizeof(raw))
+        return ext2fs_read_inode_full(fs, ino, inode, bufsize);
+    if (!ino || ino > fs->super->s_inodes_count)
+        return EXT2_ET_BAD_INODE_NUM;
+
+    group = (ino - 1) / EXT2_INODES_PER_GROUP(fs->super);
+    index = (ino - 1) % EXT2_INODES_PER_GROUP(fs->super);
+    if (group >= ic->group_count)
+        return ext2fs_read_inode_full(fs, ino, inode, bufsize);
+
+    pthread_mutex_lock(&ic->lock);
+    g = ic->groups[group];
+    if (g && index < g->count)
+    {
+        icache_copy(ic, fs, g, index, large);
+        hit = true;
+    }
+    pthread_mutex_unlock(&ic->lock);
+
+    if (!hit && !g)
+    {
+        retval = icache_load(ic, fs, group, &g);
+        if (retval)
+            return retval;
+
+        pthread_mutex_lock(&ic->lock);
+        if (g && ic->groups[group])
+        {
+            /* Another worker loaded it meanwhile */
+            icache_group_free(g);
+            g = ic->groups[group];
+        }
+        else if (g)
+        {
+            ic->groups[group] = g;
+            lru_push(ic, g);
+            ic->used += g->len;
+            while (ic->used > ic->cap && ic->lru_tail != g)
+            {
+                victim = ic->lru_tail;
+                lru_unlink(ic, victim);
+                ic->groups[victim->group] = NULL;
+                ic->used -= victim->len;
+                icache_group_free(victim);
+            }
+        }
+        if (g && index < g->count)
+        {
+            icache_copy(ic, fs, g, index, large);
+            hit = true;
+        }
+        pthread_mutex_unlock(&ic->lock);
+    }
+
+    if (!hit)
+        return ext2fs_read_inode_full(fs, ino, inode, bufsize);
+
+    if (!(fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS) &&
+        !ext2fs_inode_csum_verify(fs, ino, large))
+        return EXT2_ET_INODE_CSUM_INVALID;
+
+#ifdef WORDS_BIGENDIAN
+    ext2fs_swap_inode_full(fs, (struct ext2_inode_large *)inode, large, 0,
+                           bufsize < inode_size ? bufsize : inode_size);
+#else
+    memcpy(inode, large, bufsize < inode_size ? bufsize : inode_size);
+#endif
+    return 0;
+}
+
+void icache_free(struct icache *ic)
+{
+    struct icache_group *g, *next;
+
+    if (!ic)
+        return;
+
+    for (g = ic->lru_head; g; g = next)
+    {
+        next = g->next;
+        icache_group_free(g);
+    }
+    pthread_mutex_destroy(&ic->lock);
+    free(ic->groups);
+    free(ic);
+}
@@ -0,0 +1,1006 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "e2fstool.h"
+
+/*
+ * Core of e2fstool as a library, see libe2fstool.h. Besides opening and
+ * walking images, the helpers the extractor shares with it live here:
+ * path arenas, extent runs and symlink targets.
+ */
+
+struct e2fstool_image {
+    ext2_filsys fs;
+    char *name; /* As handed to ext2fs_open(), libsparse wants a spec */
+    io_manager io;
+    unsigned int blocksize;
+    int flags;
+    image_type_t type;
+    compress_type_t compression;
+    struct icache *icache; /* Shared by every handle, or NULL */
+};
+
+/* One e2fstool_walk(), handed through the libext2fs iterators */
+struct walk_state {
+    ext2_filsys fs;
+    const struct e2fstool_visitor *visitor;
+    void *data;
+    struct path_arena path;
+    struct ext2_inode_large *inode;
+    int inode_size;
+    unsigned int depth;
+    char *buf; /* E2FSTOOL_CHUNK bytes of file data */
+    bool stop;
+    errcode_t retval;
+};
+
+struct walk_data_args {
+    struct walk_state *st;
+    const struct e2fstool_entry *e;
+    e2fstool_action_t action;
+};
+
+struct walk_xattr_args {
+    struct walk_state *st;
+    const struct e2fstool_entry *e;
+    e2fstool_action_t action;
+};
+
+errcode_t path_reserve(struct path_arena *pa, size_t len)
+{
+    size_t cap = pa->cap ? pa->cap : PATH_ARENA_INIT;
+    char *buf;
+
+    if (len < pa->cap)
+        return 0;
+
+    while (cap <= len)
+        cap *= 2;
+
+    buf = realloc(pa->buf, cap);
+    if (!buf)
+    {
+        com_err(__func__, EXT2_ET_NO_MEMORY, "while allocating memory");
+        return EXT2_ET_NO_MEMORY;
+    }
+    pa->buf = buf;
+    pa->cap = cap;
+    return 0;
+}
+
+errcode_t path_set(struct path_arena *pa, const char *path)
+{
+    size_t len = strlen(path);
+    errcode_t retval;
+
+    retval = path_reserve(pa, len);
+    if (retval)
+        return retval;
+
+    memcpy(pa->buf, path, len + 1);
+    pa->len = len;
+    return 0;
+}
+
+errcode_t path_push(struct path_arena *pa, const char *name, size_t len)
+{
+    errcode_t retval;
+
+    retval = path_reserve(pa, pa->len + len + 1);
+    if (retval)
+        return retval;
+
+    pa->buf[pa->len++] = '/';
+    memcpy(pa->buf + pa->len, name, len);
+    pa->len += len;
+    pa->buf[pa->len] = '\0';
+    return 0;
+}
+
+/* Joins @prefix and @path in @pa, which is reused from call to call */
+const char *path_join(struct path_arena *pa, const char *prefix, const char *path)
+{
+    size_t plen = strlen(prefix), len = strlen(path);
+
+    if (path_reserve(pa, plen + len))
+        return NULL;
+
+    memcpy(pa->buf, prefix, plen);
+    memcpy(pa->buf + plen, path, len + 1);
+    pa->len = plen + len;
+    return pa->buf;
+}
+
+void path_free(struct path_arena *pa)
+{
+    free(pa->buf);
+    pa->buf = NULL;
+    pa->len = pa->cap = 0;
+}
+
+/*
+ * Reads the runs of an extent tree held entirely in the inode, which is
+ * most small files, without an extent handle. Returns their count, or -1
+ * if the tree has index levels and libext2fs has to walk it.
+ */
+int ino_root_runs(const struct ext2_inode *inode, struct extent_run *runs)
+{
+    const struct ext3_extent_header *eh = (const struct ext3_extent_header *)inode->i_block;
+    const struct ext3_extent *ex = (const struct ext3_extent *)(eh + 1);
+    unsigned int entries = ext2fs_le16_to_cpu(eh->eh_entries), i, len;
+    int count = 0, uninit;
+    blk64_t lblk, pblk;
+
+    if (ext2fs_le16_to_cpu(eh->eh_magic) != EXT3_EXT_MAGIC ||
+        ext2fs_le16_to_cpu(eh->eh_depth) || entries > ROOT_RUNS_MAX)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < entries; i++)
+    {
+        len = ext2fs_le16_to_cpu(ex[i].ee_len);
+        uninit = len > EXT_INIT_MAX_LEN;
+        if (uninit)
+            len -= EXT_INIT_MAX_LEN;
+        if (!len)
+            continue;
+        lblk = ext2fs_le32_to_cpu(ex[i].ee_block);
+        pblk = ext2fs_le32_to_cpu(ex[i].ee_start) |
+               (blk64_t)ext2fs_le16_to_cpu(ex[i].ee_start_hi) << 32;
+
+        if (count && runs[count - 1].lblk + runs[count - 1].len == lblk &&
+            runs[count - 1].pblk + runs[count - 1].len == pblk &&
+            runs[count - 1].uninit == uninit)
+        {
+            runs[count - 1].len += len;
+            continue;
+        }
+        runs[count].lblk = lblk;
+        runs[count].pblk = pblk;
+        runs[count].len = len;
+        runs[count].uninit = uninit;
+        count++;
+    }
+    return count;
+}
+
+errcode_t ino_get_extent_runs(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
+                              struct extent_run **ret_runs, size_t *ret_count)
+{
+    ext2_extent_handle_t handle;
+    struct ext2fs_extent extent;
+    struct extent_run *runs = NULL, *last;
+    struct extent_run root[ROOT_RUNS_MAX];
+    size_t count = 0, size = 0;
+    int root_count;
+    errcode_t retval;
+
+    root_count = ino_root_runs(inode, root);
+    if (root_count >= 0)
+    {
+        if (root_count)
+        {
+            retval = ext2fs_get_array(root_count, sizeof(*runs), &runs);
+            if (retval)
+            {
+                com_err(__func__, retval, "while allocating memory");
+                return retval;
+            }
+            memcpy(runs, root, root_count * sizeof(*runs));
+        }
+        *ret_runs = runs;
+        *ret_count = root_count;
+        return 0;
+    }
+
+    retval = ext2fs_extent_open2(fs, ino, inode, &handle);
+    if (retval)
+    {
+        com_err(__func__, retval, "while opening extents of inode %u", ino);
+        return retval;
+    }
+
+    retval = ext2fs_extent_get(handle, EXT2_EXTENT_ROOT, &extent);
+    while (!retval)
+    {
+        if (!(extent.e_flags & EXT2_EXTENT_FLAGS_LEAF) || !extent.e_len)
+            goto next;
+
+        last = count ? &runs[count - 1] : NULL;
+        if (last &&
+            last->lblk + last->len == extent.e_lblk &&
+            last->pblk + last->len == extent.e_pblk &&
+            last->uninit == !!(extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT))
+        {
+            last->len += extent.e_len;
+            goto next;
+        }
+
+        if (count == size)
+        {
+            size_t new_size = size ? size * 2 : 8;
+
+            retval = ext2fs_resize_array(sizeof(*runs), size, new_size, &runs);
+            if (retval)
+            {
+                com_err(__func__, retval, "while allocating memory");
+                goto end;
+            }
+            size = new_size;
+        }
+
+        runs[count].lblk = extent.e_lblk;
+        runs[count].pblk = extent.e_pblk;
+        runs[count].len = extent.e_len;
+        runs[count].uninit = !!(extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT);
+        count++;
+next:
+        retval = ext2fs_extent_get(handle, EXT2_EXTENT_NEXT_LEAF, &extent);
+    }
+
+    if (retval == EXT2_ET_EXTENT_NO_NEXT)
+        retval = 0;
+    else
+        com_err(__func__, retval, "while walking extents of inode %u", ino);
+
+end:
+    ext2fs_extent_free(handle);
+    if (retval)
+    {
+        ext2fs_free_mem(&runs);
+        return retval;
+    }
+
+    *ret_runs = runs;
+    *ret_count = count;
+    return 0;
+}
+
+struct block_runs {
+    struct extent_run *runs;
+    size_t count, size;
+    errcode_t retval;
+};
+
+static int block_runs_cb(ext2_filsys fs EXT2FS_ATTR((unused)), blk64_t *blocknr,
+                         e2_blkcnt_t blockcnt, blk64_t ref_blk EXT2FS_ATTR((unused)),
+                         int ref_offset EXT2FS_ATTR((unused)), void *priv_data)
+{
+    struct block_runs *br = priv_data;
+    struct extent_run *last = br->count ? &br->runs[br->count - 1] : NULL;
+
+    if (last && last->lblk + last->len == (blk64_t)blockcnt &&
+        last->pblk + last->len == *blocknr)
+    {
+        last->len++;
+        return 0;
+    }
+
+    if (br->count == br->size)
+    {
+        size_t new_size = br->size ? br->size * 2 : 8;
+
+        br->retval = ext2fs_resize_array(sizeof(*br->runs), br->size, new_size, &br->runs);
+        if (br->retval)
+            return BLOCK_ABORT;
+        br->size = new_size;
+    }
+    br->runs[br->count++] = (struct extent_run){blockcnt, *blocknr, 1, 0};
+    return 0;
+}
+
+/* ino_get_extent_runs() for block mapped files, gaps in the map are holes */
+errcode_t ino_get_block_runs(ext2_filsys fs, ext2_ino_t ino, struct extent_run **ret_runs,
+                             size_t *ret_count)
+{
+    struct block_runs br = {0};
+    errcode_t retval;
+
+    retval = ext2fs_block_iterate3(fs, ino, BLOCK_FLAG_READ_ONLY | BLOCK_FLAG_DATA_ONLY, NULL,
+                                   block_runs_cb, &br);
+    retval = br.retval ?: retval;
+    if (retval)
+    {
+        com_err(__func__, retval, "while iterating blocks of inode %u", ino);
+        ext2fs_free_mem(&br.runs);
+        return retval;
+    }
+
+    *ret_runs = br.runs;
+    *ret_count = br.count;
+    return 0;
+}
+
+/*
+ * Goes through the first @size bytes of file @ino, mapped by @runs, in
+ * order: data is read into @buf, whole blocks of up to @buflen bytes at
+ * a time, and handed to @ops->data, everything else goes to @ops->hole.
+ */
+errcode_t ino_read_runs(ext2_filsys fs, ext2_ino_t ino, const struct extent_run *runs,
+                        size_t count, __u64 size, char *buf, size_t buflen,
+                        const struct run_ops *ops, void *data)
+{
+    unsigned int bs = fs->blocksize;
+    blk64_t buf_blocks = buflen / bs, done, n;
+    __u64 off = 0, start, len, chunk;
+    size_t i;
+    errcode_t retval = 0;
+
+    for (i = 0; i < count && off < size && !retval; i++)
+    {
+        start = runs[i].lblk * bs;
+        if (start >= size)
+            break;
+        if (start > off)
+        {
+            retval = ops->hole(data, off, start - off);
+            if (retval)
+                break;
+            off = start;
+        }
+
+        len = runs[i].len * bs < size - off ? runs[i].len * bs : size - off;
+        if (runs[i].uninit)
+        {
+            retval = ops->hole(data, off, len);
+            off += len;
+            continue;
+        }
+
+        done = 0;
+        if (ops->take)
+        {
+            retval = ops->take(data, &runs[i], len, &done);
+            if (retval)
+                break;
+            if (done * bs >= len)
+            {
+                off += len;
+                continue;
+            }
+            off += done * bs;
+        }
+
+        for (; done < runs[i].len && off < size; done += n)
+        {
+            n = runs[i].len - done < buf_blocks ? runs[i].len - done : buf_blocks;
+            chunk = n * bs < size - off ? n * bs : size - off;
+
+            if (ops->read)
+                retval = ops->read(data, runs[i].pblk + done, n, buf);
+            else
+                retval = io_channel_read_blk64(fs->io, runs[i].pblk + done, n, buf);
+            if (retval)
+            {
+                com_err(__func__, retval, "while reading blocks %llu-%llu of inode %u",
+                        (unsigned long long)(runs[i].pblk + done),
+                        (unsigned long long)(runs[i].pblk + done + n - 1), ino);
+                break;
+            }
+
+            retval = ops->data(data, off, buf, chunk);
+            if (retval)
+                break;
+            off += chunk;
+        }
+    }
+
+    if (!retval && off < size)
+        retval = ops->hole(data, off, size - off);
+    return retval;
+}
+
+errcode_t ino_read_symlink(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
+                           char **target)
+{
+    ext2_file_t e2_file;
+    char *link_target = NULL;
+    __u32 i_size = inode->i_size;
+    errcode_t retval = 0;
+
+    link_target = malloc(i_size + 1);
+    if (!link_target)
+    {
+        com_err(__func__, EXT2_ET_NO_MEMORY, "while allocating memory");
+        return EXT2_ET_NO_MEMORY;
+    }
+
+    if (i_size < SYMLINK_I_BLOCK_MAX_SIZE)
+    {
+        strncpy(link_target, (char *)inode->i_block, i_size + 1);
+    }
+    else
+    {
+        unsigned bytes = i_size;
+        char *p = link_target;
+        retval = ext2fs_file_open2(fs, ino, inode, 0, &e2_file);
+        if (retval)
+        {
+            com_err(__func__, retval, "while opening ex2fs symlink");
+            goto end;
+        }
+        for (;;)
+        {
+            unsigned int got;
+            retval = ext2fs_file_read(e2_file, p, bytes, &got);
+            if (retval)
+            {
+                com_err(__func__, retval, "while reading ex2fs symlink");
+                goto end;
+            }
+            bytes -= got;
+            p += got;
+            if (got == 0 || bytes == 0)
+                break;
+        }
+        link_target[i_size] = '\0';
+        retval = ext2fs_file_close(e2_file);
+        if (retval)
+        {
+            com_err(__func__, retval, "while closing symlink");
+            goto end;
+        }
+    }
+
+end:
+    if (retval)
+        free(link_target);
+    else
+        *target = link_target;
+    return retval;
+}
+
+static image_type_t get_magic_image_type(uint32_t sparse_magic, uint32_t moto_magic,
+                                         uint16_t ext4_magic)
+{
+    if (sparse_magic == SPARSE_HEADER_MAGIC && moto_magic == MOTO_HEADER_MAGIC)
+        return E2FSTOOL_MOTO;
+    if (sparse_magic == SPARSE_HEADER_MAGIC)
+        return E2FSTOOL_SPARSE;
+    if (ext4_magic == EXT2_SUPER_MAGIC)
+        return E2FSTOOL_RAW;
+    return E2FSTOOL_UNKNOWN;
+}
+
+/* Same probe as get_image_type, through the decompressor */
+static image_type_t get_compressed_image_type(const char *filename, compress_type_t compression)
+{
+    image_type_t type = E2FSTOOL_UNKNOWN;
+    struct zfile *zf;
+    uint32_t sparse_magic, moto_magic;
+    uint16_t ext4_magic;
+    errcode_t retval;
+
+    retval = zfile_open(filename, &zf);
+    if (retval)
+    {
+        com_err(__func__, retval, "while opening %s image %s",
+                compress_type_str(compression), filename);
+        return E2FSTOOL_UNKNOWN;
+    }
+
+    if (!zfile_read(zf, 0, &sparse_magic, sizeof(sparse_magic)) &&
+        !zfile_read(zf, 0x28, &moto_magic, sizeof(moto_magic)) &&
+        !zfile_read(zf, 0x438, &ext4_magic, sizeof(ext4_magic)))
+        type = get_magic_image_type(sparse_magic, moto_magic, ext4_magic);
+
+    zfile_close(zf);
+    return type;
+}
+
+static image_type_t get_image_type(const char *filename, compress_type_t compression)
+{
+    image_type_t type = E2FSTOOL_UNKNOWN;
+    FILE *fp = NULL;
+    uint32_t sparse_magic, moto_magic;
+    uint16_t ext4_magic;
+    int ret;
+
+    if (compression != E2FSTOOL_COMPRESS_NONE)
+        return get_compressed_image_type(filename, compression);
+
+    fp = fopen(filename, "rb");
+    if (!fp)
+    {
+        com_err(__func__, errno, "while opening %s", filename);
+        return E2FSTOOL_UNKNOWN;
+    }
+
+    ret = fread(&sparse_magic, sizeof(sparse_magic), 1, fp);
+    if (ret != 1)
+    {
+        com_err(__func__, ferror(fp) ? errno : EXT2_ET_SHORT_READ,
+                "while reading sparse_magic number of %s", filename);
+        goto end;
+    }
+
+    ret = fseek(fp, 0x28, SEEK_SET);
+    if (ret)
+    {
+        com_err(__func__, errno, "while seeking to MOTO magic offset of %s", filename);
+        goto end;
+    }
+
+    ret = fread(&moto_magic, sizeof(moto_magic), 1, fp);
+    if (ret != 1)
+    {
+        com_err(__func__, ferror(fp) ? errno : EXT2_ET_SHORT_READ,
+                "while reading moto_magic number of %s", filename);
+        goto end;
+    }
+
+    ret = fseek(fp, 0x438, SEEK_SET);
+    if (ret)
+    {
+        com_err(__func__, errno, "while seeking to EXT4 magic offset of %s", filename);
+        goto end;
+    }
+
+    ret = fread(&ext4_magic, sizeof(ext4_magic), 1, fp);
+    if (ret != 1)
+    {
+        com_err(__func__, ferror(fp) ? errno : EXT2_ET_SHORT_READ,
+                "while reading ext4_magic number of %s", filename);
+        goto end;
+    }
+
+    type = get_magic_image_type(sparse_magic, moto_magic, ext4_magic);
+
+end:
+    fclose(fp);
+    return type;
+}
+
+/* Finds out how @path is packed, EXT2_ET_BAD_MAGIC if it isn't an image */
+errcode_t e2fstool_probe(const char *path, image_type_t *type, compress_type_t *compression)
+{
+    *compression = compress_detect(path);
+    *type = get_image_type(path, *compression);
+    return *type == E2FSTOOL_UNKNOWN ? EXT2_ET_BAD_MAGIC : 0;
+}
+
+const char *e2fstool_image_type_str(image_type_t type)
+{
+    switch (type)
+    {
+    case E2FSTOOL_SPARSE:
+        return "SPARSE";
+    case E2FSTOOL_RAW:
+        return "RAW";
+    case E2FSTOOL_MOTO:
+        return "MOTO";
+    default:
+        return "UNKNOWN";
+    }
+}
+
+errcode_t e2fstool_open(const char *path, const struct e2fstool_open_opts *opts,
+                        struct e2fstool_image **ret)
+{
+    static const struct e2fstool_open_opts defaults = {.type = E2FSTOOL_UNKNOWN};
+    struct e2fstool_image *image;
+    errcode_t retval;
+
+    if (!opts)
+        opts = &defaults;
+
+    retval = ext2fs_get_memzero(sizeof(*image), &image);
+    if (retval)
+        return retval;
+
+    image->type = opts->type;
+    image->blocksize = opts->blocksize;
+    image->flags = EXT2_FLAG_64BITS | opts->flags;
+    image->compression = compress_detect(path);
+    if (image->type == E2FSTOOL_UNKNOWN)
+        image->type = get_image_type(path, image->compression);
+    if (image->type == E2FSTOOL_UNKNOWN)
+    {
+        retval = EXT2_ET_BAD_MAGIC;
+        goto end;
+    }
+
+    /* libsparse can't read through the decompressor */
+    if (image->compression != E2FSTOOL_COMPRESS_NONE && image->type == E2FSTOOL_RAW)
+        image->io = compressed_io_manager;
+    else if (image->type != E2FSTOOL_RAW &&
+             (!opts->use_libsparse || image->compression != E2FSTOOL_COMPRESS_NONE))
+        image->io = image->type == E2FSTOOL_SPARSE ? sparse_index_io_manager
+                                                   : moto_index_io_manager;
+    else if (image->type != E2FSTOOL_RAW)
+        image->io = image->type == E2FSTOOL_SPARSE ? sparse_io_manager : moto_io_manager;
+    else
+        image->io = unix_io_manager;
+
+    if (image->io == sparse_io_manager || image->io == moto_io_manager)
+    {
+        if (asprintf(&image->name, "(%s):0:%u", path, image->blocksize) == -1)
+            image->name = NULL;
+    }
+    else
+    {
+        image->name = strdup(path);
+    }
+    if (!image->name)
+    {
+        retval = EXT2_ET_NO_MEMORY;
+        goto end;
+    }
+
+    if (opts->wrap_io)
+        image->io = opts->wrap_io(image->io, opts->wrap_data);
+
+    retval = ext2fs_open(image->name, image->flags, 0, image->blocksize, image->io, &image->fs);
+    if (!retval && opts->inode_cache)
+    {
+        retval = icache_new(image->fs, opts->inode_cache, &image->icache);
+        if (retval)
+            ext2fs_close_free(&image->fs);
+        else
+            icache_attach(image->icache, image->fs);
+    }
+
+end:
+    if (retval)
+    {
+        free(image->name);
+        ext2fs_free_mem(&image);
+        return retval;
+    }
+    *ret = image;
+    return 0;
+}
+
+/*
+ * Opens another handle on @image for a thread of its own. No
+ * EXT2_FLAG_EXCLUSIVE here, a block device can only be opened O_EXCL once.
+ */
+errcode_t e2fstool_open_handle(const struct e2fstool_image *image, ext2_filsys *ret)
+{
+    errcode_t retval;
+
+    retval = ext2fs_open(image->name,
+                         image->flags & ~(EXT2_FLAG_EXCLUSIVE | EXT2_FLAG_PRINT_PROGRESS),
+                         0, image->blocksize, image->io, ret);
+    if (!retval && image->icache)
+        icache_attach(image->icache, *ret);
+    return retval;
+}
+
+ext2_filsys e2fstool_fs(const struct e2fstool_image *image)
+{
+    return image->fs;
+}
+
+image_type_t e2fstool_type(const struct e2fstool_image *image)
+{
+    return image->type;
+}
+
+compress_type_t e2fstool_compression(const struct e2fstool_image *image)
+{
+    return image->compression;
+}
+
+errcode_t e2fstool_close(struct e2fstool_image *image)
+{
+    errcode_t retval;
+
+    if (!image)
+        return 0;
+
+    retval = ext2fs_close_free(&image->fs);
+    icache_free(image->icache);
+    free(image->name);
+    ext2fs_free_mem(&image);
+    return retval;
+}
+
+static e2fstool_action_t walk_emit(struct walk_state *st, const struct e2fstool_entry *e,
+                                   __u64 off, const void *buf, size_t len)
+{
+    return st->visitor->data(st->data, e, off, buf, len);
+}
+
+/* Chunks of ino_read_runs() to the visitor, which can cut the read short */
+static errcode_t walk_run_data(void *data, __u64 off, const char *buf, size_t len)
+{
+    struct walk_data_args *args = data;
+
+    args->action = walk_emit(args->st, args->e, off, buf, len);
+    return args->action == E2FSTOOL_CONTINUE ? 0 : EXT2_ET_CANCEL_REQUESTED;
+}
+
+static errcode_t walk_run_hole(void *data, __u64 off, __u64 len)
+{
+    return walk_run_data(data, off, NULL, len);
+}
+
+static const struct run_ops walk_run_ops = {
+    .hole = walk_run_hole,
+    .data = walk_run_data,
+};
+
+/* Streams the data of regular file @e to the visitor */
+static e2fstool_action_t walk_data(struct walk_state *st, const struct e2fstool_entry *e)
+{
+    struct ext2_inode *inode = (struct ext2_inode *)st->inode;
+    struct walk_data_args args = {.st = st, .e = e, .action = E2FSTOOL_CONTINUE};
+    struct extent_run *runs = NULL;
+    __u64 size = EXT2_I_SIZE(inode);
+    size_t count = 0, len = size;
+    errcode_t retval;
+
+    if (!size)
+        return E2FSTOOL_CONTINUE;
+
+    if (inode->i_flags & EXT4_INLINE_DATA_FL)
+    {
+        if (size <= sizeof(inode->i_block))
+            return walk_emit(st, e, 0, inode->i_block, size);
+
+        retval = ext2fs_inline_data_get(st->fs, e->ino, inode, st->buf, &len);
+        if (retval)
+        {
+            com_err(__func__, retval, "while reading inline data of inode %u", e->ino);
+            st->retval = retval;
+            return E2FSTOOL_STOP;
+        }
+        return walk_emit(st, e, 0, st->buf, len);
+    }
+
+    if (inode->i_flags & EXT4_EXTENTS_FL)
+        retval = ino_get_extent_runs(st->fs, e->ino, inode, &runs, &count);
+    else
+        retval = ino_get_block_runs(st->fs, e->ino, &runs, &count);
+    if (retval)
+    {
+        st->retval = retval;
+        return E2FSTOOL_STOP;
+    }
+
+    retval = ino_read_runs(st->fs, e->ino, runs, count, size, st->buf, E2FSTOOL_CHUNK,
+                           &walk_run_ops, &args);
+    ext2fs_free_mem(&runs);
+    if (retval && args.action == E2FSTOOL_CONTINUE)
+    {
+        st->retval = retval;
+        return E2FSTOOL_STOP;
+    }
+    return args.action;
+}
+
+static int walk_xattr(char *name, char *value, size_t value_len, void *priv_data)
+{
+    struct walk_xattr_args *args = priv_data;
+
+    args->action = args->st->visitor->xattr(args->st->data, args->e, name, value, value_len);
+    return args->action == E2FSTOOL_CONTINUE ? 0 : XATTR_ABORT;
+}
+
+static e2fstool_action_t walk_xattrs(struct walk_state *st, const struct e2fstool_entry *e)
+{
+    struct walk_xattr_args args = {.st = st, .e = e, .action = E2FSTOOL_CONTINUE};
+    struct ext2_xattr_handle *xhandle;
+    errcode_t retval, close_retval;
+
+    retval = ext2fs_xattrs_open(st->fs, e->ino, &xhandle);
+    if (retval)
+    {
+        com_err(__func__, retval, "while opening inode %u", e->ino);
+        st->retval = retval;
+        return E2FSTOOL_STOP;
+    }
+
+    retval = ext2fs_xattrs_read(xhandle);
+    if (retval)
+        com_err(__func__, retval, "while reading xattrs of inode %u", e->ino);
+    else
+        retval = ext2fs_xattrs_iterate(xhandle, walk_xattr, &args);
+
+    close_retval = ext2fs_xattrs_close(&xhandle);
+    if (close_retval)
+        com_err(__func__, close_retval, "while closing xattrs of inode %u", e->ino);
+    retval = retval ?: close_retval;
+    if (retval)
+    {
+        st->retval = retval;
+        return E2FSTOOL_STOP;
+    }
+    return args.action;
+}
+
+static int walk_dirent(ext2_ino_t dir, int flags, struct ext2_dir_entry *de,
+                       int offset, int blocksize, char *buf, void *priv_data);
+
+/* Visits @ino, named by the tail of the path arena, and everything below it */
+static void walk_entry(struct walk_state *st, ext2_ino_t ino, const char *name)
+{
+    struct ext2_inode *inode = (struct ext2_inode *)st->inode;
+    struct e2fstool_entry e = {
+        .ino = ino,
+        .path = st->path.len ? st->path.buf : "/",
+        .name = name,
+        .depth = st->depth,
+        .inode = st->inode,
+        .inode_size = st->inode_size,
+    };
+    const struct e2fstool_visitor *v = st->visitor;
+    e2fstool_action_t action = E2FSTOOL_CONTINUE;
+    char *link_target = NULL;
+    errcode_t retval;
+
+    retval = ino_read(st->fs, ino, inode, st->inode_size);
+    if (retval)
+    {
+        com_err(__func__, retval, "while reading inode %u", ino);
+        st->retval = retval;
+        return;
+    }
+
+    if (LINUX_S_ISLNK(inode->i_mode))
+    {
+        retval = ino_read_symlink(st->fs, ino, inode, &link_target);
+        if (retval)
+        {
+            st->retval = retval;
+            return;
+        }
+        e.link_target = link_target;
+    }
+
+    if (v->entry)
+        action = v->entry(st->data, &e);
+    if (action == E2FSTOOL_CONTINUE && v->xattr)
+        action = walk_xattrs(st, &e);
+    if (action == E2FSTOOL_CONTINUE && v->data && LINUX_S_ISREG(inode->i_mode))
+        action = walk_data(st, &e);
+    free(link_target);
+
+    if (action == E2FSTOOL_STOP)
+    {
+        st->stop = true;
+        return;
+    }
+
+    /* The subtree reuses the inode buffer, @e is done with by now */
+    if (action == E2FSTOOL_CONTINUE && LINUX_S_ISDIR(inode->i_mode))
+    {
+        st->depth++;
+        retval = ext2fs_dir_iterate2(st->fs, ino, 0, NULL, walk_dirent, st);
+        st->depth--;
+        if (retval && !st->retval)
+        {
+            com_err(__func__, retval, "while iterating directory %u", ino);
+            st->retval = retval;
+        }
+    }
+}
+
+static int walk_dirent(ext2_ino_t dir EXT2FS_ATTR((unused)),
+                       int flags EXT2FS_ATTR((unused)),
+                       struct ext2_dir_entry *de,
+                       int offset EXT2FS_ATTR((unused)),
+                       int blocksize EXT2FS_ATTR((unused)),
+                       char *buf EXT2FS_ATTR((unused)), void *priv_data)
+{
+    struct walk_state *st = priv_data;
+    size_t parent_len = st->path.len;
+    __u16 name_len = de->name_len & 0xff;
+    errcode_t retval;
+
+    if ((name_len == 1 && de->name[0] == '.') ||
+        (name_len == 2 && de->name[0] == '.' && de->name[1] == '.'))
+        return 0;
+
+    retval = path_push(&st->path, de->name, name_len);
+    if (retval)
+    {
+        st->retval = retval;
+        return DIRENT_ABORT;
+    }
+
+    walk_entry(st, de->inode, st->path.buf + parent_len + 1);
+    path_pop(&st->path, parent_len);
+    return st->stop || st->retval ? DIRENT_ABORT : 0;
+}
+
+/* Walks from @ino, named by the path already in the arena, which is freed */
+static errcode_t walk_from(struct walk_state *st, ext2_ino_t ino)
+{
+    const char *name = strrchr(st->path.buf, '/');
+    errcode_t retval;
+
+    retval = ext2fs_get_mem(st->inode_size, &st->inode);
+    if (!retval && st->visitor->data)
+        retval = ext2fs_get_mem(E2FSTOOL_CHUNK, &st->buf);
+    if (retval)
+        goto end;
+
+    walk_entry(st, ino, name ? name + 1 : "");
+    retval = st->retval;
+
+end:
+    ext2fs_free_mem(&st->buf);
+    ext2fs_free_mem(&st->inode);
+    path_free(&st->path);
+    return retval;
+}
+
+/* e2fstool_walk() on a handle of e2fstool_open_handle() */
+errcode_t e2fstool_walk_fs(ext2_filsys fs, const struct e2fstool_visitor *visitor, void *data)
+{
+    struct walk_state st = {
+        .fs = fs,
+        .visitor = visitor,
+        .data = data,
+        .inode_size = EXT2_INODE_SIZE(fs->super),
+    };
+    errcode_t retval;
+
+    retval = path_set(&st.path, "");
+    if (retval)
+    {
+        path_free(&st.path);
+        return retval;
+    }
+    return walk_from(&st, EXT2_ROOT_INO);
+}
+
+/*
+ * Walks the tree of @image, calling @visitor with @data. Returns the
+ * first error met, 0 if the visitor stopped the walk.
+ */
+errcode_t e2fstool_walk(struct e2fstool_image *image, const struct e2fstool_visitor *visitor,
+                        void *data)
+{
+    return e2fstool_walk_fs(image->fs, visitor, data);
+}
+
+/*
+ * e2fstool_walk() from @path down, looked up through the directory index.
+ * A final symlink is followed when @follow is set. Entries are named from
+ * the image root as usual, with "." and repeated slashes dropped.
+ */
+errcode_t e2fstool_walk_path(struct e2fstool_image *image, const char *path, bool follow,
+                             const struct e2fstool_visitor *visitor, void *data)
+{
+    struct walk_state st = {
+        .fs = image->fs,
+        .visitor = visitor,
+        .data = data,
+        .inode_size = EXT2_INODE_SIZE(image->fs->super),
+    };
+    const char *p = path;
+    ext2_ino_t ino;
+    size_t len;
+    errcode_t retval;
+
+    retval = path_resolve(image->fs, path, follow, &ino);
+    if (retval)
+    {
+        com_err(__func__, retval, "while looking up %s", path);
+        return retval;
+    }
+
+    retval = path_set(&st.path, "");
+    while (!retval && *p)
+    {
+        len = strcspn(p, "/");
+        if (len && (len != 1 || *p != '.'))
+            retval = path_push(&st.path, p, len);
+        p += len;
+        p += *p == '/';
+    }
+    if (retval)
+    {
+        path_free(&st.path);
+        return retval;
+    }
+    return walk_from(&st, ino);
+}
@@ -0,0 +1,97 @@
+#ifndef LIBE2FSTOOL_H_INC
+#define LIBE2FSTOOL_H_INC
+
+#include <stdbool.h>
+#include <ext2fs/ext2fs.h>
+
+/*
+ * Image access without process state.
+ *
+ * An image is opened into a struct e2fstool_image, everything about it
+ * lives there. Nothing here exits, errors come back as errcode_t, and
+ * com_err() messages can be routed with set_com_err_hook(). Any number of
+ * images can be open and walked at once from different threads, compressed
+ * images share one decompression cache.
+ *
+ * A handle is not thread-safe (libext2fs isn't), two threads walking the
+ * same image take a handle each from e2fstool_open_handle().
+ */
+
+typedef enum image_type {
+    E2FSTOOL_SPARSE,
+    E2FSTOOL_RAW,
+    E2FSTOOL_MOTO,
+    E2FSTOOL_UNKNOWN
+} image_type_t;
+
+/* Compression around the image file, orthogonal to image_type_t */
+typedef enum compress_type {
+    E2FSTOOL_COMPRESS_NONE,
+    E2FSTOOL_COMPRESS_GZIP,
+    E2FSTOOL_COMPRESS_XZ,
+    E2FSTOOL_COMPRESS_LZ4,
+} compress_type_t;
+
+struct e2fstool_image;
+
+struct e2fstool_open_opts {
+    image_type_t type; /* E2FSTOOL_UNKNOWN probes the image */
+    unsigned int blocksize; /* 0 finds the superblock */
+    bool use_libsparse;
+    int flags; /* EXT2_FLAG_* on top of read-only 64-bit access */
+    size_t inode_cache; /* Bytes of inode tables kept in memory, 0 for none */
+    /* Stacks io managers over the one picked for the image, or NULL */
+    io_manager (*wrap_io)(io_manager inner, void *data);
+    void *wrap_data;
+};
+
+/* What the visitor wants next, from any of its callbacks */
+typedef enum e2fstool_action {
+    E2FSTOOL_CONTINUE,
+    E2FSTOOL_SKIP, /* Past the rest of this entry: xattrs, data, subtree */
+    E2FSTOOL_STOP, /* Ends the walk, which still returns 0 */
+} e2fstool_action_t;
+
+/* Entry handed to the visitor, only valid during the callback */
+struct e2fstool_entry {
+    ext2_ino_t ino;
+    const char *path; /* From the image root, "/" for the root itself */
+    const char *name;
+    unsigned int depth;
+    const struct ext2_inode_large *inode;
+    int inode_size;
+    const char *link_target; /* Symlinks only */
+};
+
+/*
+ * Every entry is visited depth first, directories before what is below
+ * them. Then come its xattrs, then for regular files the data in order,
+ * in chunks of up to E2FSTOOL_CHUNK bytes. Holes and unwritten extents
+ * come as chunks with a NULL @buf. Any callback may be NULL.
+ */
+struct e2fstool_visitor {
+    e2fstool_action_t (*entry)(void *data, const struct e2fstool_entry *e);
+    e2fstool_action_t (*xattr)(void *data, const struct e2fstool_entry *e, const char *name,
+                               const void *value, size_t len);
+    e2fstool_action_t (*data)(void *data, const struct e2fstool_entry *e, __u64 off,
+                              const void *buf, size_t len);
+};
+
+#define E2FSTOOL_CHUNK (1 << 20)
+
+errcode_t e2fstool_probe(const char *path, image_type_t *type, compress_type_t *compression);
+const char *e2fstool_image_type_str(image_type_t type);
+errcode_t e2fstool_open(const char *path, const struct e2fstool_open_opts *opts,
+                        struct e2fstool_image **ret);
+errcode_t e2fstool_open_handle(const struct e2fstool_image *image, ext2_filsys *ret);
+ext2_filsys e2fstool_fs(const struct e2fstool_image *image);
+image_type_t e2fstool_type(const struct e2fstool_image *image);
+compress_type_t e2fstool_compression(const struct e2fstool_image *image);
+errcode_t e2fstool_walk(struct e2fstool_image *image, const struct e2fstool_visitor *visitor,
+                        void *data);
+errcode_t e2fstool_walk_fs(ext2_filsys fs, const struct e2fstool_visitor *visitor, void *data);
+errcode_t e2fstool_walk_path(struct e2fstool_image *image, const char *path, bool follow,
+                             const struct e2fstool_visitor *visitor, void *data);
+errcode_t e2fstool_close(struct e2fstool_image *image);
+
+#endif /* LIBE2FSTOOL_H_INC */
@@ -0,0 +1,239 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "e2fstool.h"
+
+/*
+ * Metadata manifest (list subcommand).
+ *
+ * A visitor of e2fstool_walk(), every entry is printed as it is met.
+ * Inodes are read through the inode table cache of the image, which
+ * loads tables whole and in order, so the walk does not seek for every
+ * dirent. Nothing but the manifest line of one entry is kept.
+ */
+
+struct list_inode {
+    __u64 size;
+    __u64 first_block;
+    uint64_t caps;
+    const char *selinux;
+    ext2_ino_t ino;
+    __u32 uid, gid;
+    __u32 fragments; /* Physically contiguous runs of data */
+    __u16 mode;
+    __u16 links;
+};
+
+struct list_state {
+    ext2_filsys fs;
+    FILE *out;
+    bool json, first;
+    unsigned char *seen; /* Directories listed, one bit per inode */
+    struct xattr_cache xattrs;
+    errcode_t retval;
+};
+
+static const char *list_type_str(__u16 mode)
+{
+    switch (mode & LINUX_S_IFMT)
+    {
+    case LINUX_S_IFREG:
+        return "file";
+    case LINUX_S_IFDIR:
+        return "dir";
+    case LINUX_S_IFLNK:
+        return "symlink";
+    case LINUX_S_IFCHR:
+        return "chardev";
+    case LINUX_S_IFBLK:
+        return "blockdev";
+    case LINUX_S_IFIFO:
+        return "fifo";
+    case LINUX_S_IFSOCK:
+        return "socket";
+    default:
+        return "unknown";
+    }
+}
+
+/* TSV escapes tabs, newlines and backslashes C style, JSON as usual */
+static void list_put_str(struct list_state *st, const char *s)
+{
+    FILE *f = st->out;
+
+    if (st->json)
+        fputc('"', f);
+    for (; *s; s++)
+    {
+        unsigned char c = *s;
+
+        if (c == '\\' || (st->json && c == '"'))
+            fprintf(f, "\\%c", c);
+        else if (c == '\t')
+            fputs("\\t", f);
+        else if (c == '\n')
+            fputs("\\n", f);
+        else if (c < 0x20)
+            fprintf(f, st->json ? "\\u%04x" : "\\x%02x", c);
+        else
+            fputc(c, f);
+    }
+    if (st->json)
+        fputc('"', f);
+}
+
+static void list_print(struct list_state *st, const char *path, const struct list_inode *rec)
+{
+    FILE *f = st->out;
+
+    if (st->json)
+    {
+        fputs(st->first ? "\n  {\"path\": " : ",\n  {\"path\": ", f);
+        st->first = false;
+    }
+    list_put_str(st, path);
+
+    if (st->json)
+        fprintf(f, ", \"inode\": %u, \"type\": \"%s\", \"size\": %llu, \"uid\": %u, "
+                   "\"gid\": %u, \"mode\": \"%04o\", \"capabilities\": %llu, \"selinux\": ",
+                rec->ino, list_type_str(rec->mode), (unsigned long long)rec->size, rec->uid,
+                rec->gid, rec->mode & FILE_MODE_MASK, (unsigned long long)rec->caps);
+    else
+        fprintf(f, "\t%u\t%s\t%llu\t%u\t%u\t%04o\t%llu\t",
+                rec->ino, list_type_str(rec->mode), (unsigned long long)rec->size, rec->uid,
+                rec->gid, rec->mode & FILE_MODE_MASK, (unsigned long long)rec->caps);
+
+    if (rec->selinux)
+        list_put_str(st, rec->selinux);
+    else
+        fputs(st->json ? "null" : "-", f);
+
+    if (st->json)
+        fprintf(f, ", \"links\": %u, \"fragments\": %u, \"first_block\": %llu}",
+                rec->links, rec->fragments, (unsigned long long)rec->first_block);
+    else
+        fprintf(f, "\t%u\t%u\t%llu\n", rec->links, rec->fragments,
+                (unsigned long long)rec->first_block);
+}
+
+/* Fills fragments and first_block from the block map of @rec */
+static errcode_t list_runs(struct list_state *st, const struct e2fstool_entry *e,
+                           struct list_inode *rec)
+{
+    struct ext2_inode *inode = (struct ext2_inode *)e->inode;
+    struct extent_run *runs = NULL;
+    size_t count = 0;
+    errcode_t retval;
+
+    if (!LINUX_S_ISREG(rec->mode) && !LINUX_S_ISDIR(rec->mode) && !LINUX_S_ISLNK(rec->mode))
+        return 0;
+    if (LINUX_S_ISLNK(rec->mode) && ext2fs_is_fast_symlink(inode))
+        return 0;
+    if (inode->i_flags & EXT4_INLINE_DATA_FL)
+        return 0;
+
+    if (inode->i_flags & EXT4_EXTENTS_FL)
+        retval = ino_get_extent_runs(st->fs, e->ino, inode, &runs, &count);
+    else
+        retval = ino_get_block_runs(st->fs, e->ino, &runs, &count);
+    if (retval)
+        return retval;
+
+    rec->fragments = count;
+    rec->first_block = count ? runs[0].pblk : 0;
+    ext2fs_free_mem(&runs);
+    return 0;
+}
+
+static e2fstool_action_t list_entry(void *data, const struct e2fstool_entry *e)
+{
+    struct list_state *st = data;
+    const struct ext2_inode *in = (const struct ext2_inode *)e->inode;
+    struct list_inode rec = {
+        .ino = e->ino,
+        .size = EXT2_I_SIZE(in),
+        .uid = inode_uid(*in),
+        .gid = inode_gid(*in),
+        .mode = in->i_mode,
+        .links = in->i_links_count,
+    };
+    struct ino_xattrs x;
+    __u64 start;
+
+    if (e->depth == 1 && !strcmp(e->name, "lost+found"))
+        return E2FSTOOL_SKIP;
+
+    if (!in->i_links_count || in->i_dtime)
+    {
+        fprintf(stderr, "%s: %s points to unused inode %u\n", __func__, e->path, e->ino);
+        return E2FSTOOL_SKIP;
+    }
+
+    start = stats_now();
+    st->retval = ino_decode_xattrs(st->fs, &st->xattrs, e->ino,
+                                   (struct ext2_inode_large *)e->inode, e->inode_size, &x);
+    if (st->retval)
+        return E2FSTOOL_STOP;
+    stats_end(STAT_XATTR, start, x.selinux_len + x.caps_len, NULL);
+    rec.selinux = x.selinux;
+    xattr_decode_caps(x.caps, x.caps_len, &rec.caps);
+
+    st->retval = list_runs(st, e, &rec);
+    if (st->retval)
+        return E2FSTOOL_STOP;
+
+    list_print(st, e->path, &rec);
+    if (!LINUX_S_ISDIR(rec.mode))
+        return E2FSTOOL_SKIP;
+
+    /* A damaged tree may link a directory twice */
+    if (st->seen[e->ino / 8] & 1 << e->ino % 8)
+        return E2FSTOOL_SKIP;
+    st->seen[e->ino / 8] |= 1 << e->ino % 8;
+    return E2FSTOOL_CONTINUE;
+}
+
+static const struct e2fstool_visitor list_visitor = {
+    .entry = list_entry,
+};
+
+/* Writes the manifest of @image to @out, as TSV or as a JSON array */
+errcode_t list_fs(struct e2fstool_image *image, FILE *out, bool json)
+{
+    ext2_filsys fs = e2fstool_fs(image);
+    struct list_state st = {
+        .fs = fs,
+        .out = out,
+        .json = json,
+        .first = true,
+    };
+    errcode_t retval;
+
+    st.seen = calloc(fs->super->s_inodes_count / 8 + 1, 1);
+    if (!st.seen)
+    {
+        E2FSTOOL_ERROR("while allocating memory");
+        return EXT2_ET_NO_MEMORY;
+    }
+    xattr_cache_init(&st.xattrs);
+
+    if (json)
+        fputc('[', out);
+    else
+        fputs("path\tinode\ttype\tsize\tuid\tgid\tmode\tcapabilities\tselinux\t"
+              "links\tfragments\tfirst_block\n", out);
+
+    retval = e2fstool_walk(image, &list_visitor, &st);
+    retval = retval ?: st.retval;
+
+    if (json)
+        fputs("\n]\n", out);
+    if (!retval && fflush(out))
+        retval = errno;
+
+    free(st.seen);
+    xattr_cache_free(&st.xattrs);
+    return retval;
+}
@@ -0,0 +1,301 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "e2fstool.h"
+
+/*
+ * Path lookup for single file access (cat, stat, getfattr).
+ *
+ * ext2fs_lookup() scans every block of a directory. Indexed directories
+ * carry a hash tree instead, so here the name is hashed and the index
+ * walked down to the one leaf block that can hold it. Directories the
+ * index walk can not handle (casefolded, encrypted, inline, collisions
+ * spanning index nodes, damaged trees) go through ext2fs_lookup().
+ */
+
+#define DX_MAX_LEVELS 3
+#define SYMLINK_MAX_FOLLOW 8
+
+/* Not an error, the caller should retry with a linear scan */
+#define DX_FALLBACK 1
+
+struct dx_node {
+    const struct ext2_dx_entry *entries;
+    unsigned int count;
+};
+
+static errcode_t dir_read_block(ext2_filsys fs, ext2_ino_t dir, struct ext2_inode *inode,
+                                blk64_t lblk, void *buf, bool leaf)
+{
+    blk64_t pblk;
+    errcode_t retval;
+
+    retval = ext2fs_bmap2(fs, dir, inode, NULL, 0, lblk, NULL, &pblk);
+    if (retval)
+        return retval;
+    if (!pblk)
+        return EXT2_ET_DIR_CORRUPTED;
+
+    /* read_dir_block byte swaps dirents, which would garble index nodes */
+    if (leaf)
+        return ext2fs_read_dir_block4(fs, pblk, buf, 0, dir);
+    return io_channel_read_blk64(fs->io, pblk, 1, buf);
+}
+
+/* Parses the count/limit header at @offset of an index block */
+static errcode_t dx_parse_node(ext2_filsys fs, const char *buf, unsigned int offset,
+                               struct dx_node *node)
+{
+    const struct ext2_dx_countlimit *cl = (const void *)(buf + offset);
+    unsigned int count = ext2fs_le16_to_cpu(cl->count);
+    unsigned int limit = ext2fs_le16_to_cpu(cl->limit);
+
+    if (!count || count > limit ||
+        offset + limit * sizeof(struct ext2_dx_entry) > fs->blocksize)
+        return DX_FALLBACK;
+
+    node->entries = (const void *)cl;
+    node->count = count;
+    return 0;
+}
+
+/* Index of the last entry whose hash is <= @hash; entry 0 covers hash 0 */
+static unsigned int dx_search(const struct dx_node *node, ext2_dirhash_t hash)
+{
+    unsigned int lo = 1, hi = node->count;
+
+    while (lo < hi)
+    {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if (ext2fs_le32_to_cpu(node->entries[mid].hash) > hash)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo - 1;
+}
+
+static errcode_t dx_scan_leaf(ext2_filsys fs, const char *buf, const char *name,
+                              int len, ext2_ino_t *ino)
+{
+    unsigned int offset = 0, rec_len;
+    errcode_t retval;
+
+    while (offset + 8 <= fs->blocksize)
+    {
+        struct ext2_dir_entry *dirent = (void *)(buf + offset);
+
+        retval = ext2fs_get_rec_len(fs, dirent, &rec_len);
+        if (retval)
+            return retval;
+        if (rec_len < 8 || offset + rec_len > fs->blocksize)
+            return EXT2_ET_DIR_CORRUPTED;
+
+        if (dirent->inode && ext2fs_dirent_name_len(dirent) == len &&
+            !memcmp(dirent->name, name, len))
+        {
+            *ino = dirent->inode;
+            return 0;
+        }
+        offset += rec_len;
+    }
+    return EXT2_ET_FILE_NOT_FOUND;
+}
+
+static errcode_t dx_lookup(ext2_filsys fs, ext2_ino_t dir, struct ext2_inode *inode,
+                           const char *name, int len, ext2_ino_t *ino)
+{
+    const struct ext2_dx_root_info *info;
+    struct dx_node node;
+    ext2_dirhash_t hash;
+    unsigned int level, levels, idx;
+    int version;
+    char *node_buf, *leaf_buf;
+    errcode_t retval;
+
+    retval = ext2fs_get_mem(2 * fs->blocksize, &node_buf);
+    if (retval)
+        return retval;
+    leaf_buf = node_buf + fs->blocksize;
+
+    retval = dir_read_block(fs, dir, inode, 0, node_buf, false);
+    if (retval)
+        goto end;
+
+    /* The root block starts with fake "." and ".." entries of 12 bytes each */
+    info = (const void *)(node_buf + 24);
+    levels = info->indirect_levels;
+    version = info->hash_version;
+    if (info->reserved_zero || info->info_length < 8 || levels >= DX_MAX_LEVELS)
+    {
+        retval = DX_FALLBACK;
+        goto end;
+    }
+    if (version <= EXT2_HASH_TEA && (fs->super->s_flags & EXT2_FLAGS_UNSIGNED_HASH))
+        version += 3;
+
+    retval = ext2fs_dirhash2(version, name, len, fs->encoding, 0,
+                             fs->super->s_hash_seed, &hash, NULL);
+    if (retval)
+    {
+        retval = DX_FALLBACK;
+        goto end;
+    }
+    hash &= ~1;
+
+    retval = dx_parse_node(fs, node_buf, 24 + info->info_length, &node);
+    for (level = 0; !retval; level++)
+    {
+        idx = dx_search(&node, hash);
+        if (level == levels)
+            break;
+
+        /* Interior nodes start with one empty dirent spanning the block */
+        retval = dir_read_block(fs, dir, inode, ext2fs_le32_to_cpu(node.entries[idx].block),
+                                node_buf, false);
+        if (!retval)
+            retval = dx_parse_node(fs, node_buf, 8, &node);
+    }
+    if (retval)
+        goto end;
+
+    for (;;)
+    {
+        retval = dir_read_block(fs, dir, inode, ext2fs_le32_to_cpu(node.entries[idx].block),
+                                leaf_buf, true);
+        if (retval)
+            goto end;
+
+        retval = dx_scan_leaf(fs, leaf_buf, name, len, ino);
+        if (retval != EXT2_ET_FILE_NOT_FOUND)
+            goto end;
+
+        /* Names with the same hash may continue in the next leaf */
+        if (++idx == node.count)
+        {
+            if (levels)
+                retval = DX_FALLBACK;
+            goto end;
+        }
+        if ((ext2fs_le32_to_cpu(node.entries[idx].hash) & ~1) != hash)
+            goto end;
+    }
+
+end:
+    ext2fs_free_mem(&node_buf);
+    return retval;
+}
+
+/* Looks up @name in directory @dir, through its hash index if it has one */
+errcode_t dir_lookup(ext2_filsys fs, ext2_ino_t dir, const char *name, int len, ext2_ino_t *ino)
+{
+    struct ext2_inode inode;
+    errcode_t retval;
+
+    retval = ino_read(fs, dir, &inode, sizeof(inode));
+    if (retval)
+        return retval;
+    if (!LINUX_S_ISDIR(inode.i_mode))
+        return EXT2_ET_NO_DIRECTORY;
+
+    if (ext2fs_has_feature_dir_index(fs->super) && (inode.i_flags & EXT2_INDEX_FL) &&
+        !(inode.i_flags & (EXT4_CASEFOLD_FL | EXT4_ENCRYPT_FL | EXT4_INLINE_DATA_FL)))
+    {
+        retval = dx_lookup(fs, dir, &inode, name, len, ino);
+        if (!retval || retval == EXT2_ET_FILE_NOT_FOUND)
+            return retval;
+    }
+
+    return ext2fs_lookup(fs, dir, name, len, NULL, ino);
+}
+
+/*
+ * Resolves @path from the root of @fs. Symlinks in the middle of the path
+ * are always followed, the last component only if @follow is set.
+ */
+errcode_t path_resolve(ext2_filsys fs, const char *path, bool follow, ext2_ino_t *ret_ino)
+{
+    struct ext2_inode inode;
+    ext2_ino_t dir = EXT2_ROOT_INO, ino;
+    unsigned int links = 0;
+    char *buf, *p;
+    errcode_t retval = 0;
+
+    buf = strdup(path);
+    if (!buf)
+        return EXT2_ET_NO_MEMORY;
+
+    p = buf;
+    ino = dir;
+    for (;;)
+    {
+        char *name, *target, *rest;
+        size_t len;
+
+        while (*p == '/')
+            p++;
+        if (!*p)
+            break;
+
+        name = p;
+        len = strcspn(p, "/");
+        p += len;
+        while (*p == '/')
+            p++;
+
+        if (len == 1 && name[0] == '.')
+            continue;
+
+        /* ".." needs the real dirent, the index only knows hashes */
+        if (len == 2 && name[0] == '.' && name[1] == '.')
+            retval = ext2fs_lookup(fs, dir, name, len, NULL, &ino);
+        else
+            retval = dir_lookup(fs, dir, name, len, &ino);
+        if (retval)
+            goto end;
+
+        retval = ino_read(fs, ino, &inode, sizeof(inode));
+        if (retval)
+            goto end;
+
+        if (!LINUX_S_ISLNK(inode.i_mode) || (!*p && !follow))
+        {
+            dir = ino;
+            continue;
+        }
+
+        if (++links > SYMLINK_MAX_FOLLOW)
+        {
+            retval = EXT2_ET_SYMLINK_LOOP;
+            goto end;
+        }
+
+        retval = ino_read_symlink(fs, ino, &inode, &target);
+        if (retval)
+            goto end;
+
+        /* Continue with the link target followed by what is left of the path */
+        len = strlen(target);
+        rest = malloc(len + strlen(p) + 2);
+        if (!rest)
+        {
+            free(target);
+            retval = EXT2_ET_NO_MEMORY;
+            goto end;
+        }
+        sprintf(rest, "%s/%s", target, p);
+        if (target[0] == '/')
+            dir = EXT2_ROOT_INO;
+        ino = dir;
+        free(target);
+        free(buf);
+        buf = p = rest;
+    }
+
+    *ret_ino = ino;
+end:
+    free(buf);
+    return retval;
+}
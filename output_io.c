@@ -0,0 +1,673 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "e2fstool.h"
+
+/*
+ * Batched output.
+ *
+ * Small files are read into memory whole and handed over here, as are
+ * symlinks, so the walk does not wait for their open/write/close round
+ * trips. With liburing each file becomes a linked open, write and close
+ * on a ring of the submitting thread, using a fixed file table so the
+ * chain never needs a descriptor back, and rings are submitted in
+ * batches. Without it, when the kernel lacks the opcodes, or with -p,
+ * whose fchown and friends rings can not do, a few writer threads run
+ * the same syscalls instead.
+ *
+ * Queued entries name their directory by descriptor: out_flush() has to
+ * be called before one is closed or its metadata restored. Every thread
+ * only waits for what it queued itself.
+ */
+
+#define OUT_QUEUE_DEPTH 64 /* Entries in flight per submitting thread */
+#define OUT_SUBMIT_BATCH 16
+
+enum out_type {
+    OUT_FILE,
+    OUT_SYMLINK,
+};
+
+/* Steps of an entry, kept in the low bits of the completion data */
+enum out_step {
+    OUT_STEP_CREATE,
+    OUT_STEP_WRITE,
+    OUT_STEP_CLOSE,
+};
+
+struct out_local;
+
+struct out_op {
+    enum out_type type;
+    int dirfd;
+    char *name;
+    char *data; /* File contents, or symlink target */
+    size_t len;
+    size_t charged; /* Of --max-memory, for the buffer behind @data */
+    struct ext2_inode inode;
+    struct out_local *owner;
+    struct out_op *next;
+#ifdef HAVE_LIBURING
+    unsigned int slot, steps;
+    bool opened;
+    int err;
+    enum out_step err_step;
+    __u64 start;
+#endif
+};
+
+#ifdef HAVE_LIBURING
+struct out_ring {
+    struct io_uring ring;
+    struct out_op *slots[OUT_QUEUE_DEPTH];
+    unsigned int used, staged;
+    int dir_res[2];
+    unsigned int dir_wait;
+    struct out_ring *next;
+};
+#endif
+
+struct out_local {
+#ifdef HAVE_LIBURING
+    struct out_ring *ring;
+    bool ring_failed;
+#endif
+    unsigned int pending;
+    errcode_t error;
+};
+
+static _Thread_local struct out_local local;
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t out_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t out_done = PTHREAD_COND_INITIALIZER;
+static struct out_op *queue_head = NULL, *queue_tail = NULL;
+static pthread_t *writers = NULL;
+static unsigned int writer_count = 0;
+static bool out_stop = false;
+static bool restore = false; /* -p */
+#ifdef HAVE_LIBURING
+static struct out_ring *rings = NULL;
+static bool uring_ok = false;
+#endif
+
+static void out_op_free(struct out_op *op)
+{
+    /* File contents were charged to --max-memory when read */
+    mem_release(op->charged);
+    free(op->name);
+    free(op->data);
+    free(op);
+}
+
+/* Runs @op with plain syscalls, for the writer threads and as last resort */
+static errcode_t out_op_run(struct out_op *op)
+{
+    __u64 start = stats_now();
+    size_t off = 0;
+    ssize_t n;
+    int fd;
+
+    if (op->type == OUT_SYMLINK)
+    {
+        if (symlinkat(op->data, op->dirfd, op->name) == -1)
+        {
+            E2FSTOOL_ERROR("while creating symlink %s", op->name);
+            return -1;
+        }
+        if (restore)
+            ino_restore_metadata(-1, op->dirfd, op->name, &op->inode);
+        return 0;
+    }
+
+    fd = openat(op->dirfd, op->name, O_WRONLY | O_TRUNC | O_BINARY | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        E2FSTOOL_ERROR("while creating %s", op->name);
+        return -1;
+    }
+
+    while (off < op->len)
+    {
+        n = write(fd, op->data + off, op->len - off);
+        if (n < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            E2FSTOOL_ERROR("while writing %s", op->name);
+            close(fd);
+            return -1;
+        }
+        off += n;
+    }
+    stats_end(STAT_WRITE, start, op->len, NULL);
+
+    if (restore)
+        ino_restore_metadata(fd, op->dirfd, op->name, &op->inode);
+    close(fd);
+    return 0;
+}
+
+static void *out_writer(void *arg EXT2FS_ATTR((unused)))
+{
+    struct out_local *owner;
+    struct out_op *op;
+    errcode_t retval;
+
+    pthread_mutex_lock(&out_lock);
+    for (;;)
+    {
+        while (!out_stop && !queue_head)
+            pthread_cond_wait(&out_work, &out_lock);
+        if (!queue_head)
+            break;
+
+        op = queue_head;
+        queue_head = op->next;
+        if (!queue_head)
+            queue_tail = NULL;
+        pthread_mutex_unlock(&out_lock);
+
+        owner = op->owner;
+        retval = out_op_run(op);
+        out_op_free(op);
+
+        pthread_mutex_lock(&out_lock);
+        if (retval && !owner->error)
+            owner->error = retval;
+        owner->pending--;
+        pthread_cond_broadcast(&out_done);
+    }
+    pthread_mutex_unlock(&out_lock);
+    return NULL;
+}
+
+/* Hands out, once, the first error of an entry queued by this thread */
+static errcode_t out_take_error(void)
+{
+    errcode_t retval;
+
+    pthread_mutex_lock(&out_lock);
+    retval = local.error;
+    local.error = 0;
+    pthread_mutex_unlock(&out_lock);
+    return retval;
+}
+
+#ifdef HAVE_LIBURING
+static int out_ring_setup(struct out_ring *r)
+{
+    static const int ops[] = {
+        IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE,
+        IORING_OP_SYMLINKAT, IORING_OP_MKDIRAT,
+    };
+    struct io_uring_probe *probe;
+    unsigned int i;
+    int ret;
+
+    /* Three entries per file, plus room for a directory and cleanups */
+    ret = io_uring_queue_init(OUT_QUEUE_DEPTH * 4, &r->ring, 0);
+    if (ret)
+        return ret;
+
+    probe = io_uring_get_probe_ring(&r->ring);
+    for (i = 0; probe && i < sizeof(ops) / sizeof(ops[0]); i++)
+    {
+        if (!io_uring_opcode_supported(probe, ops[i]))
+            break;
+    }
+    ret = !probe || i < sizeof(ops) / sizeof(ops[0]) ? -EOPNOTSUPP : 0;
+    if (probe)
+        io_uring_free_probe(probe);
+
+    if (!ret)
+        ret = io_uring_register_files_sparse(&r->ring, OUT_QUEUE_DEPTH);
+    if (ret)
+        io_uring_queue_exit(&r->ring);
+    return ret;
+}
+
+/* Ring of the calling thread, set up on first use */
+static struct out_ring *out_ring_get(void)
+{
+    struct out_ring *r = local.ring;
+
+    if (r || !uring_ok || local.ring_failed)
+        return r;
+
+    r = calloc(1, sizeof(*r));
+    if (!r || out_ring_setup(r))
+    {
+        free(r);
+        local.ring_failed = true;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&out_lock);
+    r->next = rings;
+    rings = r;
+    pthread_mutex_unlock(&out_lock);
+    local.ring = r;
+    return r;
+}
+
+static errcode_t out_ring_submit(struct out_ring *r, unsigned int wait)
+{
+    int ret;
+
+    do
+        ret = io_uring_submit_and_wait(&r->ring, wait);
+    while (ret == -EINTR || ret == -EAGAIN);
+    if (ret < 0)
+    {
+        errno = -ret;
+        E2FSTOOL_ERROR("while submitting output");
+        return -1;
+    }
+    r->staged = 0;
+    return 0;
+}
+
+static void out_ring_complete(struct out_ring *r, __u64 data, int res)
+{
+    struct out_op *op = (struct out_op *)(uintptr_t)(data & ~(__u64)3);
+    enum out_step step = data & 3;
+    struct io_uring_sqe *sqe;
+
+    if (!op)
+    {
+        r->dir_res[step] = res;
+        r->dir_wait--;
+        return;
+    }
+
+    if (step == OUT_STEP_CREATE && res >= 0)
+        op->opened = true;
+    else if (step == OUT_STEP_CLOSE && res >= 0)
+        op->opened = false;
+    else if (step == OUT_STEP_WRITE && res >= 0 && (size_t)res < op->len)
+        res = -ENOSPC;
+
+    /* Steps after a failed one complete as canceled */
+    if (res < 0 && res != -ECANCELED && !op->err)
+    {
+        op->err = -res;
+        op->err_step = step;
+    }
+    if (--op->steps)
+        return;
+
+    /* A broken chain leaves the file in its slot */
+    if (op->type == OUT_FILE && op->opened)
+    {
+        op->opened = false;
+        op->steps = 1;
+        sqe = io_uring_get_sqe(&r->ring);
+        io_uring_prep_close_direct(sqe, op->slot);
+        io_uring_sqe_set_data64(sqe, (uintptr_t)op | OUT_STEP_CLOSE);
+        r->staged++;
+        return;
+    }
+
+    if (op->err)
+    {
+        errno = op->err;
+        if (op->type == OUT_SYMLINK)
+            E2FSTOOL_ERROR("while creating symlink %s", op->name);
+        else if (op->err_step == OUT_STEP_CREATE)
+            E2FSTOOL_ERROR("while creating %s", op->name);
+        else if (op->err_step == OUT_STEP_WRITE)
+            E2FSTOOL_ERROR("while writing %s", op->name);
+        else
+            E2FSTOOL_ERROR("while closing %s", op->name);
+        if (!local.error)
+            local.error = -1;
+    }
+    else if (op->type == OUT_FILE)
+    {
+        stats_end(STAT_WRITE, op->start, op->len, NULL);
+    }
+
+    r->slots[op->slot] = NULL;
+    r->used--;
+    out_op_free(op);
+}
+
+/* Handles available completions, after waiting for one if @wait */
+static errcode_t out_ring_reap(struct out_ring *r, bool wait)
+{
+    struct io_uring_cqe *cqe;
+    errcode_t retval;
+
+    if (wait)
+    {
+        retval = out_ring_submit(r, 1);
+        if (retval)
+            return retval;
+    }
+
+    while (!io_uring_peek_cqe(&r->ring, &cqe))
+    {
+        out_ring_complete(r, io_uring_cqe_get_data64(cqe), cqe->res);
+        io_uring_cqe_seen(&r->ring, cqe);
+    }
+    return 0;
+}
+
+static errcode_t out_ring_queue(struct out_ring *r, struct out_op *op)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int slot;
+    errcode_t retval;
+
+    while (r->used == OUT_QUEUE_DEPTH)
+    {
+        retval = out_ring_reap(r, true);
+        if (retval)
+        {
+            out_op_free(op);
+            return retval;
+        }
+    }
+
+    for (slot = 0; r->slots[slot]; slot++)
+        ;
+    r->slots[slot] = op;
+    r->used++;
+    op->slot = slot;
+    op->start = stats_now();
+
+    sqe = io_uring_get_sqe(&r->ring);
+    if (op->type == OUT_SYMLINK)
+    {
+        io_uring_prep_symlinkat(sqe, op->data, op->dirfd, op->name);
+        io_uring_sqe_set_data64(sqe, (uintptr_t)op | OUT_STEP_CREATE);
+        op->steps = 1;
+    }
+    else
+    {
+        io_uring_prep_openat_direct(sqe, op->dirfd, op->name,
+                                    O_WRONLY | O_TRUNC | O_BINARY | O_CREAT, 0644, slot);
+        io_uring_sqe_set_data64(sqe, (uintptr_t)op | OUT_STEP_CREATE);
+        sqe->flags |= IOSQE_IO_LINK;
+        op->steps = 2;
+
+        if (op->len)
+        {
+            sqe = io_uring_get_sqe(&r->ring);
+            io_uring_prep_write(sqe, slot, op->data, op->len, 0);
+            io_uring_sqe_set_data64(sqe, (uintptr_t)op | OUT_STEP_WRITE);
+            sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+            op->steps++;
+        }
+
+        sqe = io_uring_get_sqe(&r->ring);
+        io_uring_prep_close_direct(sqe, slot);
+        io_uring_sqe_set_data64(sqe, (uintptr_t)op | OUT_STEP_CLOSE);
+    }
+
+    if (++r->staged >= OUT_SUBMIT_BATCH)
+    {
+        retval = out_ring_submit(r, 0);
+        if (retval)
+            return retval;
+    }
+    return out_ring_reap(r, false);
+}
+#endif
+
+static errcode_t out_queue(struct out_op *op)
+{
+    errcode_t retval;
+#ifdef HAVE_LIBURING
+    struct out_ring *r = out_ring_get();
+
+    if (r)
+    {
+        retval = out_ring_queue(r, op);
+        return retval ?: out_take_error();
+    }
+#endif
+
+    /* A thread without a ring when the rest has one */
+    if (!writer_count)
+    {
+        retval = out_op_run(op);
+        out_op_free(op);
+        return retval;
+    }
+
+    op->owner = &local;
+    pthread_mutex_lock(&out_lock);
+    while (local.pending >= OUT_QUEUE_DEPTH)
+        pthread_cond_wait(&out_done, &out_lock);
+    local.pending++;
+    if (queue_tail)
+        queue_tail->next = op;
+    else
+        queue_head = op;
+    queue_tail = op;
+    pthread_cond_signal(&out_work);
+    retval = local.error;
+    local.error = 0;
+    pthread_mutex_unlock(&out_lock);
+    return retval;
+}
+
+static struct out_op *out_op_new(enum out_type type, int dirfd, const char *name,
+                                 char *data, size_t len, size_t charged,
+                                 const struct ext2_inode *inode)
+{
+    struct out_op *op;
+
+    op = calloc(1, sizeof(*op));
+    if (op)
+        op->name = strdup(name);
+    if (!op || !op->name)
+    {
+        E2FSTOOL_ERROR("while allocating memory");
+        free(op);
+        free(data);
+        mem_release(charged);
+        return NULL;
+    }
+
+    op->type = type;
+    op->dirfd = dirfd;
+    op->data = data;
+    op->len = len;
+    op->charged = charged;
+    op->inode = *inode;
+    return op;
+}
+
+/*
+ * Queues creation of @name relative to @dirfd with @len bytes of @data.
+ * @data is taken over in any case, along with the @charged bytes of the
+ * memory budget it holds. Errors may also belong to an entry queued
+ * earlier.
+ */
+errcode_t out_queue_file(int dirfd, const char *name, char *data, size_t len,
+                         size_t charged, const struct ext2_inode *inode)
+{
+    struct out_op *op = out_op_new(OUT_FILE, dirfd, name, data, len, charged, inode);
+
+    return op ? out_queue(op) : EXT2_ET_NO_MEMORY;
+}
+
+/* Same as out_queue_file() for a symlink to @target */
+errcode_t out_queue_symlink(int dirfd, const char *name, char *target,
+                            const struct ext2_inode *inode)
+{
+    struct out_op *op = out_op_new(OUT_SYMLINK, dirfd, name, target, 0, 0, inode);
+
+    return op ? out_queue(op) : EXT2_ET_NO_MEMORY;
+}
+
+/*
+ * Creates directory @name relative to @dirfd, an existing one is fine, and
+ * opens it into *@fd unless @fd is NULL. On a ring both go down as one
+ * linked pair along with whatever else is waiting.
+ */
+errcode_t out_mkdir_open(int dirfd, const char *name, mode_t mode, int *fd)
+{
+    bool exists = false;
+#ifdef HAVE_LIBURING
+    struct out_ring *r = fd ? out_ring_get() : NULL;
+    struct io_uring_sqe *sqe;
+
+    if (r)
+    {
+        /* No entry behind these, the step indexes dir_res */
+        sqe = io_uring_get_sqe(&r->ring);
+        io_uring_prep_mkdirat(sqe, dirfd, name, mode);
+        io_uring_sqe_set_data64(sqe, 0);
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe = io_uring_get_sqe(&r->ring);
+        io_uring_prep_openat(sqe, dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW, 0);
+        io_uring_sqe_set_data64(sqe, 1);
+
+        r->dir_wait = 2;
+        while (r->dir_wait)
+        {
+            if (out_ring_reap(r, true))
+                return -1;
+        }
+
+        if (r->dir_res[1] >= 0)
+        {
+            *fd = r->dir_res[1];
+            return 0;
+        }
+        if (r->dir_res[0] < 0 && r->dir_res[0] != -EEXIST)
+        {
+            errno = -r->dir_res[0];
+            E2FSTOOL_ERROR("while creating %s", name);
+            return -1;
+        }
+        if (r->dir_res[0] >= 0)
+        {
+            errno = -r->dir_res[1];
+            E2FSTOOL_ERROR("while opening %s", name);
+            return -1;
+        }
+        /* EEXIST broke the link, the open still has to happen */
+        exists = true;
+    }
+#endif
+
+    if (!exists && mkdirat(dirfd, name, mode) == -1 && errno != EEXIST)
+    {
+        E2FSTOOL_ERROR("while creating %s", name);
+        return -1;
+    }
+
+    if (fd)
+    {
+        *fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (*fd < 0)
+        {
+            E2FSTOOL_ERROR("while opening %s", name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Waits for everything this thread queued, returns the first error */
+errcode_t out_flush(void)
+{
+#ifdef HAVE_LIBURING
+    struct out_ring *r = local.ring;
+
+    while (r && (r->used || r->staged))
+    {
+        if (out_ring_reap(r, r->used != 0))
+            break;
+        if (r->staged && out_ring_submit(r, 0))
+            break;
+    }
+#endif
+
+    pthread_mutex_lock(&out_lock);
+    while (local.pending)
+        pthread_cond_wait(&out_done, &out_lock);
+    pthread_mutex_unlock(&out_lock);
+    return out_take_error();
+}
+
+/*
+ * Picks the backend: rings when liburing and the kernel allow it, else
+ * @threads writer threads. @restore_metadata applies -p to every entry.
+ */
+errcode_t out_init(unsigned int threads, bool restore_metadata)
+{
+    unsigned int i;
+    int ret;
+
+    restore = restore_metadata;
+#ifdef HAVE_LIBURING
+    uring_ok = !restore;
+    if (uring_ok && out_ring_get())
+        return 0;
+    uring_ok = false;
+    local.ring_failed = false;
+#endif
+
+    writers = calloc(threads, sizeof(*writers));
+    if (!writers)
+    {
+        E2FSTOOL_ERROR("while allocating memory");
+        return EXT2_ET_NO_MEMORY;
+    }
+
+    out_stop = false;
+    for (i = 0; i < threads; i++)
+    {
+        ret = pthread_create(&writers[i], NULL, out_writer, NULL);
+        if (ret)
+        {
+            errno = ret;
+            E2FSTOOL_ERROR("while starting writer threads");
+            out_free();
+            return -1;
+        }
+        writer_count++;
+    }
+    return 0;
+}
+
+void out_free(void)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&out_lock);
+    out_stop = true;
+    pthread_cond_broadcast(&out_work);
+    pthread_mutex_unlock(&out_lock);
+
+    for (i = 0; i < writer_count; i++)
+        pthread_join(writers[i], NULL);
+    free(writers);
+    writers = NULL;
+    writer_count = 0;
+
+#ifdef HAVE_LIBURING
+    while (rings)
+    {
+        struct out_ring *r = rings;
+
+        rings = r->next;
+        io_uring_queue_exit(&r->ring);
+        free(r);
+    }
+    local.ring = NULL;
+    uring_ok = false;
+#endif
+}
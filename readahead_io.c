@@ -0,0 +1,611 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "e2fstool.h"
+
+/*
+ * Readahead io_manager.
+ *
+ * Wraps other managers with one set of reader threads. Every channel has
+ * a fixed window of chunks. cache_readahead() hints queue the chunks they
+ * cover; reads are copied out of ready chunks, wait for chunks in flight
+ * and go to the inner channel directly for the rest. A read spanning
+ * several chunks queues them all first, so a single large read keeps one
+ * request per thread in flight instead of one in total.
+ *
+ * Channels with queued chunks wait on one queue and the readers take a
+ * chunk from each in turn. The -j handles of an image and the images of
+ * a batch all read through the same threads, so they share the disk
+ * instead of each running readers of its own.
+ */
+
+#define RA_CHUNK_SIZE (256 << 10)
+#define RA_CHUNKS (RA_DEFAULT_WINDOW / RA_CHUNK_SIZE)
+#define RA_MANAGERS 8 /* Inner managers wrapped at once */
+
+enum ra_state {
+    RA_FREE,
+    RA_QUEUED,
+    RA_READING,
+    RA_READY,
+    RA_FAILED,
+};
+
+struct ra_chunk {
+    __u64 index;
+    enum ra_state state;
+    __u64 seq; /* Queue order while queued, last use once read */
+    char *buf;
+};
+
+struct ra_channel {
+    io_channel inner;
+    unsigned int chunk_blocks;
+    struct ra_chunk chunks[RA_CHUNKS];
+    unsigned int nchunks; /* In use out of chunks[] */
+    __u64 tick;
+    unsigned int queued, reading;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+
+    /* Under ra_lock */
+    struct ra_channel *next;
+    bool listed;
+    unsigned int users; /* Readers that took it off the queue */
+};
+
+/* Readahead over one inner manager */
+struct ra_wrap {
+    io_manager inner;
+    struct struct_io_manager manager;
+};
+
+static struct ra_wrap wraps[RA_MANAGERS];
+static unsigned int wrap_count = 0;
+static unsigned int ra_threads = 0;
+static unsigned int ra_chunks = RA_CHUNKS;
+static pthread_mutex_t wrap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The readers run while any channel is open */
+static pthread_t *readers = NULL;
+static unsigned int reader_count = 0, channel_count = 0;
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Channels with queued chunks, in turn. Taken after a channel lock, never before */
+static struct ra_channel *queue_head = NULL, *queue_tail = NULL;
+static bool ra_stop = false;
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ra_idle = PTHREAD_COND_INITIALIZER;
+
+static struct ra_chunk *ra_find(struct ra_channel *ra, __u64 index)
+{
+    unsigned int i;
+
+    for (i = 0; i < ra->nchunks; i++)
+    {
+        if (ra->chunks[i].state != RA_FREE && ra->chunks[i].index == index)
+            return &ra->chunks[i];
+    }
+    return NULL;
+}
+
+/* A free chunk, or the least recently used one that is done */
+static struct ra_chunk *ra_slot(struct ra_channel *ra, int block_size)
+{
+    struct ra_chunk *c, *victim = NULL;
+    unsigned int i;
+
+    for (i = 0; i < ra->nchunks; i++)
+    {
+        c = &ra->chunks[i];
+        if (c->state == RA_FREE)
+        {
+            victim = c;
+            break;
+        }
+        if ((c->state == RA_READY || c->state == RA_FAILED) &&
+            (!victim || c->seq < victim->seq))
+            victim = c;
+    }
+
+    if (victim && !victim->buf)
+    {
+        victim->buf = malloc((size_t)ra->chunk_blocks * block_size);
+        if (!victim->buf)
+            return NULL;
+    }
+    return victim;
+}
+
+/* Gives the readers one more chunk of @ra to read, called with its lock held */
+static void ra_list(struct ra_channel *ra)
+{
+    pthread_mutex_lock(&ra_lock);
+    if (!ra->listed)
+    {
+        ra->listed = true;
+        ra->next = NULL;
+        if (queue_tail)
+            queue_tail->next = ra;
+        else
+            queue_head = ra;
+        queue_tail = ra;
+    }
+    pthread_cond_signal(&ra_work);
+    pthread_mutex_unlock(&ra_lock);
+}
+
+/* Queues the chunks of [@block, @block + @count) that are not in the window */
+static void ra_queue(struct ra_channel *ra, int block_size, __u64 block, __u64 count)
+{
+    __u64 index, last;
+    struct ra_chunk *c;
+
+    if (!count)
+        return;
+
+    last = (block + count - 1) / ra->chunk_blocks;
+    for (index = block / ra->chunk_blocks; index <= last; index++)
+    {
+        if (ra_find(ra, index))
+            continue;
+
+        c = ra_slot(ra, block_size);
+        if (!c)
+            break;
+
+        c->index = index;
+        c->state = RA_QUEUED;
+        c->seq = ++ra->tick;
+        ra->queued++;
+        ra_list(ra);
+    }
+}
+
+/* Reads the oldest queued chunk of @ra, if it still has one */
+static void ra_read_next(struct ra_channel *ra)
+{
+    struct ra_chunk *c = NULL;
+    unsigned int i;
+    errcode_t retval;
+
+    pthread_mutex_lock(&ra->lock);
+    for (i = 0; i < ra->nchunks; i++)
+    {
+        if (ra->chunks[i].state == RA_QUEUED && (!c || ra->chunks[i].seq < c->seq))
+            c = &ra->chunks[i];
+    }
+    if (!c)
+    {
+        pthread_mutex_unlock(&ra->lock);
+        return;
+    }
+    c->state = RA_READING;
+    ra->queued--;
+    ra->reading++;
+
+    /* The rest of it waits behind the other channels */
+    if (ra->queued)
+        ra_list(ra);
+    pthread_mutex_unlock(&ra->lock);
+
+    /* Past the end of the image this fails, readers then go direct */
+    retval = ra->inner->manager->read_blk64(ra->inner, c->index * ra->chunk_blocks,
+                                            ra->chunk_blocks, c->buf);
+
+    pthread_mutex_lock(&ra->lock);
+    c->state = retval ? RA_FAILED : RA_READY;
+    c->seq = ++ra->tick;
+    ra->reading--;
+    pthread_cond_broadcast(&ra->done);
+    pthread_mutex_unlock(&ra->lock);
+}
+
+static void *ra_thread(void *arg EXT2FS_ATTR((unused)))
+{
+    struct ra_channel *ra;
+
+    pthread_mutex_lock(&ra_lock);
+    for (;;)
+    {
+        while (!ra_stop && !queue_head)
+            pthread_cond_wait(&ra_work, &ra_lock);
+        if (ra_stop)
+            break;
+
+        ra = queue_head;
+        queue_head = ra->next;
+        if (!queue_head)
+            queue_tail = NULL;
+        ra->listed = false;
+        ra->users++;
+        pthread_mutex_unlock(&ra_lock);
+
+        ra_read_next(ra);
+
+        pthread_mutex_lock(&ra_lock);
+        if (!--ra->users)
+            pthread_cond_broadcast(&ra_idle);
+    }
+    pthread_mutex_unlock(&ra_lock);
+    return NULL;
+}
+
+/* Starts the readers with the first channel open */
+static void ra_start(void)
+{
+    pthread_mutex_lock(&start_lock);
+    if (!channel_count++)
+    {
+        readers = calloc(ra_threads, sizeof(*readers));
+        for (reader_count = 0; readers && reader_count < ra_threads; reader_count++)
+        {
+            /* Short of threads the channels still work, with fewer reads in flight */
+            if (pthread_create(&readers[reader_count], NULL, ra_thread, NULL))
+                break;
+        }
+    }
+    pthread_mutex_unlock(&start_lock);
+}
+
+/* Stops the readers once the last channel is closed */
+static void ra_end(void)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&start_lock);
+    if (!--channel_count)
+    {
+        pthread_mutex_lock(&ra_lock);
+        ra_stop = true;
+        pthread_cond_broadcast(&ra_work);
+        pthread_mutex_unlock(&ra_lock);
+        for (i = 0; i < reader_count; i++)
+            pthread_join(readers[i], NULL);
+
+        ra_stop = false;
+        free(readers);
+        readers = NULL;
+        reader_count = 0;
+    }
+    pthread_mutex_unlock(&start_lock);
+}
+
+static errcode_t ra_inner_read(struct ra_channel *ra, unsigned long long block, int count,
+                               void *data)
+{
+    io_channel inner = ra->inner;
+
+    if (inner->manager->read_blk64)
+        return inner->manager->read_blk64(inner, block, count, data);
+    return inner->manager->read_blk(inner, block, count, data);
+}
+
+static errcode_t ra_read_blk64(io_channel channel, unsigned long long block, int count,
+                               void *data)
+{
+    struct ra_channel *ra = channel->private_data;
+    int bs = channel->block_size;
+    unsigned long long first = block;
+    int total = count;
+    char *out = data;
+    errcode_t retval = 0;
+
+    if (count < 0 || !reader_count)
+        return ra_inner_read(ra, block, count, data);
+
+    pthread_mutex_lock(&ra->lock);
+    ra_queue(ra, bs, block, count);
+    while (count > 0)
+    {
+        __u64 index = block / ra->chunk_blocks;
+        unsigned int off = block % ra->chunk_blocks;
+        int n = ra->chunk_blocks - off;
+        struct ra_chunk *c = ra_find(ra, index);
+
+        if (n > count)
+            n = count;
+
+        if (c && c->state == RA_READING)
+        {
+            pthread_cond_wait(&ra->done, &ra->lock);
+            continue;
+        }
+
+        if (c && c->state == RA_READY)
+        {
+            memcpy(out, c->buf + (size_t)off * bs, (size_t)n * bs);
+            c->seq = ++ra->tick;
+            goto next;
+        }
+
+        /* Nobody started on it yet, reading it here is as fast */
+        if (c && c->state == RA_QUEUED)
+        {
+            c->state = RA_FREE;
+            ra->queued--;
+        }
+
+        /* Read every chunk not in the window from here on in one go */
+        while (n < count && !ra_find(ra, index + (n + off) / ra->chunk_blocks))
+            n = count - n < (int)ra->chunk_blocks ? count : n + (int)ra->chunk_blocks;
+
+        pthread_mutex_unlock(&ra->lock);
+        retval = ra_inner_read(ra, block, n, out);
+        pthread_mutex_lock(&ra->lock);
+        if (retval)
+            break;
+next:
+        block += n;
+        count -= n;
+        out += (size_t)n * bs;
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    if (retval && channel->read_error)
+        retval = channel->read_error(channel, first, total, data, (size_t)total * bs, 0, retval);
+    return retval;
+}
+
+static errcode_t ra_read_blk(io_channel channel, unsigned long block, int count, void *data)
+{
+    return ra_read_blk64(channel, block, count, data);
+}
+
+static errcode_t ra_cache_readahead(io_channel channel, unsigned long long block,
+                                    unsigned long long count)
+{
+    struct ra_channel *ra = channel->private_data;
+
+    if (!reader_count)
+        return 0;
+
+    pthread_mutex_lock(&ra->lock);
+    ra_queue(ra, channel->block_size, block, count);
+    pthread_mutex_unlock(&ra->lock);
+    return 0;
+}
+
+/* Drops the whole window, waiting for reads in flight */
+static void ra_drop(struct ra_channel *ra, bool free_bufs)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&ra->lock);
+    while (ra->reading)
+        pthread_cond_wait(&ra->done, &ra->lock);
+    for (i = 0; i < RA_CHUNKS; i++)
+    {
+        ra->chunks[i].state = RA_FREE;
+        if (free_bufs)
+        {
+            free(ra->chunks[i].buf);
+            ra->chunks[i].buf = NULL;
+        }
+    }
+    ra->queued = 0;
+    pthread_mutex_unlock(&ra->lock);
+}
+
+static errcode_t ra_set_blksize(io_channel channel, int blksize)
+{
+    struct ra_channel *ra = channel->private_data;
+    errcode_t retval;
+
+    ra_drop(ra, true);
+    retval = ra->inner->manager->set_blksize(ra->inner, blksize);
+    if (retval)
+        return retval;
+
+    channel->block_size = blksize;
+    ra->chunk_blocks = blksize < RA_CHUNK_SIZE ? RA_CHUNK_SIZE / blksize : 1;
+    return 0;
+}
+
+static errcode_t ra_write_blk64(io_channel channel, unsigned long long block, int count,
+                                const void *data)
+{
+    struct ra_channel *ra = channel->private_data;
+
+    ra_drop(ra, false);
+    if (!ra->inner->manager->write_blk64)
+        return ra->inner->manager->write_blk(ra->inner, block, count, data);
+    return ra->inner->manager->write_blk64(ra->inner, block, count, data);
+}
+
+static errcode_t ra_write_blk(io_channel channel, unsigned long block, int count,
+                              const void *data)
+{
+    return ra_write_blk64(channel, block, count, data);
+}
+
+static errcode_t ra_flush(io_channel channel)
+{
+    struct ra_channel *ra = channel->private_data;
+
+    return ra->inner->manager->flush(ra->inner);
+}
+
+static errcode_t ra_set_option(io_channel channel, const char *option, const char *arg)
+{
+    struct ra_channel *ra = channel->private_data;
+
+    if (!ra->inner->manager->set_option)
+        return EXT2_ET_INVALID_ARGUMENT;
+    return ra->inner->manager->set_option(ra->inner, option, arg);
+}
+
+static errcode_t ra_get_stats(io_channel channel, io_stats *stats)
+{
+    struct ra_channel *ra = channel->private_data;
+
+    if (!ra->inner->manager->get_stats)
+    {
+        if (stats)
+            *stats = NULL;
+        return 0;
+    }
+    return ra->inner->manager->get_stats(ra->inner, stats);
+}
+
+static void ra_channel_free(io_channel channel)
+{
+    struct ra_channel *ra = channel->private_data, *prev, **p;
+
+    /* Nothing is queued after this, readers that took it only find that out */
+    ra_drop(ra, true);
+
+    pthread_mutex_lock(&ra_lock);
+    if (ra->listed)
+    {
+        for (prev = NULL, p = &queue_head; *p != ra; prev = *p, p = &(*p)->next)
+            ;
+        *p = ra->next;
+        if (queue_tail == ra)
+            queue_tail = prev;
+    }
+    while (ra->users)
+        pthread_cond_wait(&ra_idle, &ra_lock);
+    pthread_mutex_unlock(&ra_lock);
+    ra_end();
+
+    pthread_mutex_destroy(&ra->lock);
+    pthread_cond_destroy(&ra->done);
+    free(ra);
+    ext2fs_free_mem(&channel->name);
+    ext2fs_free_mem(&channel);
+}
+
+static errcode_t ra_close(io_channel channel)
+{
+    struct ra_channel *ra = channel->private_data;
+    io_channel inner = ra->inner;
+
+    if (--channel->refcount > 0)
+        return 0;
+
+    ra_channel_free(channel);
+    return io_channel_close(inner);
+}
+
+/* Opens a channel of the inner manager of wraps[@i] and reads ahead of it */
+static errcode_t ra_open(unsigned int i, const char *name, int flags, io_channel *ret)
+{
+    io_channel channel = NULL, inner;
+    struct ra_channel *ra;
+    errcode_t retval;
+
+    retval = wraps[i].inner->open(name, flags, &inner);
+    if (retval)
+        return retval;
+
+    ra = calloc(1, sizeof(*ra));
+    if (!ra)
+        goto nomem;
+    ra->inner = inner;
+    ra->chunk_blocks = RA_CHUNK_SIZE / inner->block_size;
+    ra->nchunks = ra_chunks;
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->done, NULL);
+
+    if (ext2fs_get_memzero(sizeof(*channel), &channel) ||
+        ext2fs_get_mem(strlen(name) + 1, &channel->name))
+        goto nomem;
+    strcpy(channel->name, name);
+    channel->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+    channel->manager = &wraps[i].manager;
+    channel->block_size = inner->block_size;
+    channel->flags = inner->flags;
+    channel->align = inner->align;
+    channel->refcount = 1;
+    channel->private_data = ra;
+
+    ra_start();
+    *ret = channel;
+    return 0;
+
+nomem:
+    if (channel)
+        ext2fs_free_mem(&channel->name);
+    ext2fs_free_mem(&channel);
+    if (ra)
+    {
+        pthread_mutex_destroy(&ra->lock);
+        pthread_cond_destroy(&ra->done);
+        free(ra);
+    }
+    io_channel_close(inner);
+    return EXT2_ET_NO_MEMORY;
+}
+
+/* libext2fs opens channels by manager alone, each wrap needs an open of its own */
+#define RA_OPEN(i)                                                             \
+    static errcode_t ra_open_##i(const char *name, int flags, io_channel *ret) \
+    {                                                                          \
+        return ra_open(i, name, flags, ret);                                   \
+    }
+
+RA_OPEN(0)
+RA_OPEN(1)
+RA_OPEN(2)
+RA_OPEN(3)
+RA_OPEN(4)
+RA_OPEN(5)
+RA_OPEN(6)
+RA_OPEN(7)
+
+static errcode_t (*const ra_opens[RA_MANAGERS])(const char *, int, io_channel *) = {
+    ra_open_0, ra_open_1, ra_open_2, ra_open_3, ra_open_4, ra_open_5, ra_open_6, ra_open_7,
+};
+
+/*
+ * Returns a manager reading ahead of @inner, with a window of @window
+ * bytes per channel opened from now on, at most RA_DEFAULT_WINDOW. The
+ * channels of every wrapped manager share @threads reader threads, as of
+ * the call before the first channel is opened. @inner comes back as is
+ * once RA_MANAGERS different managers are wrapped.
+ */
+io_manager readahead_io_manager(io_manager inner, unsigned int threads, size_t window)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&wrap_lock);
+    ra_threads = threads;
+    ra_chunks = window / RA_CHUNK_SIZE;
+    if (ra_chunks > RA_CHUNKS)
+        ra_chunks = RA_CHUNKS;
+    if (!ra_chunks)
+        ra_chunks = 1;
+
+    for (i = 0; i < wrap_count && wraps[i].inner != inner; i++)
+        ;
+    if (i == RA_MANAGERS)
+    {
+        pthread_mutex_unlock(&wrap_lock);
+        return inner;
+    }
+    if (i == wrap_count)
+    {
+        wraps[i].inner = inner;
+        wraps[i].manager = (struct struct_io_manager){
+            .magic = EXT2_ET_MAGIC_IO_MANAGER,
+            .name = "Readahead I/O Manager",
+            .open = ra_opens[i],
+            .close = ra_close,
+            .set_blksize = ra_set_blksize,
+            .read_blk = ra_read_blk,
+            .write_blk = ra_write_blk,
+            .flush = ra_flush,
+            .set_option = ra_set_option,
+            .get_stats = ra_get_stats,
+            .read_blk64 = ra_read_blk64,
+            .write_blk64 = ra_write_blk64,
+            .cache_readahead = ra_cache_readahead,
+        };
+        wrap_count++;
+    }
+    pthread_mutex_unlock(&wrap_lock);
+    return &wraps[i].manager;
+}
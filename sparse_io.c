@@ -0,0 +1,581 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "e2fstool.h"
+
+/*
+ * Read-only io_manager for Android sparse images.
+ *
+ * The container is parsed once into a sorted chunk index; block reads do a
+ * binary search over it. RAW chunks are copied straight out of an mmap of
+ * the image, FILL and DONT_CARE chunks are synthesized without touching
+ * the disk. MOTO images are the same container with a vendor header in
+ * front of the filesystem, which is located by probing for the ext4 magic.
+ * A compressed container is read through compress_io.c instead.
+ */
+
+#define SPARSE_HEADER_LEN 28
+#define SPARSE_CHUNK_HEADER_LEN 12
+
+#define CHUNK_TYPE_RAW 0xCAC1
+#define CHUNK_TYPE_FILL 0xCAC2
+#define CHUNK_TYPE_DONT_CARE 0xCAC3
+#define CHUNK_TYPE_CRC32 0xCAC4
+
+#define MOTO_PROBE_LIMIT (1 << 20)
+#define MOTO_PROBE_STEP 512
+
+struct sparse_chunk {
+    __u64 start; /* offset in the expanded image */
+    __u64 len;
+    __u64 data; /* RAW: offset of the payload in the container */
+    __u32 fill;
+    __u16 type;
+};
+
+struct sparse_io {
+    int fd;
+    pthread_mutex_t fd_lock; /* Readahead threads share the fd and its offset */
+    const unsigned char *map;
+    struct zfile *zf;
+    __u64 file_size;
+
+    struct sparse_chunk *chunks;
+    size_t count;
+    __u64 size;
+    __u32 blk_sz;
+    __u64 base;
+
+    struct struct_io_stats stats;
+};
+
+static inline __u16 get_le16(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static inline __u32 get_le32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (__u32)p[3] << 24;
+}
+
+/* Safe from several threads, the mmap and zfile paths need no lock */
+static errcode_t backing_read(struct sparse_io *sio, __u64 off, void *buf, size_t len)
+{
+    errcode_t retval = 0;
+
+    if (off > sio->file_size || len > sio->file_size - off)
+        return EXT2_ET_SHORT_READ;
+
+    if (sio->zf)
+        return zfile_read(sio->zf, off, buf, len);
+
+    if (sio->map)
+    {
+        memcpy(buf, sio->map + off, len);
+        return 0;
+    }
+
+    pthread_mutex_lock(&sio->fd_lock);
+    if (lseek(sio->fd, off, SEEK_SET) == (off_t)-1)
+    {
+        retval = errno;
+        goto end;
+    }
+
+    while (len)
+    {
+        ssize_t n = read(sio->fd, buf, len);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            retval = errno;
+            goto end;
+        }
+        if (!n)
+        {
+            retval = EXT2_ET_SHORT_READ;
+            goto end;
+        }
+        buf = (char *)buf + n;
+        len -= n;
+    }
+end:
+    pthread_mutex_unlock(&sio->fd_lock);
+    return retval;
+}
+
+static errcode_t sparse_index_build(struct sparse_io *sio)
+{
+    unsigned char hdr[SPARSE_HEADER_LEN], chdr[SPARSE_CHUNK_HEADER_LEN];
+    __u32 file_hdr_sz, chunk_hdr_sz, total_blks, total_chunks, i;
+    __u64 off, pos = 0;
+    errcode_t retval;
+
+    retval = backing_read(sio, 0, hdr, sizeof(hdr));
+    if (retval)
+        return retval;
+
+    if (get_le32(hdr) != SPARSE_HEADER_MAGIC || get_le16(hdr + 4) != 1)
+        return EXT2_ET_BAD_MAGIC;
+
+    file_hdr_sz = get_le16(hdr + 8);
+    chunk_hdr_sz = get_le16(hdr + 10);
+    sio->blk_sz = get_le32(hdr + 12);
+    total_blks = get_le32(hdr + 16);
+    total_chunks = get_le32(hdr + 20);
+
+    if (file_hdr_sz < SPARSE_HEADER_LEN || chunk_hdr_sz < SPARSE_CHUNK_HEADER_LEN ||
+        !sio->blk_sz || sio->blk_sz % 4)
+        return EXT2_ET_BAD_MAGIC;
+
+    retval = ext2fs_get_array(total_chunks ? total_chunks : 1, sizeof(*sio->chunks),
+                              &sio->chunks);
+    if (retval)
+        return retval;
+
+    off = file_hdr_sz;
+    for (i = 0; i < total_chunks; i++)
+    {
+        struct sparse_chunk *c = &sio->chunks[sio->count];
+        __u32 chunk_sz, total_sz;
+        __u16 type;
+
+        retval = backing_read(sio, off, chdr, sizeof(chdr));
+        if (retval)
+            return retval;
+
+        type = get_le16(chdr);
+        chunk_sz = get_le32(chdr + 4);
+        total_sz = get_le32(chdr + 8);
+        if (total_sz < chunk_hdr_sz)
+            return EXT2_ET_BAD_MAGIC;
+
+        c->start = pos;
+        c->len = (__u64)chunk_sz * sio->blk_sz;
+        c->type = type;
+
+        switch (type)
+        {
+        case CHUNK_TYPE_RAW:
+            if (total_sz - chunk_hdr_sz != c->len)
+                return EXT2_ET_BAD_MAGIC;
+            c->data = off + chunk_hdr_sz;
+            break;
+        case CHUNK_TYPE_FILL:
+            if (total_sz - chunk_hdr_sz < sizeof(__u32))
+                return EXT2_ET_BAD_MAGIC;
+            retval = backing_read(sio, off + chunk_hdr_sz, chdr, sizeof(__u32));
+            if (retval)
+                return retval;
+            /* Kept in image byte order, it is replayed byte by byte */
+            memcpy(&c->fill, chdr, sizeof(c->fill));
+            break;
+        case CHUNK_TYPE_DONT_CARE:
+            break;
+        case CHUNK_TYPE_CRC32:
+            /* Checksums carry no data, nothing to index */
+            off += total_sz;
+            continue;
+        default:
+            return EXT2_ET_BAD_MAGIC;
+        }
+
+        off += total_sz;
+        pos += c->len;
+        if (c->len)
+            sio->count++;
+    }
+
+    sio->size = (__u64)total_blks * sio->blk_sz;
+    if (pos > sio->size)
+        sio->size = pos;
+    return 0;
+}
+
+/* First chunk that ends past @off */
+static size_t sparse_index_find(struct sparse_io *sio, __u64 off)
+{
+    size_t lo = 0, hi = sio->count;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct sparse_chunk *c = &sio->chunks[mid];
+
+        if (c->start + c->len <= off)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void fill_pattern(unsigned char *p, size_t len, __u32 fill, unsigned int phase)
+{
+    const unsigned char *pat = (const unsigned char *)&fill;
+    size_t i, done;
+
+    if (!fill)
+    {
+        memset(p, 0, len);
+        return;
+    }
+
+    for (i = 0; i < len && i < 8; i++)
+        p[i] = pat[(phase + i) & 3];
+
+    /* Double the already expanded prefix, it stays in phase at 4n */
+    for (done = i & ~(size_t)3; done && done < len; done *= 2)
+        memcpy(p + done, p, len - done < done ? len - done : done);
+}
+
+static errcode_t sparse_index_read(struct sparse_io *sio, __u64 off, void *buf, size_t len)
+{
+    unsigned char *p = buf;
+    size_t i = sparse_index_find(sio, off);
+    errcode_t retval;
+
+    while (len)
+    {
+        const struct sparse_chunk *c = i < sio->count ? &sio->chunks[i] : NULL;
+        size_t n;
+
+        if (!c || off < c->start)
+        {
+            /* Past the end or a gap in a malformed image, reads as zeroes */
+            n = c && c->start - off < len ? c->start - off : len;
+            memset(p, 0, n);
+        }
+        else
+        {
+            n = c->start + c->len - off < len ? c->start + c->len - off : len;
+
+            switch (c->type)
+            {
+            case CHUNK_TYPE_RAW:
+                retval = backing_read(sio, c->data + (off - c->start), p, n);
+                if (retval)
+                    return retval;
+                break;
+            case CHUNK_TYPE_FILL:
+                fill_pattern(p, n, c->fill, (off - c->start) & 3);
+                break;
+            default:
+                memset(p, 0, n);
+            }
+            i++;
+        }
+
+        p += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static errcode_t sparse_index_probe_fs(struct sparse_io *sio)
+{
+    unsigned char magic[2];
+    __u64 off;
+    errcode_t retval;
+
+    for (off = 0; off < MOTO_PROBE_LIMIT && off + 0x43A <= sio->size; off += MOTO_PROBE_STEP)
+    {
+        retval = sparse_index_read(sio, off + 0x438, magic, sizeof(magic));
+        if (retval)
+            return retval;
+
+        if (get_le16(magic) == EXT2_SUPER_MAGIC)
+        {
+            sio->base = off;
+            return 0;
+        }
+    }
+    return EXT2_ET_BAD_MAGIC;
+}
+
+static void sparse_io_free(struct sparse_io *sio)
+{
+#ifndef _WIN32
+    if (sio->map)
+        munmap((void *)sio->map, sio->file_size);
+#endif
+    if (sio->fd >= 0)
+        close(sio->fd);
+    zfile_close(sio->zf);
+    pthread_mutex_destroy(&sio->fd_lock);
+    ext2fs_free_mem(&sio->chunks);
+    ext2fs_free_mem(&sio);
+}
+
+static errcode_t sparse_io_open_index(const char *name, struct sparse_io **ret, bool moto)
+{
+    struct sparse_io *sio;
+    struct stat st;
+    errcode_t retval;
+
+    retval = ext2fs_get_memzero(sizeof(*sio), &sio);
+    if (retval)
+        return retval;
+    pthread_mutex_init(&sio->fd_lock, NULL);
+
+    if (compress_detect(name) != E2FSTOOL_COMPRESS_NONE)
+    {
+        sio->fd = -1;
+        retval = zfile_open(name, &sio->zf);
+        if (retval)
+            goto err;
+        sio->file_size = zfile_size(sio->zf);
+        goto index;
+    }
+
+    sio->fd = open(name, O_RDONLY | O_BINARY);
+    if (sio->fd < 0)
+    {
+        retval = errno;
+        goto err;
+    }
+
+    if (fstat(sio->fd, &st))
+    {
+        retval = errno;
+        goto err;
+    }
+    sio->file_size = st.st_size;
+
+#ifndef _WIN32
+    if (sio->file_size && (__u64)(size_t)sio->file_size == sio->file_size)
+    {
+        void *map = mmap(NULL, sio->file_size, PROT_READ, MAP_SHARED, sio->fd, 0);
+
+        /* Without a mapping we still work, just through read() */
+        if (map != MAP_FAILED)
+        {
+            sio->map = map;
+            madvise(map, sio->file_size, MADV_RANDOM);
+        }
+    }
+#endif
+
+index:
+    retval = sparse_index_build(sio);
+    if (retval)
+        goto err;
+
+    if (moto)
+    {
+        retval = sparse_index_probe_fs(sio);
+        if (retval)
+            goto err;
+    }
+
+    *ret = sio;
+    return 0;
+err:
+    sparse_io_free(sio);
+    return retval;
+}
+
+static errcode_t sparse_io_open_common(const char *name, int flags, io_channel *channel,
+                                       io_manager manager, bool moto)
+{
+    io_channel io = NULL;
+    struct sparse_io *sio = NULL;
+    errcode_t retval;
+
+    if (!name)
+        return EXT2_ET_BAD_DEVICE_NAME;
+    if (flags & IO_FLAG_RW)
+        return EXT2_ET_OP_NOT_SUPPORTED;
+
+    retval = sparse_io_open_index(name, &sio, moto);
+    if (retval)
+        return retval;
+
+    retval = ext2fs_get_memzero(sizeof(struct struct_io_channel), &io);
+    if (retval)
+        goto err;
+
+    retval = ext2fs_get_mem(strlen(name) + 1, &io->name);
+    if (retval)
+        goto err;
+    strcpy(io->name, name);
+
+    io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+    io->manager = manager;
+    io->block_size = 1024;
+    io->refcount = 1;
+    io->private_data = sio;
+    sio->stats.num_fields = 2;
+
+    *channel = io;
+    return 0;
+err:
+    if (io)
+        ext2fs_free_mem(&io);
+    sparse_io_free(sio);
+    return retval;
+}
+
+static errcode_t sparse_io_open(const char *name, int flags, io_channel *channel);
+static errcode_t moto_io_open(const char *name, int flags, io_channel *channel);
+
+static errcode_t sparse_io_close(io_channel channel)
+{
+    if (--channel->refcount > 0)
+        return 0;
+
+    sparse_io_free(channel->private_data);
+    ext2fs_free_mem(&channel->name);
+    ext2fs_free_mem(&channel);
+    return 0;
+}
+
+static errcode_t sparse_io_set_blksize(io_channel channel, int blksize)
+{
+    channel->block_size = blksize;
+    return 0;
+}
+
+static errcode_t sparse_io_read_blk64(io_channel channel, unsigned long long block,
+                                      int count, void *data)
+{
+    struct sparse_io *sio = channel->private_data;
+    size_t size = count < 0 ? (size_t)-count : (size_t)count * channel->block_size;
+    errcode_t retval;
+
+    retval = sparse_index_read(sio, sio->base + block * channel->block_size, data, size);
+    if (retval && channel->read_error)
+        retval = channel->read_error(channel, block, count, data, size, 0, retval);
+    if (!retval)
+        sio->stats.bytes_read += size;
+    return retval;
+}
+
+static errcode_t sparse_io_read_blk(io_channel channel, unsigned long block,
+                                    int count, void *data)
+{
+    return sparse_io_read_blk64(channel, block, count, data);
+}
+
+static errcode_t sparse_io_write_blk64(io_channel channel EXT2FS_ATTR((unused)),
+                                       unsigned long long block EXT2FS_ATTR((unused)),
+                                       int count EXT2FS_ATTR((unused)),
+                                       const void *data EXT2FS_ATTR((unused)))
+{
+    return EXT2_ET_OP_NOT_SUPPORTED;
+}
+
+static errcode_t sparse_io_write_blk(io_channel channel, unsigned long block,
+                                     int count, const void *data)
+{
+    return sparse_io_write_blk64(channel, block, count, data);
+}
+
+static errcode_t sparse_io_flush(io_channel channel EXT2FS_ATTR((unused)))
+{
+    return 0;
+}
+
+static errcode_t sparse_io_set_option(io_channel channel EXT2FS_ATTR((unused)),
+                                      const char *option EXT2FS_ATTR((unused)),
+                                      const char *arg EXT2FS_ATTR((unused)))
+{
+    return EXT2_ET_INVALID_ARGUMENT;
+}
+
+static errcode_t sparse_io_get_stats(io_channel channel, io_stats *stats)
+{
+    struct sparse_io *sio = channel->private_data;
+
+    if (stats)
+        *stats = &sio->stats;
+    return 0;
+}
+
+static errcode_t sparse_io_cache_readahead(io_channel channel, unsigned long long block,
+                                           unsigned long long count)
+{
+#ifndef _WIN32
+    struct sparse_io *sio = channel->private_data;
+    __u64 off = sio->base + block * channel->block_size;
+    __u64 end = off + count * channel->block_size;
+    size_t i;
+    long page = sysconf(_SC_PAGESIZE);
+
+    if (!sio->map)
+        return 0;
+
+    for (i = sparse_index_find(sio, off); i < sio->count && sio->chunks[i].start < end; i++)
+    {
+        const struct sparse_chunk *c = &sio->chunks[i];
+        __u64 from, to;
+
+        if (c->type != CHUNK_TYPE_RAW)
+            continue;
+
+        from = c->data + (off > c->start ? off - c->start : 0);
+        to = c->data + (end < c->start + c->len ? end - c->start : c->len);
+        from &= ~(__u64)(page - 1);
+        madvise((void *)(sio->map + from), to - from, MADV_WILLNEED);
+    }
+#endif
+    return 0;
+}
+
+static struct struct_io_manager struct_sparse_index_manager = {
+    .magic = EXT2_ET_MAGIC_IO_MANAGER,
+    .name = "Sparse index I/O Manager",
+    .open = sparse_io_open,
+    .close = sparse_io_close,
+    .set_blksize = sparse_io_set_blksize,
+    .read_blk = sparse_io_read_blk,
+    .write_blk = sparse_io_write_blk,
+    .flush = sparse_io_flush,
+    .set_option = sparse_io_set_option,
+    .get_stats = sparse_io_get_stats,
+    .read_blk64 = sparse_io_read_blk64,
+    .write_blk64 = sparse_io_write_blk64,
+    .cache_readahead = sparse_io_cache_readahead,
+};
+
+static struct struct_io_manager struct_moto_index_manager = {
+    .magic = EXT2_ET_MAGIC_IO_MANAGER,
+    .name = "MOTO index I/O Manager",
+    .open = moto_io_open,
+    .close = sparse_io_close,
+    .set_blksize = sparse_io_set_blksize,
+    .read_blk = sparse_io_read_blk,
+    .write_blk = sparse_io_write_blk,
+    .flush = sparse_io_flush,
+    .set_option = sparse_io_set_option,
+    .get_stats = sparse_io_get_stats,
+    .read_blk64 = sparse_io_read_blk64,
+    .write_blk64 = sparse_io_write_blk64,
+    .cache_readahead = sparse_io_cache_readahead,
+};
+
+io_manager sparse_index_io_manager = &struct_sparse_index_manager;
+io_manager moto_index_io_manager = &struct_moto_index_manager;
+
+static errcode_t sparse_io_open(const char *name, int flags, io_channel *channel)
+{
+    return sparse_io_open_common(name, flags, channel, sparse_index_io_manager, false);
+}
+
+static errcode_t moto_io_open(const char *name, int flags, io_channel *channel)
+{
+    return sparse_io_open_common(name, flags, channel, moto_index_io_manager, true);
+}
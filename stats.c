@@ -0,0 +1,392 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+struct stat_counter {
+    atomic_ullong calls;
+    atomic_ullong ns;
+    atomic_ullong bytes;
+    atomic_ullong hist[STATS_HIST_BUCKETS];
+};
+
+#define STATS_MANAGERS 8 /* Inner managers counted at once */
+
+/* Counted reads of one inner manager, its channels point at @manager */
+struct stats_wrap {
+    io_manager inner;
+    struct struct_io_manager manager;
+};
+
+struct slow_file {
+    char *path;
+    __u64 ns;
+    __u64 bytes;
+};
+
+static const char *phase_names[STAT_PHASE_COUNT] = {
+    [STAT_INODE_READ] = "inode_read",
+    [STAT_XATTR] = "xattr",
+    [STAT_CONFIG] = "config",
+    [STAT_FILE] = "file",
+    [STAT_DATA_READ] = "data_read",
+    [STAT_WRITE] = "write",
+    [STAT_COPY] = "copy",
+    [STAT_MKDIR] = "mkdir",
+    [STAT_SYMLINK] = "symlink",
+    [STAT_LINK] = "link",
+    [STAT_METADATA] = "metadata",
+    [STAT_HASH] = "hash",
+    [STAT_IO_READ] = "io_read",
+};
+
+static struct stat_counter counters[STAT_PHASE_COUNT];
+static atomic_ullong io_sizes[STATS_HIST_BUCKETS];
+
+static struct slow_file slowest[STATS_SLOWEST];
+static size_t slowest_count = 0;
+static atomic_ullong slowest_min = 0;
+static pthread_mutex_t slowest_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static FILE *trace = NULL;
+static bool trace_first = true;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_uint trace_tids = 0;
+static __thread unsigned int trace_tid;
+
+static __u64 start_ns = 0;
+static struct stats_wrap wraps[STATS_MANAGERS];
+static unsigned int wrap_count = 0;
+static pthread_mutex_t wrap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool stats_enabled = false;
+
+static __u64 clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Bucket b counts values in [2^(b-1), 2^b), bucket 0 counts zeroes */
+static unsigned int hist_bucket(__u64 v)
+{
+    unsigned int b = v ? 64 - __builtin_clzll(v) : 0;
+
+    return b < STATS_HIST_BUCKETS ? b : STATS_HIST_BUCKETS - 1;
+}
+
+static void json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++)
+    {
+        unsigned char c = *s;
+
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+errcode_t stats_init(const char *trace_path)
+{
+    stats_enabled = true;
+    start_ns = clock_ns();
+
+    if (!trace_path)
+        return 0;
+
+    trace = fopen(trace_path, "w");
+    if (!trace)
+        return errno;
+
+    fputs("{\"traceEvents\":[\n", trace);
+    return 0;
+}
+
+__u64 stats_now(void)
+{
+    return stats_enabled ? clock_ns() : 0;
+}
+
+static void slowest_add(const char *path, __u64 ns, __u64 bytes)
+{
+    size_t i, victim = 0;
+    char *copy;
+
+    if (ns <= atomic_load(&slowest_min))
+        return;
+
+    pthread_mutex_lock(&slowest_lock);
+    if (slowest_count < STATS_SLOWEST)
+    {
+        victim = slowest_count++;
+    }
+    else
+    {
+        for (i = 1; i < STATS_SLOWEST; i++)
+        {
+            if (slowest[i].ns < slowest[victim].ns)
+                victim = i;
+        }
+        if (ns <= slowest[victim].ns)
+            goto end;
+    }
+
+    copy = strdup(path);
+    if (!copy)
+        goto end;
+
+    free(slowest[victim].path);
+    slowest[victim] = (struct slow_file){copy, ns, bytes};
+
+    if (slowest_count == STATS_SLOWEST)
+    {
+        __u64 min = slowest[0].ns;
+
+        for (i = 1; i < STATS_SLOWEST; i++)
+        {
+            if (slowest[i].ns < min)
+                min = slowest[i].ns;
+        }
+        atomic_store(&slowest_min, min);
+    }
+end:
+    pthread_mutex_unlock(&slowest_lock);
+}
+
+static void trace_event(stat_phase_t phase, __u64 start, __u64 ns, const char *path)
+{
+    if (!trace_tid)
+        trace_tid = atomic_fetch_add(&trace_tids, 1) + 1;
+
+    pthread_mutex_lock(&trace_lock);
+    fprintf(trace, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+            trace_first ? "" : ",\n", phase_names[phase], trace_tid,
+            (start - start_ns) / 1e3, ns / 1e3);
+    if (path)
+    {
+        fputs(",\"args\":{\"path\":", trace);
+        json_string(trace, path);
+        fputc('}', trace);
+    }
+    fputc('}', trace);
+    trace_first = false;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/* Accounts the phase that began at @start, as returned by stats_now() */
+void stats_end(stat_phase_t phase, __u64 start, __u64 bytes, const char *path)
+{
+    struct stat_counter *c = &counters[phase];
+    __u64 ns;
+
+    if (!start)
+        return;
+
+    ns = clock_ns() - start;
+    atomic_fetch_add(&c->calls, 1);
+    atomic_fetch_add(&c->ns, ns);
+    atomic_fetch_add(&c->bytes, bytes);
+    atomic_fetch_add(&c->hist[hist_bucket(ns / 1000)], 1);
+
+    if (phase == STAT_FILE && path)
+        slowest_add(path, ns, bytes);
+
+    /* Block reads are far too many for a readable timeline */
+    if (trace && phase != STAT_IO_READ)
+        trace_event(phase, start, ns, path);
+}
+
+static errcode_t stats_io_read(io_channel channel, unsigned long long block, int count,
+                               void *data, bool is64)
+{
+    const struct stats_wrap *wrap = (const struct stats_wrap *)
+        ((const char *)channel->manager - offsetof(struct stats_wrap, manager));
+    __u64 start = clock_ns(), bytes;
+    errcode_t retval;
+
+    if (is64)
+        retval = wrap->inner->read_blk64(channel, block, count, data);
+    else
+        retval = wrap->inner->read_blk(channel, block, count, data);
+
+    bytes = count < 0 ? (__u64)-count : (__u64)count * channel->block_size;
+    atomic_fetch_add(&io_sizes[hist_bucket(bytes)], 1);
+    stats_end(STAT_IO_READ, start, bytes, NULL);
+    return retval;
+}
+
+static errcode_t stats_read_blk(io_channel channel, unsigned long block, int count, void *data)
+{
+    return stats_io_read(channel, block, count, data, false);
+}
+
+static errcode_t stats_read_blk64(io_channel channel, unsigned long long block, int count,
+                                  void *data)
+{
+    return stats_io_read(channel, block, count, data, true);
+}
+
+static errcode_t stats_open(unsigned int i, const char *name, int flags, io_channel *channel)
+{
+    errcode_t retval;
+
+    retval = wraps[i].inner->open(name, flags, channel);
+    if (!retval)
+        (*channel)->manager = &wraps[i].manager;
+    return retval;
+}
+
+/* libext2fs opens channels by manager alone, each wrap needs an open of its own */
+#define STATS_OPEN(i)                                                                 \
+    static errcode_t stats_open_##i(const char *name, int flags, io_channel *channel) \
+    {                                                                                 \
+        return stats_open(i, name, flags, channel);                                   \
+    }
+
+STATS_OPEN(0)
+STATS_OPEN(1)
+STATS_OPEN(2)
+STATS_OPEN(3)
+STATS_OPEN(4)
+STATS_OPEN(5)
+STATS_OPEN(6)
+STATS_OPEN(7)
+
+static errcode_t (*const stats_opens[STATS_MANAGERS])(const char *, int, io_channel *) = {
+    stats_open_0, stats_open_1, stats_open_2, stats_open_3,
+    stats_open_4, stats_open_5, stats_open_6, stats_open_7,
+};
+
+/*
+ * Counts block reads of @inner. The returned manager is a copy of @inner
+ * with open and reads hooked, channels keep the private data of @inner.
+ * Each inner manager gets one copy, up to STATS_MANAGERS of them, past
+ * that @inner comes back uncounted.
+ */
+io_manager stats_io_manager(io_manager inner)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&wrap_lock);
+    for (i = 0; i < wrap_count && wraps[i].inner != inner; i++)
+        ;
+    if (i == STATS_MANAGERS)
+    {
+        pthread_mutex_unlock(&wrap_lock);
+        return inner;
+    }
+    if (i == wrap_count)
+    {
+        wraps[i].inner = inner;
+        wraps[i].manager = *inner;
+        wraps[i].manager.open = stats_opens[i];
+        wraps[i].manager.read_blk = stats_read_blk;
+        if (inner->read_blk64)
+            wraps[i].manager.read_blk64 = stats_read_blk64;
+        wrap_count++;
+    }
+    pthread_mutex_unlock(&wrap_lock);
+    return &wraps[i].manager;
+}
+
+static void report_hist(FILE *f, atomic_ullong *hist)
+{
+    unsigned int b;
+    bool first = true;
+
+    fputc('{', f);
+    for (b = 0; b < STATS_HIST_BUCKETS; b++)
+    {
+        unsigned long long n = atomic_load(&hist[b]);
+
+        if (!n)
+            continue;
+        fprintf(f, "%s\"%llu\":%llu", first ? "" : ",", 1ULL << b, n);
+        first = false;
+    }
+    fputc('}', f);
+}
+
+static int slow_file_cmp(const void *a, const void *b)
+{
+    const struct slow_file *fa = a, *fb = b;
+
+    return fa->ns < fb->ns ? 1 : -(fa->ns > fb->ns);
+}
+
+/*
+ * Writes the JSON report to @path ("-" for stdout). Histogram keys are
+ * exclusive upper bounds: microseconds for latencies, bytes for sizes.
+ */
+errcode_t stats_report(const char *path)
+{
+    FILE *f = strcmp(path, "-") ? fopen(path, "w") : stdout;
+    unsigned int p;
+    size_t i;
+
+    if (!f)
+        return errno;
+
+    fprintf(f, "{\n  \"elapsed\": %.6f,\n  \"phases\": {\n", (clock_ns() - start_ns) / 1e9);
+    for (p = 0; p < STAT_PHASE_COUNT; p++)
+    {
+        struct stat_counter *c = &counters[p];
+
+        fprintf(f, "    \"%s\": {\"calls\": %llu, \"seconds\": %.6f, \"bytes\": %llu, \"latency_us\": ",
+                phase_names[p], (unsigned long long)atomic_load(&c->calls),
+                atomic_load(&c->ns) / 1e9, (unsigned long long)atomic_load(&c->bytes));
+        report_hist(f, c->hist);
+        fprintf(f, "}%s\n", p + 1 < STAT_PHASE_COUNT ? "," : "");
+    }
+
+    fputs("  },\n  \"io_read_sizes\": ", f);
+    report_hist(f, io_sizes);
+
+    fputs(",\n  \"slowest_files\": [", f);
+    pthread_mutex_lock(&slowest_lock);
+    qsort(slowest, slowest_count, sizeof(*slowest), slow_file_cmp);
+    for (i = 0; i < slowest_count; i++)
+    {
+        fprintf(f, "%s\n    {\"path\": ", i ? "," : "");
+        json_string(f, slowest[i].path);
+        fprintf(f, ", \"seconds\": %.6f, \"bytes\": %llu}", slowest[i].ns / 1e9,
+                (unsigned long long)slowest[i].bytes);
+    }
+    pthread_mutex_unlock(&slowest_lock);
+    fputs("\n  ]\n}\n", f);
+
+    if (f != stdout && fclose(f))
+        return errno;
+    return 0;
+}
+
+void stats_free(void)
+{
+    size_t i;
+
+    if (trace)
+    {
+        fputs("\n]}\n", trace);
+        fclose(trace);
+        trace = NULL;
+    }
+
+    for (i = 0; i < slowest_count; i++)
+        free(slowest[i].path);
+    slowest_count = 0;
+    stats_enabled = false;
+}
@@ -0,0 +1,45 @@
+#ifndef STATS_H_INC
+#define STATS_H_INC
+
+#include <stdbool.h>
+#include <ext2fs/ext2fs.h>
+
+/*
+ * Optional instrumentation (--stats, --trace).
+ *
+ * Every phase counts calls, bytes, time and a log2 latency histogram,
+ * whole files also feed a list of the slowest ones. With stats off
+ * stats_now() returns 0 and stats_end() returns right away, so call sites
+ * cost a branch.
+ */
+
+#define STATS_HIST_BUCKETS 32
+#define STATS_SLOWEST 16
+
+typedef enum stat_phase {
+    STAT_INODE_READ,
+    STAT_XATTR,
+    STAT_CONFIG,
+    STAT_FILE,
+    STAT_DATA_READ,
+    STAT_WRITE,
+    STAT_COPY,
+    STAT_MKDIR,
+    STAT_SYMLINK,
+    STAT_LINK,
+    STAT_METADATA,
+    STAT_HASH,
+    STAT_IO_READ,
+    STAT_PHASE_COUNT
+} stat_phase_t;
+
+extern bool stats_enabled;
+
+errcode_t stats_init(const char *trace_path);
+__u64 stats_now(void);
+void stats_end(stat_phase_t phase, __u64 start, __u64 bytes, const char *path);
+io_manager stats_io_manager(io_manager inner);
+errcode_t stats_report(const char *path);
+void stats_free(void);
+
+#endif /* STATS_H_INC */
@@ -0,0 +1,276 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "workpool.h"
+
+#define DEQUE_INIT_SIZE 64
+
+struct wp_worker {
+    struct workpool *pool;
+    pthread_t thread;
+    void *data;
+
+    pthread_mutex_t lock;
+    struct workpool_task **tasks;
+    size_t cap, head, count;
+};
+
+struct workpool {
+    struct wp_worker *workers;
+    unsigned int nworkers;
+    unsigned int started;
+    atomic_uint next_victim;
+    struct wp_worker inject; /* Tasks from outside the pool, taken FIFO */
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    atomic_size_t queued;
+    atomic_size_t pending;
+    int stop;
+};
+
+static __thread struct wp_worker *wp_self;
+
+static int deque_push(struct wp_worker *w, struct workpool_task *task)
+{
+    pthread_mutex_lock(&w->lock);
+    if (w->count == w->cap)
+    {
+        size_t i, new_cap = w->cap ? w->cap * 2 : DEQUE_INIT_SIZE;
+        struct workpool_task **tasks = malloc(new_cap * sizeof(*tasks));
+
+        if (!tasks)
+        {
+            pthread_mutex_unlock(&w->lock);
+            return ENOMEM;
+        }
+
+        for (i = 0; i < w->count; i++)
+            tasks[i] = w->tasks[(w->head + i) % w->cap];
+
+        free(w->tasks);
+        w->tasks = tasks;
+        w->cap = new_cap;
+        w->head = 0;
+    }
+    w->tasks[(w->head + w->count) % w->cap] = task;
+    w->count++;
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+static struct workpool_task *deque_pop_bottom(struct wp_worker *w)
+{
+    struct workpool_task *task = NULL;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->count)
+    {
+        w->count--;
+        task = w->tasks[(w->head + w->count) % w->cap];
+    }
+    pthread_mutex_unlock(&w->lock);
+    return task;
+}
+
+static struct workpool_task *deque_steal_top(struct wp_worker *w)
+{
+    struct workpool_task *task = NULL;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->count)
+    {
+        task = w->tasks[w->head];
+        w->head = (w->head + 1) % w->cap;
+        w->count--;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return task;
+}
+
+static struct workpool_task *wp_find_task(struct wp_worker *self)
+{
+    struct workpool *pool = self->pool;
+    struct workpool_task *task;
+    unsigned int i, start;
+
+    task = deque_pop_bottom(self);
+    if (task)
+        return task;
+
+    task = deque_steal_top(&pool->inject);
+    if (task)
+        return task;
+
+    start = atomic_fetch_add(&pool->next_victim, 1);
+    for (i = 0; i < pool->nworkers; i++)
+    {
+        struct wp_worker *victim = &pool->workers[(start + i) % pool->nworkers];
+
+        if (victim == self)
+            continue;
+
+        task = deque_steal_top(victim);
+        if (task)
+            return task;
+    }
+    return NULL;
+}
+
+static void *wp_worker_main(void *arg)
+{
+    struct wp_worker *self = arg;
+    struct workpool *pool = self->pool;
+    struct workpool_task *task;
+
+    wp_self = self;
+
+    for (;;)
+    {
+        task = wp_find_task(self);
+        if (task)
+        {
+            atomic_fetch_sub(&pool->queued, 1);
+            task->run(task, self->data);
+
+            if (atomic_fetch_sub(&pool->pending, 1) == 1)
+            {
+                pthread_mutex_lock(&pool->lock);
+                pthread_cond_broadcast(&pool->done_cond);
+                pthread_mutex_unlock(&pool->lock);
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->stop && !atomic_load(&pool->queued))
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        if (pool->stop)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    wp_self = NULL;
+    return NULL;
+}
+
+int workpool_create(struct workpool **ret, unsigned int nworkers, void **worker_data)
+{
+    struct workpool *pool;
+    unsigned int i;
+    int retval;
+
+    if (!nworkers)
+        return EINVAL;
+
+    pool = calloc(1, sizeof(*pool));
+    if (!pool)
+        return ENOMEM;
+
+    pool->workers = calloc(nworkers, sizeof(*pool->workers));
+    if (!pool->workers)
+    {
+        free(pool);
+        return ENOMEM;
+    }
+
+    pool->nworkers = nworkers;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    pthread_mutex_init(&pool->inject.lock, NULL);
+
+    for (i = 0; i < nworkers; i++)
+    {
+        struct wp_worker *w = &pool->workers[i];
+
+        w->pool = pool;
+        w->data = worker_data ? worker_data[i] : NULL;
+        pthread_mutex_init(&w->lock, NULL);
+    }
+
+    for (i = 0; i < nworkers; i++)
+    {
+        retval = pthread_create(&pool->workers[i].thread, NULL,
+                                wp_worker_main, &pool->workers[i]);
+        if (retval)
+        {
+            workpool_destroy(pool);
+            return retval;
+        }
+        pool->started++;
+    }
+
+    *ret = pool;
+    return 0;
+}
+
+int workpool_submit(struct workpool *pool, struct workpool_task *task)
+{
+    struct wp_worker *w = wp_self;
+    int retval;
+
+    if (!w || w->pool != pool)
+        w = &pool->inject;
+
+    atomic_fetch_add(&pool->pending, 1);
+    atomic_fetch_add(&pool->queued, 1);
+
+    retval = deque_push(w, task);
+    if (retval)
+    {
+        atomic_fetch_sub(&pool->queued, 1);
+        atomic_fetch_sub(&pool->pending, 1);
+        return retval;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+void workpool_wait(struct workpool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (atomic_load(&pool->pending))
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void workpool_destroy(struct workpool *pool)
+{
+    unsigned int i;
+
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->started; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+
+    for (i = 0; i < pool->nworkers; i++)
+    {
+        pthread_mutex_destroy(&pool->workers[i].lock);
+        free(pool->workers[i].tasks);
+    }
+    pthread_mutex_destroy(&pool->inject.lock);
+    free(pool->inject.tasks);
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
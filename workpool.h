@@ -0,0 +1,29 @@
+#ifndef WORKPOOL_H_INC
+#define WORKPOOL_H_INC
+
+/*
+ * Small work-stealing thread pool.
+ *
+ * Every worker owns a deque: tasks submitted from a worker go to the
+ * bottom of its own deque and are popped LIFO (depth-first), idle workers
+ * steal from the top of the others (breadth-first, i.e. the biggest
+ * remaining subtrees). Tasks submitted from outside the pool wait in a
+ * shared queue that workers turn to once their own deque is empty, in
+ * the order they were submitted.
+ */
+
+struct workpool;
+struct workpool_task;
+
+typedef void (*workpool_fn)(struct workpool_task *task, void *worker_data);
+
+struct workpool_task {
+    workpool_fn run;
+};
+
+int workpool_create(struct workpool **ret, unsigned int nworkers, void **worker_data);
+int workpool_submit(struct workpool *pool, struct workpool_task *task);
+void workpool_wait(struct workpool *pool);
+void workpool_destroy(struct workpool *pool);
+
+#endif /* WORKPOOL_H_INC */